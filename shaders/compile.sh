@@ -28,5 +28,16 @@ compile triangle.vert triangle.vert.spv
 compile triangle.frag triangle.frag.spv
 compile model.vert model.vert.spv
 compile model.frag model.frag.spv
+compile depth.vert depth.vert.spv
+compile shadow.vert shadow.vert.spv
+compile indirect.vert indirect.vert.spv
+compile model_multiview.vert model_multiview.vert.spv
+compile cull.comp cull.comp.spv
+compile hiz.comp hiz.comp.spv
+compile cluster.comp cluster.comp.spv
+compile env_cube.comp env_cube.comp.spv
+compile env_irradiance.comp env_irradiance.comp.spv
+compile env_prefilter.comp env_prefilter.comp.spv
+compile env_brdf.comp env_brdf.comp.spv
 
 echo "Shader compilation complete"
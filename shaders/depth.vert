@@ -0,0 +1,32 @@
+#version 450
+
+// Depth pre-pass: model.vert reduced to the position. Both compute
+// gl_Position the same way, so the color pass can test EQUAL against it.
+
+layout(location = 0) in vec3 inPosition;
+
+struct View {
+    mat4 view;
+    mat4 proj;
+    vec3 camPos;
+};
+
+layout(binding = 0) uniform UniformBufferObject {
+    View views[8];  // MAX_CULL_VIEWS
+} ubo;
+
+layout(push_constant) uniform PushConstants {
+    layout(offset = 48) uint view;
+} pc;
+
+layout(std430, set = 1, binding = 0) readonly buffer Instances {
+    mat4 models[];
+};
+
+invariant gl_Position;
+
+void main() {
+    vec4 worldPos = models[gl_InstanceIndex] * vec4(inPosition, 1.0);
+    View view = ubo.views[pc.view];
+    gl_Position = view.proj * view.view * worldPos;
+}
@@ -0,0 +1,64 @@
+#version 450
+
+// model.vert for GPU-driven draws: the model matrix comes from the instance
+// buffer, indexed by the firstInstance the cull shader wrote into each draw
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec2 inUV;
+layout(location = 3) in vec4 inTangent;
+
+layout(location = 0) out vec3 fragPosition;
+layout(location = 1) out vec3 fragNormal;
+layout(location = 2) out vec2 fragUV;
+layout(location = 3) out vec4 fragTangent;
+layout(location = 4) flat out uint fragView;
+
+struct View {
+    mat4 view;
+    mat4 proj;
+    vec3 camPos;
+};
+
+layout(set = 0, binding = 0) uniform UniformBufferObject {
+    View views[8];  // MAX_CULL_VIEWS
+} ubo;
+
+layout(push_constant) uniform PushConstants {
+    vec4 baseColorFactor;
+    vec4 mrFactors;
+    vec4 emissiveFactor;
+    uint view;
+} pc;
+
+struct Instance {
+    mat4 model;
+    vec4 sphere;  // xyz = world center, w = radius
+    vec4 extent;  // xyz = world box half extent
+    uint indexCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint batch;
+    uint batchFirst;
+    uint pad0;
+    uint pad1;
+    uint pad2;
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer Instances {
+    Instance instances[];
+};
+
+void main() {
+    mat4 model = instances[gl_InstanceIndex].model;
+    vec4 worldPos = model * vec4(inPosition, 1.0);
+    fragPosition = worldPos.xyz;
+    View view = ubo.views[pc.view];
+    gl_Position = view.proj * view.view * worldPos;
+
+    mat3 normalMatrix = mat3(model);
+    fragNormal = normalMatrix * inNormal;
+    fragTangent = vec4(normalMatrix * inTangent.xyz, inTangent.w);
+    fragUV = inUV;
+    fragView = pc.view;
+}
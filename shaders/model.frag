@@ -4,21 +4,25 @@ layout(location = 0) in vec3 fragPosition;
 layout(location = 1) in vec3 fragNormal;
 layout(location = 2) in vec2 fragUV;
 layout(location = 3) in vec4 fragTangent;
+layout(location = 4) flat in uint fragView;  // Multiview adds gl_ViewIndex to pc.view
 
 layout(location = 0) out vec4 outColor;
 
-layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
+struct View {
     mat4 view;
     mat4 proj;
     vec3 camPos;
+};
+
+layout(binding = 0) uniform UniformBufferObject {
+    View views[8];  // MAX_CULL_VIEWS
 } ubo;
 
 layout(push_constant) uniform PushConstants {
-    mat4 model;
     vec4 baseColorFactor;
     vec4 mrFactors;       // x=metallic, y=roughness
     vec4 emissiveFactor;
+    uint view;
 } pc;
 
 layout(binding = 1) uniform sampler2D baseColorTex;
@@ -27,6 +31,53 @@ layout(binding = 3) uniform sampler2D metallicRoughnessTex;
 layout(binding = 4) uniform sampler2D occlusionTex;
 layout(binding = 5) uniform sampler2D emissiveTex;
 
+// Clustered lights, see LightClusters
+struct Light {
+    vec4 position;   // xyz = world position, w = range, 0 for directional lights
+    vec4 color;      // rgb = color * intensity, w = spot cone scale
+    vec4 direction;  // xyz = direction the light points, w = spot cone offset
+};
+
+layout(std430, set = 2, binding = 0) readonly buffer Lights {
+    mat4 clusterViews[8];   // MAX_CULL_VIEWS, camera each view's clusters are built for
+    vec4 clusterDepths[8];  // x = near plane, y = slices / log(far / near), z = P00, w = |P11|
+    uvec4 grid;             // xyz = clusters per axis, w = max lights per cluster
+    uvec4 counts;           // x = directional lights, y = all lights, z = views
+    Light lights[];         // Directional lights first
+};
+
+layout(std430, set = 2, binding = 1) readonly buffer Clusters {
+    uvec2 clusters[];  // Offset and count into lightIndices, each view's grid after the one before
+};
+
+layout(std430, set = 2, binding = 2) readonly buffer Indices {
+    uint lightIndices[];
+};
+
+// Cascaded shadow maps of the first directional light, see ShadowCascades
+layout(set = 3, binding = 0) uniform Shadows {
+    mat4 cascades[4];    // MAX_SHADOW_CASCADES, world to each cascade's clip space
+    vec4 tiles[4];       // xy = offset, zw = scale in the atlas
+    vec4 texelSizes;     // World size of a texel, per cascade
+    vec4 params;         // xy = 1 / atlas size, z = tile edge margin, w = depth bias
+    uvec4 shadowCounts;  // x = cascades
+} shadows;
+
+layout(set = 3, binding = 1) uniform sampler2DShadow shadowAtlas;
+
+// Image-based ambient light, see EnvironmentLighting. Without an environment
+// environmentParams.x is 0 and a constant ambient stands in.
+layout(std430, set = 4, binding = 0) readonly buffer Irradiance {
+    vec4 environmentParams;  // x = 1 once baked, y = last specular mip
+    vec4 irradiance[9];      // L2 SH of irradiance over pi, rgb
+};
+
+layout(set = 4, binding = 1) uniform samplerCube specularMap;  // Roughness along the mips
+layout(set = 4, binding = 2) uniform sampler2D brdfTable;      // Split-sum scale and bias
+
+// The lookup moves off the surface along its normal by this many texels
+const float SHADOW_NORMAL_OFFSET = 1.5;
+
 const float PI = 3.14159265359;
 
 // Compute TBN matrix from vertex tangent
@@ -79,6 +130,91 @@ vec3 fresnelSchlick(float cosTheta, vec3 F0) {
     return F0 + (1.0 - F0) * pow(clamp(1.0 - cosTheta, 0.0, 1.0), 5.0);
 }
 
+// Fresnel averaged over the rough lobe, for light from every direction
+vec3 fresnelSchlickRoughness(float cosTheta, vec3 F0, float roughness) {
+    return F0 + (max(vec3(1.0 - roughness), F0) - F0) * pow(clamp(1.0 - cosTheta, 0.0, 1.0), 5.0);
+}
+
+// Diffuse light per unit albedo arriving around N, from the SH coefficients
+vec3 environmentIrradiance(vec3 N) {
+    vec3 result = irradiance[0].rgb * 0.282095
+        + irradiance[1].rgb * 0.488603 * N.y
+        + irradiance[2].rgb * 0.488603 * N.z
+        + irradiance[3].rgb * 0.488603 * N.x
+        + irradiance[4].rgb * 1.092548 * N.x * N.y
+        + irradiance[5].rgb * 1.092548 * N.y * N.z
+        + irradiance[6].rgb * 0.315392 * (3.0 * N.z * N.z - 1.0)
+        + irradiance[7].rgb * 1.092548 * N.x * N.z
+        + irradiance[8].rgb * 0.546274 * (N.x * N.x - N.y * N.y);
+    return max(result, vec3(0.0));
+}
+
+// Cook-Torrance BRDF for light arriving from L with the given radiance
+vec3 shadeLight(vec3 N, vec3 V, vec3 L, vec3 radiance, vec3 albedo, float metallic, float roughness, vec3 F0) {
+    vec3 H = normalize(V + L);
+
+    float NDF = DistributionGGX(N, H, roughness);
+    float G = GeometrySmith(N, V, L, roughness);
+    vec3 F = fresnelSchlick(max(dot(H, V), 0.0), F0);
+
+    vec3 numerator = NDF * G * F;
+    float denominator = 4.0 * max(dot(N, V), 0.0) * max(dot(N, L), 0.0) + 0.0001;
+    vec3 specular = numerator / denominator;
+
+    // Energy conservation
+    vec3 kS = F;
+    vec3 kD = vec3(1.0) - kS;
+    kD *= 1.0 - metallic; // Metals have no diffuse
+
+    float NdotL = max(dot(N, L), 0.0);
+    return (kD * albedo / PI + specular) * radiance * NdotL;
+}
+
+// Froxel of a world position in a view's grid, false outside its frustum
+bool findCluster(vec3 position, uint view, out uint cluster) {
+    if (view >= counts.z) {
+        return false;
+    }
+    vec4 clusterDepth = clusterDepths[view];
+    vec3 viewPos = (clusterViews[view] * vec4(position, 1.0)).xyz;
+    float depth = -viewPos.z;
+    if (depth < clusterDepth.x) {
+        return false;
+    }
+    vec2 ndc = viewPos.xy * clusterDepth.zw / depth;
+    uint slice = uint(log(depth / clusterDepth.x) * clusterDepth.y);
+    if (any(greaterThan(abs(ndc), vec2(1.0))) || slice >= grid.z) {
+        return false;
+    }
+    uvec2 tile = min(uvec2((ndc * 0.5 + 0.5) * vec2(grid.xy)), grid.xy - uvec2(1));
+    cluster = tile.x + grid.x * (tile.y + grid.y * (slice + grid.z * view));
+    return true;
+}
+
+// Fraction of the shadowing light reaching a world position, from the first
+// cascade that covers it. Past the last cascade everything is lit.
+float shadowFactor(vec3 position, vec3 normal) {
+    for (uint c = 0; c < shadows.shadowCounts.x; c++) {
+        vec3 offsetPosition = position + normal * shadows.texelSizes[c] * SHADOW_NORMAL_OFFSET;
+        vec3 coord = (shadows.cascades[c] * vec4(offsetPosition, 1.0)).xyz;
+        if (any(greaterThan(abs(coord.xy), vec2(1.0 - shadows.params.z))) || coord.z > 1.0) {
+            continue;
+        }
+
+        // 3x3 comparisons, each filtered over 2x2 texels by the sampler
+        vec2 uv = (coord.xy * 0.5 + 0.5) * shadows.tiles[c].zw + shadows.tiles[c].xy;
+        float depth = coord.z - shadows.params.w;
+        float lit = 0.0;
+        for (int y = -1; y <= 1; y++) {
+            for (int x = -1; x <= 1; x++) {
+                lit += texture(shadowAtlas, vec3(uv + vec2(x, y) * shadows.params.xy, depth));
+            }
+        }
+        return lit / 9.0;
+    }
+    return 1.0;
+}
+
 void main() {
     // Sample textures and multiply by material factors
     vec4 baseColor = texture(baseColorTex, fragUV) * pc.baseColorFactor;
@@ -98,38 +234,53 @@ void main() {
     mat3 TBN = computeTBN(geomNormal, fragTangent.xyz, fragTangent.w);
     vec3 N = normalize(TBN * normalMap);
 
-    vec3 V = normalize(ubo.camPos - fragPosition);
+    vec3 V = normalize(ubo.views[fragView].camPos - fragPosition);
 
     // F0 for dielectrics is 0.04, for metals use albedo
     vec3 F0 = vec3(0.04);
     F0 = mix(F0, albedo, metallic);
 
-    // Single directional light
-    vec3 lightDir = normalize(vec3(1.0, 1.0, 1.0));
-    vec3 lightColor = vec3(1.0, 1.0, 1.0) * 3.0;
-
-    vec3 L = lightDir;
-    vec3 H = normalize(V + L);
-
-    // Cook-Torrance BRDF
-    float NDF = DistributionGGX(N, H, roughness);
-    float G = GeometrySmith(N, V, L, roughness);
-    vec3 F = fresnelSchlick(max(dot(H, V), 0.0), F0);
-
-    vec3 numerator = NDF * G * F;
-    float denominator = 4.0 * max(dot(N, V), 0.0) * max(dot(N, L), 0.0) + 0.0001;
-    vec3 specular = numerator / denominator;
-
-    // Energy conservation
-    vec3 kS = F;
-    vec3 kD = vec3(1.0) - kS;
-    kD *= 1.0 - metallic; // Metals have no diffuse
-
-    float NdotL = max(dot(N, L), 0.0);
-    vec3 Lo = (kD * albedo / PI + specular) * lightColor * NdotL;
-
-    // Ambient (simple IBL approximation)
+    // Directional lights reach everywhere, the first one casts shadows
+    vec3 Lo = vec3(0.0);
+    for (uint i = 0; i < counts.x; i++) {
+        float shadow = i == 0 ? shadowFactor(fragPosition, geomNormal) : 1.0;
+        Lo += shadeLight(N, V, -lights[i].direction.xyz, lights[i].color.rgb * shadow, albedo, metallic, roughness, F0);
+    }
+
+    // Point and spot lights only from this fragment's cluster
+    uint cluster;
+    if (findCluster(fragPosition, fragView, cluster)) {
+        uvec2 range = clusters[cluster];
+        for (uint i = 0; i < range.y; i++) {
+            Light light = lights[lightIndices[range.x + i]];
+            vec3 toLight = light.position.xyz - fragPosition;
+            float distance2 = max(dot(toLight, toLight), 0.0001);
+            vec3 L = toLight * inversesqrt(distance2);
+
+            // KHR_lights_punctual: inverse square, windowed to zero at the range
+            float ratio2 = distance2 / (light.position.w * light.position.w);
+            float window = clamp(1.0 - ratio2 * ratio2, 0.0, 1.0);
+            float spot = clamp(dot(light.direction.xyz, -L) * light.color.w + light.direction.w, 0.0, 1.0);
+            vec3 radiance = light.color.rgb * (window * window * spot * spot / distance2);
+
+            Lo += shadeLight(N, V, L, radiance, albedo, metallic, roughness, F0);
+        }
+    }
+
+    // Ambient from the environment: SH diffuse and split-sum specular
     vec3 ambient = vec3(0.15) * albedo * ao;
+    if (environmentParams.x > 0.0) {
+        float NdotV = max(dot(N, V), 0.0);
+        vec3 F = fresnelSchlickRoughness(NdotV, F0, roughness);
+        vec3 kD = (1.0 - F) * (1.0 - metallic);
+        vec3 diffuse = kD * albedo * environmentIrradiance(N);
+
+        vec3 prefiltered = textureLod(specularMap, reflect(-V, N), roughness * environmentParams.y).rgb;
+        vec2 brdf = texture(brdfTable, vec2(NdotV, roughness)).rg;
+        vec3 specular = prefiltered * (F * brdf.x + brdf.y);
+
+        ambient = (diffuse + specular) * ao;
+    }
 
     vec3 color = ambient + Lo;
 
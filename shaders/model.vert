@@ -9,28 +9,43 @@ layout(location = 0) out vec3 fragPosition;
 layout(location = 1) out vec3 fragNormal;
 layout(location = 2) out vec2 fragUV;
 layout(location = 3) out vec4 fragTangent;
+layout(location = 4) flat out uint fragView;
+
+// Must match depth.vert bit for bit, the color pass tests EQUAL after a depth pre-pass
+invariant gl_Position;
 
 layout(push_constant) uniform PushConstants {
-    mat4 model;
     vec4 baseColorFactor;
     vec4 mrFactors;       // x=metallic, y=roughness
     vec4 emissiveFactor;
+    uint view;            // Index into ubo.views
 } pc;
 
-layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;  // Unused, kept for layout compatibility
+struct View {
     mat4 view;
     mat4 proj;
     vec3 camPos;
+};
+
+layout(binding = 0) uniform UniformBufferObject {
+    View views[8];  // MAX_CULL_VIEWS
 } ubo;
 
+// Model matrices of this frame's draws, each instanced draw starts at its first one
+layout(std430, set = 1, binding = 0) readonly buffer Instances {
+    mat4 models[];
+};
+
 void main() {
-    vec4 worldPos = pc.model * vec4(inPosition, 1.0);
+    mat4 model = models[gl_InstanceIndex];
+    vec4 worldPos = model * vec4(inPosition, 1.0);
     fragPosition = worldPos.xyz;
-    gl_Position = ubo.proj * ubo.view * worldPos;
+    View view = ubo.views[pc.view];
+    gl_Position = view.proj * view.view * worldPos;
 
-    mat3 normalMatrix = mat3(pc.model);
+    mat3 normalMatrix = mat3(model);
     fragNormal = normalMatrix * inNormal;
     fragTangent = vec4(normalMatrix * inTangent.xyz, inTangent.w);
     fragUV = inUV;
+    fragView = pc.view;
 }
@@ -0,0 +1,52 @@
+#version 450
+#extension GL_EXT_multiview : require
+
+// model.vert for multiview passes: each layer the draw is broadcast to is
+// seen from its own view, pc.view for the first layer and the next ones after it
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec2 inUV;
+layout(location = 3) in vec4 inTangent;
+
+layout(location = 0) out vec3 fragPosition;
+layout(location = 1) out vec3 fragNormal;
+layout(location = 2) out vec2 fragUV;
+layout(location = 3) out vec4 fragTangent;
+layout(location = 4) flat out uint fragView;
+
+layout(push_constant) uniform PushConstants {
+    vec4 baseColorFactor;
+    vec4 mrFactors;       // x=metallic, y=roughness
+    vec4 emissiveFactor;
+    uint view;            // View of layer 0
+} pc;
+
+struct View {
+    mat4 view;
+    mat4 proj;
+    vec3 camPos;
+};
+
+layout(binding = 0) uniform UniformBufferObject {
+    View views[8];  // MAX_CULL_VIEWS
+} ubo;
+
+layout(std430, set = 1, binding = 0) readonly buffer Instances {
+    mat4 models[];
+};
+
+void main() {
+    uint viewIndex = pc.view + gl_ViewIndex;
+    mat4 model = models[gl_InstanceIndex];
+    vec4 worldPos = model * vec4(inPosition, 1.0);
+    fragPosition = worldPos.xyz;
+    View view = ubo.views[viewIndex];
+    gl_Position = view.proj * view.view * worldPos;
+
+    mat3 normalMatrix = mat3(model);
+    fragNormal = normalMatrix * inNormal;
+    fragTangent = vec4(normalMatrix * inTangent.xyz, inTangent.w);
+    fragUV = inUV;
+    fragView = viewIndex;
+}
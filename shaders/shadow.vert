@@ -0,0 +1,18 @@
+#version 450
+
+// Shadow cascades: depth only, from the position-only vertex stream. The
+// cascade's light view-projection replaces the camera's.
+
+layout(location = 0) in vec3 inPosition;
+
+layout(push_constant) uniform PushConstants {
+    mat4 viewProjection;  // Of the cascade being drawn
+} pc;
+
+layout(std430, set = 1, binding = 0) readonly buffer Instances {
+    mat4 models[];
+};
+
+void main() {
+    gl_Position = pc.viewProjection * models[gl_InstanceIndex] * vec4(inPosition, 1.0);
+}
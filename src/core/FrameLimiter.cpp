@@ -0,0 +1,34 @@
+#include "FrameLimiter.hpp"
+
+#include <thread>
+
+using namespace std;
+
+namespace anim::core {
+
+FrameLimiter::FrameLimiter(double targetFps) {
+    setTarget(targetFps);
+}
+
+void FrameLimiter::setTarget(double targetFps) {
+    fps = targetFps > 0.0 ? targetFps : 0.0;
+    period = fps > 0.0 ? chrono::duration_cast<Clock::duration>(chrono::duration<double>(1.0 / fps))
+                       : Clock::duration{0};
+    next = Clock::now();
+}
+
+void FrameLimiter::wait() {
+    if (period == Clock::duration{0}) {
+        return;
+    }
+
+    auto now = Clock::now();
+    if (now < next) {
+        this_thread::sleep_until(next);
+    } else if (now - next > period) {
+        next = now;
+    }
+    next += period;
+}
+
+} // namespace anim::core
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+
+using namespace std;
+
+namespace anim::core {
+
+// Paces the main loop to a target frame rate. wait() belongs before input is
+// sampled, so the time slept is not added between input and the frame it drives.
+class FrameLimiter {
+public:
+    // targetFps 0 = unlimited
+    explicit FrameLimiter(double targetFps = 0.0);
+
+    void setTarget(double targetFps);
+    double target() const { return fps; }
+
+    // Sleeps until the next frame is due. A frame that is late by more than a
+    // period starts a new schedule instead of being made up by short frames.
+    void wait();
+
+private:
+    using Clock = chrono::steady_clock;
+
+    double fps = 0.0;
+    Clock::duration period{0};
+    Clock::time_point next;
+};
+
+} // namespace anim::core
@@ -0,0 +1,117 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace anim::core {
+
+ThreadPool::ThreadPool(uint32_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = max(thread::hardware_concurrency(), 1u) - 1;
+    }
+
+    for (uint32_t i = 0; i < threadCount; i++) {
+        workers.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(uint32_t count, const function<void(uint32_t)>& task) {
+    if (count == 0) {
+        return;
+    }
+
+    if (workers.empty() || count == 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(jobMutex);
+        currentTask = &task;
+        taskCount = count;
+        nextIndex = 0;
+        completed = 0;
+        error = nullptr;
+        generation++;
+    }
+    jobReady.notify_all();
+
+    runTasks(task);
+
+    exception_ptr jobError;
+    {
+        // Workers that picked up the job must leave before task goes out of scope
+        unique_lock<mutex> lock(jobMutex);
+        jobDone.wait(lock, [this]() { return completed == taskCount && activeWorkers == 0; });
+        currentTask = nullptr;
+        jobError = error;
+    }
+
+    if (jobError) {
+        rethrow_exception(jobError);
+    }
+}
+
+void ThreadPool::workerLoop() {
+    uint64_t seenGeneration = 0;
+    while (true) {
+        const function<void(uint32_t)>* task = nullptr;
+        {
+            unique_lock<mutex> lock(jobMutex);
+            jobReady.wait(lock, [&]() { return stopping || generation != seenGeneration; });
+            if (stopping) {
+                return;
+            }
+            seenGeneration = generation;
+            task = currentTask;
+            if (!task) {
+                continue;  // Woke after the job had already finished
+            }
+            activeWorkers++;
+        }
+
+        runTasks(*task);
+
+        {
+            lock_guard<mutex> lock(jobMutex);
+            activeWorkers--;
+        }
+        jobDone.notify_all();
+    }
+}
+
+void ThreadPool::runTasks(const function<void(uint32_t)>& task) {
+    while (true) {
+        uint32_t index = nextIndex.fetch_add(1);
+        if (index >= taskCount) {
+            return;
+        }
+
+        try {
+            task(index);
+        } catch (...) {
+            lock_guard<mutex> lock(jobMutex);
+            if (!error) {
+                error = current_exception();
+            }
+        }
+        completed.fetch_add(1);
+    }
+}
+
+} // namespace anim::core
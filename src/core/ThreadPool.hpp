@@ -0,0 +1,54 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <vector>
+
+using namespace std;
+
+namespace anim::core {
+
+// Fixed set of worker threads for fork-join work within a frame. The calling
+// thread takes part in each job, so a pool with no workers runs serially.
+class ThreadPool {
+public:
+    // threadCount 0 = one worker per hardware thread besides the caller
+    explicit ThreadPool(uint32_t threadCount = 0);
+    ~ThreadPool();
+
+    // Non-copyable
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    uint32_t threadCount() const { return static_cast<uint32_t>(workers.size()); }
+
+    // Runs task(i) for every i in [0, count) and returns once all have finished.
+    // Rethrows the first exception thrown by a task.
+    void parallelFor(uint32_t count, const function<void(uint32_t)>& task);
+
+private:
+    void workerLoop();
+    void runTasks(const function<void(uint32_t)>& task);
+
+    vector<thread> workers;
+    mutex jobMutex;
+    condition_variable jobReady;
+    condition_variable jobDone;
+
+    // Current job, published under jobMutex
+    const function<void(uint32_t)>* currentTask = nullptr;
+    uint32_t taskCount = 0;
+    uint64_t generation = 0;
+    uint32_t activeWorkers = 0;
+    exception_ptr error;
+    bool stopping = false;
+
+    atomic<uint32_t> nextIndex{0};
+    atomic<uint32_t> completed{0};
+};
+
+} // namespace anim::core
@@ -63,6 +63,12 @@ void Window::pollEvents() {
     inputState.scrollDelta = 0.0f;
     inputState.toggleCameraMode = false;
     inputState.toggleWireframe = false;
+    inputState.nextModel = false;
+    inputState.previousModel = false;
+    inputState.toggleGpuCulling = false;
+    inputState.toggleOcclusionCulling = false;
+    inputState.cycleDepthPrepass = false;
+    inputState.nextEnvironment = false;
 
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -87,6 +93,24 @@ void Window::pollEvents() {
                 if (event.key.key == SDLK_I && !event.key.repeat) {
                     inputState.toggleWireframe = true;
                 }
+                if (event.key.key == SDLK_N && !event.key.repeat) {
+                    inputState.nextModel = true;
+                }
+                if (event.key.key == SDLK_B && !event.key.repeat) {
+                    inputState.previousModel = true;
+                }
+                if (event.key.key == SDLK_G && !event.key.repeat) {
+                    inputState.toggleGpuCulling = true;
+                }
+                if (event.key.key == SDLK_O && !event.key.repeat) {
+                    inputState.toggleOcclusionCulling = true;
+                }
+                if (event.key.key == SDLK_P && !event.key.repeat) {
+                    inputState.cycleDepthPrepass = true;
+                }
+                if (event.key.key == SDLK_E && !event.key.repeat) {
+                    inputState.nextEnvironment = true;
+                }
                 break;
 
             case SDL_EVENT_KEY_UP:
@@ -130,6 +154,7 @@ void Window::pollEvents() {
                 break;
 
             case SDL_EVENT_WINDOW_RESIZED:
+                // Bursts during a drag-resize collapse into the last size
                 windowWidth = static_cast<uint32_t>(event.window.data1);
                 windowHeight = static_cast<uint32_t>(event.window.data2);
                 resized = true;
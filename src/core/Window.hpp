@@ -21,6 +21,12 @@ struct InputState {
     bool down = false;      // Shift
     bool toggleCameraMode = false;  // Tab (single press)
     bool toggleWireframe = false;   // I (single press)
+    bool nextModel = false;         // N (single press)
+    bool previousModel = false;     // B (single press)
+    bool toggleGpuCulling = false;  // G (single press)
+    bool toggleOcclusionCulling = false;  // O (single press)
+    bool cycleDepthPrepass = false;  // P (single press)
+    bool nextEnvironment = false;   // E (single press)
 
     // Mouse
     float mouseDeltaX = 0.0f;
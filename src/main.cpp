@@ -3,24 +3,562 @@
 #include "vulkan/Instance.hpp"
 #include "vulkan/Device.hpp"
 #include "vulkan/Swapchain.hpp"
+#include "vulkan/Defragmenter.hpp"
 #include "renderer/Renderer.hpp"
 #include "renderer/Scene.hpp"
+#include "renderer/ResidencyManager.hpp"
+#include "renderer/ParallelRecorder.hpp"
+#include "renderer/OverdrawMonitor.hpp"
+#include "renderer/FrameCapture.hpp"
+#include "core/ThreadPool.hpp"
+#include "core/FrameLimiter.hpp"
 
 #include <iostream>
+#include <cmath>
 #include <chrono>
+#include <algorithm>
+#include <array>
 #include <cstdlib>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <stdexcept>
+
+#include <stb_image_write.h>
 
 using namespace std;
 using namespace anim;
 
-int main(int argc, char* argv[]) {
-    string modelPath = "";
-    if (argc > 1) {
-        modelPath = argv[1];
+struct AppOptions {
+    vector<string> modelPaths;
+    uint32_t framesInFlight = 2;
+    uint32_t recordThreads = 0;  // Worker threads besides the main one, 0 = one per core
+    bool cullStats = false;      // Print culling counters once a second
+    bool drawStats = false;      // Print command encoder counters once a second
+    bool gpuCulling = false;     // Start in GPU-driven mode
+    bool occlusionCulling = false;  // Two-phase Hi-Z culling, implies gpuCulling
+    renderer::DepthPrepassMode depthPrepass = renderer::DepthPrepassMode::Off;
+    vulkan::SwapchainConfig swapchain;
+    double fpsLimit = 0.0;         // 0 = unlimited
+    uint32_t maxQueuedFrames = 0;  // Presented frames waiting for display, 0 = unbounded
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    bool headless = false;         // No window, render offscreen and save the last frame
+    uint32_t frames = 1;           // Headless frames to render
+    string outputPath = "frame.png";
+    string captureDirectory;       // Write every frame here, empty = off
+    renderer::CaptureFormat captureFormat = renderer::CaptureFormat::Png;
+    bool turntable = false;        // Headless camera circles the model once over the frames
+    uint32_t thumbnails = 0;       // Extra views around the model, drawn in a strip along the bottom
+    uint32_t lights = 0;           // Random point lights around the origin, to load clustered lighting
+    renderer::LightClustering lightClustering = renderer::LightClustering::Cpu;
+    renderer::ShadowQuality shadowQuality = renderer::ShadowQuality::Medium;
+    optional<uint32_t> shadowCascades;   // Overrides of the quality's settings
+    optional<uint32_t> shadowResolution;
+    optional<uint32_t> shadowInterval;
+    vector<string> environments;         // HDR maps for image-based lighting, E cycles them
+    string environmentCache = "ibl_cache";  // Empty = off
+    optional<uint64_t> environmentBudget;   // Bake samples per frame
+};
+
+// Headless color target, 8-bit RGBA is what readFrame returns without swizzling
+static constexpr VkFormat HEADLESS_COLOR_FORMAT = VK_FORMAT_R8G8B8A8_SRGB;
+static constexpr float HEADLESS_CAMERA_DISTANCE = 20.0f;
+
+// Thumbnails are at most this many to the width of the frame
+static constexpr uint32_t MIN_THUMBNAIL_SLOTS = 4;
+static constexpr VkClearColorValue THUMBNAIL_CLEAR = {{0.1f, 0.1f, 0.1f, 1.0f}};
+
+// --lights are scattered this far from the origin, with a random range and intensity
+static constexpr float TEST_LIGHT_SPREAD = 10.0f;
+static constexpr float TEST_LIGHT_MIN_RANGE = 1.5f;
+static constexpr float TEST_LIGHT_MAX_RANGE = 4.0f;
+static constexpr float TEST_LIGHT_MAX_INTENSITY = 20.0f;
+
+static VkPresentModeKHR parsePresentMode(const string& value) {
+    if (value == "immediate") return VK_PRESENT_MODE_IMMEDIATE_KHR;
+    if (value == "mailbox") return VK_PRESENT_MODE_MAILBOX_KHR;
+    if (value == "fifo") return VK_PRESENT_MODE_FIFO_KHR;
+    if (value == "fifo-relaxed") return VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+    throw runtime_error("Present mode must be immediate, mailbox, fifo or fifo-relaxed: " + value);
+}
+
+static renderer::DepthPrepassMode parseDepthPrepassMode(const string& value) {
+    if (value == "off") return renderer::DepthPrepassMode::Off;
+    if (value == "on") return renderer::DepthPrepassMode::On;
+    if (value == "auto") return renderer::DepthPrepassMode::Auto;
+    throw runtime_error("Depth pre-pass must be off, on or auto: " + value);
+}
+
+static renderer::CaptureFormat parseCaptureFormat(const string& value) {
+    if (value == "png") return renderer::CaptureFormat::Png;
+    if (value == "exr") return renderer::CaptureFormat::Exr;
+    if (value == "raw") return renderer::CaptureFormat::Raw;
+    throw runtime_error("Capture format must be png, exr or raw: " + value);
+}
+
+static renderer::LightClustering parseLightClustering(const string& value) {
+    if (value == "cpu") return renderer::LightClustering::Cpu;
+    if (value == "gpu") return renderer::LightClustering::Gpu;
+    throw runtime_error("Light clustering must be cpu or gpu: " + value);
+}
+
+static renderer::ShadowQuality parseShadowQuality(const string& value) {
+    if (value == "off") return renderer::ShadowQuality::Off;
+    if (value == "low") return renderer::ShadowQuality::Low;
+    if (value == "medium") return renderer::ShadowQuality::Medium;
+    if (value == "high") return renderer::ShadowQuality::High;
+    throw runtime_error("Shadows must be off, low, medium or high: " + value);
+}
+
+static const char* depthPrepassModeName(renderer::DepthPrepassMode mode) {
+    switch (mode) {
+        case renderer::DepthPrepassMode::Off: return "OFF";
+        case renderer::DepthPrepassMode::On: return "ON";
+        case renderer::DepthPrepassMode::Auto: return "AUTO";
+    }
+    return "";
+}
+
+// Options are --name=value, everything else is a model path
+static AppOptions parseOptions(int argc, char* argv[]) {
+    AppOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (!arg.starts_with("--")) {
+            options.modelPaths.push_back(arg);
+            continue;
+        }
+
+        size_t eq = arg.find('=');
+        string name = arg.substr(2, eq == string::npos ? string::npos : eq - 2);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "frames-in-flight") {
+            options.framesInFlight = static_cast<uint32_t>(stoul(value));
+        } else if (name == "record-threads") {
+            options.recordThreads = static_cast<uint32_t>(stoul(value));
+        } else if (name == "cull-stats") {
+            options.cullStats = true;
+        } else if (name == "draw-stats") {
+            options.drawStats = true;
+        } else if (name == "gpu-culling") {
+            options.gpuCulling = true;
+        } else if (name == "occlusion-culling") {
+            options.gpuCulling = true;
+            options.occlusionCulling = true;
+        } else if (name == "depth-prepass") {
+            options.depthPrepass = parseDepthPrepassMode(value);
+        } else if (name == "present-mode") {
+            options.swapchain.presentMode = parsePresentMode(value);
+        } else if (name == "swapchain-images") {
+            options.swapchain.imageCount = static_cast<uint32_t>(stoul(value));
+        } else if (name == "fps-limit") {
+            options.fpsLimit = stod(value);
+        } else if (name == "max-queued-frames") {
+            options.maxQueuedFrames = static_cast<uint32_t>(stoul(value));
+        } else if (name == "size") {
+            size_t x = value.find('x');
+            if (x == string::npos) {
+                throw runtime_error("Size must be WIDTHxHEIGHT: " + value);
+            }
+            options.width = static_cast<uint32_t>(stoul(value.substr(0, x)));
+            options.height = static_cast<uint32_t>(stoul(value.substr(x + 1)));
+        } else if (name == "headless") {
+            options.headless = true;
+        } else if (name == "frames") {
+            options.frames = max(static_cast<uint32_t>(stoul(value)), 1u);
+        } else if (name == "output") {
+            options.outputPath = value;
+        } else if (name == "capture") {
+            options.captureDirectory = value.empty() ? "frames" : value;
+        } else if (name == "capture-format") {
+            options.captureFormat = parseCaptureFormat(value);
+        } else if (name == "turntable") {
+            options.turntable = true;
+        } else if (name == "thumbnails") {
+            options.thumbnails = static_cast<uint32_t>(stoul(value));
+            if (options.thumbnails >= renderer::MAX_CULL_VIEWS) {
+                throw runtime_error("Thumbnails must be fewer than " + to_string(renderer::MAX_CULL_VIEWS));
+            }
+        } else if (name == "lights") {
+            options.lights = static_cast<uint32_t>(stoul(value));
+        } else if (name == "light-clustering") {
+            options.lightClustering = parseLightClustering(value);
+        } else if (name == "shadows") {
+            options.shadowQuality = parseShadowQuality(value);
+        } else if (name == "shadow-cascades") {
+            options.shadowCascades = static_cast<uint32_t>(stoul(value));
+            if (*options.shadowCascades > renderer::MAX_SHADOW_CASCADES) {
+                throw runtime_error("Shadow cascades must be at most " + to_string(renderer::MAX_SHADOW_CASCADES));
+            }
+        } else if (name == "shadow-resolution") {
+            options.shadowResolution = static_cast<uint32_t>(stoul(value));
+        } else if (name == "shadow-interval") {
+            options.shadowInterval = max(static_cast<uint32_t>(stoul(value)), 1u);
+        } else if (name == "environment") {
+            options.environments.push_back(value);
+        } else if (name == "environment-cache") {
+            options.environmentCache = value == "off" ? "" : value;
+        } else if (name == "environment-budget") {
+            options.environmentBudget = stoull(value);
+        } else {
+            throw runtime_error("Unknown option: " + arg);
+        }
+    }
+    return options;
+}
+
+// The default headless camera, turned by angle around the origin
+static renderer::CameraData orbitCamera(float angle) {
+    glm::vec3 position = glm::vec3(sin(angle), 0.0f, cos(angle)) * HEADLESS_CAMERA_DISTANCE;
+    float yaw = glm::degrees(atan2(-position.z, -position.x));
+    core::Camera camera(position, yaw, 0.0f);
+
+    renderer::CameraData camData;
+    camData.view = camera.viewMatrix();
+    camData.position = camera.position();
+    camData.fov = camera.fov();
+    return camData;
+}
+
+// View 0 is the camera, the thumbnail views circle the origin after it
+static void updateSceneViews(renderer::Scene& scene, float time, float aspect,
+                             const renderer::CameraData& camera, uint32_t thumbnails) {
+    vector<renderer::SceneView> views = {{camera, aspect}};
+    for (uint32_t i = 0; i < thumbnails; i++) {
+        float angle = glm::radians(360.0f * static_cast<float>(i) / static_cast<float>(thumbnails));
+        views.push_back({orbitCamera(angle), aspect});
+    }
+    scene.updateViews(time, views);
+}
+
+// The thumbnail views share one multiview pass where the device allows it
+static void configureThumbnails(vulkan::Device& device, renderer::Renderer& renderer,
+                                renderer::Scene& scene, uint32_t thumbnails) {
+    if (thumbnails == 0) {
+        return;
+    }
+    if (device.features().maxMultiviewViews >= thumbnails &&
+        scene.setMultiview(1, thumbnails, renderer.multiviewTarget((1u << thumbnails) - 1))) {
+        cout << "Thumbnails: " << thumbnails << " views in one multiview pass" << endl;
+    } else {
+        cout << "Thumbnails: " << thumbnails << " views, one viewport each (multiview not supported)" << endl;
+    }
+}
+
+// Draws views 1 and up side by side along the bottom of the frame. With
+// multiview they render into the layers of one image in a single pass, which
+// is then copied into place, otherwise each is drawn into its own viewport.
+static void addThumbnailPasses(renderer::Renderer& renderer, renderer::Scene& scene) {
+    auto& graph = renderer.graph();
+    uint32_t thumbnails = scene.viewCount() - 1;
+    VkExtent2D frame = renderer.extent();
+    uint32_t width = max(frame.width / max(thumbnails, MIN_THUMBNAIL_SLOTS), 1u);
+    VkExtent2D size = {width, max(width * frame.height / frame.width, 1u)};
+    auto top = static_cast<int32_t>(frame.height - size.height);
+
+    if (!scene.isMultiview()) {
+        renderer.addScenePass("thumbnails", [&scene, thumbnails, size, top](renderer::RenderGraph::PassContext& pass) {
+            auto& encoder = pass.encoder;
+            for (uint32_t view = 1; view <= thumbnails; view++) {
+                auto left = static_cast<int32_t>((view - 1) * size.width);
+
+                // Each view starts from its own background and far depth
+                array<VkClearAttachment, 2> clears{};
+                clears[0].aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                clears[0].colorAttachment = 0;
+                clears[0].clearValue.color = THUMBNAIL_CLEAR;
+                clears[1].aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+                clears[1].clearValue.depthStencil = {1.0f, 0};
+                VkClearRect rect{{{left, top}, size}, 0, 1};
+                vkCmdClearAttachments(encoder.handle(), static_cast<uint32_t>(clears.size()), clears.data(), 1, &rect);
+
+                encoder.setViewport(static_cast<float>(left), static_cast<float>(top),
+                                    static_cast<float>(size.width), static_cast<float>(size.height));
+                encoder.setScissor(left, top, size.width, size.height);
+                if (scene.isDepthPrepassActive()) {
+                    scene.recordDepthDraws(encoder, 0, scene.drawCount(view), view);
+                }
+                scene.recordDraws(encoder, 0, scene.drawCount(view), view);
+            }
+        });
+        return;
+    }
+
+    auto color = graph.createImage("thumbnail color", {
+        size.width, size.height, renderer.colorFormat(),
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, thumbnails});
+    auto depth = graph.createImage("thumbnail depth", {
+        size.width, size.height, renderer.renderTarget().depthFormat,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT, thumbnails});
+
+    // The group's draws are recorded once, as view 1, and broadcast to every layer
+    graph.addPass("thumbnails", [&scene, size](renderer::RenderGraph::PassContext& pass) {
+        pass.encoder.setViewport(0, 0, static_cast<float>(size.width), static_cast<float>(size.height));
+        pass.encoder.setScissor(0, 0, size.width, size.height);
+        scene.recordDraws(pass.encoder, 0, scene.drawCount(1), 1);
+    }).colorAttachment(color, THUMBNAIL_CLEAR).depthAttachment(depth, 1.0f).viewMask((1u << thumbnails) - 1);
+
+    renderer::RenderGraph::ImageHandle target = renderer.colorTarget();
+    graph.addPass("thumbnail copy", [&graph, color, target, thumbnails, size, top](renderer::RenderGraph::PassContext& pass) {
+        vector<VkImageCopy> regions(thumbnails);
+        for (uint32_t layer = 0; layer < thumbnails; layer++) {
+            VkImageCopy& region = regions[layer];
+            region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, layer, 1};
+            region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+            region.dstOffset = {static_cast<int32_t>(layer * size.width), top, 0};
+            region.extent = {size.width, size.height, 1};
+        }
+        vkCmdCopyImage(pass.encoder.handle(), graph.image(color).handle(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       graph.image(target).handle(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       thumbnails, regions.data());
+    }).read(color, renderer::ImageAccess::TransferSrc).write(target, renderer::ImageAccess::TransferDst);
+}
+
+// Declares the frame's passes and records it, shared by the window and
+// headless loops. Does nothing while minimized.
+static void renderFrame(renderer::Renderer& renderer, renderer::Scene& scene,
+                        renderer::ParallelRecorder& recorder, renderer::OverdrawMonitor& overdrawMonitor,
+                        bool overdrawSupported, renderer::FrameCapture* capture) {
+    bool parallel = !scene.isGpuDriven() && recorder.shouldSplit(scene.drawCount());
+
+    // Overdraw is measured on the inline path, where one query sees every draw
+    bool measureOverdraw = overdrawSupported && !parallel && !scene.isGpuDriven() &&
+                           scene.depthPrepassMode() == renderer::DepthPrepassMode::Auto;
+
+    if (!renderer.beginFrame()) {
+        return;
+    }
+
+    if (auto overdraw = overdrawMonitor.beginFrame(renderer.commandBuffer().handle(), renderer.frameSlot())) {
+        scene.reportOverdraw(*overdraw);
+    }
+    scene.writeInstances(renderer.frameSlot());
+
+    // Passes run in endFrame, after everything is declared
+    auto& graph = renderer.graph();
+    renderer::RenderGraph::ImageHandle depth = renderer.depthTarget();
+    renderer::RenderGraph::ImageHandle shadowAtlas = scene.addShadowPass(graph);
+
+    // Light lists and indirect draws are buffers the graph does not track
+    if (scene.lightClustering() == renderer::LightClustering::Gpu) {
+        graph.addPass("light clustering", [&](renderer::RenderGraph::PassContext& pass) {
+            scene.recordLightClustering(pass.encoder.handle());
+        }).sideEffects();
+    }
+    if (scene.isBakingEnvironment()) {
+        graph.addPass("environment", [&](renderer::RenderGraph::PassContext& pass) {
+            scene.recordEnvironmentBake(pass.encoder.handle());
+        }).sideEffects();
+    }
+    if (scene.isGpuDriven()) {
+        graph.addPass("culling", [&](renderer::RenderGraph::PassContext& pass) {
+            scene.recordCulling(pass.encoder.handle(), graph.image(depth));
+        }).sideEffects();
+    }
+
+    renderer.addScenePass("scene", [&](renderer::RenderGraph::PassContext& pass) {
+        if (parallel) {
+            // Each range lays down its own depth first, which still skips most shading
+            recorder.record(renderer, pass, scene.drawCount(), [&scene](vulkan::CommandEncoder& encoder, size_t first, size_t count) {
+                if (scene.isDepthPrepassActive()) {
+                    scene.recordDepthDraws(encoder, first, count);
+                }
+                scene.recordDraws(encoder, first, count);
+            });
+            return;
+        }
+
+        auto& encoder = pass.encoder;
+        VkExtent2D extent = pass.extent;
+
+        encoder.setViewport(0, 0, static_cast<float>(extent.width), static_cast<float>(extent.height));
+        encoder.setScissor(0, 0, extent.width, extent.height);
+
+        if (scene.isGpuDriven()) {
+            scene.recordIndirectDraws(encoder);
+        } else {
+            // The query covers whichever pass lays down depth
+            if (measureOverdraw) {
+                overdrawMonitor.begin(encoder.handle(), extent);
+            }
+            if (scene.isDepthPrepassActive()) {
+                scene.recordDepthDraws(encoder, 0, scene.drawCount());
+                if (measureOverdraw) {
+                    overdrawMonitor.end(encoder.handle());
+                }
+                scene.recordDraws(encoder, 0, scene.drawCount());
+            } else {
+                scene.recordDraws(encoder, 0, scene.drawCount());
+                if (measureOverdraw) {
+                    overdrawMonitor.end(encoder.handle());
+                }
+            }
+        }
+    }).secondaryCommandBuffers(parallel).read(shadowAtlas, renderer::ImageAccess::SampledGraphics);
+
+    // Second occlusion phase: re-test what the first rejected against this frame's depth
+    if (scene.hasLatePass()) {
+        graph.addPass("late culling", [&](renderer::RenderGraph::PassContext& pass) {
+            scene.recordLateCulling(pass.encoder.handle(), graph.image(depth));
+        }).read(depth, renderer::ImageAccess::SampledCompute).sideEffects();
+
+        renderer.addScenePass("late scene", [&](renderer::RenderGraph::PassContext& pass) {
+            pass.encoder.setViewport(0, 0, static_cast<float>(pass.extent.width),
+                                     static_cast<float>(pass.extent.height));
+            pass.encoder.setScissor(0, 0, pass.extent.width, pass.extent.height);
+            scene.recordIndirectDraws(pass.encoder);
+        });
     }
 
+    if (scene.viewCount() > 1) {
+        addThumbnailPasses(renderer, scene);
+    }
+
+    if (capture) {
+        capture->capture(renderer);
+    }
+
+    renderer.endFrame();
+}
+
+// Point lights of random color and range, the same ones every run
+static void addTestLights(renderer::Scene& scene, uint32_t count) {
+    mt19937 random(1);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (uint32_t i = 0; i < count; i++) {
+        renderer::PunctualLight light;
+        light.position = (glm::vec3(unit(random), unit(random), unit(random)) * 2.0f - 1.0f) * TEST_LIGHT_SPREAD;
+        light.color = glm::vec3(unit(random), unit(random), unit(random));
+        light.intensity = unit(random) * TEST_LIGHT_MAX_INTENSITY;
+        light.range = TEST_LIGHT_MIN_RANGE + unit(random) * (TEST_LIGHT_MAX_RANGE - TEST_LIGHT_MIN_RANGE);
+        scene.addLight(light);
+    }
+}
+
+// Culling, depth pre-pass and lighting settings from the command line
+static void configureScene(renderer::Scene& scene, const AppOptions& options, bool overdrawSupported) {
+    scene.setLightClustering(options.lightClustering);
+    addTestLights(scene, options.lights);
+
+    renderer::ShadowSettings shadows = renderer::ShadowSettings::forQuality(options.shadowQuality);
+    shadows.cascadeCount = options.shadowCascades.value_or(shadows.cascadeCount);
+    shadows.resolution = options.shadowResolution.value_or(shadows.resolution);
+    shadows.updateInterval = options.shadowInterval.value_or(shadows.updateInterval);
+    scene.setShadowSettings(shadows);
+
+    // Headless frames are few, the first one bakes the whole environment
+    renderer::EnvironmentSettings environment = scene.environmentSettings();
+    environment.cacheDirectory = options.environmentCache;
+    environment.samplesPerFrame = options.headless ? 0 : options.environmentBudget.value_or(environment.samplesPerFrame);
+    scene.setEnvironmentSettings(environment);
+    if (!options.environments.empty()) {
+        scene.setEnvironment(options.environments[0]);
+    }
+
+    scene.setOcclusionCulling(options.occlusionCulling);
+    scene.setDepthPrepassMode(options.depthPrepass);
+    if (options.depthPrepass == renderer::DepthPrepassMode::Auto && !overdrawSupported) {
+        cout << "Precise occlusion queries not supported, automatic depth pre-pass stays off" << endl;
+    }
+    if (options.gpuCulling && !scene.setGpuDriven(true)) {
+        cout << "GPU culling is not supported on this device" << endl;
+    }
+}
+
+// Renders the first model from the default camera without a window or
+// surface, for thumbnails and benchmarks on machines without a display
+// (lavapipe works). The last frame is read back and saved as PNG, or with
+// --capture every frame is written as the next ones render.
+static void runHeadless(const AppOptions& options) {
+    vulkan::Instance instance("Anim", {});
+
+    {
+        vulkan::Device device(instance.handle(), VK_NULL_HANDLE);
+        renderer::Renderer renderer(device, {options.width, options.height}, HEADLESS_COLOR_FORMAT,
+                                    options.framesInFlight);
+
+        core::ThreadPool threadPool(options.recordThreads);
+        renderer::Scene scene(device, renderer.renderTarget(), renderer.framesInFlight());
+        scene.setThreadPool(&threadPool);
+
+        renderer::ParallelRecorder recorder(device, threadPool, renderer.framesInFlight());
+        renderer::OverdrawMonitor overdrawMonitor(device, renderer.framesInFlight());
+        bool overdrawSupported = renderer::OverdrawMonitor::isSupported(device);
+        renderer::ResidencyManager residency(device, scene, renderer.frameTimeline());
+
+        if (options.modelPaths.empty()) {
+            scene.addTriangle();
+        } else {
+            residency.load(options.modelPaths[0]);
+            cout << "Loaded model: " << options.modelPaths[0] << endl;
+        }
+        configureScene(scene, options, overdrawSupported);
+        configureThumbnails(device, renderer, scene, options.thumbnails);
+
+        unique_ptr<renderer::FrameCapture> capture;
+        if (!options.captureDirectory.empty()) {
+            renderer::CaptureConfig captureConfig;
+            captureConfig.directory = options.captureDirectory;
+            captureConfig.format = options.captureFormat;
+            capture = make_unique<renderer::FrameCapture>(device, renderer.framesInFlight(), captureConfig);
+        }
+
+        float aspect = static_cast<float>(options.width) / static_cast<float>(options.height);
+
+        auto start = chrono::high_resolution_clock::now();
+        for (uint32_t frame = 0; frame < options.frames; frame++) {
+            // The default camera, or one turn around the origin at its distance
+            float angle = options.turntable ? glm::radians(360.0f * static_cast<float>(frame) /
+                                                           static_cast<float>(options.frames)) : 0.0f;
+            updateSceneViews(scene, 0.0f, aspect, orbitCamera(angle), options.thumbnails);
+            residency.update(renderer.frameNumber());
+            scene.prepareDraws();
+            renderFrame(renderer, scene, recorder, overdrawMonitor, overdrawSupported, capture.get());
+        }
+        if (capture) {
+            capture->finish(renderer);
+        } else {
+            renderer.waitForFrame(renderer.frameNumber() - 1);
+        }
+        float elapsedMs = chrono::duration<float, milli>(chrono::high_resolution_clock::now() - start).count();
+        cout << "Rendered " << options.frames << " frames at " << options.width << "x" << options.height
+             << " in " << elapsedMs << " ms (" << elapsedMs / static_cast<float>(options.frames)
+             << " ms per frame)" << endl;
+
+        if (capture) {
+            cout << "Saved " << capture->framesWritten() << " frames to " << options.captureDirectory << endl;
+        } else {
+            vector<uint8_t> pixels = renderer.readFrame();
+            int stride = static_cast<int>(options.width * 4);
+            if (!stbi_write_png(options.outputPath.c_str(), static_cast<int>(options.width),
+                                static_cast<int>(options.height), 4, pixels.data(), stride)) {
+                throw runtime_error("Failed to write " + options.outputPath);
+            }
+            cout << "Saved frame: " << options.outputPath << endl;
+        }
+
+        device.waitIdle();
+        scene.flushEnvironmentCache();
+    }
+}
+
+int main(int argc, char* argv[]) {
     try {
-        core::Window window("Anim Engine", 1280, 720);
+        AppOptions options = parseOptions(argc, argv);
+        const vector<string>& modelPaths = options.modelPaths;
+
+        if (options.headless) {
+            runHeadless(options);
+            cout << "Shutdown complete." << endl;
+            return EXIT_SUCCESS;
+        }
+
+        core::Window window("Anim Engine", options.width, options.height);
 
         auto extensions = window.getRequiredVulkanExtensions();
         vulkan::Instance instance("Anim", extensions);
@@ -29,30 +567,82 @@ int main(int argc, char* argv[]) {
 
         {
             vulkan::Device device(instance.handle(), surface);
-            vulkan::Swapchain swapchain(device, surface, window.width(), window.height());
-            renderer::Renderer renderer(device, swapchain);
+            vulkan::Swapchain swapchain(device, surface, window.width(), window.height(), options.swapchain);
+            renderer::Renderer renderer(device, swapchain, options.framesInFlight);
+
+            // Workers for parallel command recording and BVH builds
+            core::ThreadPool threadPool(options.recordThreads);
+
+            renderer::Scene scene(device, renderer.renderTarget(), renderer.framesInFlight());
+            scene.setThreadPool(&threadPool);
 
-            renderer::Scene scene(device, renderer.renderPass().handle());
+            // Large draw lists are recorded into secondary command buffers on worker threads
+            renderer::ParallelRecorder recorder(device, threadPool, renderer.framesInFlight());
+            renderer::OverdrawMonitor overdrawMonitor(device, renderer.framesInFlight());
+            bool overdrawSupported = renderer::OverdrawMonitor::isSupported(device);
 
-            if (modelPath.empty()) {
+            // Keeps loaded models under a GPU memory budget, one model is shown at a time
+            renderer::ResidencyManager residency(device, scene, renderer.frameTimeline());
+            vector<int> models(modelPaths.size(), -1);  // Residency ids, -1 until first shown
+            size_t currentModel = 0;
+            size_t currentEnvironment = 0;  // options.environments.size() = none
+
+            if (modelPaths.empty()) {
                 scene.addTriangle();
                 cout << "No model specified. Rendering triangle." << endl;
             } else {
-                scene.loadModel(modelPath);
-                cout << "Loaded model: " << modelPath << endl;
+                models[0] = static_cast<int>(residency.load(modelPaths[0]));
+                cout << "Loaded model: " << modelPaths[0] << endl;
             }
 
+            configureScene(scene, options, overdrawSupported);
+            configureThumbnails(device, renderer, scene, options.thumbnails);
+
+            // Compact GPU memory a few allocations per frame in long sessions
+            vulkan::Defragmenter defragmenter(device);
+            defragmenter.setRelocationCallback([&scene]() { scene.refreshDescriptors(); });
+
             // Create camera at a good viewing position
             core::Camera camera(glm::vec3(0.0f, 0.0f, 20.0f), -90.0f, 0.0f);
 
             cout << "Controls:" << endl;
             cout << "  FPS mode: WASD to move, Click+Drag to look, Space/Shift for up/down" << endl;
             cout << "  Orbit mode: Click+Drag to orbit, Right+Drag to pan, Scroll to zoom" << endl;
-            cout << "  Tab to toggle camera mode, I for wireframe, ESC to exit" << endl;
+            cout << "  Tab to toggle camera mode, I for wireframe, G for GPU culling, O for occlusion culling, P for depth pre-pass, ESC to exit" << endl;
+            if (modelPaths.size() > 1) {
+                cout << "  N/B to switch to the next/previous model" << endl;
+            }
+            if (!options.environments.empty()) {
+                cout << "  E to switch to the next environment, or none" << endl;
+            }
+
+            // Frames written while the window renders, e.g. to record a session
+            unique_ptr<renderer::FrameCapture> capture;
+            if (!options.captureDirectory.empty()) {
+                renderer::CaptureConfig captureConfig;
+                captureConfig.directory = options.captureDirectory;
+                captureConfig.format = options.captureFormat;
+                capture = make_unique<renderer::FrameCapture>(device, renderer.framesInFlight(), captureConfig);
+            }
+
+            core::FrameLimiter limiter(options.fpsLimit);
+            if (options.fpsLimit > 0.0) {
+                cout << "Frame rate limit: " << options.fpsLimit << " fps" << endl;
+            }
+            if (options.maxQueuedFrames > 0 && !swapchain.presentWaitSupported()) {
+                cout << "Present wait not supported, queued frames are not bounded" << endl;
+            }
 
             auto lastTime = chrono::high_resolution_clock::now();
+            auto lastStatsTime = lastTime;
 
             while (!window.shouldClose()) {
+                // Wait before sampling input rather than after present, so the
+                // input a frame uses is as fresh as possible when it is shown
+                if (options.maxQueuedFrames > 0) {
+                    renderer.limitQueuedFrames(options.maxQueuedFrames);
+                }
+                limiter.wait();
                 window.pollEvents();
 
                 // Calculate delta time
@@ -75,6 +665,56 @@ int main(int argc, char* argv[]) {
                     cout << "Wireframe: " << (scene.isWireframe() ? "ON" : "OFF") << endl;
                 }
 
+                // Toggle GPU-driven culling and indirect draws
+                if (input.toggleGpuCulling) {
+                    if (scene.setGpuDriven(!scene.isGpuDriven())) {
+                        cout << "GPU culling: " << (scene.isGpuDriven() ? "ON" : "OFF") << endl;
+                    } else {
+                        cout << "GPU culling is not supported on this device" << endl;
+                    }
+                }
+
+                // Toggle occlusion culling, which only applies in GPU-driven mode
+                if (input.toggleOcclusionCulling) {
+                    scene.setOcclusionCulling(!scene.isOcclusionCulling());
+                    cout << "Occlusion culling: " << (scene.isOcclusionCulling() ? "ON" : "OFF")
+                         << (scene.isGpuDriven() ? "" : " (takes effect with GPU culling)") << endl;
+                }
+
+                // Cycle the depth pre-pass through off, on and automatic
+                if (input.cycleDepthPrepass) {
+                    auto mode = scene.depthPrepassMode();
+                    auto next = mode == renderer::DepthPrepassMode::Off ? renderer::DepthPrepassMode::On
+                              : mode == renderer::DepthPrepassMode::On ? renderer::DepthPrepassMode::Auto
+                              : renderer::DepthPrepassMode::Off;
+                    scene.setDepthPrepassMode(next);
+                    cout << "Depth pre-pass: " << depthPrepassModeName(next) << endl;
+                }
+
+                // Switch models, loading each one the first time it is shown
+                if ((input.nextModel || input.previousModel) && modelPaths.size() > 1) {
+                    residency.release(static_cast<uint32_t>(models[currentModel]));
+                    size_t count = modelPaths.size();
+                    currentModel = input.nextModel ? (currentModel + 1) % count : (currentModel + count - 1) % count;
+                    if (models[currentModel] >= 0) {
+                        residency.request(static_cast<uint32_t>(models[currentModel]));
+                    } else {
+                        models[currentModel] = static_cast<int>(residency.load(modelPaths[currentModel]));
+                    }
+                    cout << "Model: " << modelPaths[currentModel] << endl;
+                }
+
+                // Cycle the environments and no environment, bakes spread over the next frames
+                if (input.nextEnvironment && !options.environments.empty()) {
+                    currentEnvironment = (currentEnvironment + 1) % (options.environments.size() + 1);
+                    if (currentEnvironment < options.environments.size()) {
+                        scene.setEnvironment(options.environments[currentEnvironment]);
+                    } else {
+                        scene.clearEnvironment();
+                        cout << "Environment: none" << endl;
+                    }
+                }
+
                 // Update camera from input based on mode
                 if (camera.mode() == core::CameraMode::FPS) {
                     if (input.forward) camera.moveForward(deltaTime);
@@ -103,17 +743,16 @@ int main(int argc, char* argv[]) {
                     }
                 }
 
-                // Handle window resize
+                // Handle window resize, the renderer recreates the swapchain on its next frame
                 if (window.wasResized()) {
                     window.resetResizeFlag();
-                    if (window.width() > 0 && window.height() > 0) {
-                        renderer.handleResize(window.width(), window.height());
-                    }
-                    continue;
+                    renderer.handleResize(window.width(), window.height());
                 }
 
-                VkExtent2D extent = swapchain.extent();
-                float aspect = static_cast<float>(extent.width) / static_cast<float>(extent.height);
+                if (window.width() == 0 || window.height() == 0) {
+                    continue;  // Minimized
+                }
+                float aspect = static_cast<float>(window.width()) / static_cast<float>(window.height());
 
                 renderer::CameraData camData;
                 camData.view = camera.viewMatrix();
@@ -121,21 +760,60 @@ int main(int argc, char* argv[]) {
                 camData.fov = camera.fov();
 
                 float time = chrono::duration<float>(currentTime - lastTime).count();
-                scene.update(time, aspect, camData);
-
-                if (renderer.beginFrame()) {
-                    auto& cmd = renderer.commandBuffer();
-
-                    cmd.setViewport(0, 0, static_cast<float>(extent.width), static_cast<float>(extent.height));
-                    cmd.setScissor(0, 0, extent.width, extent.height);
+                updateSceneViews(scene, time, aspect, camData, options.thumbnails);
 
-                    scene.render(cmd.handle());
+                residency.update(renderer.frameNumber());
+                defragmenter.step();
 
-                    renderer.endFrame();
+                scene.prepareDraws();
+                bool printStats = (options.cullStats || options.drawStats) &&
+                                  currentTime - lastStatsTime >= chrono::seconds(1);
+                if (printStats) {
+                    lastStatsTime = currentTime;
+                }
+                if (printStats && options.drawStats) {
+                    // Of the last frame that ended
+                    const auto& stats = renderer.encoderStats();
+                    cout << "Draws: " << stats.draws << ", state calls " << stats.issued.total()
+                         << " issued, " << stats.skipped.total() << " skipped ("
+                         << stats.skipped.pipelines << " pipeline, "
+                         << stats.skipped.descriptorSets << " descriptor, "
+                         << stats.skipped.buffers << " buffer, "
+                         << stats.skipped.pushConstants << " push constant, "
+                         << stats.skipped.dynamicState << " dynamic), "
+                         << stats.mergedPushConstants << " push constants merged" << endl;
+                    const auto& graphStats = renderer.graph().stats();
+                    cout << "Render graph: " << graphStats.passes << " passes, " << graphStats.culledPasses
+                         << " culled, " << graphStats.barriers << " barriers in "
+                         << graphStats.barrierBatches << " batches" << endl;
+                    if (swapchain.presentWaitSupported()) {
+                        cout << "Present: " << vulkan::presentModeName(swapchain.presentMode()) << ", "
+                             << renderer.queuedFrames() << " frames queued for display" << endl;
+                    }
                 }
+                if (printStats && options.cullStats) {
+                    const auto& stats = scene.cullStats();
+                    cout << "Culling (" << renderer::CullingBounds::instructionSet() << "): "
+                         << stats.tested << " tested, " << stats.culled << " culled, "
+                         << stats.drawn << " drawn";
+                    if (!scene.isGpuDriven()) {
+                        cout << " in " << scene.drawCount() << " instanced draws";
+                    }
+                    cout << endl;
+                    if (scene.depthPrepassMode() == renderer::DepthPrepassMode::Auto) {
+                        cout << "Overdraw: " << overdrawMonitor.overdraw() << "x, depth pre-pass "
+                             << (scene.isDepthPrepassActive() ? "on" : "off") << endl;
+                    }
+                }
+                renderFrame(renderer, scene, recorder, overdrawMonitor, overdrawSupported, capture.get());
             }
 
+            if (capture) {
+                capture->finish(renderer);
+                cout << "Saved " << capture->framesWritten() << " frames to " << options.captureDirectory << endl;
+            }
             device.waitIdle();
+            scene.flushEnvironmentCache();
         }
 
         vkDestroySurfaceKHR(instance.handle(), surface, nullptr);
@@ -0,0 +1,72 @@
+#include "Bounds.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace anim::renderer {
+
+void BoundingBox::expand(const glm::vec3& point) {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+}
+
+void BoundingBox::expand(const BoundingBox& box) {
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+}
+
+BoundingBox BoundingBox::transformed(const glm::mat4& transform) const {
+    if (!valid()) {
+        return *this;
+    }
+
+    // Center and half extent form: the new extent is |M| * extent (Arvo)
+    glm::vec3 c = glm::vec3(transform * glm::vec4(center(), 1.0f));
+    glm::vec3 e = extent();
+    glm::vec3 newExtent{0.0f};
+    for (int col = 0; col < 3; col++) {
+        newExtent += glm::abs(glm::vec3(transform[col])) * e[col];
+    }
+
+    BoundingBox result;
+    result.min = c - newExtent;
+    result.max = c + newExtent;
+    return result;
+}
+
+MeshBounds MeshBounds::fromVertices(const vector<Vertex>& vertices) {
+    MeshBounds bounds;
+    for (const auto& vertex : vertices) {
+        bounds.box.expand(vertex.position);
+    }
+    if (!bounds.box.valid()) {
+        return bounds;
+    }
+
+    // Sphere around the box center, tighter than the box's half diagonal
+    bounds.sphere.center = bounds.box.center();
+    float radiusSq = 0.0f;
+    for (const auto& vertex : vertices) {
+        glm::vec3 offset = vertex.position - bounds.sphere.center;
+        radiusSq = max(radiusSq, glm::dot(offset, offset));
+    }
+    bounds.sphere.radius = sqrt(radiusSq);
+    return bounds;
+}
+
+MeshBounds MeshBounds::transformed(const glm::mat4& transform) const {
+    MeshBounds result;
+    result.box = box.transformed(transform);
+    result.sphere.center = glm::vec3(transform * glm::vec4(sphere.center, 1.0f));
+
+    // Largest axis scale keeps the sphere conservative under non-uniform scale
+    float scale = max({glm::length(glm::vec3(transform[0])),
+                       glm::length(glm::vec3(transform[1])),
+                       glm::length(glm::vec3(transform[2]))});
+    result.sphere.radius = sphere.radius * scale;
+    return result;
+}
+
+} // namespace anim::renderer
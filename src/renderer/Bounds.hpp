@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Mesh.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <limits>
+
+using namespace std;
+
+namespace anim::renderer {
+
+struct BoundingBox {
+    glm::vec3 min{numeric_limits<float>::max()};
+    glm::vec3 max{numeric_limits<float>::lowest()};
+
+    bool valid() const { return min.x <= max.x; }
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    glm::vec3 extent() const { return (max - min) * 0.5f; }
+
+    void expand(const glm::vec3& point);
+    void expand(const BoundingBox& box);
+    // Box around this box after transformation, conservative under rotation
+    BoundingBox transformed(const glm::mat4& transform) const;
+};
+
+struct BoundingSphere {
+    glm::vec3 center{0.0f};
+    float radius = 0.0f;
+};
+
+// Both volumes are kept: the box is tighter for long thin meshes, the sphere
+// for rotated ones, culling uses whichever rejects more
+struct MeshBounds {
+    BoundingBox box;
+    BoundingSphere sphere;
+
+    static MeshBounds fromVertices(const vector<Vertex>& vertices);
+    MeshBounds transformed(const glm::mat4& transform) const;
+};
+
+} // namespace anim::renderer
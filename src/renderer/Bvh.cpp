@@ -0,0 +1,432 @@
+#include "Bvh.hpp"
+
+#include <algorithm>
+#include <deque>
+
+using namespace std;
+
+namespace anim::renderer {
+
+static constexpr uint32_t BIN_COUNT = 16;
+static constexpr uint32_t MAX_LEAF_SIZE = 4;
+static constexpr float TRAVERSAL_COST = 1.0f;  // Relative to testing one primitive
+
+// Nodes this large are split serially so there are enough subtrees to spread
+// across the pool, smaller ones become one task each
+static constexpr uint32_t PARALLEL_SPLIT_SIZE = 4096;
+
+static float surfaceArea(const BoundingBox& box) {
+    if (!box.valid()) {
+        return 0.0f;
+    }
+    glm::vec3 size = box.max - box.min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+void Bvh::build(const vector<BoundingBox>& boxes, core::ThreadPool* threadPool) {
+    primitiveBoxes = boxes;
+    order.clear();
+    unbounded.clear();
+    boundsChanged = false;
+    centroids.resize(boxes.size());
+    for (uint32_t i = 0; i < boxes.size(); i++) {
+        if (boxes[i].valid()) {
+            order.push_back(i);
+            centroids[i] = boxes[i].center();
+        } else {
+            unbounded.push_back(i);
+        }
+    }
+
+    nodes.clear();
+    if (order.empty()) {
+        builtCost = 0.0f;
+        return;
+    }
+
+    // A binary tree with N leaves or fewer has at most 2N - 1 nodes
+    nodes.resize(2 * order.size() - 1);
+    atomic<uint32_t> nodesUsed{1};
+
+    BvhNode& root = nodes[0];
+    root.first = 0;
+    root.count = static_cast<uint32_t>(order.size());
+    for (uint32_t id : order) {
+        root.box.expand(primitiveBoxes[id]);
+    }
+
+    if (!threadPool || threadPool->threadCount() == 0) {
+        buildSubtree(0, nodesUsed);
+    } else {
+        // Breadth-first serial splits until there is a subtree per task
+        size_t targetSubtrees = (threadPool->threadCount() + 1) * 4;
+        deque<uint32_t> frontier = {0};
+        vector<uint32_t> subtrees;
+        while (!frontier.empty()) {
+            uint32_t index = frontier.front();
+            frontier.pop_front();
+            bool large = nodes[index].count > PARALLEL_SPLIT_SIZE;
+            if (large && frontier.size() + subtrees.size() < targetSubtrees) {
+                if (split(index, nodesUsed)) {
+                    frontier.push_back(nodes[index].leftChild);
+                    frontier.push_back(nodes[index].leftChild + 1);
+                }
+            } else {
+                subtrees.push_back(index);
+            }
+        }
+
+        threadPool->parallelFor(static_cast<uint32_t>(subtrees.size()), [&](uint32_t i) {
+            buildSubtree(subtrees[i], nodesUsed);
+        });
+    }
+
+    nodes.resize(nodesUsed);
+    centroids.clear();
+    centroids.shrink_to_fit();
+    builtCost = cost();
+}
+
+void Bvh::buildSubtree(uint32_t nodeIndex, atomic<uint32_t>& nodesUsed) {
+    if (split(nodeIndex, nodesUsed)) {
+        uint32_t left = nodes[nodeIndex].leftChild;
+        buildSubtree(left, nodesUsed);
+        buildSubtree(left + 1, nodesUsed);
+    }
+}
+
+bool Bvh::split(uint32_t nodeIndex, atomic<uint32_t>& nodesUsed) {
+    BvhNode& node = nodes[nodeIndex];
+    if (node.count <= MAX_LEAF_SIZE) {
+        return false;
+    }
+
+    BoundingBox centroidBox;
+    for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        centroidBox.expand(centroids[order[i]]);
+    }
+
+    // Bin centroids along each axis and sweep for the cheapest split plane
+    struct Bin {
+        BoundingBox box;
+        uint32_t count = 0;
+    };
+
+    float bestCost = numeric_limits<float>::max();
+    int bestAxis = -1;
+    uint32_t bestSplit = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = centroidBox.min[axis];
+        float extent = centroidBox.max[axis] - lo;
+        if (extent <= 0.0f) {
+            continue;
+        }
+        float scale = BIN_COUNT / extent;
+
+        array<Bin, BIN_COUNT> bins{};
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            uint32_t id = order[i];
+            auto bin = min(BIN_COUNT - 1, static_cast<uint32_t>((centroids[id][axis] - lo) * scale));
+            bins[bin].count++;
+            bins[bin].box.expand(primitiveBoxes[id]);
+        }
+
+        // leftArea[i] and leftCount[i] cover bins [0, i], the right side sweeps back
+        array<float, BIN_COUNT - 1> leftArea;
+        array<uint32_t, BIN_COUNT - 1> leftCount;
+        BoundingBox sweep;
+        uint32_t sweepCount = 0;
+        for (uint32_t i = 0; i < BIN_COUNT - 1; i++) {
+            sweep.expand(bins[i].box);
+            sweepCount += bins[i].count;
+            leftArea[i] = surfaceArea(sweep);
+            leftCount[i] = sweepCount;
+        }
+
+        sweep = BoundingBox();
+        sweepCount = 0;
+        for (uint32_t i = BIN_COUNT - 1; i > 0; i--) {
+            sweep.expand(bins[i].box);
+            sweepCount += bins[i].count;
+            if (leftCount[i - 1] == 0 || sweepCount == 0) {
+                continue;
+            }
+            float splitCost = leftArea[i - 1] * leftCount[i - 1] + surfaceArea(sweep) * sweepCount;
+            if (splitCost < bestCost) {
+                bestCost = splitCost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    // Keep a leaf when splitting does not pay for the extra traversal step
+    float leafCost = surfaceArea(node.box) * node.count;
+    if (bestAxis < 0 || TRAVERSAL_COST * surfaceArea(node.box) + bestCost >= leafCost) {
+        return false;
+    }
+
+    float lo = centroidBox.min[bestAxis];
+    float scale = BIN_COUNT / (centroidBox.max[bestAxis] - lo);
+    auto middle = partition(order.begin() + node.first, order.begin() + node.first + node.count,
+                            [&](uint32_t id) {
+        auto bin = min(BIN_COUNT - 1, static_cast<uint32_t>((centroids[id][bestAxis] - lo) * scale));
+        return bin < bestSplit;
+    });
+    auto leftCountFinal = static_cast<uint32_t>(middle - (order.begin() + node.first));
+
+    uint32_t left = nodesUsed.fetch_add(2);
+    for (uint32_t child = 0; child < 2; child++) {
+        BvhNode& childNode = nodes[left + child];
+        childNode.first = child == 0 ? node.first : node.first + leftCountFinal;
+        childNode.count = child == 0 ? leftCountFinal : node.count - leftCountFinal;
+        childNode.leftChild = 0;
+        childNode.box = BoundingBox();
+        for (uint32_t i = childNode.first; i < childNode.first + childNode.count; i++) {
+            childNode.box.expand(primitiveBoxes[order[i]]);
+        }
+    }
+    node.leftChild = left;
+    return true;
+}
+
+void Bvh::refit(const vector<BoundingBox>& boxes) {
+    primitiveBoxes = boxes;
+
+    // The tree shape only holds primitives with valid boxes
+    for (uint32_t id : order) {
+        boundsChanged = boundsChanged || !primitiveBoxes[id].valid();
+    }
+    for (uint32_t id : unbounded) {
+        boundsChanged = boundsChanged || primitiveBoxes[id].valid();
+    }
+
+    // Children are always allocated after their parent, so a reverse pass is bottom-up
+    for (size_t i = nodes.size(); i-- > 0;) {
+        BvhNode& node = nodes[i];
+        node.box = BoundingBox();
+        if (node.isLeaf()) {
+            for (uint32_t p = node.first; p < node.first + node.count; p++) {
+                node.box.expand(primitiveBoxes[order[p]]);
+            }
+        } else {
+            node.box.expand(nodes[node.leftChild].box);
+            node.box.expand(nodes[node.leftChild + 1].box);
+        }
+    }
+}
+
+float Bvh::cost() const {
+    float rootArea = surfaceArea(nodes[0].box);
+    if (rootArea <= 0.0f) {
+        return 0.0f;
+    }
+
+    float total = 0.0f;
+    for (const auto& node : nodes) {
+        float area = surfaceArea(node.box);
+        total += node.isLeaf() ? area * node.count : area * TRAVERSAL_COST;
+    }
+    return total / rootArea;
+}
+
+bool Bvh::needsRebuild(float costRatio) const {
+    if (boundsChanged) {
+        return true;
+    }
+    return !nodes.empty() && builtCost > 0.0f && cost() > builtCost * costRatio;
+}
+
+size_t Bvh::cull(const vector<Frustum>& frusta, vector<uint32_t>& visible, vector<uint8_t>& viewMasks) const {
+    if (frusta.empty()) {
+        return 0;
+    }
+
+    auto viewCount = static_cast<uint32_t>(min<size_t>(frusta.size(), MAX_CULL_VIEWS));
+    auto allViews = static_cast<uint8_t>((1u << viewCount) - 1);
+
+    // Nothing to test them against, drawn in every view
+    visible.insert(visible.end(), unbounded.begin(), unbounded.end());
+    viewMasks.insert(viewMasks.end(), unbounded.size(), allViews);
+    if (nodes.empty()) {
+        return 0;
+    }
+
+    array<array<glm::vec3, 6>, MAX_CULL_VIEWS> absNormals;
+    for (uint32_t v = 0; v < viewCount; v++) {
+        for (size_t p = 0; p < 6; p++) {
+            absNormals[v][p] = glm::abs(glm::vec3(frusta[v].planes[p]));
+        }
+    }
+
+    // Six plane bits per frustum, frustum v at bit 6 * v. Tests a box against
+    // the planes still set, clearing planes the box is fully inside of and
+    // dropping frusta it is outside of. Returns false when no frustum is left.
+    auto testBox = [&](const BoundingBox& box, uint8_t& views, uint64_t& planes) {
+        glm::vec3 center = box.center();
+        glm::vec3 extent = box.extent();
+        for (uint32_t v = 0; v < viewCount; v++) {
+            for (uint32_t p = 0; p < 6; p++) {
+                uint64_t bit = 1ull << (v * 6 + p);
+                if (!(planes & bit)) {
+                    continue;
+                }
+                const glm::vec4& plane = frusta[v].planes[p];
+                float dist = glm::dot(glm::vec3(plane), center) + plane.w;
+                float radius = glm::dot(absNormals[v][p], extent);
+                if (dist + radius < 0.0f) {
+                    views &= static_cast<uint8_t>(~(1u << v));
+                    planes &= ~(0x3Full << (v * 6));
+                    break;
+                }
+                if (dist - radius >= 0.0f) {
+                    planes &= ~bit;
+                }
+            }
+        }
+        return views != 0;
+    };
+
+    struct Entry {
+        uint32_t node;
+        uint8_t views;    // Frusta the node may intersect
+        uint64_t planes;  // Their planes it is not fully inside of
+    };
+    vector<Entry> stack;
+    stack.reserve(64);
+    stack.push_back({0, allViews, (1ull << (viewCount * 6)) - 1});
+    size_t tested = 0;
+
+    while (!stack.empty()) {
+        Entry entry = stack.back();
+        stack.pop_back();
+        const BvhNode& node = nodes[entry.node];
+
+        tested++;
+        uint8_t views = entry.views;
+        uint64_t planes = entry.planes;
+        if (!testBox(node.box, views, planes)) {
+            continue;
+        }
+
+        if (planes == 0) {
+            // Inside every frustum left, accept the whole subtree
+            visible.insert(visible.end(), order.begin() + node.first, order.begin() + node.first + node.count);
+            viewMasks.insert(viewMasks.end(), node.count, views);
+        } else if (node.isLeaf()) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                tested++;
+                uint8_t primitiveViews = views;
+                uint64_t primitivePlanes = planes;
+                if (testBox(primitiveBoxes[order[i]], primitiveViews, primitivePlanes)) {
+                    visible.push_back(order[i]);
+                    viewMasks.push_back(primitiveViews);
+                }
+            }
+        } else {
+            stack.push_back({node.leftChild + 1, views, planes});
+            stack.push_back({node.leftChild, views, planes});
+        }
+    }
+    return tested;
+}
+
+void Bvh::queryBox(const BoundingBox& box, vector<uint32_t>& results) const {
+    if (nodes.empty() || !box.valid()) {
+        return;
+    }
+
+    auto overlaps = [&box](const BoundingBox& other) {
+        return other.min.x <= box.max.x && other.max.x >= box.min.x &&
+               other.min.y <= box.max.y && other.max.y >= box.min.y &&
+               other.min.z <= box.max.z && other.max.z >= box.min.z;
+    };
+
+    vector<uint32_t> stack = {0};
+    while (!stack.empty()) {
+        const BvhNode& node = nodes[stack.back()];
+        stack.pop_back();
+        if (!overlaps(node.box)) {
+            continue;
+        }
+
+        if (node.isLeaf()) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                if (overlaps(primitiveBoxes[order[i]])) {
+                    results.push_back(order[i]);
+                }
+            }
+        } else {
+            stack.push_back(node.leftChild);
+            stack.push_back(node.leftChild + 1);
+        }
+    }
+}
+
+optional<BvhHit> Bvh::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance) const {
+    if (nodes.empty()) {
+        return nullopt;
+    }
+
+    // Slab test, IEEE infinities handle axis-parallel rays
+    glm::vec3 invDir(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    auto intersect = [&](const BoundingBox& box, float limit) {
+        glm::vec3 t0 = (box.min - origin) * invDir;
+        glm::vec3 t1 = (box.max - origin) * invDir;
+        glm::vec3 tNear = glm::min(t0, t1);
+        glm::vec3 tFar = glm::max(t0, t1);
+        float enter = max({tNear.x, tNear.y, tNear.z, 0.0f});
+        float exit = min({tFar.x, tFar.y, tFar.z, limit});
+        return enter <= exit ? enter : numeric_limits<float>::max();
+    };
+
+    optional<BvhHit> closest;
+    float limit = maxDistance;
+
+    struct Entry {
+        uint32_t node;
+        float distance;
+    };
+    vector<Entry> stack;
+    float rootDistance = intersect(nodes[0].box, limit);
+    if (rootDistance != numeric_limits<float>::max()) {
+        stack.push_back({0, rootDistance});
+    }
+
+    while (!stack.empty()) {
+        Entry entry = stack.back();
+        stack.pop_back();
+        if (entry.distance > limit) {
+            continue;  // A closer hit was found after this node was pushed
+        }
+
+        const BvhNode& node = nodes[entry.node];
+        if (node.isLeaf()) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                float distance = intersect(primitiveBoxes[order[i]], limit);
+                if (distance != numeric_limits<float>::max() && (!closest || distance < closest->distance)) {
+                    limit = distance;
+                    closest = BvhHit{order[i], distance};
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first so the limit shrinks early
+        Entry left = {node.leftChild, intersect(nodes[node.leftChild].box, limit)};
+        Entry right = {node.leftChild + 1, intersect(nodes[node.leftChild + 1].box, limit)};
+        if (left.distance > right.distance) {
+            swap(left, right);
+        }
+        if (right.distance != numeric_limits<float>::max()) {
+            stack.push_back(right);
+        }
+        if (left.distance != numeric_limits<float>::max()) {
+            stack.push_back(left);
+        }
+    }
+    return closest;
+}
+
+} // namespace anim::renderer
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Bounds.hpp"
+#include "Culling.hpp"
+#include "../core/ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <optional>
+#include <atomic>
+#include <limits>
+#include <cstdint>
+
+using namespace std;
+
+namespace anim::renderer {
+
+struct BvhNode {
+    BoundingBox box;
+    uint32_t leftChild = 0;  // 0 for leaves, the right child is leftChild + 1
+    uint32_t first = 0;      // Primitive range, contiguous for every subtree
+    uint32_t count = 0;
+
+    bool isLeaf() const { return leftChild == 0; }
+};
+
+struct BvhHit {
+    uint32_t primitive;
+    float distance;  // Along the ray to the primitive's box
+};
+
+// Bounding volume hierarchy over primitive boxes, built with a binned surface
+// area heuristic. Primitives are identified by their index in the boxes passed
+// to build(). Queries test boxes only, so hits are conservative.
+class Bvh {
+public:
+    // Primitives with invalid boxes are kept out of the tree and always pass
+    // cull(), like the flat culling path. With a thread pool the top levels
+    // are split serially and the subtrees below built in parallel.
+    void build(const vector<BoundingBox>& boxes, core::ThreadPool* threadPool = nullptr);
+
+    // Recomputes node boxes for moved primitives, keeping the tree shape.
+    // Quality degrades as primitives move away from where they were built.
+    void refit(const vector<BoundingBox>& boxes);
+
+    // True once refits made the tree noticeably worse than a fresh build, or
+    // a primitive's box became valid or invalid since the build
+    bool needsRebuild(float costRatio = 1.5f) const;
+
+    bool empty() const { return nodes.empty() && unbounded.empty(); }
+    size_t nodeCount() const { return nodes.size(); }
+    size_t primitiveCount() const { return order.size(); }
+
+    // Appends the primitives that may intersect any of the frusta, and to
+    // viewMasks which ones (bit i for frusta[i]). One traversal serves all
+    // frusta: a subtree is skipped once every frustum rejects it, and planes
+    // a node is fully inside are not tested below it, so subtrees inside every
+    // frustum are accepted whole. Returns boxes tested.
+    size_t cull(const vector<Frustum>& frusta, vector<uint32_t>& visible, vector<uint8_t>& viewMasks) const;
+
+    // Appends the primitives whose boxes overlap box
+    void queryBox(const BoundingBox& box, vector<uint32_t>& results) const;
+
+    // Nearest primitive box hit by the ray, direction need not be normalized
+    optional<BvhHit> raycast(const glm::vec3& origin, const glm::vec3& direction,
+                             float maxDistance = numeric_limits<float>::max()) const;
+
+private:
+    // Children are taken from nodesUsed two at a time, so subtrees can be built concurrently
+    bool split(uint32_t nodeIndex, atomic<uint32_t>& nodesUsed);
+    void buildSubtree(uint32_t nodeIndex, atomic<uint32_t>& nodesUsed);
+    float cost() const;
+
+    vector<BvhNode> nodes;
+    vector<uint32_t> order;  // Primitive ids, each node covers order[first, first + count)
+    vector<uint32_t> unbounded;  // Primitive ids with invalid boxes, visible to every frustum
+    vector<BoundingBox> primitiveBoxes;  // Indexed by primitive id
+    vector<glm::vec3> centroids;         // Build only
+    float builtCost = 0.0f;
+    bool boundsChanged = false;  // A refit saw a box change validity
+};
+
+} // namespace anim::renderer
@@ -0,0 +1,204 @@
+#include "Culling.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <bit>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define ANIM_CULL_AVX
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ANIM_CULL_SSE
+#endif
+
+using namespace std;
+
+namespace anim::renderer {
+
+Frustum Frustum::fromViewProjection(const glm::mat4& m) {
+    // Gribb-Hartmann, GLM is column-major so row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+    auto row = [&m](int i) { return glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]); };
+
+    Frustum frustum;
+    frustum.planes[0] = row(3) + row(0);  // Left
+    frustum.planes[1] = row(3) - row(0);  // Right
+    frustum.planes[2] = row(3) + row(1);  // Bottom
+    frustum.planes[3] = row(3) - row(1);  // Top
+    frustum.planes[4] = row(2);           // Near, depth is zero-to-one
+    frustum.planes[5] = row(3) - row(2);  // Far
+
+    for (auto& plane : frustum.planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return frustum;
+}
+
+void CullingBounds::resize(size_t count) {
+    for (auto* component : {&centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ, &radius}) {
+        component->resize(count, 0.0f);
+    }
+}
+
+void CullingBounds::set(size_t index, const MeshBounds& worldBounds) {
+    if (!worldBounds.box.valid()) {
+        // Never culled, FLT_MAX rather than infinity so 0 * extent stays 0
+        float huge = numeric_limits<float>::max();
+        centerX[index] = centerY[index] = centerZ[index] = 0.0f;
+        extentX[index] = extentY[index] = extentZ[index] = huge;
+        radius[index] = huge;
+        return;
+    }
+
+    glm::vec3 center = worldBounds.box.center();
+    glm::vec3 extent = worldBounds.box.extent();
+    centerX[index] = center.x;
+    centerY[index] = center.y;
+    centerZ[index] = center.z;
+    extentX[index] = extent.x;
+    extentY[index] = extent.y;
+    extentZ[index] = extent.z;
+    radius[index] = worldBounds.sphere.radius;
+}
+
+const char* CullingBounds::instructionSet() {
+#if defined(ANIM_CULL_AVX)
+    return "AVX";
+#elif defined(ANIM_CULL_SSE)
+    return "SSE";
+#else
+    return "scalar";
+#endif
+}
+
+size_t CullingBounds::cull(const vector<Frustum>& frusta, uint32_t first, uint32_t count,
+                           vector<uint32_t>& visible, vector<uint8_t>& viewMasks) const {
+    // An object is outside when, for some plane, its center is further behind
+    // than its projected radius: dot(n, c) + w < -min(|n| . extent, radius)
+    size_t culled = 0;
+    uint32_t i = first;
+    uint32_t end = first + count;
+    auto viewCount = static_cast<uint32_t>(min<size_t>(frusta.size(), MAX_CULL_VIEWS));
+
+    array<array<glm::vec3, 6>, MAX_CULL_VIEWS> absNormals;
+    for (uint32_t v = 0; v < viewCount; v++) {
+        for (size_t p = 0; p < 6; p++) {
+            absNormals[v][p] = glm::abs(glm::vec3(frusta[v].planes[p]));
+        }
+    }
+
+#if defined(ANIM_CULL_AVX)
+    for (; i + 8 <= end; i += 8) {
+        __m256 cx = _mm256_loadu_ps(&centerX[i]);
+        __m256 cy = _mm256_loadu_ps(&centerY[i]);
+        __m256 cz = _mm256_loadu_ps(&centerZ[i]);
+        __m256 ex = _mm256_loadu_ps(&extentX[i]);
+        __m256 ey = _mm256_loadu_ps(&extentY[i]);
+        __m256 ez = _mm256_loadu_ps(&extentZ[i]);
+        __m256 rad = _mm256_loadu_ps(&radius[i]);
+
+        array<uint8_t, 8> laneViews{};
+        uint32_t anyVisible = 0;
+        for (uint32_t v = 0; v < viewCount; v++) {
+            __m256 outside = _mm256_setzero_ps();
+            for (size_t p = 0; p < 6; p++) {
+                const glm::vec4& plane = frusta[v].planes[p];
+                const glm::vec3& absNormal = absNormals[v][p];
+                __m256 dist = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), cx), _mm256_mul_ps(_mm256_set1_ps(plane.y), cy)),
+                    _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), cz), _mm256_set1_ps(plane.w)));
+                __m256 boxRadius = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(absNormal.x), ex), _mm256_mul_ps(_mm256_set1_ps(absNormal.y), ey)),
+                    _mm256_mul_ps(_mm256_set1_ps(absNormal.z), ez));
+                __m256 r = _mm256_min_ps(boxRadius, rad);
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(dist, r), _mm256_setzero_ps(), _CMP_LT_OQ));
+            }
+
+            auto mask = static_cast<uint32_t>(~_mm256_movemask_ps(outside) & 0xFF);
+            anyVisible |= mask;
+            for (; mask != 0; mask &= mask - 1) {
+                laneViews[countr_zero(mask)] |= static_cast<uint8_t>(1u << v);
+            }
+        }
+
+        culled += 8 - static_cast<size_t>(popcount(anyVisible));
+        for (; anyVisible != 0; anyVisible &= anyVisible - 1) {
+            auto lane = static_cast<uint32_t>(countr_zero(anyVisible));
+            visible.push_back(i + lane);
+            viewMasks.push_back(laneViews[lane]);
+        }
+    }
+#elif defined(ANIM_CULL_SSE)
+    for (; i + 4 <= end; i += 4) {
+        __m128 cx = _mm_loadu_ps(&centerX[i]);
+        __m128 cy = _mm_loadu_ps(&centerY[i]);
+        __m128 cz = _mm_loadu_ps(&centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&extentX[i]);
+        __m128 ey = _mm_loadu_ps(&extentY[i]);
+        __m128 ez = _mm_loadu_ps(&extentZ[i]);
+        __m128 rad = _mm_loadu_ps(&radius[i]);
+
+        array<uint8_t, 4> laneViews{};
+        for (uint32_t v = 0; v < viewCount; v++) {
+            __m128 outside = _mm_setzero_ps();
+            for (size_t p = 0; p < 6; p++) {
+                const glm::vec4& plane = frusta[v].planes[p];
+                const glm::vec3& absNormal = absNormals[v][p];
+                __m128 dist = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), cx), _mm_mul_ps(_mm_set1_ps(plane.y), cy)),
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), cz), _mm_set1_ps(plane.w)));
+                __m128 boxRadius = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(absNormal.x), ex), _mm_mul_ps(_mm_set1_ps(absNormal.y), ey)),
+                    _mm_mul_ps(_mm_set1_ps(absNormal.z), ez));
+                __m128 r = _mm_min_ps(boxRadius, rad);
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, r), _mm_setzero_ps()));
+            }
+
+            int mask = ~_mm_movemask_ps(outside) & 0xF;
+            for (uint32_t lane = 0; lane < 4; lane++) {
+                if (mask & (1 << lane)) {
+                    laneViews[lane] |= static_cast<uint8_t>(1u << v);
+                }
+            }
+        }
+
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            if (laneViews[lane] != 0) {
+                visible.push_back(i + lane);
+                viewMasks.push_back(laneViews[lane]);
+            } else {
+                culled++;
+            }
+        }
+    }
+#endif
+
+    // Scalar fallback and the tail that does not fill a register
+    for (; i < end; i++) {
+        uint8_t views = 0;
+        for (uint32_t v = 0; v < viewCount; v++) {
+            bool outside = false;
+            for (size_t p = 0; p < 6 && !outside; p++) {
+                const glm::vec4& plane = frusta[v].planes[p];
+                const glm::vec3& absNormal = absNormals[v][p];
+                float dist = plane.x * centerX[i] + plane.y * centerY[i] + plane.z * centerZ[i] + plane.w;
+                float boxRadius = absNormal.x * extentX[i] + absNormal.y * extentY[i] + absNormal.z * extentZ[i];
+                outside = dist + min(boxRadius, radius[i]) < 0.0f;
+            }
+            if (!outside) {
+                views |= static_cast<uint8_t>(1u << v);
+            }
+        }
+
+        if (views == 0) {
+            culled++;
+        } else {
+            visible.push_back(i);
+            viewMasks.push_back(views);
+        }
+    }
+
+    return culled;
+}
+
+} // namespace anim::renderer
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Bounds.hpp"
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+namespace anim::renderer {
+
+struct Frustum {
+    // xyz = inward unit normal, w = distance, a point p is inside when dot(xyz, p) + w >= 0
+    array<glm::vec4, 6> planes;
+
+    // Planes of a Vulkan (zero-to-one depth) view-projection matrix
+    static Frustum fromViewProjection(const glm::mat4& viewProjection);
+};
+
+// Frusta one culling pass tests together, each result holds a bit per frustum
+static constexpr uint32_t MAX_CULL_VIEWS = 8;
+
+struct CullStats {
+    uint64_t tested = 0;
+    uint64_t culled = 0;
+    uint64_t drawn = 0;
+};
+
+// World-space bounds stored structure-of-arrays, so one SIMD register holds the
+// same component of 4 (SSE) or 8 (AVX) objects
+class CullingBounds {
+public:
+    void resize(size_t count);
+    size_t size() const { return centerX.size(); }
+    void set(size_t index, const MeshBounds& worldBounds);
+
+    // Appends the indices in [first, first + count) that intersect any of the
+    // frusta to visible, and to viewMasks which ones (bit i for frusta[i]).
+    // Each batch of bounds is loaded once and tested against every frustum.
+    // Objects with no bounds are always kept. Returns the number culled from all.
+    size_t cull(const vector<Frustum>& frusta, uint32_t first, uint32_t count,
+                vector<uint32_t>& visible, vector<uint8_t>& viewMasks) const;
+
+    // "AVX", "SSE" or "scalar", chosen at compile time
+    static const char* instructionSet();
+
+private:
+    // Box center and half extent, plus sphere radius around the box center
+    vector<float> centerX, centerY, centerZ;
+    vector<float> extentX, extentY, extentZ;
+    vector<float> radius;
+};
+
+} // namespace anim::renderer
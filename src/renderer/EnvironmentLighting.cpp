@@ -0,0 +1,822 @@
+#include "EnvironmentLighting.hpp"
+#include "../vulkan/CommandBuffer.hpp"
+
+#include <glm/gtc/packing.hpp>
+#include <stb_image.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Push constants of every bake shader, unused fields are ignored
+struct BakeParams {
+    int32_t size;
+    int32_t face;
+    uint32_t samples;
+    float roughness;
+    float sourceSize;
+    float sourceLod;
+    float lastMip;
+    float padding;
+};
+
+static_assert(sizeof(GpuIrradiance) == 160, "GpuIrradiance must match the Irradiance block in model.frag");
+
+static constexpr uint32_t BAKE_GROUP_SIZE = 8;     // local_size_x/y of env_cube, env_prefilter and env_brdf
+static constexpr uint32_t IRRADIANCE_SIZE = 32;    // Cube mip projected onto SH, irradiance has no fine detail
+static constexpr uint32_t MAX_SPECULAR_MIPS = 12;
+static constexpr uint32_t MIN_CUBE_SIZE = 16;
+static constexpr uint32_t MAX_CUBE_SIZE = 4096;    // maxImageDimensionCube every device supports
+
+// The table depends on neither the environment nor the settings
+static constexpr uint32_t BRDF_TABLE_SIZE = 128;
+static constexpr uint32_t BRDF_SAMPLES = 512;
+
+// Filterable and writable as a storage image on every device
+static constexpr VkFormat ENVIRONMENT_FORMAT = VK_FORMAT_R16G16B16A16_SFLOAT;
+static constexpr VkDeviceSize TEXEL_BYTES = 8;
+static constexpr float HALF_MAX = 65504.0f;  // Brighter texels, the sun usually, are clamped
+
+static constexpr uint32_t CACHE_MAGIC = 0x4c424941;  // "AIBL"
+static constexpr uint32_t CACHE_VERSION = 1;
+
+// Start of every cache file, the GPU's bytes follow
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t size;
+};
+
+// FNV-1a, stable across runs and platforms unlike std::hash
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint32_t groupCount(uint32_t size) {
+    return (size + BAKE_GROUP_SIZE - 1) / BAKE_GROUP_SIZE;
+}
+
+// Every specular mip, all six faces each, packed after the irradiance
+static vector<VkBufferImageCopy> specularRegions(const EnvironmentSettings& settings, VkDeviceSize offset) {
+    vector<VkBufferImageCopy> regions;
+    for (uint32_t mip = 0; mip < settings.specularMips; mip++) {
+        uint32_t size = max(settings.specularSize >> mip, 1u);
+        VkBufferImageCopy region{};
+        region.bufferOffset = offset;
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, mip, 0, 6};
+        region.imageExtent = {size, size, 1};
+        regions.push_back(region);
+        offset += VkDeviceSize(size) * size * 6 * TEXEL_BYTES;
+    }
+    return regions;
+}
+
+static VkDeviceSize resultBytes(const EnvironmentSettings& settings) {
+    VkDeviceSize bytes = sizeof(GpuIrradiance);
+    for (uint32_t mip = 0; mip < settings.specularMips; mip++) {
+        VkDeviceSize size = max(settings.specularSize >> mip, 1u);
+        bytes += size * size * 6 * TEXEL_BYTES;
+    }
+    return bytes;
+}
+
+// Empty when the file is missing, truncated or written for other inputs
+static vector<uint8_t> readCache(const string& path, uint64_t key, uint64_t size) {
+    ifstream file(path, ios::binary);
+    CacheHeader header{};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != CACHE_MAGIC ||
+        header.version != CACHE_VERSION || header.key != key || header.size != size) {
+        return {};
+    }
+    vector<uint8_t> data(size);
+    if (!file.read(reinterpret_cast<char*>(data.data()), static_cast<streamsize>(size))) {
+        return {};
+    }
+    return data;
+}
+
+// A failed write only costs a bake next time, so it is reported, not thrown
+static void writeCache(const string& path, uint64_t key, const void* data, uint64_t size) {
+    error_code error;
+    filesystem::create_directories(filesystem::path(path).parent_path(), error);
+
+    // Written aside and renamed over the old file, so a crash or a concurrent
+    // reader never sees a torn cache
+    string tempPath = path + ".tmp";
+    CacheHeader header{CACHE_MAGIC, CACHE_VERSION, key, size};
+    {
+        ofstream file(tempPath, ios::binary | ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(static_cast<const char*>(data), static_cast<streamsize>(size));
+        file.close();
+        if (!file) {
+            cout << "Failed to write " << path << endl;
+            filesystem::remove(tempPath, error);
+            return;
+        }
+    }
+    filesystem::rename(tempPath, path, error);
+    if (error) {
+        cout << "Failed to write " << path << ": " << error.message() << endl;
+        filesystem::remove(tempPath, error);
+    }
+}
+
+static void memoryBarrier(VkCommandBuffer cmd, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+                          VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+    vkCmdPipelineBarrier(cmd, srcStage, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Every image here lives in GENERAL from its first use on
+static void toGeneral(VkCommandBuffer cmd, const vulkan::Image& image, VkPipelineStageFlags dstStage,
+                      VkAccessFlags dstAccess) {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = dstAccess;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image.handle();
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, image.mipLevels(), 0, image.layers()};
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+static void writeImage(VkDevice device, VkDescriptorSet set, uint32_t binding, VkDescriptorType type,
+                       VkImageView view, VkSampler sampler) {
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.sampler = sampler;
+    imageInfo.imageView = view;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.descriptorType = type;
+    write.descriptorCount = 1;
+    write.pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+}
+
+static void writeBuffer(VkDevice device, VkDescriptorSet set, uint32_t binding, const vulkan::Buffer& buffer) {
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = buffer.handle();
+    bufferInfo.offset = 0;
+    bufferInfo.range = buffer.size();
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.descriptorCount = 1;
+    write.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+}
+
+static void destroyViews(vulkan::Device& device, vector<VkImageView>& views) {
+    if (views.empty()) {
+        return;
+    }
+
+    VkDevice handle = device.handle();
+    vector<VkImageView> oldViews = std::move(views);
+    device.deletionQueue().push([handle, oldViews]() {
+        for (VkImageView view : oldViews) {
+            vkDestroyImageView(handle, view, nullptr);
+        }
+    });
+    views.clear();
+}
+
+EnvironmentLighting::Environment::~Environment() {
+    if (deviceRef) {
+        destroyViews(*deviceRef, views);
+    }
+}
+
+EnvironmentLighting::EnvironmentLighting(vulkan::Device& device, vulkan::PipelineCache& pipelineCache,
+                                         vulkan::CommandPool& commandPool, const vector<uint32_t>& cubeShaderCode,
+                                         const vector<uint32_t>& irradianceShaderCode,
+                                         const vector<uint32_t>& prefilterShaderCode,
+                                         const vector<uint32_t>& brdfShaderCode)
+    : deviceRef(&device) {
+    // A changed bake shader invalidates every cache file
+    shaderHash = hashBytes(cubeShaderCode.data(), cubeShaderCode.size() * sizeof(uint32_t));
+    for (const vector<uint32_t>* code : {&irradianceShaderCode, &prefilterShaderCode, &brdfShaderCode}) {
+        shaderHash = hashBytes(code->data(), code->size() * sizeof(uint32_t), shaderHash);
+    }
+    uint32_t tableInputs[] = {BRDF_TABLE_SIZE, BRDF_SAMPLES};
+    brdfKey = hashBytes(tableInputs, sizeof(tableInputs), shaderHash);
+
+    vulkan::SamplerConfig samplerConfig;
+    samplerConfig.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerConfig.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.enableAnisotropy = false;
+    mapSampler = make_unique<vulkan::Sampler>(device, samplerConfig);
+    samplerConfig.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    cubeSampler = make_unique<vulkan::Sampler>(device, samplerConfig);
+
+    environmentSetLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding = 2,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr
+        }
+    });
+
+    // Source, destination and irradiance, each bake shader uses some of them
+    bakeSetLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding = 2,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        }
+    });
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(BakeParams);
+
+    vulkan::ComputePipelineConfig pipelineConfig;
+    pipelineConfig.descriptorLayouts = {bakeSetLayout->handle()};
+    pipelineConfig.pushConstantRanges = {pushConstantRange};
+    pipelineConfig.shaderCode = cubeShaderCode;
+    cubePipeline = &pipelineCache.getComputePipeline(pipelineConfig);
+    pipelineConfig.shaderCode = irradianceShaderCode;
+    irradiancePipeline = &pipelineCache.getComputePipeline(pipelineConfig);
+    pipelineConfig.shaderCode = prefilterShaderCode;
+    prefilterPipeline = &pipelineCache.getComputePipeline(pipelineConfig);
+    pipelineConfig.shaderCode = brdfShaderCode;
+    brdfPipeline = &pipelineCache.getComputePipeline(pipelineConfig);
+
+    brdfTable = make_unique<vulkan::Image>(
+        device, BRDF_TABLE_SIZE, BRDF_TABLE_SIZE, ENVIRONMENT_FORMAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_SAMPLE_COUNT_1_BIT, vulkan::MemoryClass::Texture
+    );
+    // A bake set takes one descriptor of every binding, used or not
+    vector<VkDescriptorPoolSize> brdfPoolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1},
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1},
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1}
+    };
+    brdfPool = make_unique<vulkan::DescriptorPool>(device, brdfPoolSizes, 1);
+    brdfSet = brdfPool->allocate(bakeSetLayout->handle());
+    writeImage(device.handle(), brdfSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, brdfTable->view(), VK_NULL_HANDLE);
+
+    // One black texel and zero irradiance keep set 4 valid without an environment
+    EnvironmentSettings fallbackSettings;
+    fallbackSettings.specularSize = 1;
+    fallbackSettings.specularMips = 1;
+    fallback = createEnvironment("none", fallbackSettings);
+
+    vulkan::CommandBuffer cmd(commandPool);
+    cmd.begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    toGeneral(cmd.handle(), *brdfTable, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    toGeneral(cmd.handle(), *fallback->specular, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    VkClearColorValue black{};
+    VkImageSubresourceRange tableRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    VkImageSubresourceRange cubeRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 6};
+    vkCmdClearColorImage(cmd.handle(), brdfTable->handle(), VK_IMAGE_LAYOUT_GENERAL, &black, 1, &tableRange);
+    vkCmdClearColorImage(cmd.handle(), fallback->specular->handle(), VK_IMAGE_LAYOUT_GENERAL, &black, 1, &cubeRange);
+    vkCmdFillBuffer(cmd.handle(), fallback->irradiance->handle(), 0, VK_WHOLE_SIZE, 0);
+    memoryBarrier(cmd.handle(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+    cmd.end();
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    VkCommandBuffer cmdHandle = cmd.handle();
+    submitInfo.pCommandBuffers = &cmdHandle;
+
+    if (vkQueueSubmit(device.graphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+        throw runtime_error("Failed to submit environment setup");
+    }
+    vkQueueWaitIdle(device.graphicsQueue());
+}
+
+EnvironmentLighting::~EnvironmentLighting() = default;
+
+void EnvironmentLighting::setSettings(const EnvironmentSettings& settings) {
+    // Powers of two, so every mip halves exactly
+    config = settings;
+    config.cubeSize = bit_floor(clamp(config.cubeSize, MIN_CUBE_SIZE, MAX_CUBE_SIZE));
+    config.specularSize = bit_floor(clamp(config.specularSize, MIN_CUBE_SIZE, config.cubeSize));
+    config.specularMips = clamp(config.specularMips, 1u,
+                                min(static_cast<uint32_t>(bit_width(config.specularSize)), MAX_SPECULAR_MIPS));
+    config.specularSamples = max(config.specularSamples, 1u);
+}
+
+unique_ptr<EnvironmentLighting::Environment> EnvironmentLighting::createEnvironment(
+    const string& name, const EnvironmentSettings& settings) {
+    auto environment = make_unique<Environment>();
+    environment->deviceRef = deviceRef;
+    environment->name = name;
+    environment->settings = settings;
+
+    environment->specular = make_unique<vulkan::Image>(
+        *deviceRef, settings.specularSize, settings.specularSize, ENVIRONMENT_FORMAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, settings.specularMips, VK_SAMPLE_COUNT_1_BIT,
+        vulkan::MemoryClass::Texture, true
+    );
+    environment->irradiance = make_unique<vulkan::Buffer>(
+        *deviceRef, sizeof(GpuIrradiance),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY);
+    // Left non-relocatable: set 4 and the bake set write it once below, and
+    // neither is rewritten after a defragmentation pass
+
+    // Set 4, then the bake's: map to cube, irradiance and one per specular mip.
+    // Bake sets take one descriptor of every binding.
+    uint32_t bakeSets = 2 + settings.specularMips;
+    vector<VkDescriptorPoolSize> poolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 2 + bakeSets},
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = bakeSets},
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1 + bakeSets}
+    };
+    environment->descriptorPool = make_unique<vulkan::DescriptorPool>(*deviceRef, poolSizes, 1 + bakeSets);
+    environment->set = environment->descriptorPool->allocate(environmentSetLayout->handle());
+
+    VkDevice device = deviceRef->handle();
+    writeBuffer(device, environment->set, 0, *environment->irradiance);
+    writeImage(device, environment->set, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+               environment->specular->view(), cubeSampler->handle());
+    writeImage(device, environment->set, 2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+               brdfTable->view(), cubeSampler->handle());
+    return environment;
+}
+
+void EnvironmentLighting::prepareBake(Environment& environment, uint32_t mapWidth, uint32_t mapHeight) {
+    const EnvironmentSettings& settings = environment.settings;
+
+    environment.map = make_unique<vulkan::Image>(
+        *deviceRef, mapWidth, mapHeight, ENVIRONMENT_FORMAT,
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_SAMPLE_COUNT_1_BIT, vulkan::MemoryClass::Texture
+    );
+    environment.cube = make_unique<vulkan::Image>(
+        *deviceRef, settings.cubeSize, settings.cubeSize, ENVIRONMENT_FORMAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, static_cast<uint32_t>(bit_width(settings.cubeSize)), VK_SAMPLE_COUNT_1_BIT,
+        vulkan::MemoryClass::Texture, true
+    );
+
+    VkDevice device = deviceRef->handle();
+    VkSampler sampler = cubeSampler->handle();
+    vulkan::DescriptorPool& pool = *environment.descriptorPool;
+
+    environment.cubeSet = pool.allocate(bakeSetLayout->handle());
+    writeImage(device, environment.cubeSet, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+               environment.map->view(), mapSampler->handle());
+    writeImage(device, environment.cubeSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+               createStorageView(environment, *environment.cube, 0), VK_NULL_HANDLE);
+
+    environment.irradianceSet = pool.allocate(bakeSetLayout->handle());
+    writeImage(device, environment.irradianceSet, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+               environment.cube->view(), sampler);
+    writeBuffer(device, environment.irradianceSet, 2, *environment.irradiance);
+
+    environment.prefilterSets = pool.allocate(
+        vector<VkDescriptorSetLayout>(settings.specularMips, bakeSetLayout->handle()));
+    for (uint32_t mip = 0; mip < settings.specularMips; mip++) {
+        writeImage(device, environment.prefilterSets[mip], 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                   environment.cube->view(), sampler);
+        writeImage(device, environment.prefilterSets[mip], 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                   createStorageView(environment, *environment.specular, mip), VK_NULL_HANDLE);
+    }
+}
+
+VkImageView EnvironmentLighting::createStorageView(Environment& environment, const vulkan::Image& image,
+                                                   uint32_t mip) {
+    // Storage images cannot be cubes, the shaders address faces as layers
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = image.handle();
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    viewInfo.format = image.format();
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.baseMipLevel = mip;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = image.layers();
+
+    VkImageView view;
+    if (vkCreateImageView(deviceRef->handle(), &viewInfo, nullptr, &view) != VK_SUCCESS) {
+        throw runtime_error("Failed to create environment view");
+    }
+    environment.views.push_back(view);
+    return view;
+}
+
+void EnvironmentLighting::releaseBakeResources(Environment& environment) {
+    // The bake's descriptor sets stay allocated but are never bound again
+    destroyViews(*deviceRef, environment.views);
+    environment.staging.reset();
+    environment.map.reset();
+    environment.cube.reset();
+}
+
+void EnvironmentLighting::setEnvironment(const string& path) {
+    ifstream file(path, ios::ate | ios::binary);
+    if (!file.is_open()) {
+        throw runtime_error("Failed to open environment map: " + path);
+    }
+    vector<uint8_t> bytes(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(bytes.data()), static_cast<streamsize>(bytes.size()));
+
+    // Everything the results depend on
+    const EnvironmentSettings& settings = config;
+    uint64_t inputs[] = {hashBytes(bytes.data(), bytes.size()), settings.cubeSize, settings.specularSize,
+                         settings.specularMips, settings.specularSamples};
+    uint64_t key = hashBytes(inputs, sizeof(inputs), shaderHash);
+    VkDeviceSize size = resultBytes(settings);
+    bool caching = !settings.cacheDirectory.empty();
+
+    auto environment = createEnvironment(path, settings);
+    deque<BakeJob>& jobs = environment->jobs;
+
+    if (!brdfBaked) {
+        uint64_t tableTexels = uint64_t(BRDF_TABLE_SIZE) * BRDF_TABLE_SIZE;
+        if (!brdfStaging && caching) {
+            VkDeviceSize tableBytes = tableTexels * TEXEL_BYTES;
+            vector<uint8_t> table = readCache(cachePath("brdf", brdfKey), brdfKey, tableBytes);
+            if (!table.empty()) {
+                brdfStaging = make_unique<vulkan::Buffer>(
+                    *deviceRef, tableBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                    VMA_MEMORY_USAGE_CPU_ONLY, vulkan::MemoryClass::Staging);
+                brdfStaging->upload(table.data(), table.size());
+            }
+        }
+        jobs.push_back({BakeStep::BrdfTable, 0, 0, brdfStaging ? tableTexels : tableTexels * BRDF_SAMPLES});
+    }
+
+    vector<uint8_t> cached = caching ? readCache(cachePath("environment", key), key, size) : vector<uint8_t>{};
+    if (!cached.empty()) {
+        environment->staging = make_unique<vulkan::Buffer>(
+            *deviceRef, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VMA_MEMORY_USAGE_CPU_ONLY, vulkan::MemoryClass::Staging);
+        environment->staging->upload(cached.data(), cached.size());
+        jobs.push_back({BakeStep::Upload, 0, 0, size / TEXEL_BYTES});
+
+        cout << "Environment " << path << ": cached" << endl;
+        pending = std::move(environment);
+        return;
+    }
+
+    int width, height, channels;
+    float* pixels = stbi_loadf_from_memory(bytes.data(), static_cast<int>(bytes.size()),
+                                           &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels) {
+        throw runtime_error("Failed to load environment map: " + path);
+    }
+
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(deviceRef->physicalDevice(), &properties);
+    if (static_cast<uint32_t>(max(width, height)) > properties.limits.maxImageDimension2D) {
+        stbi_image_free(pixels);
+        throw runtime_error("Environment map too large: " + path);
+    }
+
+    // Half floats, as the map image holds them
+    size_t texelCount = size_t(width) * size_t(height);
+    environment->staging = make_unique<vulkan::Buffer>(
+        *deviceRef, texelCount * TEXEL_BYTES, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VMA_MEMORY_USAGE_CPU_ONLY, vulkan::MemoryClass::Staging);
+    auto* halves = static_cast<uint16_t*>(environment->staging->map());
+    for (size_t i = 0; i < texelCount * 4; i++) {
+        halves[i] = glm::packHalf1x16(min(pixels[i], HALF_MAX));
+    }
+    environment->staging->unmap();
+    stbi_image_free(pixels);
+
+    prepareBake(*environment, static_cast<uint32_t>(width), static_cast<uint32_t>(height));
+    if (caching) {
+        environment->cachePath = cachePath("environment", key);
+        environment->cacheKey = key;
+    }
+
+    uint64_t cubeTexels = uint64_t(settings.cubeSize) * settings.cubeSize * 6;
+    jobs.push_back({BakeStep::Upload, 0, 0, texelCount});
+    jobs.push_back({BakeStep::Cube, 0, 0, cubeTexels * 4});
+    jobs.push_back({BakeStep::Irradiance, 0, 0, uint64_t(IRRADIANCE_SIZE) * IRRADIANCE_SIZE * 6});
+    for (uint32_t mip = 0; mip < settings.specularMips; mip++) {
+        uint64_t mipSize = max(settings.specularSize >> mip, 1u);
+        for (uint32_t face = 0; face < 6; face++) {
+            jobs.push_back({BakeStep::Prefilter, mip, face, mipSize * mipSize * (mip == 0 ? 1 : settings.specularSamples)});
+        }
+    }
+    jobs.push_back({BakeStep::Finish, 0, 0, size / TEXEL_BYTES});
+
+    cout << "Environment " << path << ": baking " << width << "x" << height
+         << " in " << jobs.size() << " steps" << endl;
+    pending = std::move(environment);
+}
+
+void EnvironmentLighting::clearEnvironment() {
+    current.reset();
+    pending.reset();
+}
+
+void EnvironmentLighting::recordBake(VkCommandBuffer cmd) {
+    if (!pending) {
+        return;
+    }
+
+    // At least one step per frame, however costly
+    uint64_t budget = pending->settings.samplesPerFrame;
+    uint64_t spent = 0;
+    while (!pending->jobs.empty()) {
+        BakeJob job = pending->jobs.front();
+        if (budget > 0 && spent > 0 && spent + job.cost > budget) {
+            break;
+        }
+        pending->jobs.pop_front();
+        recordJob(cmd, *pending, job);
+        spent += job.cost;
+    }
+
+    if (pending->jobs.empty()) {
+        cout << "Environment " << pending->name << ": ready" << endl;
+        current = std::move(pending);
+    }
+}
+
+void EnvironmentLighting::recordJob(VkCommandBuffer cmd, Environment& environment, const BakeJob& job) {
+    const EnvironmentSettings& settings = environment.settings;
+    BakeParams params{};
+    params.lastMip = static_cast<float>(settings.specularMips - 1);
+
+    switch (job.step) {
+        case BakeStep::BrdfTable:
+            recordBrdfTable(cmd);
+            break;
+        case BakeStep::Upload:
+            recordUpload(cmd, environment);
+            break;
+        case BakeStep::Cube:
+            recordCube(cmd, environment);
+            break;
+        case BakeStep::Irradiance: {
+            uint32_t size = min(IRRADIANCE_SIZE, settings.cubeSize);
+            params.size = static_cast<int32_t>(size);
+            params.sourceLod = log2(static_cast<float>(settings.cubeSize / size));
+            dispatch(cmd, *irradiancePipeline, environment.irradianceSet, &params, 1, 1, 1);
+            break;
+        }
+        case BakeStep::Prefilter: {
+            uint32_t size = max(settings.specularSize >> job.mip, 1u);
+            params.size = static_cast<int32_t>(size);
+            params.face = static_cast<int32_t>(job.face);
+            params.samples = job.mip == 0 ? 1 : settings.specularSamples;
+            params.roughness = settings.specularMips > 1 ? float(job.mip) / float(settings.specularMips - 1) : 0.0f;
+            params.sourceSize = static_cast<float>(settings.cubeSize);
+            params.sourceLod = log2(static_cast<float>(settings.cubeSize / size));
+            dispatch(cmd, *prefilterPipeline, environment.prefilterSets[job.mip], &params,
+                     groupCount(size), groupCount(size), 1);
+            break;
+        }
+        case BakeStep::Finish:
+            recordFinish(cmd, environment);
+            break;
+    }
+}
+
+void EnvironmentLighting::recordBrdfTable(VkCommandBuffer cmd) {
+    VkDeviceSize tableBytes = VkDeviceSize(BRDF_TABLE_SIZE) * BRDF_TABLE_SIZE * TEXEL_BYTES;
+    VkBufferImageCopy region{};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {BRDF_TABLE_SIZE, BRDF_TABLE_SIZE, 1};
+
+    // Sampled by earlier frames through the fallback, never read there
+    if (brdfStaging) {
+        memoryBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+        vkCmdCopyBufferToImage(cmd, brdfStaging->handle(), brdfTable->handle(), VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+        memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        brdfStaging.reset();
+        brdfBaked = true;
+        return;
+    }
+
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+    BakeParams params{};
+    params.size = static_cast<int32_t>(BRDF_TABLE_SIZE);
+    params.samples = BRDF_SAMPLES;
+    dispatch(cmd, *brdfPipeline, brdfSet, &params, groupCount(BRDF_TABLE_SIZE), groupCount(BRDF_TABLE_SIZE), 1);
+    brdfBaked = true;
+
+    if (config.cacheDirectory.empty()) {
+        memoryBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        return;
+    }
+
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT);
+    auto readback = make_unique<vulkan::Buffer>(
+        *deviceRef, tableBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+    vkCmdCopyImageToBuffer(cmd, brdfTable->handle(), VK_IMAGE_LAYOUT_GENERAL, readback->handle(), 1, &region);
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+    cacheWrites.push_back({std::move(readback), cachePath("brdf", brdfKey), brdfKey, currentSlot});
+}
+
+void EnvironmentLighting::recordUpload(VkCommandBuffer cmd, Environment& environment) {
+    toGeneral(cmd, *environment.specular, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+              VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+    // Cached results: the irradiance, then the specular mips
+    if (!environment.map) {
+        VkBufferCopy copy{0, 0, sizeof(GpuIrradiance)};
+        vkCmdCopyBuffer(cmd, environment.staging->handle(), environment.irradiance->handle(), 1, &copy);
+        vector<VkBufferImageCopy> regions = specularRegions(environment.settings, sizeof(GpuIrradiance));
+        vkCmdCopyBufferToImage(cmd, environment.staging->handle(), environment.specular->handle(),
+                               VK_IMAGE_LAYOUT_GENERAL, static_cast<uint32_t>(regions.size()), regions.data());
+        memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        environment.staging.reset();
+        return;
+    }
+
+    toGeneral(cmd, *environment.map, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    toGeneral(cmd, *environment.cube, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+
+    VkBufferImageCopy region{};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {environment.map->width(), environment.map->height(), 1};
+    vkCmdCopyBufferToImage(cmd, environment.staging->handle(), environment.map->handle(),
+                           VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+}
+
+void EnvironmentLighting::recordCube(VkCommandBuffer cmd, Environment& environment) {
+    const vulkan::Image& cube = *environment.cube;
+    BakeParams params{};
+    params.size = static_cast<int32_t>(cube.width());
+    dispatch(cmd, *cubePipeline, environment.cubeSet, &params, groupCount(cube.width()), groupCount(cube.width()), 6);
+
+    // Mips by blitting, each from the one before. The prefilter reads them
+    // to keep its few samples per texel from aliasing.
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+    for (uint32_t mip = 1; mip < cube.mipLevels(); mip++) {
+        int32_t sourceSize = static_cast<int32_t>(max(cube.width() >> (mip - 1), 1u));
+        int32_t mipSize = max(sourceSize / 2, 1);
+
+        VkImageBlit blit{};
+        blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, mip - 1, 0, 6};
+        blit.srcOffsets[1] = {sourceSize, sourceSize, 1};
+        blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, mip, 0, 6};
+        blit.dstOffsets[1] = {mipSize, mipSize, 1};
+        vkCmdBlitImage(cmd, cube.handle(), VK_IMAGE_LAYOUT_GENERAL, cube.handle(), VK_IMAGE_LAYOUT_GENERAL,
+                       1, &blit, VK_FILTER_LINEAR);
+
+        if (mip + 1 < cube.mipLevels()) {
+            memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+        }
+    }
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+    // The cube holds everything from here on
+    environment.staging.reset();
+    environment.map.reset();
+}
+
+void EnvironmentLighting::recordFinish(VkCommandBuffer cmd, Environment& environment) {
+    if (environment.cachePath.empty()) {
+        memoryBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        releaseBakeResources(environment);
+        return;
+    }
+
+    // The cache file holds the bytes in the order an upload copies them back
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT);
+    auto readback = make_unique<vulkan::Buffer>(
+        *deviceRef, resultBytes(environment.settings), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_TO_CPU);
+    VkBufferCopy copy{0, 0, sizeof(GpuIrradiance)};
+    vkCmdCopyBuffer(cmd, environment.irradiance->handle(), readback->handle(), 1, &copy);
+    vector<VkBufferImageCopy> regions = specularRegions(environment.settings, sizeof(GpuIrradiance));
+    vkCmdCopyImageToBuffer(cmd, environment.specular->handle(), VK_IMAGE_LAYOUT_GENERAL, readback->handle(),
+                           static_cast<uint32_t>(regions.size()), regions.data());
+    memoryBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+    cacheWrites.push_back({std::move(readback), environment.cachePath, environment.cacheKey, currentSlot});
+    releaseBakeResources(environment);
+}
+
+void EnvironmentLighting::dispatch(VkCommandBuffer cmd, const vulkan::ComputePipeline& pipeline,
+                                   VkDescriptorSet set, const void* params,
+                                   uint32_t groupsX, uint32_t groupsY, uint32_t groupsZ) {
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.handle());
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout(), 0, 1, &set, 0, nullptr);
+    vkCmdPushConstants(cmd, pipeline.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(BakeParams), params);
+    vkCmdDispatch(cmd, groupsX, groupsY, groupsZ);
+}
+
+void EnvironmentLighting::update(uint32_t frameSlot) {
+    currentSlot = frameSlot;
+
+    // The slot's previous frame has finished, and with it its readbacks
+    for (auto it = cacheWrites.begin(); it != cacheWrites.end();) {
+        if (it->frameSlot == frameSlot) {
+            writeCacheFile(*it);
+            it = cacheWrites.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void EnvironmentLighting::flushCache() {
+    for (CacheWrite& write : cacheWrites) {
+        writeCacheFile(write);
+    }
+    cacheWrites.clear();
+}
+
+void EnvironmentLighting::writeCacheFile(CacheWrite& write) {
+    write.buffer->invalidate();
+    writeCache(write.path, write.key, write.buffer->map(), write.buffer->size());
+    write.buffer->unmap();
+}
+
+string EnvironmentLighting::cachePath(const string& prefix, uint64_t key) const {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%016llx.bin", prefix.c_str(), static_cast<unsigned long long>(key));
+    return (filesystem::path(config.cacheDirectory) / name).string();
+}
+
+} // namespace anim::renderer
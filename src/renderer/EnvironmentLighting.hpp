@@ -0,0 +1,180 @@
+#pragma once
+
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Buffer.hpp"
+#include "../vulkan/Image.hpp"
+#include "../vulkan/Sampler.hpp"
+#include "../vulkan/CommandPool.hpp"
+#include "../vulkan/DescriptorSet.hpp"
+#include "../vulkan/PipelineCache.hpp"
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace anim::renderer {
+
+struct EnvironmentSettings {
+    uint32_t cubeSize = 512;          // Faces of the cube the map is resampled into, the prefilter's source
+    uint32_t specularSize = 256;      // Mip 0 of the prefiltered cube, a mirror
+    uint32_t specularMips = 6;        // Roughness goes from 0 to 1 over these
+    uint32_t specularSamples = 64;    // GGX samples per texel, mips past the first
+    uint64_t samplesPerFrame = 1ull << 23;  // Bake budget per frame, 0 bakes in one frame
+    string cacheDirectory = "ibl_cache";    // Empty turns the disk cache off
+};
+
+// Start of the irradiance buffer, std430 layout, read by model.frag
+struct GpuIrradiance {
+    glm::vec4 params;                   // x = 1 once baked, y = last specular mip
+    array<glm::vec4, 9> coefficients;   // L2 SH of irradiance over pi, rgb
+};
+
+// Ambient light from an HDR environment map, equirectangular as stb_image
+// reads it. A bake resamples the map into a cube with mips, projects its
+// irradiance onto L2 spherical harmonics and prefilters a mip chain for GGX
+// specular, one roughness per mip. The split-sum BRDF table is shared by
+// every environment and made once. model.frag reads the results from set 4.
+//
+// The bake is a queue of small compute steps, down to one face of one mip,
+// and recordBake only records as many as fit samplesPerFrame. Changing the
+// environment at runtime spreads the work over frames while the previous
+// one stays bound. Results are written to the cache directory under a hash
+// of the map, the settings and the bake shaders, so baking the same map
+// again only uploads them.
+class EnvironmentLighting {
+public:
+    EnvironmentLighting(vulkan::Device& device, vulkan::PipelineCache& pipelineCache,
+                        vulkan::CommandPool& commandPool, const vector<uint32_t>& cubeShaderCode,
+                        const vector<uint32_t>& irradianceShaderCode, const vector<uint32_t>& prefilterShaderCode,
+                        const vector<uint32_t>& brdfShaderCode);
+    ~EnvironmentLighting();
+
+    // Non-copyable
+    EnvironmentLighting(const EnvironmentLighting&) = delete;
+    EnvironmentLighting& operator=(const EnvironmentLighting&) = delete;
+
+    // Applies to environments set from now on
+    void setSettings(const EnvironmentSettings& settings);
+    const EnvironmentSettings& settings() const { return config; }
+
+    // Reads an HDR map and queues its bake, or the upload of its cached
+    // results, replacing a bake still queued
+    void setEnvironment(const string& path);
+    // Back to the constant ambient of scenes without an environment
+    void clearEnvironment();
+    bool isBaking() const { return pending != nullptr; }
+
+    // Records queued bake steps within the frame's budget, outside a render
+    // pass and before the draws. When the last step is recorded the new
+    // environment is bound from this frame's draws on.
+    void recordBake(VkCommandBuffer cmd);
+
+    // Writes the cache files of bakes whose frame has finished. Call once the
+    // renderer has waited for frameSlot, before recording.
+    void update(uint32_t frameSlot);
+    // Writes the cache files still waiting for their frame, the device must be idle
+    void flushCache();
+
+    // Irradiance, prefiltered cube and BRDF table, set 4 of the scene pipelines
+    VkDescriptorSetLayout setLayout() const { return environmentSetLayout->handle(); }
+    VkDescriptorSet set() const { return current ? current->set : fallback->set; }
+
+private:
+    enum class BakeStep {
+        BrdfTable,   // Once, unless cached
+        Upload,      // The map, or the cached results
+        Cube,        // Map to cube, then its mips
+        Irradiance,
+        Prefilter,   // One face of one specular mip
+        Finish       // Readable by the draws, copied out for the cache
+    };
+
+    struct BakeJob {
+        BakeStep step;
+        uint32_t mip = 0;
+        uint32_t face = 0;
+        uint64_t cost = 0;  // Samples taken, roughly
+    };
+
+    // Baked, being baked, or the black fallback
+    struct Environment {
+        vulkan::Device* deviceRef = nullptr;
+        string name;
+        EnvironmentSettings settings;
+        unique_ptr<vulkan::Buffer> staging;     // The map or cached results, until uploaded
+        unique_ptr<vulkan::Image> map;          // Until resampled
+        unique_ptr<vulkan::Image> cube;         // Source of the prefilter, until baked
+        unique_ptr<vulkan::Image> specular;
+        unique_ptr<vulkan::Buffer> irradiance;  // GpuIrradiance
+        unique_ptr<vulkan::DescriptorPool> descriptorPool;
+        VkDescriptorSet set = VK_NULL_HANDLE;   // Set 4 of the scene pipelines
+        VkDescriptorSet cubeSet = VK_NULL_HANDLE;
+        VkDescriptorSet irradianceSet = VK_NULL_HANDLE;
+        vector<VkDescriptorSet> prefilterSets;  // One per specular mip
+        vector<VkImageView> views;              // Single-mip array views, written as storage images
+        deque<BakeJob> jobs;
+        string cachePath;                       // Empty when the results are not written
+        uint64_t cacheKey = 0;
+
+        ~Environment();
+    };
+
+    // A readback that becomes a cache file once its frame has finished
+    struct CacheWrite {
+        unique_ptr<vulkan::Buffer> buffer;
+        string path;
+        uint64_t key;
+        uint32_t frameSlot;
+    };
+
+    unique_ptr<Environment> createEnvironment(const string& name, const EnvironmentSettings& settings);
+    void prepareBake(Environment& environment, uint32_t mapWidth, uint32_t mapHeight);
+    VkImageView createStorageView(Environment& environment, const vulkan::Image& image, uint32_t mip);
+    void releaseBakeResources(Environment& environment);
+    void recordJob(VkCommandBuffer cmd, Environment& environment, const BakeJob& job);
+    void recordBrdfTable(VkCommandBuffer cmd);
+    void recordUpload(VkCommandBuffer cmd, Environment& environment);
+    void recordCube(VkCommandBuffer cmd, Environment& environment);
+    void recordFinish(VkCommandBuffer cmd, Environment& environment);
+    void dispatch(VkCommandBuffer cmd, const vulkan::ComputePipeline& pipeline, VkDescriptorSet set,
+                  const void* params, uint32_t groupsX, uint32_t groupsY, uint32_t groupsZ);
+    void writeCacheFile(CacheWrite& write);
+    string cachePath(const string& prefix, uint64_t key) const;
+
+    vulkan::Device* deviceRef;
+    EnvironmentSettings config;
+    uint64_t shaderHash = 0;  // Of the bake shaders, part of every cache key
+
+    unique_ptr<vulkan::Sampler> mapSampler;   // Wraps around horizontally
+    unique_ptr<vulkan::Sampler> cubeSampler;  // Trilinear, for the cubes and the table
+    unique_ptr<vulkan::DescriptorSetLayout> environmentSetLayout;
+    unique_ptr<vulkan::DescriptorSetLayout> bakeSetLayout;
+    vulkan::ComputePipeline* cubePipeline = nullptr;
+    vulkan::ComputePipeline* irradiancePipeline = nullptr;
+    vulkan::ComputePipeline* prefilterPipeline = nullptr;
+    vulkan::ComputePipeline* brdfPipeline = nullptr;
+
+    // Split-sum table, black until the first bake fills it or the cache does
+    unique_ptr<vulkan::Image> brdfTable;
+    unique_ptr<vulkan::DescriptorPool> brdfPool;
+    VkDescriptorSet brdfSet = VK_NULL_HANDLE;
+    unique_ptr<vulkan::Buffer> brdfStaging;  // Cached table, until uploaded
+    uint64_t brdfKey = 0;
+    bool brdfBaked = false;
+
+    unique_ptr<Environment> fallback;  // Zero irradiance, model.frag uses a constant ambient
+    unique_ptr<Environment> current;
+    unique_ptr<Environment> pending;
+
+    vector<CacheWrite> cacheWrites;
+    uint32_t currentSlot = 0;
+};
+
+} // namespace anim::renderer
@@ -0,0 +1,318 @@
+#include "FrameCapture.hpp"
+
+#include <stb_image_write.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// sRGB encoded 8-bit values to linear light
+static const array<float, 256>& srgbToLinear() {
+    static const array<float, 256> table = []() {
+        array<float, 256> values{};
+        for (size_t i = 0; i < values.size(); i++) {
+            float c = static_cast<float>(i) / 255.0f;
+            values[i] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return values;
+    }();
+    return table;
+}
+
+template<typename T>
+static void append(vector<uint8_t>& out, const T& value) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static void appendAttribute(vector<uint8_t>& out, const char* name, const char* type, uint32_t size) {
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    append(out, size);
+}
+
+// Single-part scanline OpenEXR, FLOAT channels and no compression
+static void writeExr(const string& path, uint32_t width, uint32_t height, const uint8_t* rgba, bool srgb) {
+    // Channels are stored in alphabetical order, each line one channel after another
+    static constexpr array<char, 4> CHANNELS = {'A', 'B', 'G', 'R'};
+    static constexpr array<uint32_t, 4> SOURCE = {3, 2, 1, 0};
+    static constexpr int32_t PIXEL_TYPE_FLOAT = 2;
+
+    vector<uint8_t> out;
+    append(out, uint32_t(20000630));  // Magic number
+    append(out, uint32_t(2));         // Version 2, single-part scanline
+
+    appendAttribute(out, "channels", "chlist", static_cast<uint32_t>(CHANNELS.size() * 18 + 1));
+    for (char channel : CHANNELS) {
+        out.push_back(static_cast<uint8_t>(channel));
+        out.push_back(0);
+        append(out, PIXEL_TYPE_FLOAT);
+        append(out, uint32_t(0));  // pLinear and reserved
+        append(out, int32_t(1));   // x and y sampling
+        append(out, int32_t(1));
+    }
+    out.push_back(0);
+
+    array<int32_t, 4> window = {0, 0, static_cast<int32_t>(width) - 1, static_cast<int32_t>(height) - 1};
+    appendAttribute(out, "compression", "compression", 1);
+    out.push_back(0);
+    appendAttribute(out, "dataWindow", "box2i", 16);
+    append(out, window);
+    appendAttribute(out, "displayWindow", "box2i", 16);
+    append(out, window);
+    appendAttribute(out, "lineOrder", "lineOrder", 1);
+    out.push_back(0);
+    appendAttribute(out, "pixelAspectRatio", "float", 4);
+    append(out, 1.0f);
+    appendAttribute(out, "screenWindowCenter", "v2f", 8);
+    append(out, 0.0f);
+    append(out, 0.0f);
+    appendAttribute(out, "screenWindowWidth", "float", 4);
+    append(out, 1.0f);
+    out.push_back(0);  // End of header
+
+    // Offset table, then one block per line: y, byte count, channel data
+    uint32_t lineBytes = width * static_cast<uint32_t>(CHANNELS.size()) * sizeof(float);
+    uint64_t blockStart = out.size() + uint64_t(height) * sizeof(uint64_t);
+    for (uint32_t y = 0; y < height; y++) {
+        append(out, blockStart + uint64_t(y) * (8 + lineBytes));
+    }
+
+    const auto& linear = srgbToLinear();
+    for (uint32_t y = 0; y < height; y++) {
+        append(out, static_cast<int32_t>(y));
+        append(out, lineBytes);
+        const uint8_t* row = rgba + size_t(y) * width * 4;
+        for (size_t c = 0; c < CHANNELS.size(); c++) {
+            bool alpha = SOURCE[c] == 3;
+            for (uint32_t x = 0; x < width; x++) {
+                uint8_t value = row[x * 4 + SOURCE[c]];
+                append(out, srgb && !alpha ? linear[value] : static_cast<float>(value) / 255.0f);
+            }
+        }
+    }
+
+    ofstream file(path, ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), static_cast<streamsize>(out.size()));
+    if (!file) {
+        throw runtime_error("Failed to write " + path);
+    }
+}
+
+FrameCapture::FrameCapture(vulkan::Device& device, uint32_t framesInFlight, const CaptureConfig& config)
+    : deviceRef(&device)
+    , config(config)
+    , readbacks(framesInFlight) {
+    filesystem::create_directories(config.directory);
+
+    uint32_t threadCount = config.encodeThreads;
+    if (threadCount == 0) {
+        threadCount = max(thread::hardware_concurrency(), 2u) - 1;
+    }
+    for (uint32_t i = 0; i < threadCount; i++) {
+        workers.emplace_back([this]() { workerLoop(); });
+    }
+
+    cout << "Capturing frames to " << config.directory << " (" << extension(config.format) << ", "
+         << threadCount << " encode threads)" << endl;
+}
+
+FrameCapture::~FrameCapture() {
+    {
+        lock_guard<mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+const char* FrameCapture::extension(CaptureFormat format) {
+    switch (format) {
+        case CaptureFormat::Png: return "png";
+        case CaptureFormat::Exr: return "exr";
+        case CaptureFormat::Raw: return "rgba";
+    }
+    return "";
+}
+
+void FrameCapture::capture(Renderer& renderer) {
+    rethrowError();
+
+    // beginFrame waited for the frame this slot recorded last
+    Readback& readback = readbacks[renderer.frameSlot()];
+    if (readback.pending) {
+        collect(readback);
+    }
+
+    VkExtent2D extent = renderer.extent();
+    VkDeviceSize size = static_cast<VkDeviceSize>(extent.width) * extent.height * 4;
+    if (!readback.buffer || readback.buffer->size() != size) {
+        readback.buffer = make_unique<vulkan::Buffer>(*deviceRef, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                      VMA_MEMORY_USAGE_GPU_TO_CPU);
+    }
+
+    VkFormat format = renderer.colorFormat();
+    bool bgra = format == VK_FORMAT_B8G8R8A8_SRGB || format == VK_FORMAT_B8G8R8A8_UNORM;
+    if (!bgra && format != VK_FORMAT_R8G8B8A8_SRGB && format != VK_FORMAT_R8G8B8A8_UNORM) {
+        throw runtime_error("Frame capture needs an 8-bit RGBA or BGRA color target");
+    }
+
+    readback.extent = extent;
+    readback.bgra = bgra;
+    readback.srgb = format == VK_FORMAT_B8G8R8A8_SRGB || format == VK_FORMAT_R8G8B8A8_SRGB;
+    readback.frame = renderer.frameNumber();
+    readback.index = nextIndex++;
+    readback.pending = true;
+
+    auto& graph = renderer.graph();
+    RenderGraph::ImageHandle color = renderer.colorTarget();
+    VkBuffer buffer = readback.buffer->handle();
+    graph.addPass("capture", [&renderer, &graph, color, buffer, extent](RenderGraph::PassContext&) {
+        auto& cmd = renderer.commandBuffer();
+        cmd.copyImageToBuffer(graph.image(color).handle(), buffer, extent.width, extent.height);
+
+        // Host reads after the frame timeline wait need the copy made visible to them
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = buffer;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(cmd.handle(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                             0, 0, nullptr, 1, &barrier, 0, nullptr);
+    }).read(color, ImageAccess::TransferSrc).sideEffects();
+}
+
+void FrameCapture::finish(Renderer& renderer) {
+    // Oldest first, so files are queued in order
+    vector<Readback*> pending;
+    for (auto& readback : readbacks) {
+        if (readback.pending) {
+            pending.push_back(&readback);
+        }
+    }
+    sort(pending.begin(), pending.end(), [](const Readback* a, const Readback* b) { return a->frame < b->frame; });
+    for (Readback* readback : pending) {
+        renderer.waitForFrame(readback->frame);
+        collect(*readback);
+    }
+
+    {
+        unique_lock<mutex> lock(jobMutex);
+        jobDone.wait(lock, [this]() { return (jobs.empty() && activeJobs == 0) || error; });
+    }
+    rethrowError();
+}
+
+void FrameCapture::collect(Readback& readback) {
+    Job job{readback.index, readback.extent, readback.bgra, readback.srgb, {}};
+    job.pixels.resize(readback.buffer->size());
+    readback.buffer->invalidate();
+    memcpy(job.pixels.data(), readback.buffer->map(), job.pixels.size());
+    readback.pending = false;
+
+    {
+        // Encoding fell behind: wait for a worker instead of growing without bound
+        unique_lock<mutex> lock(jobMutex);
+        jobDone.wait(lock, [this]() { return jobs.size() < max(config.maxPendingFrames, 1u) || error; });
+        jobs.push_back(move(job));
+    }
+    jobReady.notify_one();
+    rethrowError();
+}
+
+void FrameCapture::workerLoop() {
+    while (true) {
+        Job job;
+        {
+            unique_lock<mutex> lock(jobMutex);
+            jobReady.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;  // Stopping with nothing left to write
+            }
+            job = move(jobs.front());
+            jobs.pop_front();
+            activeJobs++;
+        }
+        jobDone.notify_all();
+
+        try {
+            encode(job);
+            written++;
+        } catch (...) {
+            lock_guard<mutex> lock(jobMutex);
+            if (!error) {
+                error = current_exception();
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(jobMutex);
+            activeJobs--;
+        }
+        jobDone.notify_all();
+    }
+}
+
+void FrameCapture::encode(Job& job) const {
+    uint32_t width = job.extent.width;
+    uint32_t height = job.extent.height;
+    if (job.bgra) {
+        for (size_t i = 0; i < job.pixels.size(); i += 4) {
+            swap(job.pixels[i], job.pixels[i + 2]);
+        }
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "frame_%05u.%s", job.index, extension(config.format));
+    string path = (filesystem::path(config.directory) / name).string();
+
+    switch (config.format) {
+        case CaptureFormat::Png:
+            if (!stbi_write_png(path.c_str(), static_cast<int>(width), static_cast<int>(height), 4,
+                                job.pixels.data(), static_cast<int>(width * 4))) {
+                throw runtime_error("Failed to write " + path);
+            }
+            break;
+        case CaptureFormat::Exr:
+            writeExr(path, width, height, job.pixels.data(), job.srgb);
+            break;
+        case CaptureFormat::Raw: {
+            ofstream file(path, ios::binary);
+            file.write(reinterpret_cast<const char*>(job.pixels.data()), static_cast<streamsize>(job.pixels.size()));
+            if (!file) {
+                throw runtime_error("Failed to write " + path);
+            }
+            break;
+        }
+    }
+}
+
+void FrameCapture::rethrowError() {
+    exception_ptr workerError;
+    {
+        lock_guard<mutex> lock(jobMutex);
+        workerError = error;
+    }
+    if (workerError) {
+        rethrow_exception(workerError);
+    }
+}
+
+} // namespace anim::renderer
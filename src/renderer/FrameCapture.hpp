@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Renderer.hpp"
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Buffer.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+using namespace std;
+
+namespace anim::renderer {
+
+enum class CaptureFormat {
+    Png,
+    Exr,   // 32-bit float, linear, uncompressed
+    Raw    // 8-bit RGBA rows as rendered, top to bottom
+};
+
+struct CaptureConfig {
+    string directory = "frames";   // Files are named frame_00000.<ext>
+    CaptureFormat format = CaptureFormat::Png;
+    uint32_t encodeThreads = 0;    // 0 = one per hardware thread besides the caller
+    uint32_t maxPendingFrames = 8; // Frames waiting for a worker before capture() blocks
+};
+
+// Writes frames the renderer records to numbered image files. The last pass
+// of a captured frame copies its color target into the frame slot's
+// host-visible buffer. The pixels are picked up when the slot comes around
+// again, which Renderer::beginFrame already waited for, and encoded on
+// worker threads, so recording never waits for a particular frame.
+class FrameCapture {
+public:
+    FrameCapture(vulkan::Device& device, uint32_t framesInFlight, const CaptureConfig& config);
+    // Writes what is queued, call finish() first to include frames in flight
+    ~FrameCapture();
+
+    // Non-copyable
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    // Call between Renderer::beginFrame and endFrame, after the scene passes.
+    // Rethrows the first error a worker hit.
+    void capture(Renderer& renderer);
+
+    // Collects the frames still in flight and waits until every file is written
+    void finish(Renderer& renderer);
+
+    uint32_t framesCaptured() const { return nextIndex; }
+    uint32_t framesWritten() const { return written.load(); }
+
+    static const char* extension(CaptureFormat format);
+
+private:
+    // One per frame slot
+    struct Readback {
+        unique_ptr<vulkan::Buffer> buffer;
+        VkExtent2D extent = {0, 0};
+        uint64_t frame = 0;
+        uint32_t index = 0;
+        bool bgra = false;     // Format of the frame it holds, see Job
+        bool srgb = false;
+        bool pending = false;  // Holds a frame not collected yet
+    };
+
+    // Carries the color target's format so workers never read capture() state
+    struct Job {
+        uint32_t index;
+        VkExtent2D extent;
+        bool bgra;   // Channel order of the color target, swapped while encoding
+        bool srgb;   // Encoded values, linearized for EXR
+        vector<uint8_t> pixels;
+    };
+
+    void collect(Readback& readback);
+    void workerLoop();
+    void encode(Job& job) const;
+    void rethrowError();
+
+    vulkan::Device* deviceRef;
+    CaptureConfig config;
+    vector<Readback> readbacks;
+    uint32_t nextIndex = 0;
+
+    vector<thread> workers;
+    mutex jobMutex;
+    condition_variable jobReady;
+    condition_variable jobDone;   // A job finished or left the queue
+    deque<Job> jobs;
+    uint32_t activeJobs = 0;
+    bool stopping = false;
+    exception_ptr error;
+    atomic<uint32_t> written{0};
+};
+
+} // namespace anim::renderer
@@ -0,0 +1,454 @@
+#include "GpuCulling.hpp"
+#include "../vulkan/CommandBuffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::renderer {
+
+static_assert(sizeof(GpuInstance) == 128, "GpuInstance must match the std430 Instance struct");
+
+// Frustum planes are derived in the shader, a matrix and six planes would
+// not fit the 128 bytes of push constants every device guarantees
+struct CullParams {
+    glm::mat4 viewProjection;
+    uint32_t instanceCount;
+    uint32_t compact;  // Nonzero when draws are compacted for the count buffer
+    uint32_t phase;
+    uint32_t pyramidLevels;  // 0 skips the occlusion test
+    glm::vec2 pyramidSize;
+};
+
+static_assert(sizeof(CullParams) <= 128, "CullParams must fit the guaranteed push constant size");
+
+// Values of params.phase in cull.comp
+static constexpr uint32_t PHASE_FRUSTUM = 0;
+static constexpr uint32_t PHASE_EARLY = 1;
+static constexpr uint32_t PHASE_LATE = 2;
+
+static constexpr uint32_t CULL_GROUP_SIZE = 64;  // local_size_x in cull.comp
+static constexpr uint32_t SET_KINDS = 2;  // Cull and instance sets
+
+// Transform and world bounds of an instance
+static void writeTransform(GpuInstance& instance, const LoadedMesh& loadedMesh) {
+    MeshBounds world = loadedMesh.bounds.transformed(loadedMesh.transform);
+    instance.model = loadedMesh.transform;
+    if (world.box.valid()) {
+        instance.sphere = glm::vec4(world.box.center(), world.sphere.radius);
+        instance.extent = glm::vec4(world.box.extent(), 0.0f);
+    } else {
+        // Never culled, FLT_MAX rather than infinity so 0 * extent stays 0
+        float huge = numeric_limits<float>::max();
+        instance.sphere = glm::vec4(0.0f, 0.0f, 0.0f, huge);
+        instance.extent = glm::vec4(huge, huge, huge, 0.0f);
+    }
+}
+
+GpuCulling::GpuCulling(vulkan::Device& device, vulkan::CommandPool& commandPool,
+                       vulkan::PipelineCache& pipelineCache, const vector<uint32_t>& cullShaderCode,
+                       const vector<uint32_t>& hizShaderCode, uint32_t framesInFlight)
+    : deviceRef(&device)
+    , commandPoolRef(&commandPool)
+    , useDrawCount(device.features().drawIndirectCount)
+    , slots(framesInFlight) {
+    if (!isSupported(device)) {
+        throw runtime_error("GPU culling requires multiDrawIndirect and drawIndirectFirstInstance");
+    }
+
+    auto storageBinding = [](uint32_t binding, VkShaderStageFlags stages) {
+        return VkDescriptorSetLayoutBinding{
+            .binding = binding,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = stages,
+            .pImmutableSamplers = nullptr
+        };
+    };
+
+    // Set 0 of cull.comp: instances, draw commands, draw counts, occluded flags, depth pyramid
+    cullSetLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        storageBinding(0, VK_SHADER_STAGE_COMPUTE_BIT),
+        storageBinding(1, VK_SHADER_STAGE_COMPUTE_BIT),
+        storageBinding(2, VK_SHADER_STAGE_COMPUTE_BIT),
+        storageBinding(3, VK_SHADER_STAGE_COMPUTE_BIT),
+        {
+            .binding = 4,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        }
+    });
+
+    // Set 1 of indirect.vert: instances
+    instanceSetLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        storageBinding(0, VK_SHADER_STAGE_VERTEX_BIT)
+    });
+
+    // Sets are rewritten in place rather than replaced, so only the slots' own
+    uint32_t maxSets = framesInFlight * SET_KINDS;
+    vector<VkDescriptorPoolSize> poolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 4 * maxSets},
+        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = maxSets}
+    };
+    descriptorPool = make_unique<vulkan::DescriptorPool>(device, poolSizes, maxSets);
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(CullParams);
+
+    vulkan::ComputePipelineConfig config;
+    config.shaderCode = cullShaderCode;
+    config.descriptorLayouts = {cullSetLayout->handle()};
+    config.pushConstantRanges = {pushConstantRange};
+    cullPipeline = &pipelineCache.getComputePipeline(config);
+
+    depthPyramid = make_unique<HiZPyramid>(device, pipelineCache, hizShaderCode);
+}
+
+bool GpuCulling::isSupported(const vulkan::Device& device) {
+    return device.features().multiDrawIndirect && device.features().drawIndirectFirstInstance;
+}
+
+GpuCulling::~GpuCulling() {
+    // The command buffer must outlive its last submission
+    if (uploadFence) {
+        uploadFence->wait();
+    }
+}
+
+void GpuCulling::build(const vector<LoadedMesh>& loadedMeshes, const vector<uint32_t>& meshes) {
+    // Group by material so each batch is a contiguous range of command slots
+    vector<uint32_t> sorted = meshes;
+    stable_sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+        return loadedMeshes[a].materialIndex < loadedMeshes[b].materialIndex;
+    });
+
+    createGeometry(loadedMeshes, sorted);
+
+    instances.clear();
+    instances.reserve(sorted.size());
+    meshInstances.assign(loadedMeshes.size(), -1);
+    batchList.clear();
+
+    uint32_t vertexOffset = 0;
+    uint32_t firstIndex = 0;
+    for (uint32_t meshIdx : sorted) {
+        const LoadedMesh& loadedMesh = loadedMeshes[meshIdx];
+        auto slot = static_cast<uint32_t>(instances.size());
+        if (batchList.empty() || batchList.back().material != loadedMesh.materialIndex) {
+            batchList.push_back({loadedMesh.materialIndex, slot, 0});
+        }
+        GpuBatch& batch = batchList.back();
+        batch.commandCount++;
+
+        GpuInstance instance{};
+        writeTransform(instance, loadedMesh);
+        instance.indexCount = loadedMesh.mesh->indexCount();
+        instance.firstIndex = firstIndex;
+        instance.vertexOffset = static_cast<int32_t>(vertexOffset);
+        instance.batch = static_cast<uint32_t>(batchList.size() - 1);
+        instance.batchFirst = batch.firstCommand;
+        instances.push_back(instance);
+        meshInstances[meshIdx] = static_cast<int32_t>(slot);
+
+        vertexOffset += loadedMesh.mesh->vertexCount();
+        firstIndex += loadedMesh.mesh->indexCount();
+    }
+
+    // Replaced buffers are released through the deletion queue, in-flight frames keep theirs
+    size_t instanceCapacity = max<size_t>(instances.size(), 1);
+    drawCommands = make_unique<vulkan::Buffer>(
+        *deviceRef, sizeof(VkDrawIndexedIndirectCommand) * instanceCapacity,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY);
+    drawCounts = make_unique<vulkan::Buffer>(
+        *deviceRef, sizeof(uint32_t) * max<size_t>(batchList.size(), 1),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY);
+    occludedFlags = make_unique<vulkan::Buffer>(
+        *deviceRef, sizeof(uint32_t) * instanceCapacity,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+    // Device-only, refreshDescriptors() writes fresh sets after they move
+    drawCommands->setRelocatable(true);
+    drawCounts->setRelocatable(true);
+    occludedFlags->setRelocatable(true);
+
+    // Each slot uploads the instances and rewrites its sets at its next update()
+    buildVersion++;
+    setVersion++;
+}
+
+void GpuCulling::setTransform(uint32_t mesh, const LoadedMesh& loadedMesh) {
+    if (mesh >= meshInstances.size() || meshInstances[mesh] < 0) {
+        return;
+    }
+
+    auto instance = static_cast<uint32_t>(meshInstances[mesh]);
+    writeTransform(instances[instance], loadedMesh);
+    for (Slot& slot : slots) {
+        slot.moved.push_back(instance);
+    }
+}
+
+void GpuCulling::update(uint32_t frameSlot) {
+    currentSlot = frameSlot;
+    if (!drawCommands) {
+        return;
+    }
+
+    Slot& slot = slots[frameSlot];
+    bool replaced = false;
+    if (slot.buildVersion != buildVersion) {
+        // Grows only, and persistently mapped, which also keeps the
+        // defragmenter from moving it out from under the sets
+        size_t capacity = max<size_t>(instances.size(), 1);
+        if (slot.capacity < capacity) {
+            slot.instances = make_unique<vulkan::Buffer>(
+                *deviceRef, sizeof(GpuInstance) * capacity,
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+            slot.mapped = slot.instances->map();
+            slot.capacity = capacity;
+            replaced = true;
+        }
+        if (!instances.empty()) {
+            memcpy(slot.mapped, instances.data(), sizeof(GpuInstance) * instances.size());
+        }
+        slot.buildVersion = buildVersion;
+    } else {
+        // Only what moved since this slot's last frame
+        auto* mapped = static_cast<uint8_t*>(slot.mapped);
+        for (uint32_t instance : slot.moved) {
+            memcpy(mapped + sizeof(GpuInstance) * instance, &instances[instance], sizeof(GpuInstance));
+        }
+    }
+    slot.moved.clear();
+
+    // The renderer has waited on this slot, so no frame still reads its sets
+    if (replaced || slot.setVersion != setVersion) {
+        writeDescriptors(slot);
+    }
+}
+
+void GpuCulling::createGeometry(const vector<LoadedMesh>& loadedMeshes, const vector<uint32_t>& meshes) {
+    VkDeviceSize vertexBytes = 0;
+    VkDeviceSize indexBytes = 0;
+    for (uint32_t meshIdx : meshes) {
+        vertexBytes += sizeof(Vertex) * loadedMeshes[meshIdx].mesh->vertexCount();
+        indexBytes += sizeof(uint32_t) * loadedMeshes[meshIdx].mesh->indexCount();
+    }
+
+    vertexBuffer = make_unique<vulkan::Buffer>(
+        *deviceRef, max<VkDeviceSize>(vertexBytes, sizeof(Vertex)),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY, vulkan::MemoryClass::Geometry);
+    indexBuffer = make_unique<vulkan::Buffer>(
+        *deviceRef, max<VkDeviceSize>(indexBytes, sizeof(uint32_t)),
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY, vulkan::MemoryClass::Geometry);
+    vertexBuffer->setRelocatable(true);
+    indexBuffer->setRelocatable(true);
+
+    if (meshes.empty()) {
+        return;
+    }
+
+    // Reuse the upload command buffer once its last copy has finished, which
+    // only blocks when rebuilds come faster than the copies
+    if (!uploadCommands) {
+        uploadCommands = make_unique<vulkan::CommandBuffer>(*commandPoolRef);
+        uploadFence = make_unique<vulkan::Fence>(*deviceRef, true);
+    }
+    uploadFence->wait();
+
+    // Copy each mesh's buffers into place, meshes stay usable by the CPU-driven path
+    vulkan::CommandBuffer& cmd = *uploadCommands;
+    cmd.reset();
+    cmd.begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    VkDeviceSize vertexOffset = 0;
+    VkDeviceSize indexOffset = 0;
+    for (uint32_t meshIdx : meshes) {
+        const Mesh& mesh = *loadedMeshes[meshIdx].mesh;
+        VkDeviceSize meshVertexBytes = sizeof(Vertex) * mesh.vertexCount();
+        VkDeviceSize meshIndexBytes = sizeof(uint32_t) * mesh.indexCount();
+        if (meshVertexBytes > 0) {
+            cmd.copyBuffer(mesh.vertexBuffer(), vertexBuffer->handle(), meshVertexBytes, 0, vertexOffset);
+        }
+        if (meshIndexBytes > 0) {
+            cmd.copyBuffer(mesh.indexBuffer(), indexBuffer->handle(), meshIndexBytes, 0, indexOffset);
+        }
+        vertexOffset += meshVertexBytes;
+        indexOffset += meshIndexBytes;
+    }
+
+    // Draws submitted after this read the geometry without waiting on the host
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    vkCmdPipelineBarrier(cmd.handle(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+    cmd.end();
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    VkCommandBuffer cmdHandle = cmd.handle();
+    submitInfo.pCommandBuffers = &cmdHandle;
+
+    uploadFence->reset();
+    if (vkQueueSubmit(deviceRef->graphicsQueue(), 1, &submitInfo, uploadFence->handle()) != VK_SUCCESS) {
+        throw runtime_error("Failed to submit geometry copy");
+    }
+}
+
+void GpuCulling::writeDescriptors(Slot& slot) {
+    if (slot.cullSet == VK_NULL_HANDLE) {
+        slot.cullSet = descriptorPool->allocate(cullSetLayout->handle());
+        slot.instanceSet = descriptorPool->allocate(instanceSetLayout->handle());
+    }
+
+    auto writeBuffer = [this](VkDescriptorSet set, uint32_t binding, const vulkan::Buffer& buffer) {
+        VkDescriptorBufferInfo bufferInfo{};
+        bufferInfo.buffer = buffer.handle();
+        bufferInfo.offset = 0;
+        bufferInfo.range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = set;
+        write.dstBinding = binding;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.descriptorCount = 1;
+        write.pBufferInfo = &bufferInfo;
+        vkUpdateDescriptorSets(deviceRef->handle(), 1, &write, 0, nullptr);
+    };
+
+    writeBuffer(slot.cullSet, 0, *slot.instances);
+    writeBuffer(slot.cullSet, 1, *drawCommands);
+    writeBuffer(slot.cullSet, 2, *drawCounts);
+    writeBuffer(slot.cullSet, 3, *occludedFlags);
+    writeBuffer(slot.instanceSet, 0, *slot.instances);
+    slot.setVersion = setVersion;
+
+    // The pyramid is created by the first recordCulling, which writes it then
+    slot.pyramidBound = depthPyramid->isCreated();
+    if (slot.pyramidBound) {
+        VkDescriptorImageInfo imageInfo{};
+        imageInfo.sampler = depthPyramid->sampler();
+        imageInfo.imageView = depthPyramid->view();
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = slot.cullSet;
+        write.dstBinding = 4;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        write.descriptorCount = 1;
+        write.pImageInfo = &imageInfo;
+        vkUpdateDescriptorSets(deviceRef->handle(), 1, &write, 0, nullptr);
+    }
+}
+
+void GpuCulling::refreshDescriptors() {
+    setVersion++;
+}
+
+void GpuCulling::recordCulling(VkCommandBuffer cmd, const glm::mat4& viewProjection, const vulkan::Image& depth) {
+    if (instances.empty()) {
+        return;
+    }
+
+    // Other slots pick the new pyramid up at their next update(), this one
+    // is rewritten before anything in this frame binds it
+    if (depthPyramid->resize(cmd, depth)) {
+        setVersion++;
+    }
+    Slot& slot = slots[currentSlot];
+    if (slot.setVersion != setVersion || !slot.pyramidBound) {
+        writeDescriptors(slot);
+    }
+
+    dispatch(cmd, viewProjection, occlusionCulling ? PHASE_EARLY : PHASE_FRUSTUM);
+}
+
+void GpuCulling::recordLateCulling(VkCommandBuffer cmd, const glm::mat4& viewProjection, const vulkan::Image& depth) {
+    if (instances.empty() || !occlusionCulling) {
+        return;
+    }
+
+    depthPyramid->build(cmd, depth);
+    dispatch(cmd, viewProjection, PHASE_LATE);
+}
+
+void GpuCulling::dispatch(VkCommandBuffer cmd, const glm::mat4& viewProjection, uint32_t phase) {
+    // Earlier draws must have read the commands before they are overwritten, and
+    // the late phase reads the flags the early phase wrote
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdFillBuffer(cmd, drawCounts->handle(), 0, VK_WHOLE_SIZE, 0);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    CullParams params{};
+    params.viewProjection = viewProjection;
+    params.instanceCount = static_cast<uint32_t>(instances.size());
+    params.compact = useDrawCount ? 1 : 0;
+    params.phase = phase;
+    if (phase != PHASE_FRUSTUM && depthPyramid->isBuilt()) {
+        params.pyramidLevels = depthPyramid->levels();
+        params.pyramidSize = glm::vec2(depthPyramid->width(), depthPyramid->height());
+    }
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline->handle());
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline->layout(),
+                            0, 1, &slots[currentSlot].cullSet, 0, nullptr);
+    vkCmdPushConstants(cmd, cullPipeline->layout(), VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(CullParams), &params);
+    vkCmdDispatch(cmd, (params.instanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void GpuCulling::bind(vulkan::CommandEncoder& encoder, VkPipelineLayout layout) const {
+    encoder.bindVertexBuffer(0, vertexBuffer->handle());
+    encoder.bindIndexBuffer(indexBuffer->handle());
+    encoder.bindDescriptorSet(layout, 1, slots[currentSlot].instanceSet);
+}
+
+void GpuCulling::drawBatch(vulkan::CommandEncoder& encoder, uint32_t batch) const {
+    const GpuBatch& entry = batchList[batch];
+    VkDeviceSize offset = sizeof(VkDrawIndexedIndirectCommand) * entry.firstCommand;
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+    if (useDrawCount) {
+        encoder.drawIndexedIndirectCount(drawCommands->handle(), offset,
+                                         drawCounts->handle(), sizeof(uint32_t) * batch,
+                                         entry.commandCount, stride);
+    } else {
+        // Culled draws were written with instanceCount 0
+        encoder.drawIndexedIndirect(drawCommands->handle(), offset, entry.commandCount, stride);
+    }
+}
+
+} // namespace anim::renderer
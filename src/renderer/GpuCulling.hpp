@@ -0,0 +1,158 @@
+#pragma once
+
+#include "ModelLoader.hpp"
+#include "HiZPyramid.hpp"
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Buffer.hpp"
+#include "../vulkan/Image.hpp"
+#include "../vulkan/CommandPool.hpp"
+#include "../vulkan/CommandBuffer.hpp"
+#include "../vulkan/Sync.hpp"
+#include "../vulkan/CommandEncoder.hpp"
+#include "../vulkan/DescriptorSet.hpp"
+#include "../vulkan/PipelineCache.hpp"
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Per-instance data read by cull.comp and indirect.vert, std430 layout
+struct GpuInstance {
+    glm::mat4 model;
+    glm::vec4 sphere;  // xyz = world center, w = radius
+    glm::vec4 extent;  // xyz = world box half extent
+    uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t batch;
+    uint32_t batchFirst;  // First command slot of the batch
+    uint32_t padding[3];
+};
+
+// Instances sharing a material, drawn with one indirect call
+struct GpuBatch {
+    int material;  // Scene material index, -1 for the default material
+    uint32_t firstCommand;
+    uint32_t commandCount;
+};
+
+// GPU-driven culling and submission. Meshes are copied into one vertex and
+// one index buffer, their transforms, bounds and draw arguments go into a
+// storage buffer, and a compute pass writes the indexed indirect draws.
+// The CPU records one indirect draw per material, whatever the instance count.
+//
+// With occlusion culling, instances are also tested against a depth pyramid.
+// The early phase uses the previous frame's pyramid and draws what passes,
+// then the late phase rebuilds the pyramid from that depth and draws the
+// rejected instances that are visible after all.
+class GpuCulling {
+public:
+    // framesInFlight is the renderer's, each frame slot gets its own instance buffer and sets
+    GpuCulling(vulkan::Device& device, vulkan::CommandPool& commandPool,
+               vulkan::PipelineCache& pipelineCache, const vector<uint32_t>& cullShaderCode,
+               const vector<uint32_t>& hizShaderCode, uint32_t framesInFlight);
+    ~GpuCulling();
+
+    // Non-copyable
+    GpuCulling(const GpuCulling&) = delete;
+    GpuCulling& operator=(const GpuCulling&) = delete;
+
+    // Multi-draw indirect with firstInstance is required, the draw count
+    // buffer (vkCmdDrawIndexedIndirectCount) is used when available
+    static bool isSupported(const vulkan::Device& device);
+
+    // Uploads geometry and instances for the given meshes, which must be resident.
+    // Waits for the copies, call when the set of meshes changes rather than per frame.
+    void build(const vector<LoadedMesh>& loadedMeshes, const vector<uint32_t>& meshes);
+
+    // Moves the instance of a mesh from the last build, others are ignored.
+    // Each frame slot picks up the new transform and bounds at its next update().
+    void setTransform(uint32_t mesh, const LoadedMesh& loadedMesh);
+
+    // Writes the instances this frame slot is missing and rewrites its stale sets.
+    // Call once the renderer has waited on frameSlot, before recording culling.
+    void update(uint32_t frameSlot);
+
+    // Record outside the render pass, before the draws that read the results.
+    // depth is the renderer's depth image, the pyramid follows its size.
+    void recordCulling(VkCommandBuffer cmd, const glm::mat4& viewProjection, const vulkan::Image& depth);
+
+    // Late occlusion phase, record in a pass after the early draws that reads
+    // depth as ImageAccess::SampledCompute, and draw the results in a pass
+    // that loads depth. No-op without occlusion culling.
+    void recordLateCulling(VkCommandBuffer cmd, const glm::mat4& viewProjection, const vulkan::Image& depth);
+
+    void setOcclusionCulling(bool enabled) { occlusionCulling = enabled; }
+    bool isOcclusionCulling() const { return occlusionCulling; }
+
+    // Binds the merged geometry and the instance buffer as set 1 of layout
+    void bind(vulkan::CommandEncoder& encoder, VkPipelineLayout layout) const;
+    void drawBatch(vulkan::CommandEncoder& encoder, uint32_t batch) const;
+
+    const vector<GpuBatch>& batches() const { return batchList; }
+    uint32_t instanceCount() const { return static_cast<uint32_t>(instances.size()); }
+    VkDescriptorSetLayout instanceLayout() const { return instanceSetLayout->handle(); }
+
+    // Marks the sets stale after the buffers were relocated, each slot
+    // rewrites its own once its frame is done with them
+    void refreshDescriptors();
+
+private:
+    // Instances are written into a buffer per frame slot, so a move touches
+    // only its own entry and never a buffer an in-flight frame reads. The
+    // slot's sets are allocated once and rewritten when setVersion moves on.
+    struct Slot {
+        unique_ptr<vulkan::Buffer> instances;
+        void* mapped = nullptr;  // Held for the buffer's lifetime
+        size_t capacity = 0;
+        VkDescriptorSet cullSet = VK_NULL_HANDLE;
+        VkDescriptorSet instanceSet = VK_NULL_HANDLE;
+        uint32_t buildVersion = 0;
+        uint32_t setVersion = 0;
+        bool pyramidBound = false;  // cullSet points at the current pyramid
+        vector<uint32_t> moved;  // Instances moved since the last update
+    };
+
+    void createGeometry(const vector<LoadedMesh>& loadedMeshes, const vector<uint32_t>& meshes);
+    void writeDescriptors(Slot& slot);
+    void dispatch(VkCommandBuffer cmd, const glm::mat4& viewProjection, uint32_t phase);
+
+    vulkan::Device* deviceRef;
+    vulkan::CommandPool* commandPoolRef;
+    bool useDrawCount;
+    bool occlusionCulling = false;
+
+    unique_ptr<vulkan::DescriptorSetLayout> cullSetLayout;
+    unique_ptr<vulkan::DescriptorSetLayout> instanceSetLayout;
+    unique_ptr<vulkan::DescriptorPool> descriptorPool;
+    vulkan::ComputePipeline* cullPipeline = nullptr;
+    unique_ptr<HiZPyramid> depthPyramid;
+
+    vector<Slot> slots;
+    uint32_t currentSlot = 0;  // Of the last update, the one recorded commands use
+    uint32_t buildVersion = 0;
+    uint32_t setVersion = 0;  // Bumped when a buffer the sets point at is replaced or moved
+
+    // Geometry copies are fenced rather than waited on, frames recorded after
+    // them are ordered behind the copy on the queue
+    unique_ptr<vulkan::CommandBuffer> uploadCommands;
+    unique_ptr<vulkan::Fence> uploadFence;
+
+    unique_ptr<vulkan::Buffer> vertexBuffer;
+    unique_ptr<vulkan::Buffer> indexBuffer;
+    unique_ptr<vulkan::Buffer> drawCommands;  // VkDrawIndexedIndirectCommand per instance
+    unique_ptr<vulkan::Buffer> drawCounts;    // Visible draws per batch
+    unique_ptr<vulkan::Buffer> occludedFlags; // Early phase rejections, per instance
+
+    vector<GpuBatch> batchList;
+    vector<GpuInstance> instances;  // Indexed by command slot
+    vector<int32_t> meshInstances;  // Instance of each mesh, -1 outside the build
+};
+
+} // namespace anim::renderer
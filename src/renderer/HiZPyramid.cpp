@@ -0,0 +1,220 @@
+#include "HiZPyramid.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::renderer {
+
+struct ReduceParams {
+    int32_t sourceWidth;
+    int32_t sourceHeight;
+    int32_t destinationWidth;
+    int32_t destinationHeight;
+};
+
+static constexpr uint32_t REDUCE_GROUP_SIZE = 8;  // local_size_x/y in hiz.comp
+static constexpr uint32_t MAX_LEVELS = 16;        // 32768 texels on a side
+
+HiZPyramid::HiZPyramid(vulkan::Device& device, vulkan::PipelineCache& pipelineCache,
+                       const vector<uint32_t>& shaderCode)
+    : deviceRef(&device) {
+    // texelFetch ignores filtering, the sampler only makes the bindings valid
+    vulkan::SamplerConfig samplerConfig;
+    samplerConfig.magFilter = VK_FILTER_NEAREST;
+    samplerConfig.minFilter = VK_FILTER_NEAREST;
+    samplerConfig.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerConfig.enableAnisotropy = false;
+    nearestSampler = make_unique<vulkan::Sampler>(device, samplerConfig);
+
+    setLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        }
+    });
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(ReduceParams);
+
+    vulkan::ComputePipelineConfig config;
+    config.shaderCode = shaderCode;
+    config.descriptorLayouts = {setLayout->handle()};
+    config.pushConstantRanges = {pushConstantRange};
+    reducePipeline = &pipelineCache.getComputePipeline(config);
+}
+
+HiZPyramid::~HiZPyramid() {
+    destroyLevelViews();
+}
+
+bool HiZPyramid::resize(VkCommandBuffer cmd, const vulkan::Image& depth) {
+    // The renderer replaces the depth image on resize, old handles stay alive until retired
+    if (depth.handle() == sourceDepth) {
+        return false;
+    }
+    createPyramid(cmd, depth);
+    return true;
+}
+
+void HiZPyramid::createPyramid(VkCommandBuffer cmd, const vulkan::Image& depth) {
+    destroyLevelViews();
+
+    uint32_t width = bit_floor(max(depth.width(), 1u));
+    uint32_t height = bit_floor(max(depth.height(), 1u));
+    uint32_t levelCount = min(static_cast<uint32_t>(bit_width(max(width, height))), MAX_LEVELS);
+
+    pyramid = make_unique<vulkan::Image>(
+        *deviceRef, width, height, VK_FORMAT_R32_SFLOAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT, levelCount, VK_SAMPLE_COUNT_1_BIT,
+        vulkan::MemoryClass::Transient
+    );
+
+    for (uint32_t level = 0; level < levelCount; level++) {
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = pyramid->handle();
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = VK_FORMAT_R32_SFLOAT;
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        viewInfo.subresourceRange.baseMipLevel = level;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = 0;
+        viewInfo.subresourceRange.layerCount = 1;
+
+        VkImageView view;
+        if (vkCreateImageView(deviceRef->handle(), &viewInfo, nullptr, &view) != VK_SUCCESS) {
+            throw runtime_error("Failed to create depth pyramid view");
+        }
+        levelViews.push_back(view);
+    }
+
+    // A fresh pool per size, the old one is destroyed once in-flight frames retire
+    vector<VkDescriptorPoolSize> poolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = MAX_LEVELS},
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = MAX_LEVELS}
+    };
+    descriptorPool = make_unique<vulkan::DescriptorPool>(*deviceRef, poolSizes, MAX_LEVELS);
+    levelSets = descriptorPool->allocate(vector<VkDescriptorSetLayout>(levelCount, setLayout->handle()));
+
+    for (uint32_t level = 0; level < levelCount; level++) {
+        VkDescriptorImageInfo sourceInfo{};
+        sourceInfo.sampler = nearestSampler->handle();
+        sourceInfo.imageView = level == 0 ? depth.view() : levelViews[level - 1];
+        sourceInfo.imageLayout = level == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+        VkDescriptorImageInfo destinationInfo{};
+        destinationInfo.imageView = levelViews[level];
+        destinationInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        array<VkWriteDescriptorSet, 2> writes{};
+        writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[0].dstSet = levelSets[level];
+        writes[0].dstBinding = 0;
+        writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        writes[0].descriptorCount = 1;
+        writes[0].pImageInfo = &sourceInfo;
+        writes[1] = writes[0];
+        writes[1].dstBinding = 1;
+        writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        writes[1].pImageInfo = &destinationInfo;
+        vkUpdateDescriptorSets(deviceRef->handle(), static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+    }
+
+    // The pyramid stays in GENERAL, written by the reduction and read by culling
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = pyramid->handle();
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount, 0, 1};
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    sourceDepth = depth.handle();
+    built = false;
+}
+
+void HiZPyramid::destroyLevelViews() {
+    if (levelViews.empty()) {
+        return;
+    }
+
+    VkDevice device = deviceRef->handle();
+    vector<VkImageView> oldViews = std::move(levelViews);
+    deviceRef->deletionQueue().push([device, oldViews]() {
+        for (VkImageView view : oldViews) {
+            vkDestroyImageView(device, view, nullptr);
+        }
+    });
+    levelViews.clear();
+}
+
+void HiZPyramid::build(VkCommandBuffer cmd, const vulkan::Image& depth) {
+    // The render graph made depth readable. The pyramid is not in the graph,
+    // order the rewrite after the culling that read it earlier.
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, reducePipeline->handle());
+
+    // Each level reads the one before it
+    VkMemoryBarrier levelBarrier{};
+    levelBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    uint32_t sourceWidth = depth.width();
+    uint32_t sourceHeight = depth.height();
+    for (uint32_t level = 0; level < levelSets.size(); level++) {
+        uint32_t levelWidth = max(pyramid->width() >> level, 1u);
+        uint32_t levelHeight = max(pyramid->height() >> level, 1u);
+
+        ReduceParams params{};
+        params.sourceWidth = static_cast<int32_t>(sourceWidth);
+        params.sourceHeight = static_cast<int32_t>(sourceHeight);
+        params.destinationWidth = static_cast<int32_t>(levelWidth);
+        params.destinationHeight = static_cast<int32_t>(levelHeight);
+
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, reducePipeline->layout(),
+                                0, 1, &levelSets[level], 0, nullptr);
+        vkCmdPushConstants(cmd, reducePipeline->layout(), VK_SHADER_STAGE_COMPUTE_BIT,
+                           0, sizeof(ReduceParams), &params);
+        vkCmdDispatch(cmd, (levelWidth + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE,
+                      (levelHeight + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE, 1);
+
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 1, &levelBarrier, 0, nullptr, 0, nullptr);
+
+        sourceWidth = levelWidth;
+        sourceHeight = levelHeight;
+    }
+
+
+    built = true;
+}
+
+} // namespace anim::renderer
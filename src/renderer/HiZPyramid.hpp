@@ -0,0 +1,68 @@
+#pragma once
+
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Image.hpp"
+#include "../vulkan/Sampler.hpp"
+#include "../vulkan/DescriptorSet.hpp"
+#include "../vulkan/PipelineCache.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Hierarchical depth for occlusion culling. Level 0 is the depth buffer
+// reduced to the largest power of two that fits it, each further level halves
+// it again, and every texel holds the farthest depth it covers. A box whose
+// nearest depth is behind that value is hidden.
+class HiZPyramid {
+public:
+    HiZPyramid(vulkan::Device& device, vulkan::PipelineCache& pipelineCache, const vector<uint32_t>& shaderCode);
+    ~HiZPyramid();
+
+    // Non-copyable
+    HiZPyramid(const HiZPyramid&) = delete;
+    HiZPyramid& operator=(const HiZPyramid&) = delete;
+
+    // Recreates the pyramid when the depth image was replaced, returns true if
+    // it did. Record outside a render pass, the new pyramid holds no depth
+    // until the next build.
+    bool resize(VkCommandBuffer cmd, const vulkan::Image& depth);
+
+    // Reduces depth into every level, resize must have seen this depth image.
+    // Record outside a render pass, depth is in SHADER_READ_ONLY_OPTIMAL (a
+    // RenderGraph pass reading it as ImageAccess::SampledCompute).
+    void build(VkCommandBuffer cmd, const vulkan::Image& depth);
+
+    // Whole pyramid in VK_IMAGE_LAYOUT_GENERAL, read with texelFetch
+    VkImageView view() const { return pyramid->view(); }
+    VkSampler sampler() const { return nearestSampler->handle(); }
+    uint32_t width() const { return pyramid->width(); }
+    uint32_t height() const { return pyramid->height(); }
+    uint32_t levels() const { return pyramid->mipLevels(); }
+    bool isCreated() const { return pyramid != nullptr; }
+    bool isBuilt() const { return built; }
+
+private:
+    void createPyramid(VkCommandBuffer cmd, const vulkan::Image& depth);
+    void destroyLevelViews();
+
+    vulkan::Device* deviceRef;
+
+    unique_ptr<vulkan::Sampler> nearestSampler;
+    unique_ptr<vulkan::DescriptorSetLayout> setLayout;
+    unique_ptr<vulkan::DescriptorPool> descriptorPool;
+    vulkan::ComputePipeline* reducePipeline = nullptr;
+
+    unique_ptr<vulkan::Image> pyramid;
+    vector<VkImageView> levelViews;       // One per mip, written as storage images
+    vector<VkDescriptorSet> levelSets;    // Level i reads level i - 1, level 0 reads depth
+    VkImage sourceDepth = VK_NULL_HANDLE; // Depth image the sets were written for
+    bool built = false;
+};
+
+} // namespace anim::renderer
@@ -0,0 +1,342 @@
+#include "LightClusters.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::renderer {
+
+static_assert(sizeof(GpuLightHeader) == 672, "GpuLightHeader must match the std430 LightHeader in the shaders");
+static_assert(sizeof(GpuLight) == 48, "GpuLight must match the std430 Light struct");
+
+// Lights without a range reach as far as their radiance stays above this
+static constexpr float LIGHT_CUTOFF = 0.01f;
+
+static constexpr uint32_t CLUSTER_GROUP_SIZE = 64;  // local_size_x in cluster.comp
+
+// Buffers start this large and double when a frame needs more
+static constexpr size_t MIN_LIGHT_CAPACITY = 64;
+static constexpr size_t MIN_INDEX_CAPACITY = 4096;
+
+// Distance at which a light stops contributing, the window in model.frag
+// fades it to zero there
+static float effectiveRange(const PunctualLight& light) {
+    if (light.range > 0.0f) {
+        return light.range;
+    }
+    float peak = max(light.color.r, max(light.color.g, light.color.b)) * light.intensity;
+    return sqrt(max(peak, 0.0f) / LIGHT_CUTOFF);
+}
+
+static GpuLight toGpuLight(const PunctualLight& light) {
+    GpuLight gpu{};
+    gpu.color = glm::vec4(light.color * light.intensity, 0.0f);
+    gpu.direction = glm::vec4(light.direction, 1.0f);
+    if (light.type == LightType::Directional) {
+        return gpu;
+    }
+
+    // Point lights keep cone scale 0 and offset 1, lit in every direction
+    gpu.position = glm::vec4(light.position, effectiveRange(light));
+    if (light.type == LightType::Spot) {
+        // KHR_lights_punctual cone falloff: clamp(cos * scale + offset)^2
+        float cosOuter = cos(light.outerConeAngle);
+        float cosInner = cos(light.innerConeAngle);
+        float scale = 1.0f / max(0.001f, cosInner - cosOuter);
+        gpu.color.w = scale;
+        gpu.direction.w = -cosOuter * scale;
+    }
+    return gpu;
+}
+
+LightClusters::LightClusters(vulkan::Device& device, vulkan::PipelineCache& pipelineCache,
+                             const vector<uint32_t>& clusterShaderCode, uint32_t framesInFlight)
+    : deviceRef(&device)
+    , slots(framesInFlight) {
+    auto storageBinding = [](uint32_t binding) {
+        return VkDescriptorSetLayoutBinding{
+            .binding = binding,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = nullptr
+        };
+    };
+
+    // Set 2 of model.frag, set 0 of cluster.comp: lights, clusters, light indices
+    clusterSetLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        storageBinding(0),
+        storageBinding(1),
+        storageBinding(2)
+    });
+
+    vector<VkDescriptorPoolSize> poolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 3 * framesInFlight}
+    };
+    descriptorPool = make_unique<vulkan::DescriptorPool>(device, poolSizes, framesInFlight);
+
+    vulkan::ComputePipelineConfig config;
+    config.shaderCode = clusterShaderCode;
+    config.descriptorLayouts = {clusterSetLayout->handle()};
+    clusterPipeline = &pipelineCache.getComputePipeline(config);
+}
+
+void LightClusters::setMode(LightClustering mode) {
+    // Each slot switches the next time it is updated
+    clusteringMode = mode;
+}
+
+void LightClusters::update(uint32_t frameSlot, const vector<PunctualLight>& lights, const vector<ClusterView>& views,
+                           float nearPlane, float farPlane) {
+    if (views.empty() || views.size() > MAX_CULL_VIEWS) {
+        throw runtime_error("Light clusters need 1 to " + to_string(MAX_CULL_VIEWS) + " views");
+    }
+    currentSlot = frameSlot;
+    Slot& slot = slots[frameSlot];
+
+    // Directional lights first, every fragment shades all of them
+    gpuLights.clear();
+    for (const auto& light : lights) {
+        if (light.type == LightType::Directional) {
+            gpuLights.push_back(toGpuLight(light));
+        }
+    }
+    auto firstLocal = static_cast<uint32_t>(gpuLights.size());
+    for (const auto& light : lights) {
+        if (light.type != LightType::Directional) {
+            gpuLights.push_back(toGpuLight(light));
+        }
+    }
+    uploadedLights = static_cast<uint32_t>(gpuLights.size());
+    uploadedLocalLights = uploadedLights - firstLocal;
+    uploadedViews = static_cast<uint32_t>(views.size());
+
+    GpuLightHeader header{};
+    float sliceScale = static_cast<float>(CLUSTER_GRID_Z) / log(farPlane / nearPlane);
+    for (size_t v = 0; v < views.size(); v++) {
+        header.views[v] = views[v].view;
+        header.depth[v] = glm::vec4(nearPlane, sliceScale, views[v].proj[0][0], abs(views[v].proj[1][1]));
+    }
+    header.grid = glm::uvec4(CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, MAX_LIGHTS_PER_CLUSTER);
+    header.counts = glm::uvec4(firstLocal, uploadedLights, uploadedViews, 0);
+
+    bool rewrite = false;
+    VkDeviceSize lightBytes = sizeof(GpuLightHeader) + sizeof(GpuLight) * gpuLights.size();
+    if (!slot.lights || slot.lights->size() < lightBytes) {
+        VkDeviceSize capacity = slot.lights ? slot.lights->size()
+                                            : sizeof(GpuLightHeader) + sizeof(GpuLight) * MIN_LIGHT_CAPACITY;
+        while (capacity < lightBytes) {
+            capacity *= 2;
+        }
+        slot.lights = make_unique<vulkan::Buffer>(
+            *deviceRef, capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        rewrite = true;
+    }
+    if (!slot.clusters || slot.mode != clusteringMode || slot.viewCapacity < uploadedViews) {
+        // GPU binning writes fixed-size lists that never leave the device
+        bool gpu = clusteringMode == LightClustering::Gpu;
+        size_t clusterCount = static_cast<size_t>(CLUSTER_COUNT) * uploadedViews;
+        slot.clusters = make_unique<vulkan::Buffer>(
+            *deviceRef, sizeof(glm::uvec2) * clusterCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            gpu ? VMA_MEMORY_USAGE_GPU_ONLY : VMA_MEMORY_USAGE_CPU_TO_GPU);
+        slot.indices = make_unique<vulkan::Buffer>(
+            *deviceRef, sizeof(uint32_t) * (gpu ? clusterCount * MAX_LIGHTS_PER_CLUSTER : MIN_INDEX_CAPACITY),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, gpu ? VMA_MEMORY_USAGE_GPU_ONLY : VMA_MEMORY_USAGE_CPU_TO_GPU);
+        slot.mode = clusteringMode;
+        slot.viewCapacity = uploadedViews;
+        rewrite = true;
+    }
+
+    auto* mapped = static_cast<uint8_t*>(slot.lights->map());
+    memcpy(mapped, &header, sizeof(header));
+    if (!gpuLights.empty()) {
+        memcpy(mapped + sizeof(header), gpuLights.data(), sizeof(GpuLight) * gpuLights.size());
+    }
+    slot.lights->unmap();
+
+    if (clusteringMode == LightClustering::Cpu) {
+        binLights(views, firstLocal, nearPlane, farPlane);
+
+        VkDeviceSize indexBytes = sizeof(uint32_t) * lightIndices.size();
+        if (slot.indices->size() < indexBytes) {
+            VkDeviceSize capacity = slot.indices->size();
+            while (capacity < indexBytes) {
+                capacity *= 2;
+            }
+            slot.indices = make_unique<vulkan::Buffer>(
+                *deviceRef, capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+            rewrite = true;
+        }
+        slot.clusters->upload(clusterRanges.data(), sizeof(glm::uvec2) * clusterRanges.size());
+        if (indexBytes > 0) {
+            slot.indices->upload(lightIndices.data(), indexBytes);
+        }
+    }
+
+    if (!slot.set) {
+        slot.set = make_unique<vulkan::DescriptorSet>(*descriptorPool, *clusterSetLayout);
+        rewrite = true;
+    }
+    if (rewrite) {
+        writeSet(frameSlot);
+    }
+}
+
+void LightClusters::writeSet(uint32_t slot) {
+    const Slot& entry = slots[slot];
+    entry.set->updateBuffer(0, entry.lights->handle(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    entry.set->updateBuffer(1, entry.clusters->handle(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    entry.set->updateBuffer(2, entry.indices->handle(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+}
+
+void LightClusters::buildClusterBoxes(uint32_t view, float p00, float p11, float nearPlane, float farPlane) {
+    glm::vec4 key(p00, p11, nearPlane, farPlane);
+    if (key == boxesBuiltFor[view] && clusterBoxes.size() > static_cast<size_t>(CLUSTER_COUNT) * view) {
+        return;
+    }
+    boxesBuiltFor[view] = key;
+    clusterBoxes.resize(max(clusterBoxes.size(), static_cast<size_t>(CLUSTER_COUNT) * (view + 1)));
+    ClusterBox* boxes = clusterBoxes.data() + static_cast<size_t>(CLUSTER_COUNT) * view;
+
+    // View space looks down -Z, a tile's sides are planes through the eye so
+    // its box spans both ends of the slice
+    for (uint32_t z = 0; z < CLUSTER_GRID_Z; z++) {
+        float sliceNear = nearPlane * pow(farPlane / nearPlane, static_cast<float>(z) / CLUSTER_GRID_Z);
+        float sliceFar = nearPlane * pow(farPlane / nearPlane, static_cast<float>(z + 1) / CLUSTER_GRID_Z);
+        for (uint32_t y = 0; y < CLUSTER_GRID_Y; y++) {
+            float y0 = -1.0f + 2.0f * static_cast<float>(y) / CLUSTER_GRID_Y;
+            float y1 = -1.0f + 2.0f * static_cast<float>(y + 1) / CLUSTER_GRID_Y;
+            for (uint32_t x = 0; x < CLUSTER_GRID_X; x++) {
+                float x0 = -1.0f + 2.0f * static_cast<float>(x) / CLUSTER_GRID_X;
+                float x1 = -1.0f + 2.0f * static_cast<float>(x + 1) / CLUSTER_GRID_X;
+
+                ClusterBox& box = boxes[x + CLUSTER_GRID_X * (y + CLUSTER_GRID_Y * z)];
+                box.min = glm::vec3(min(x0 * sliceNear, x0 * sliceFar) / p00,
+                                    min(y0 * sliceNear, y0 * sliceFar) / p11, -sliceFar);
+                box.max = glm::vec3(max(x1 * sliceNear, x1 * sliceFar) / p00,
+                                    max(y1 * sliceNear, y1 * sliceFar) / p11, -sliceNear);
+            }
+        }
+    }
+}
+
+void LightClusters::binLights(const vector<ClusterView>& views, uint32_t firstLocal, float nearPlane, float farPlane) {
+    float sliceScale = static_cast<float>(CLUSTER_GRID_Z) / log(farPlane / nearPlane);
+    auto slice = [&](float depth) {
+        return static_cast<uint32_t>(glm::clamp(floor(log(depth / nearPlane) * sliceScale),
+                                                0.0f, static_cast<float>(CLUSTER_GRID_Z - 1)));
+    };
+    auto tile = [](float ndc, uint32_t tiles) {
+        return static_cast<uint32_t>(glm::clamp(floor((ndc * 0.5f + 0.5f) * static_cast<float>(tiles)),
+                                                0.0f, static_cast<float>(tiles - 1)));
+    };
+
+    // Each light only visits the clusters under its bounding box on screen and
+    // in depth, so the work follows how many clusters lights cover rather than
+    // lights times clusters. Views are binned one after the other, a view's
+    // clusters numbered after those of the views before it.
+    binned.clear();
+    for (uint32_t v = 0; v < views.size(); v++) {
+        float p00 = views[v].proj[0][0];
+        float p11 = abs(views[v].proj[1][1]);
+        buildClusterBoxes(v, p00, p11, nearPlane, farPlane);
+        const ClusterBox* boxes = clusterBoxes.data() + static_cast<size_t>(CLUSTER_COUNT) * v;
+
+        viewLights.clear();
+        for (uint32_t i = firstLocal; i < gpuLights.size(); i++) {
+            const glm::vec4& position = gpuLights[i].position;
+            viewLights.push_back(glm::vec4(glm::vec3(views[v].view * glm::vec4(glm::vec3(position), 1.0f)), position.w));
+        }
+
+        for (uint32_t i = 0; i < viewLights.size(); i++) {
+            glm::vec3 center(viewLights[i]);
+            float radius = viewLights[i].w;
+            float depth = -center.z;
+            float depthMin = max(depth - radius, nearPlane);
+            float depthMax = min(depth + radius, farPlane);
+            if (radius <= 0.0f || depthMin > depthMax) {
+                continue;
+            }
+
+            // x / depth is monotonic in both, so the box's corners bound its projection
+            float ndcX[] = {(center.x - radius) / depthMin, (center.x - radius) / depthMax,
+                            (center.x + radius) / depthMin, (center.x + radius) / depthMax};
+            float ndcY[] = {(center.y - radius) / depthMin, (center.y - radius) / depthMax,
+                            (center.y + radius) / depthMin, (center.y + radius) / depthMax};
+            float minX = p00 * *min_element(begin(ndcX), end(ndcX));
+            float maxX = p00 * *max_element(begin(ndcX), end(ndcX));
+            float minY = p11 * *min_element(begin(ndcY), end(ndcY));
+            float maxY = p11 * *max_element(begin(ndcY), end(ndcY));
+            if (maxX < -1.0f || minX > 1.0f || maxY < -1.0f || minY > 1.0f) {
+                continue;
+            }
+
+            uint32_t x0 = tile(minX, CLUSTER_GRID_X), x1 = tile(maxX, CLUSTER_GRID_X);
+            uint32_t y0 = tile(minY, CLUSTER_GRID_Y), y1 = tile(maxY, CLUSTER_GRID_Y);
+            uint32_t z0 = slice(depthMin), z1 = slice(depthMax);
+            for (uint32_t z = z0; z <= z1; z++) {
+                for (uint32_t y = y0; y <= y1; y++) {
+                    for (uint32_t x = x0; x <= x1; x++) {
+                        uint32_t cluster = x + CLUSTER_GRID_X * (y + CLUSTER_GRID_Y * z);
+                        const ClusterBox& box = boxes[cluster];
+                        glm::vec3 offset = center - glm::clamp(center, box.min, box.max);
+                        if (glm::dot(offset, offset) <= radius * radius) {
+                            binned.push_back((static_cast<uint64_t>(cluster + CLUSTER_COUNT * v) << 32) |
+                                             (firstLocal + i));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Counting sort by cluster. Lights were visited in order, so a full
+    // cluster keeps its lowest indices.
+    auto clusterCount = static_cast<uint32_t>(CLUSTER_COUNT * views.size());
+    clusterCounts.assign(clusterCount, 0);
+    for (uint64_t entry : binned) {
+        clusterCounts[entry >> 32]++;
+    }
+    clusterRanges.resize(clusterCount);
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < clusterCount; i++) {
+        uint32_t count = min(clusterCounts[i], MAX_LIGHTS_PER_CLUSTER);
+        clusterRanges[i] = glm::uvec2(offset, count);
+        offset += count;
+        clusterCounts[i] = 0;
+    }
+    lightIndices.resize(offset);
+    for (uint64_t entry : binned) {
+        auto cluster = static_cast<uint32_t>(entry >> 32);
+        glm::uvec2 range = clusterRanges[cluster];
+        if (clusterCounts[cluster] < range.y) {
+            lightIndices[range.x + clusterCounts[cluster]++] = static_cast<uint32_t>(entry);
+        }
+    }
+}
+
+void LightClusters::recordClustering(VkCommandBuffer cmd) {
+    if (clusteringMode != LightClustering::Gpu || slots[currentSlot].mode != LightClustering::Gpu) {
+        return;
+    }
+
+    VkDescriptorSet set = slots[currentSlot].set->handle();
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, clusterPipeline->handle());
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, clusterPipeline->layout(),
+                            0, 1, &set, 0, nullptr);
+    vkCmdDispatch(cmd, (CLUSTER_COUNT + CLUSTER_GROUP_SIZE - 1) / CLUSTER_GROUP_SIZE, uploadedViews, 1);
+
+    // The slot's buffers are only reused once its frame has finished, so only
+    // the fragment shaders reading the lists wait
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+} // namespace anim::renderer
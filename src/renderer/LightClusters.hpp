@@ -0,0 +1,139 @@
+#pragma once
+
+#include "ModelLoader.hpp"
+#include "Culling.hpp"
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Buffer.hpp"
+#include "../vulkan/DescriptorSet.hpp"
+#include "../vulkan/PipelineCache.hpp"
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Froxel grid over a view's frustum: screen tiles, and depth slices spaced
+// logarithmically between the near and far planes
+static constexpr uint32_t CLUSTER_GRID_X = 16;
+static constexpr uint32_t CLUSTER_GRID_Y = 9;
+static constexpr uint32_t CLUSTER_GRID_Z = 24;
+static constexpr uint32_t CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+
+// Lights past this many in one cluster are dropped from it
+static constexpr uint32_t MAX_LIGHTS_PER_CLUSTER = 128;
+
+// Start of the light buffer, std430 layout. Each view has its own grid, its
+// clusters follow those of the views before it.
+struct GpuLightHeader {
+    array<glm::mat4, MAX_CULL_VIEWS> views;  // Camera each grid is built for
+    array<glm::vec4, MAX_CULL_VIEWS> depth;  // x = near plane, y = slices / log(far / near), z = P00, w = |P11|
+    glm::uvec4 grid;    // xyz = clusters per axis, w = MAX_LIGHTS_PER_CLUSTER
+    glm::uvec4 counts;  // x = directional lights, y = all lights, z = views
+};
+
+// Lights follow the header, read by model.frag and cluster.comp
+struct GpuLight {
+    glm::vec4 position;   // xyz = world position, w = range, 0 for directional lights
+    glm::vec4 color;      // rgb = color * intensity, w = spot cone scale
+    glm::vec4 direction;  // xyz = direction the light points, w = spot cone offset
+};
+
+// A camera to build clusters for, proj is its Vulkan projection with the Y flip
+struct ClusterView {
+    glm::mat4 view;
+    glm::mat4 proj;
+};
+
+enum class LightClustering {
+    Cpu,  // Binned on the CPU while the frame is prepared
+    Gpu   // Binned by a compute pass, see recordClustering
+};
+
+// Clustered forward lighting. Every frame the lights are uploaded into a
+// storage buffer, directional ones first, and each cluster of every view's
+// froxel grid gets the list of point and spot lights whose range reaches it.
+// model.frag finds its fragment's cluster in the grid of the view it is drawn
+// for and shades only those lights, so the cost per pixel follows the local
+// light density, not the light count.
+class LightClusters {
+public:
+    // Keeps a set of buffers for each of the renderer's framesInFlight slots
+    LightClusters(vulkan::Device& device, vulkan::PipelineCache& pipelineCache,
+                  const vector<uint32_t>& clusterShaderCode, uint32_t framesInFlight);
+
+    // Non-copyable
+    LightClusters(const LightClusters&) = delete;
+    LightClusters& operator=(const LightClusters&) = delete;
+
+    void setMode(LightClustering mode);
+    LightClustering mode() const { return clusteringMode; }
+
+    // Uploads the lights into frameSlot's buffers and bins them in CPU mode,
+    // into a grid per view, at most MAX_CULL_VIEWS. Call once the renderer
+    // has waited for frameSlot. near and far are the planes of every view.
+    void update(uint32_t frameSlot, const vector<PunctualLight>& lights, const vector<ClusterView>& views,
+                float nearPlane, float farPlane);
+
+    // Bins the lights of the last update, record outside the render pass and
+    // before the draws. No-op in CPU mode.
+    void recordClustering(VkCommandBuffer cmd);
+
+    // Lights, clusters and light indices of the last update, set 2 of the scene pipelines
+    VkDescriptorSetLayout setLayout() const { return clusterSetLayout->handle(); }
+    VkDescriptorSet set() const { return slots[currentSlot].set->handle(); }
+
+    uint32_t lightCount() const { return uploadedLights; }
+    uint32_t localLightCount() const { return uploadedLocalLights; }
+
+private:
+    struct ClusterBox {
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+
+    void writeSet(uint32_t slot);
+    void buildClusterBoxes(uint32_t view, float p00, float p11, float nearPlane, float farPlane);
+    void binLights(const vector<ClusterView>& views, uint32_t firstLocal, float nearPlane, float farPlane);
+
+    vulkan::Device* deviceRef;
+    LightClustering clusteringMode = LightClustering::Cpu;
+
+    unique_ptr<vulkan::DescriptorSetLayout> clusterSetLayout;
+    unique_ptr<vulkan::DescriptorPool> descriptorPool;
+    vulkan::ComputePipeline* clusterPipeline = nullptr;
+
+    // One set of buffers per frame slot, rewritten once the slot's frame has finished
+    struct Slot {
+        unique_ptr<vulkan::Buffer> lights;    // Header, then directional and local lights
+        unique_ptr<vulkan::Buffer> clusters;  // Offset and count into indices per cluster of each view
+        unique_ptr<vulkan::Buffer> indices;   // Light indices, MAX_LIGHTS_PER_CLUSTER per cluster on the GPU
+        unique_ptr<vulkan::DescriptorSet> set;
+        LightClustering mode = LightClustering::Cpu;  // Mode the clusters and indices were made for
+        uint32_t viewCapacity = 0;                    // Views they have room for
+    };
+    vector<Slot> slots;
+    uint32_t currentSlot = 0;
+    uint32_t uploadedLights = 0;
+    uint32_t uploadedLocalLights = 0;
+    uint32_t uploadedViews = 0;
+
+    vector<GpuLight> gpuLights;  // Staged for upload, in buffer order
+
+    // CPU binning: view-space cluster boxes for each view's last projection,
+    // the local lights in one view's space, and the cluster lists built from them
+    vector<ClusterBox> clusterBoxes;                   // CLUSTER_COUNT per view
+    array<glm::vec4, MAX_CULL_VIEWS> boxesBuiltFor{};  // p00, p11, near, far
+    vector<glm::vec4> viewLights;                      // xyz = view-space center, w = range
+    vector<uint64_t> binned;        // Cluster in the high bits, light in the low
+    vector<uint32_t> clusterCounts;
+    vector<glm::uvec2> clusterRanges;
+    vector<uint32_t> lightIndices;
+};
+
+} // namespace anim::renderer
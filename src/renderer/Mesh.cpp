@@ -6,20 +6,42 @@ namespace anim::renderer {
 
 Mesh::Mesh(vulkan::Device& device, const vector<Vertex>& vertices, const vector<uint32_t>& indices)
     : vertexBuf(device, sizeof(Vertex) * vertices.size(),
-                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU)
+                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+                vulkan::MemoryClass::Geometry)
+    , positionBuf(device, sizeof(glm::vec3) * vertices.size(),
+                  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+                  vulkan::MemoryClass::Geometry)
     , indexBuf(device, sizeof(uint32_t) * indices.size(),
-               VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU)
+               VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+               vulkan::MemoryClass::Geometry)
+    , vertexCnt(static_cast<uint32_t>(vertices.size()))
     , indexCnt(static_cast<uint32_t>(indices.size())) {
     vertexBuf.upload(vertices.data(), sizeof(Vertex) * vertices.size());
+
+    vector<glm::vec3> positions;
+    positions.reserve(vertices.size());
+    for (const Vertex& vertex : vertices) {
+        positions.push_back(vertex.position);
+    }
+    positionBuf.upload(positions.data(), sizeof(glm::vec3) * positions.size());
     indexBuf.upload(indices.data(), sizeof(uint32_t) * indices.size());
+
+    // Written once and bound by handle each draw, so they can move freely
+    vertexBuf.setRelocatable(true);
+    positionBuf.setRelocatable(true);
+    indexBuf.setRelocatable(true);
+}
+
+void Mesh::draw(vulkan::CommandEncoder& encoder, uint32_t instanceCount, uint32_t firstInstance) const {
+    encoder.bindVertexBuffer(0, vertexBuf.handle());
+    encoder.bindIndexBuffer(indexBuf.handle());
+    encoder.drawIndexed(indexCnt, instanceCount, 0, 0, firstInstance);
 }
 
-void Mesh::draw(VkCommandBuffer cmd) const {
-    VkBuffer buffers[] = {vertexBuf.handle()};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(cmd, 0, 1, buffers, offsets);
-    vkCmdBindIndexBuffer(cmd, indexBuf.handle(), 0, VK_INDEX_TYPE_UINT32);
-    vkCmdDrawIndexed(cmd, indexCnt, 1, 0, 0, 0);
+void Mesh::drawPositions(vulkan::CommandEncoder& encoder, uint32_t instanceCount, uint32_t firstInstance) const {
+    encoder.bindVertexBuffer(0, positionBuf.handle());
+    encoder.bindIndexBuffer(indexBuf.handle());
+    encoder.drawIndexed(indexCnt, instanceCount, 0, 0, firstInstance);
 }
 
 } // namespace anim::renderer
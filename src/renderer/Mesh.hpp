@@ -2,6 +2,7 @@
 
 #include "../vulkan/Buffer.hpp"
 #include "../vulkan/Device.hpp"
+#include "../vulkan/CommandEncoder.hpp"
 
 #include <glm/glm.hpp>
 #include <vulkan/vulkan.h>
@@ -65,13 +66,32 @@ public:
 
     VkBuffer vertexBuffer() const { return vertexBuf.handle(); }
     VkBuffer indexBuffer() const { return indexBuf.handle(); }
+    uint32_t vertexCount() const { return vertexCnt; }
     uint32_t indexCount() const { return indexCnt; }
+    VkDeviceSize memorySize() const {
+        return vertexBuf.allocationSize() + positionBuf.allocationSize() + indexBuf.allocationSize();
+    }
+
+    // instanceCount copies, gl_InstanceIndex starts at firstInstance
+    void draw(vulkan::CommandEncoder& encoder, uint32_t instanceCount = 1, uint32_t firstInstance = 0) const;
+    // Same, from the position-only stream at binding 0 for depth-only passes
+    void drawPositions(vulkan::CommandEncoder& encoder, uint32_t instanceCount = 1,
+                       uint32_t firstInstance = 0) const;
 
-    void draw(VkCommandBuffer cmd) const;
+    // Binding of the position-only stream
+    static VkVertexInputBindingDescription positionBinding() {
+        VkVertexInputBindingDescription binding{};
+        binding.binding = 0;
+        binding.stride = sizeof(glm::vec3);
+        binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return binding;
+    }
 
 private:
     vulkan::Buffer vertexBuf;
+    vulkan::Buffer positionBuf;  // Positions only, a third of the vertex fetch for shadow passes
     vulkan::Buffer indexBuf;
+    uint32_t vertexCnt = 0;
     uint32_t indexCnt = 0;
 };
 
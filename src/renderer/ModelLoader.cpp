@@ -52,7 +52,7 @@ static mat4 getNodeTransform(const tinygltf::Node& node) {
     return T * R * S;
 }
 
-LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPool, const string& path) {
+ModelData ModelLoader::parse(const string& path) {
     tinygltf::Model model;
     tinygltf::TinyGLTF loader;
     string err, warn;
@@ -74,40 +74,36 @@ LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPo
         throw runtime_error("Failed to load glTF: " + path);
     }
 
-    LoadedModel result;
+    ModelData result;
 
-    // Load all images as textures
+    // Decode all images to RGBA
     for (const auto& image : model.images) {
+        ImageData imageData;
         if (image.image.empty()) {
-            result.textures.push_back(nullptr);
+            result.images.push_back(move(imageData));
             continue;
         }
 
+        imageData.width = static_cast<uint32_t>(image.width);
+        imageData.height = static_cast<uint32_t>(image.height);
+
         // tinygltf may provide RGB (3 components) or RGBA (4 components)
         // Our Texture class expects RGBA, so convert if needed
         if (image.component == 3) {
             // Convert RGB to RGBA
-            vector<uint8_t> rgba(image.width * image.height * 4);
+            imageData.pixels.resize(image.width * image.height * 4);
             const uint8_t* src = image.image.data();
             for (int i = 0; i < image.width * image.height; i++) {
-                rgba[i * 4 + 0] = src[i * 3 + 0];  // R
-                rgba[i * 4 + 1] = src[i * 3 + 1];  // G
-                rgba[i * 4 + 2] = src[i * 3 + 2];  // B
-                rgba[i * 4 + 3] = 255;             // A
+                imageData.pixels[i * 4 + 0] = src[i * 3 + 0];  // R
+                imageData.pixels[i * 4 + 1] = src[i * 3 + 1];  // G
+                imageData.pixels[i * 4 + 2] = src[i * 3 + 2];  // B
+                imageData.pixels[i * 4 + 3] = 255;             // A
             }
-            result.textures.push_back(make_unique<Texture>(
-                device, cmdPool,
-                image.width, image.height,
-                rgba.data()
-            ));
         } else {
             // Already RGBA (or other 4-component format)
-            result.textures.push_back(make_unique<Texture>(
-                device, cmdPool,
-                image.width, image.height,
-                image.image.data()
-            ));
+            imageData.pixels = image.image;
         }
+        result.images.push_back(move(imageData));
     }
 
     // Load materials
@@ -144,13 +140,17 @@ LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPo
             mat.emissiveFactor[2]
         );
 
+        // MASK is drawn as opaque
+        loadedMat.blend = mat.alphaMode == "BLEND";
+
         result.materials.push_back(loadedMat);
     }
 
     // Helper lambda to load a primitive
-    auto loadPrimitive = [&](const tinygltf::Primitive& primitive, mat4 transform) -> LoadedMesh {
-        vector<Vertex> vertices;
-        vector<uint32_t> indices;
+    auto loadPrimitive = [&](const tinygltf::Primitive& primitive, mat4 transform) -> MeshData {
+        MeshData meshData;
+        vector<Vertex>& vertices = meshData.vertices;
+        vector<uint32_t>& indices = meshData.indices;
 
         const uint8_t* positionData = nullptr;
         const uint8_t* normalData = nullptr;
@@ -267,13 +267,15 @@ LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPo
             }
         }
 
-        LoadedMesh loadedMesh;
-        loadedMesh.mesh = make_unique<Mesh>(device, vertices, indices);
-        loadedMesh.materialIndex = primitive.material;
-        loadedMesh.transform = transform;
-        return loadedMesh;
+        meshData.materialIndex = primitive.material;
+        meshData.transform = transform;
+        meshData.bounds = MeshBounds::fromVertices(vertices);
+        return meshData;
     };
 
+    // First MeshData of each glTF mesh, primitives of a mesh placed by several nodes are loaded once
+    vector<int> firstPrimitive(model.meshes.size(), -1);
+
     // Recursive function to process nodes
     function<void(int, mat4)> processNode = [&](int nodeIndex, mat4 parentTransform) {
         const auto& node = model.nodes[nodeIndex];
@@ -283,6 +285,10 @@ LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPo
         // If node has a mesh, load all its primitives
         if (node.mesh >= 0) {
             const auto& mesh = model.meshes[node.mesh];
+            int loaded = firstPrimitive[node.mesh];
+            if (loaded < 0) {
+                firstPrimitive[node.mesh] = static_cast<int>(result.meshes.size());
+            }
             for (const auto& primitive : mesh.primitives) {
                 if (primitive.mode != TINYGLTF_MODE_TRIANGLES) {
                     continue;
@@ -290,10 +296,42 @@ LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPo
                 if (!primitive.attributes.count("POSITION")) {
                     continue;
                 }
-                result.meshes.push_back(loadPrimitive(primitive, worldTransform));
+                if (loaded >= 0) {
+                    // Same primitives in the same order, only the transform differs
+                    MeshData instance;
+                    instance.source = loaded;
+                    instance.materialIndex = result.meshes[loaded].materialIndex;
+                    instance.transform = worldTransform;
+                    instance.bounds = result.meshes[loaded].bounds;
+                    result.meshes.push_back(move(instance));
+                    loaded++;
+                } else {
+                    result.meshes.push_back(loadPrimitive(primitive, worldTransform));
+                }
             }
         }
 
+        // KHR_lights_punctual, lights shine down the node's -Z axis
+        if (node.light >= 0 && node.light < static_cast<int>(model.lights.size())) {
+            const auto& source = model.lights[node.light];
+            PunctualLight light;
+            if (source.type == "directional") {
+                light.type = LightType::Directional;
+            } else if (source.type == "spot") {
+                light.type = LightType::Spot;
+                light.innerConeAngle = static_cast<float>(source.spot.innerConeAngle);
+                light.outerConeAngle = static_cast<float>(source.spot.outerConeAngle);
+            }
+            light.position = vec3(worldTransform * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+            light.direction = normalize(mat3(worldTransform) * vec3(0.0f, 0.0f, -1.0f));
+            if (source.color.size() >= 3) {
+                light.color = vec3(source.color[0], source.color[1], source.color[2]);
+            }
+            light.intensity = static_cast<float>(source.intensity);
+            light.range = static_cast<float>(source.range);
+            result.lights.push_back(light);
+        }
+
         // Process children
         for (int childIndex : node.children) {
             processNode(childIndex, worldTransform);
@@ -307,11 +345,65 @@ LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPo
         }
     }
 
-    cout << "Loaded " << result.meshes.size() << " mesh(es), "
-         << result.textures.size() << " texture(s), "
-         << result.materials.size() << " material(s) from " << path << endl;
+    cout << "Parsed " << result.meshes.size() << " mesh(es), "
+         << result.images.size() << " image(s), "
+         << result.materials.size() << " material(s), "
+         << result.lights.size() << " light(s) from " << path << endl;
+
+    return result;
+}
+
+LoadedModel ModelLoader::upload(vulkan::Device& device, vulkan::CommandPool& cmdPool, const ModelData& data) {
+    // Back off before uploading anything if the model would exceed the GPU memory budget
+    if (!device.canAllocate(data.byteSize())) {
+        throw runtime_error("Not enough GPU memory budget to upload model");
+    }
+
+    LoadedModel result;
+
+    for (const auto& image : data.images) {
+        if (image.pixels.empty()) {
+            result.textures.push_back(nullptr);
+            continue;
+        }
+        result.textures.push_back(make_unique<Texture>(
+            device, cmdPool,
+            image.width, image.height,
+            image.pixels.data()
+        ));
+    }
+
+    result.materials = data.materials;
+
+    for (const auto& meshData : data.meshes) {
+        LoadedMesh loadedMesh;
+        if (meshData.source >= 0) {
+            loadedMesh.mesh = result.meshes[meshData.source].mesh;
+        } else {
+            loadedMesh.mesh = make_unique<Mesh>(device, meshData.vertices, meshData.indices);
+        }
+        loadedMesh.materialIndex = meshData.materialIndex;
+        loadedMesh.transform = meshData.transform;
+        loadedMesh.bounds = meshData.bounds;
+        result.meshes.push_back(move(loadedMesh));
+    }
 
     return result;
 }
 
+LoadedModel ModelLoader::load(vulkan::Device& device, vulkan::CommandPool& cmdPool, const string& path) {
+    return upload(device, cmdPool, parse(path));
+}
+
+size_t ModelData::byteSize() const {
+    size_t bytes = 0;
+    for (const auto& image : images) {
+        bytes += image.pixels.size();
+    }
+    for (const auto& mesh : meshes) {
+        bytes += mesh.vertices.size() * sizeof(Vertex) + mesh.indices.size() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
 } // namespace anim::renderer
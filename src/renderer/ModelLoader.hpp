@@ -2,6 +2,7 @@
 
 #include "Mesh.hpp"
 #include "Texture.hpp"
+#include "Bounds.hpp"
 #include "../vulkan/Device.hpp"
 #include "../vulkan/CommandPool.hpp"
 
@@ -28,12 +29,59 @@ struct LoadedMaterial {
     float metallicFactor = 1.0f;
     float roughnessFactor = 1.0f;
     glm::vec3 emissiveFactor{0.0f};
+
+    bool blend = false;  // glTF alphaMode BLEND, drawn after opaque meshes
+};
+
+enum class LightType : uint32_t {
+    Directional,
+    Point,
+    Spot
+};
+
+// KHR_lights_punctual light placed by a node, in world space
+struct PunctualLight {
+    LightType type = LightType::Point;
+    glm::vec3 position{0.0f};
+    glm::vec3 direction{0.0f, 0.0f, -1.0f};  // Where the light points
+    glm::vec3 color{1.0f};
+    float intensity = 1.0f;  // Candela for point and spot lights, lux for directional ones
+    float range = 0.0f;      // 0 if unlimited
+    float innerConeAngle = 0.0f;
+    float outerConeAngle = 0.7853982f;  // pi / 4, the glTF default
 };
 
 struct LoadedMesh {
-    unique_ptr<Mesh> mesh;
+    shared_ptr<Mesh> mesh;  // Shared by the nodes that place the same glTF primitive
     int materialIndex = -1;  // Index into LoadedModel::materials, -1 if no material
     glm::mat4 transform{1.0f};  // World transform from node hierarchy
+    MeshBounds bounds;  // Local space, before transform
+};
+
+// CPU-side copy of a parsed model, enough to upload it again without
+// touching the file
+struct MeshData {
+    vector<Vertex> vertices;
+    vector<uint32_t> indices;
+    int source = -1;  // Earlier mesh with the same geometry, vertices and indices are then empty
+    int materialIndex = -1;
+    glm::mat4 transform{1.0f};
+    MeshBounds bounds;
+};
+
+struct ImageData {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    vector<uint8_t> pixels;  // RGBA8, empty if the image could not be decoded
+};
+
+struct ModelData {
+    vector<MeshData> meshes;
+    vector<ImageData> images;  // Indexed like LoadedModel::textures
+    vector<LoadedMaterial> materials;
+    vector<PunctualLight> lights;
+
+    size_t byteSize() const;
 };
 
 struct LoadedModel {
@@ -45,6 +93,10 @@ struct LoadedModel {
 class ModelLoader {
 public:
     static LoadedModel load(vulkan::Device& device, vulkan::CommandPool& cmdPool, const string& path);
+
+    // Split load: parse a file into CPU memory, then create GPU resources from it
+    static ModelData parse(const string& path);
+    static LoadedModel upload(vulkan::Device& device, vulkan::CommandPool& cmdPool, const ModelData& data);
 };
 
 } // namespace anim::renderer
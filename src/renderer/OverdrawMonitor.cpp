@@ -0,0 +1,65 @@
+#include "OverdrawMonitor.hpp"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Weight of the newest frame, smooths out single-frame spikes
+static constexpr float OVERDRAW_SMOOTHING = 0.1f;
+
+OverdrawMonitor::OverdrawMonitor(vulkan::Device& device, uint32_t framesInFlight)
+    : deviceRef(&device)
+    , pixelCounts(framesInFlight, 0) {
+    VkQueryPoolCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    createInfo.queryType = VK_QUERY_TYPE_OCCLUSION;
+    createInfo.queryCount = framesInFlight;
+
+    if (vkCreateQueryPool(device.handle(), &createInfo, nullptr, &queryPool) != VK_SUCCESS) {
+        throw runtime_error("Failed to create query pool");
+    }
+}
+
+OverdrawMonitor::~OverdrawMonitor() {
+    if (queryPool != VK_NULL_HANDLE) {
+        VkDevice device = deviceRef->handle();
+        VkQueryPool oldPool = queryPool;
+        deviceRef->deletionQueue().push([device, oldPool]() { vkDestroyQueryPool(device, oldPool, nullptr); });
+    }
+}
+
+optional<float> OverdrawMonitor::beginFrame(VkCommandBuffer cmd, uint32_t frameSlot) {
+    currentSlot = frameSlot;
+    optional<float> result;
+
+    // The renderer waited for this slot's previous frame, so its result is ready
+    if (pixelCounts[frameSlot] > 0) {
+        uint64_t samples = 0;
+        VkResult status = vkGetQueryPoolResults(deviceRef->handle(), queryPool, frameSlot, 1,
+                                                sizeof(samples), &samples, sizeof(samples),
+                                                VK_QUERY_RESULT_64_BIT);
+        if (status == VK_SUCCESS) {
+            float ratio = static_cast<float>(static_cast<double>(samples) / static_cast<double>(pixelCounts[frameSlot]));
+            smoothed = hasSample ? smoothed + (ratio - smoothed) * OVERDRAW_SMOOTHING : ratio;
+            hasSample = true;
+            result = smoothed;
+        }
+    }
+
+    vkCmdResetQueryPool(cmd, queryPool, frameSlot, 1);
+    pixelCounts[frameSlot] = 0;
+    return result;
+}
+
+void OverdrawMonitor::begin(VkCommandBuffer cmd, VkExtent2D extent) {
+    vkCmdBeginQuery(cmd, queryPool, currentSlot, VK_QUERY_CONTROL_PRECISE_BIT);
+    pixelCounts[currentSlot] = static_cast<uint64_t>(extent.width) * extent.height;
+}
+
+void OverdrawMonitor::end(VkCommandBuffer cmd) {
+    vkCmdEndQuery(cmd, queryPool, currentSlot);
+}
+
+} // namespace anim::renderer
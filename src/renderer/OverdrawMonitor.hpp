@@ -0,0 +1,48 @@
+#pragma once
+
+#include "../vulkan/Device.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <optional>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Measures overdraw with one occlusion query per frame slot: the samples that
+// pass the depth test while the scene lays down depth, divided by the pixels
+// on screen. Without a depth pre-pass that is how often each pixel is shaded.
+class OverdrawMonitor {
+public:
+    OverdrawMonitor(vulkan::Device& device, uint32_t framesInFlight);
+    ~OverdrawMonitor();
+
+    // Non-copyable
+    OverdrawMonitor(const OverdrawMonitor&) = delete;
+    OverdrawMonitor& operator=(const OverdrawMonitor&) = delete;
+
+    // Non-precise queries may only report whether any sample passed
+    static bool isSupported(const vulkan::Device& device) { return device.features().occlusionQueryPrecise; }
+
+    // Call after Renderer::beginFrame, outside the render pass. Returns the
+    // smoothed overdraw when the slot's previous frame recorded a measurement.
+    optional<float> beginFrame(VkCommandBuffer cmd, uint32_t frameSlot);
+
+    // Bracket the draws to measure, inside the render pass
+    void begin(VkCommandBuffer cmd, VkExtent2D extent);
+    void end(VkCommandBuffer cmd);
+
+    float overdraw() const { return smoothed; }
+
+private:
+    vulkan::Device* deviceRef;
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    vector<uint64_t> pixelCounts;  // Per slot, 0 when the slot's query was not recorded
+    uint32_t currentSlot = 0;
+    float smoothed = 0.0f;
+    bool hasSample = false;
+};
+
+} // namespace anim::renderer
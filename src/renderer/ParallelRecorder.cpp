@@ -0,0 +1,80 @@
+#include "ParallelRecorder.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+namespace anim::renderer {
+
+ParallelRecorder::ParallelRecorder(vulkan::Device& device, core::ThreadPool& threadPool,
+                                   uint32_t framesInFlight, size_t minDrawsPerTask)
+    : deviceRef(&device)
+    , threadPool(&threadPool)
+    , minDrawsPerTask(max<size_t>(minDrawsPerTask, 1))
+    , maxTasks(threadPool.threadCount() + 1) {
+    contexts.resize(framesInFlight);
+    for (auto& slot : contexts) {
+        slot.resize(maxTasks);
+        for (auto& context : slot) {
+            // Transient: buffers live for one frame and are freed by resetting the pool
+            context.pool = make_unique<vulkan::CommandPool>(device, device.graphicsQueueFamily(),
+                                                            VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+            context.buffer = make_unique<vulkan::CommandBuffer>(*context.pool, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+        }
+    }
+    secondaries.reserve(maxTasks);
+
+    cout << "Recording threads: " << maxTasks << endl;
+}
+
+ParallelRecorder::~ParallelRecorder() {
+    // Pools are destroyed directly, their buffers may still be executing
+    if (deviceRef) {
+        deviceRef->waitIdle();
+    }
+}
+
+uint32_t ParallelRecorder::taskCount(size_t drawCount) const {
+    size_t tasks = drawCount / minDrawsPerTask;
+    return static_cast<uint32_t>(clamp<size_t>(tasks, 1, maxTasks));
+}
+
+void ParallelRecorder::record(Renderer& renderer, const RenderGraph::PassContext& pass,
+                              size_t drawCount, const RecordRange& recordRange) {
+    uint32_t tasks = taskCount(drawCount);
+    auto& slot = contexts[renderer.frameSlot()];
+    vulkan::RenderTarget target = pass.target;
+    VkFramebuffer framebuffer = pass.framebuffer;
+    VkExtent2D extent = pass.extent;
+
+    // beginFrame waited for this slot's previous frame, so its pools are idle
+    threadPool->parallelFor(tasks, [&](uint32_t task) {
+        TaskContext& context = slot[task];
+        context.pool->reset();
+
+        // Contiguous near-equal ranges, executed in order so draw order is kept
+        size_t first = drawCount * task / tasks;
+        size_t last = drawCount * (task + 1) / tasks;
+
+        auto& cmd = *context.buffer;
+        cmd.beginSecondary(target, framebuffer);
+        context.encoder.begin(cmd.handle());
+        // Dynamic state is not inherited from the primary
+        context.encoder.setViewport(0, 0, static_cast<float>(extent.width), static_cast<float>(extent.height));
+        context.encoder.setScissor(0, 0, extent.width, extent.height);
+        recordRange(context.encoder, first, last - first);
+        cmd.end();
+    });
+
+    secondaries.clear();
+    for (uint32_t task = 0; task < tasks; task++) {
+        secondaries.push_back(slot[task].buffer->handle());
+        renderer.addEncoderStats(slot[task].encoder.stats());
+    }
+    renderer.commandBuffer().executeCommands(secondaries.data(), static_cast<uint32_t>(secondaries.size()));
+    // Executed secondaries leave the primary's bound state undefined
+    pass.encoder.invalidate();
+}
+
+} // namespace anim::renderer
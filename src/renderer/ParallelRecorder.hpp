@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Renderer.hpp"
+#include "../core/ThreadPool.hpp"
+#include "../vulkan/Device.hpp"
+#include "../vulkan/CommandPool.hpp"
+#include "../vulkan/CommandBuffer.hpp"
+#include "../vulkan/CommandEncoder.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Records a frame's draw list on a thread pool. The list is split into
+// contiguous ranges, each recorded into a secondary command buffer that
+// continues a render graph pass, and the primary executes them in order.
+// Every range has its own transient command pool per frame slot, so workers
+// never share a pool and a slot's pools are reset in one call once it is reused.
+class ParallelRecorder {
+public:
+    using RecordRange = function<void(vulkan::CommandEncoder& encoder, size_t first, size_t count)>;
+
+    // minDrawsPerTask keeps small lists on one thread, where splitting costs
+    // more than it saves
+    ParallelRecorder(vulkan::Device& device, core::ThreadPool& threadPool,
+                     uint32_t framesInFlight, size_t minDrawsPerTask = 1024);
+    ~ParallelRecorder();
+
+    // Non-copyable
+    ParallelRecorder(const ParallelRecorder&) = delete;
+    ParallelRecorder& operator=(const ParallelRecorder&) = delete;
+
+    // Whether a list of drawCount draws is split, then the pass recording
+    // them must declare secondaryCommandBuffers()
+    bool shouldSplit(size_t drawCount) const { return taskCount(drawCount) > 1; }
+
+    // Call from the execute function of such a pass. recordRange is called
+    // concurrently with disjoint ranges and must bind its own pipeline and
+    // descriptors. The encoders' counts are added to the renderer's stats.
+    void record(Renderer& renderer, const RenderGraph::PassContext& pass,
+                size_t drawCount, const RecordRange& recordRange);
+
+private:
+    struct TaskContext {
+        unique_ptr<vulkan::CommandPool> pool;
+        unique_ptr<vulkan::CommandBuffer> buffer;
+        vulkan::CommandEncoder encoder;
+    };
+
+    uint32_t taskCount(size_t drawCount) const;
+
+    vulkan::Device* deviceRef;
+    core::ThreadPool* threadPool;
+    size_t minDrawsPerTask;
+    uint32_t maxTasks;
+
+    // Indexed [frame slot][task]
+    vector<vector<TaskContext>> contexts;
+    vector<VkCommandBuffer> secondaries;
+};
+
+} // namespace anim::renderer
@@ -0,0 +1,59 @@
+#include "RadixSort.hpp"
+
+#include <algorithm>
+#include <array>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Below this many keys the histograms cost more than a comparison sort
+static constexpr size_t RADIX_MIN_KEYS = 256;
+
+void radixSort(vector<uint64_t>& keys, vector<uint64_t>& scratch) {
+    size_t count = keys.size();
+    if (count < RADIX_MIN_KEYS) {
+        sort(keys.begin(), keys.end());
+        return;
+    }
+
+    // Histograms of all 8 bytes in one read of the keys
+    array<array<size_t, 256>, 8> histograms{};
+    for (uint64_t key : keys) {
+        for (int digit = 0; digit < 8; digit++) {
+            histograms[digit][(key >> (digit * 8)) & 0xFF]++;
+        }
+    }
+
+    scratch.resize(count);
+    uint64_t* src = keys.data();
+    uint64_t* dst = scratch.data();
+
+    for (int digit = 0; digit < 8; digit++) {
+        auto& histogram = histograms[digit];
+        if (histogram[(src[0] >> (digit * 8)) & 0xFF] == count) {
+            continue;  // Every key has this byte, the pass would not move anything
+        }
+
+        // Exclusive prefix sum gives each byte value its first output slot
+        size_t offset = 0;
+        for (size_t& bucket : histogram) {
+            size_t n = bucket;
+            bucket = offset;
+            offset += n;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            uint64_t key = src[i];
+            dst[histogram[(key >> (digit * 8)) & 0xFF]++] = key;
+        }
+        swap(src, dst);
+    }
+
+    // An odd number of passes leaves the result in scratch
+    if (src != keys.data()) {
+        keys.swap(scratch);
+    }
+}
+
+} // namespace anim::renderer
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Sorts keys ascending with a least-significant-digit radix sort over bytes.
+// Bytes that are equal in every key are skipped, sort keys usually leave most
+// of them unused. scratch is working memory, keep it around between calls.
+void radixSort(vector<uint64_t>& keys, vector<uint64_t>& scratch);
+
+} // namespace anim::renderer
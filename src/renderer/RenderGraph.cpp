@@ -0,0 +1,723 @@
+#include "RenderGraph.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Framebuffers not used for this many frames are destroyed, which covers
+// every frame slot's color target and images replaced on resize
+static constexpr uint64_t FRAMEBUFFER_RETIRE_FRAMES = 8;
+
+static constexpr VkAccessFlags2 WRITE_ACCESS =
+    VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT;
+
+struct AccessInfo {
+    VkImageLayout layout;
+    VkPipelineStageFlags2 stages;
+    VkAccessFlags2 access;
+    bool writes;
+};
+
+// Every stage and access bit used here has the same value in the original
+// flags, so the table serves both barrier paths
+static AccessInfo accessInfo(ImageAccess access) {
+    switch (access) {
+        case ImageAccess::ColorAttachment:
+            return {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, true};
+        case ImageAccess::DepthAttachment:
+            return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                    VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, true};
+        case ImageAccess::SampledGraphics:
+            return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT, false};
+        case ImageAccess::SampledCompute:
+            return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT, false};
+        case ImageAccess::StorageCompute:
+            return {VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT, true};
+        case ImageAccess::TransferSrc:
+            return {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    VK_ACCESS_2_TRANSFER_READ_BIT, false};
+        case ImageAccess::TransferDst:
+            return {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    VK_ACCESS_2_TRANSFER_WRITE_BIT, true};
+    }
+    throw runtime_error("Unknown image access");
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::read(ImageHandle image, ImageAccess access) {
+    if (accessInfo(access).writes) {
+        throw runtime_error("Render graph read declared with a writing access");
+    }
+    graph->passes[pass].uses.push_back({image, access});
+    return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::write(ImageHandle image, ImageAccess access) {
+    if (!accessInfo(access).writes) {
+        throw runtime_error("Render graph write declared with a read-only access");
+    }
+    graph->passes[pass].uses.push_back({image, access});
+    return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::colorAttachment(ImageHandle image, optional<VkClearColorValue> clear) {
+    Attachment attachment{image, nullopt};
+    if (clear) {
+        VkClearValue value{};
+        value.color = *clear;
+        attachment.clear = value;
+    }
+    graph->passes[pass].color = attachment;
+    graph->passes[pass].uses.push_back({image, ImageAccess::ColorAttachment, clear.has_value()});
+    return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::depthAttachment(ImageHandle image, optional<float> clear) {
+    Attachment attachment{image, nullopt};
+    if (clear) {
+        VkClearValue value{};
+        value.depthStencil = {*clear, 0};
+        attachment.clear = value;
+    }
+    graph->passes[pass].depth = attachment;
+    graph->passes[pass].uses.push_back({image, ImageAccess::DepthAttachment, clear.has_value()});
+    return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::secondaryCommandBuffers(bool enabled) {
+    graph->passes[pass].secondary = enabled;
+    return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::viewMask(uint32_t mask) {
+    graph->passes[pass].viewMask = mask;
+    return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::sideEffects() {
+    graph->passes[pass].sideEffects = true;
+    return *this;
+}
+
+RenderGraph::RenderGraph(vulkan::Device& device)
+    : deviceRef(&device)
+    , synchronization2(device.features().synchronization2)
+    , dynamicRendering(device.features().dynamicRendering) {
+}
+
+RenderGraph::~RenderGraph() {
+    releaseTransients();
+}
+
+void RenderGraph::reset() {
+    resources.clear();
+    passes.clear();
+}
+
+RenderGraph::ImageHandle RenderGraph::importImage(const string& name, const vulkan::Image& image,
+                                                  VkImageLayout initialLayout, ImageAccess finalAccess) {
+    Resource resource;
+    resource.name = name;
+    resource.imported = &image;
+    resource.initialLayout = initialLayout;
+    resource.initialState.layout = initialLayout;
+    resource.finalAccess = finalAccess;
+    resources.push_back(resource);
+    return static_cast<ImageHandle>(resources.size() - 1);
+}
+
+RenderGraph::ImageHandle RenderGraph::importImage(const string& name, const vulkan::Image& image,
+                                                  ImageAccess previousAccess, ImageAccess finalAccess) {
+    AccessInfo info = accessInfo(previousAccess);
+    ImageHandle handle = importImage(name, image, info.layout, finalAccess);
+    ImageState& state = resources[handle].initialState;
+    if (info.writes) {
+        state.writeStages = info.stages;
+        state.writeAccess = info.access & WRITE_ACCESS;
+    } else {
+        state.readStages = info.stages;
+    }
+    return handle;
+}
+
+RenderGraph::ImageHandle RenderGraph::createImage(const string& name, const GraphImageDesc& desc) {
+    Resource resource;
+    resource.name = name;
+    resource.desc = desc;
+    resources.push_back(resource);
+    return static_cast<ImageHandle>(resources.size() - 1);
+}
+
+RenderGraph::PassBuilder RenderGraph::addPass(const string& name, Execute execute) {
+    Pass pass;
+    pass.name = name;
+    pass.execute = move(execute);
+    passes.push_back(move(pass));
+    return PassBuilder(*this, static_cast<uint32_t>(passes.size() - 1));
+}
+
+bool RenderGraph::isWritten(ImageHandle image) const {
+    for (const auto& pass : passes) {
+        for (const auto& use : pass.uses) {
+            if (use.image == image && accessInfo(use.access).writes) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+const vulkan::Image& RenderGraph::image(ImageHandle image) const {
+    const Resource& resource = resources.at(image);
+    if (resource.imported) {
+        return *resource.imported;
+    }
+    if (resource.transient < 0) {
+        throw runtime_error("Render graph image " + resource.name + " is not used by any pass");
+    }
+    return *placed[resource.transient].image;
+}
+
+void RenderGraph::execute(vulkan::CommandEncoder& encoder) {
+    executeCount++;
+    frameStats = {};
+    frameStats.passes = static_cast<uint32_t>(passes.size());
+
+    cull();
+    computeLifetimes();
+    placeTransients();
+
+    for (uint32_t i = 0; i < passes.size(); i++) {
+        if (!passes[i].culled) {
+            executePass(passes[i], i, encoder);
+        }
+    }
+    recordFinalBarriers(encoder.handle());
+    // Barriers recorded on the buffer directly
+    encoder.invalidate();
+
+    framebuffers.erase(remove_if(framebuffers.begin(), framebuffers.end(), [this](const CachedFramebuffer& cached) {
+        return cached.lastUsed + FRAMEBUFFER_RETIRE_FRAMES < executeCount;
+    }), framebuffers.end());
+
+    lastStats = frameStats;
+}
+
+void RenderGraph::cull() {
+    // Walk back from what leaves the frame: imported images and side effects.
+    // An image stops being needed above a pass that clears it.
+    vector<bool> needed(resources.size(), false);
+    for (size_t i = passes.size(); i-- > 0;) {
+        Pass& pass = passes[i];
+        bool alive = pass.sideEffects;
+        for (const auto& use : pass.uses) {
+            const Resource& resource = resources.at(use.image);
+            if (accessInfo(use.access).writes && (resource.imported || needed[use.image])) {
+                alive = true;
+            }
+        }
+
+        pass.culled = !alive;
+        if (!alive) {
+            frameStats.culledPasses++;
+            continue;
+        }
+        for (const auto& use : pass.uses) {
+            needed[use.image] = !use.discards;
+        }
+    }
+}
+
+void RenderGraph::computeLifetimes() {
+    for (auto& resource : resources) {
+        resource.used = false;
+        resource.started = false;
+        resource.transient = -1;
+    }
+    for (uint32_t i = 0; i < passes.size(); i++) {
+        if (passes[i].culled) {
+            continue;
+        }
+        for (const auto& use : passes[i].uses) {
+            Resource& resource = resources[use.image];
+            if (!resource.used) {
+                resource.firstPass = i;
+                resource.used = true;
+            }
+            resource.lastPass = i;
+        }
+    }
+}
+
+const VkMemoryRequirements& RenderGraph::requirementsFor(const GraphImageDesc& desc) {
+    for (const auto& [cached, requirements] : requirementCache) {
+        if (cached == desc) {
+            return requirements;
+        }
+    }
+    requirementCache.emplace_back(desc, vulkan::Image::memoryRequirements(
+        *deviceRef, desc.width, desc.height, desc.format, desc.usage, desc.layers));
+    return requirementCache.back().second;
+}
+
+void RenderGraph::placeTransients() {
+    vector<uint32_t> order;
+    for (uint32_t i = 0; i < resources.size(); i++) {
+        if (!resources[i].imported && resources[i].used) {
+            order.push_back(i);
+        }
+    }
+
+    // Interval packing: an image joins the block that grows least among those
+    // whose last image is done before it starts, or opens a new one
+    vector<uint32_t> byStart = order;
+    stable_sort(byStart.begin(), byStart.end(), [this](uint32_t a, uint32_t b) {
+        return resources[a].firstPass < resources[b].firstPass;
+    });
+
+    vector<VkMemoryRequirements> wanted;
+    vector<uint32_t> freeAfter;
+    vector<uint32_t> blockOf(resources.size(), 0);
+    for (uint32_t index : byStart) {
+        const Resource& resource = resources[index];
+        const VkMemoryRequirements& requirements = requirementsFor(resource.desc);
+
+        int32_t best = -1;
+        VkDeviceSize bestGrowth = 0;
+        for (uint32_t block = 0; block < wanted.size(); block++) {
+            if (freeAfter[block] >= resource.firstPass ||
+                (wanted[block].memoryTypeBits & requirements.memoryTypeBits) == 0) {
+                continue;
+            }
+            VkDeviceSize growth = requirements.size > wanted[block].size ? requirements.size - wanted[block].size : 0;
+            if (best < 0 || growth < bestGrowth) {
+                best = static_cast<int32_t>(block);
+                bestGrowth = growth;
+            }
+        }
+
+        if (best < 0) {
+            best = static_cast<int32_t>(wanted.size());
+            wanted.push_back(requirements);
+            freeAfter.push_back(resource.lastPass);
+        } else {
+            VkMemoryRequirements& block = wanted[best];
+            block.size = max(block.size, requirements.size);
+            block.alignment = max(block.alignment, requirements.alignment);
+            block.memoryTypeBits &= requirements.memoryTypeBits;
+            freeAfter[best] = resource.lastPass;
+        }
+        blockOf[index] = static_cast<uint32_t>(best);
+    }
+
+    // Same declarations as last time: keep the images, their memory is idle or
+    // synchronized through the blocks' last use
+    bool unchanged = placed.size() == order.size() && blocks.size() == wanted.size();
+    for (uint32_t i = 0; unchanged && i < order.size(); i++) {
+        unchanged = placed[i].desc == resources[order[i]].desc && placed[i].block == blockOf[order[i]];
+    }
+    for (uint32_t block = 0; unchanged && block < wanted.size(); block++) {
+        unchanged = blocks[block].requirements.size == wanted[block].size &&
+                    blocks[block].requirements.alignment == wanted[block].alignment &&
+                    blocks[block].requirements.memoryTypeBits == wanted[block].memoryTypeBits;
+    }
+
+    if (!unchanged) {
+        releaseTransients();
+
+        VkDeviceSize separateBytes = 0;
+        VkDeviceSize sharedBytes = 0;
+        for (const auto& requirements : wanted) {
+            VmaAllocationCreateInfo allocInfo{};
+            allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+            allocInfo.pool = deviceRef->memoryPoolFor(vulkan::MemoryClass::Transient, requirements, allocInfo.usage);
+
+            MemoryBlock block;
+            block.requirements = requirements;
+            VkResult result = vmaAllocateMemory(deviceRef->allocator(), &requirements, &allocInfo,
+                                                &block.allocation, nullptr);
+            if (result != VK_SUCCESS && allocInfo.pool != VK_NULL_HANDLE) {
+                throw runtime_error("Failed to allocate render graph memory: transient memory pool is full");
+            }
+            if (result != VK_SUCCESS) {
+                throw runtime_error("Failed to allocate render graph memory");
+            }
+            sharedBytes += requirements.size;
+            blocks.push_back(block);
+        }
+
+        for (uint32_t index : order) {
+            const GraphImageDesc& desc = resources[index].desc;
+            separateBytes += requirementsFor(desc).size;
+            placed.push_back({desc, blockOf[index], make_unique<vulkan::Image>(
+                *deviceRef, desc.width, desc.height, desc.format, desc.usage, desc.aspect,
+                blocks[blockOf[index]].allocation, 0, desc.layers)});
+        }
+
+        cout << "Render graph: " << placed.size() << " transient images in " << blocks.size()
+             << " blocks, " << sharedBytes / (1024 * 1024) << " MB ("
+             << (separateBytes - sharedBytes) / (1024 * 1024) << " MB saved by aliasing)" << endl;
+    }
+
+    for (uint32_t i = 0; i < order.size(); i++) {
+        resources[order[i]].transient = static_cast<int32_t>(i);
+    }
+}
+
+void RenderGraph::releaseTransients() {
+    // Image destruction is deferred, so is the memory under them
+    placed.clear();
+    if (!blocks.empty()) {
+        VmaAllocator allocator = deviceRef->allocator();
+        vector<VmaAllocation> allocations;
+        for (const auto& block : blocks) {
+            allocations.push_back(block.allocation);
+        }
+        deviceRef->deletionQueue().push([allocator, allocations]() {
+            for (VmaAllocation allocation : allocations) {
+                vmaFreeMemory(allocator, allocation);
+            }
+        });
+    }
+    blocks.clear();
+}
+
+void RenderGraph::recordBarriers(VkCommandBuffer cmd, const vector<ImageUse>& uses) {
+    vector<VkImageMemoryBarrier2> barriers;
+
+    for (size_t i = 0; i < uses.size(); i++) {
+        // Several uses of one image in a pass wait together
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++) {
+            seen = uses[j].image == uses[i].image;
+        }
+        if (seen) {
+            continue;
+        }
+        AccessInfo info = accessInfo(uses[i].access);
+        for (size_t j = i + 1; j < uses.size(); j++) {
+            if (uses[j].image != uses[i].image) {
+                continue;
+            }
+            AccessInfo other = accessInfo(uses[j].access);
+            if (other.layout != info.layout) {
+                throw runtime_error("Render graph pass uses " + resources[uses[i].image].name + " in two layouts");
+            }
+            info.stages |= other.stages;
+            info.access |= other.access;
+            info.writes = info.writes || other.writes;
+        }
+
+        Resource& resource = resources[uses[i].image];
+        ImageState& state = resource.state;
+        MemoryBlock* block = resource.transient >= 0 ? &blocks[placed[resource.transient].block] : nullptr;
+
+        // First use this frame: transients start over in memory that other
+        // images, or the previous frame, may have used
+        if (!resource.started) {
+            state = {};
+            if (block) {
+                state.writeStages = block->lastStages;
+                state.writeAccess = block->lastAccess;
+            } else {
+                state = resource.initialState;
+            }
+            resource.started = true;
+        }
+
+        bool transition = state.layout != info.layout;
+        bool needed = false;
+        VkPipelineStageFlags2 srcStages = 0;
+        VkAccessFlags2 srcAccess = 0;
+        if (transition || info.writes) {
+            // Writes wait for earlier reads (execution only) and writes
+            srcStages = state.writeStages | state.readStages;
+            srcAccess = state.writeAccess;
+            needed = transition || srcStages != 0;
+        } else if (state.writeStages != 0 && (info.stages & ~state.visibleStages) != 0) {
+            srcStages = state.writeStages;
+            srcAccess = state.writeAccess;
+            needed = true;
+        }
+
+        if (needed) {
+            const vulkan::Image& target = image(uses[i].image);
+            VkImageMemoryBarrier2 barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+            barrier.srcStageMask = srcStages;
+            barrier.srcAccessMask = srcAccess;
+            barrier.dstStageMask = info.stages;
+            barrier.dstAccessMask = info.access;
+            barrier.oldLayout = state.layout;
+            barrier.newLayout = info.layout;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = target.handle();
+            barrier.subresourceRange = {target.aspect(), 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS};
+            barriers.push_back(barrier);
+        }
+
+        state.layout = info.layout;
+        if (info.writes) {
+            state.writeStages = info.stages;
+            state.writeAccess = info.access & WRITE_ACCESS;
+            state.visibleStages = 0;
+            state.readStages = 0;
+        } else {
+            if (needed) {
+                state.visibleStages |= info.stages;
+            }
+            state.readStages |= info.stages;
+        }
+
+        if (block) {
+            block->lastStages = state.writeStages | state.readStages;
+            block->lastAccess = state.writeAccess;
+        }
+    }
+
+    submitBarriers(cmd, barriers);
+}
+
+void RenderGraph::recordFinalBarriers(VkCommandBuffer cmd) {
+    // Imported images are handed back ready for their next use, even when no
+    // pass touched them
+    for (ImageHandle handle = 0; handle < resources.size(); handle++) {
+        Resource& resource = resources[handle];
+        if (resource.imported) {
+            recordBarriers(cmd, {{handle, resource.finalAccess}});
+        }
+    }
+}
+
+void RenderGraph::submitBarriers(VkCommandBuffer cmd, const vector<VkImageMemoryBarrier2>& barriers) {
+    if (barriers.empty()) {
+        return;
+    }
+    frameStats.barriers += static_cast<uint32_t>(barriers.size());
+    frameStats.barrierBatches++;
+
+    if (synchronization2) {
+        VkDependencyInfo dependency{};
+        dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dependency.imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size());
+        dependency.pImageMemoryBarriers = barriers.data();
+        vkCmdPipelineBarrier2(cmd, &dependency);
+        return;
+    }
+
+    // One command for the whole batch, the stage masks are merged
+    VkPipelineStageFlags srcStages = 0;
+    VkPipelineStageFlags dstStages = 0;
+    vector<VkImageMemoryBarrier> legacy;
+    for (const auto& barrier : barriers) {
+        srcStages |= static_cast<VkPipelineStageFlags>(barrier.srcStageMask);
+        dstStages |= static_cast<VkPipelineStageFlags>(barrier.dstStageMask);
+
+        VkImageMemoryBarrier converted{};
+        converted.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        converted.srcAccessMask = static_cast<VkAccessFlags>(barrier.srcAccessMask);
+        converted.dstAccessMask = static_cast<VkAccessFlags>(barrier.dstAccessMask);
+        converted.oldLayout = barrier.oldLayout;
+        converted.newLayout = barrier.newLayout;
+        converted.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        converted.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        converted.image = barrier.image;
+        converted.subresourceRange = barrier.subresourceRange;
+        legacy.push_back(converted);
+    }
+    if (srcStages == 0) {
+        srcStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    }
+    vkCmdPipelineBarrier(cmd, srcStages, dstStages, 0, 0, nullptr, 0, nullptr,
+                         static_cast<uint32_t>(legacy.size()), legacy.data());
+}
+
+void RenderGraph::executePass(Pass& pass, uint32_t index, vulkan::CommandEncoder& encoder) {
+    VkCommandBuffer cmd = encoder.handle();
+    recordBarriers(cmd, pass.uses);
+    encoder.invalidate();
+
+    PassContext context{encoder};
+    if (!pass.color && !pass.depth) {
+        pass.execute(context);
+        return;
+    }
+
+    const vulkan::Image& sizing = image(pass.color ? pass.color->image : pass.depth->image);
+    context.extent = {sizing.width(), sizing.height()};
+    context.target.colorFormat = pass.color ? image(pass.color->image).format() : VK_FORMAT_UNDEFINED;
+    context.target.depthFormat = pass.depth ? image(pass.depth->image).format() : VK_FORMAT_UNDEFINED;
+    context.target.viewMask = pass.viewMask;
+
+    if (dynamicRendering) {
+        beginRendering(cmd, pass, index, context.extent);
+        pass.execute(context);
+        vkCmdEndRendering(cmd);
+        return;
+    }
+
+    vulkan::RenderPass& renderPass = renderPassFor(pass, index);
+    context.target.renderPass = renderPass.handle();
+    context.framebuffer = framebufferFor(renderPass, pass, context.extent);
+    beginRenderPass(cmd, pass, context);
+    pass.execute(context);
+    vkCmdEndRenderPass(cmd);
+}
+
+void RenderGraph::beginRendering(VkCommandBuffer cmd, const Pass& pass, uint32_t index, VkExtent2D extent) {
+    auto attachmentInfo = [this, index](const Attachment& attachment, VkImageLayout layout) {
+        vulkan::AttachmentOps ops = opsFor(attachment, index);
+        VkRenderingAttachmentInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        info.imageView = image(attachment.image).view();
+        info.imageLayout = layout;
+        info.loadOp = ops.loadOp;
+        info.storeOp = ops.storeOp;
+        info.clearValue = attachment.clear.value_or(VkClearValue{});
+        return info;
+    };
+
+    VkRenderingAttachmentInfo colorInfo{};
+    VkRenderingAttachmentInfo depthInfo{};
+    if (pass.color) {
+        colorInfo = attachmentInfo(*pass.color, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    }
+    if (pass.depth) {
+        depthInfo = attachmentInfo(*pass.depth, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    }
+
+    VkRenderingInfo renderingInfo{};
+    renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    renderingInfo.flags = pass.secondary ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0;
+    renderingInfo.renderArea.offset = {0, 0};
+    renderingInfo.renderArea.extent = extent;
+    renderingInfo.layerCount = 1;
+    renderingInfo.viewMask = pass.viewMask;
+    renderingInfo.colorAttachmentCount = pass.color ? 1 : 0;
+    renderingInfo.pColorAttachments = pass.color ? &colorInfo : nullptr;
+    renderingInfo.pDepthAttachment = pass.depth ? &depthInfo : nullptr;
+    vkCmdBeginRendering(cmd, &renderingInfo);
+}
+
+void RenderGraph::beginRenderPass(VkCommandBuffer cmd, const Pass& pass, const PassContext& context) {
+    // Clear values are indexed by attachment, unused ones are ignored
+    vector<VkClearValue> clearValues;
+    if (pass.color) {
+        clearValues.push_back(pass.color->clear.value_or(VkClearValue{}));
+    }
+    if (pass.depth) {
+        clearValues.push_back(pass.depth->clear.value_or(VkClearValue{}));
+    }
+
+    VkRenderPassBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    beginInfo.renderPass = context.target.renderPass;
+    beginInfo.framebuffer = context.framebuffer;
+    beginInfo.renderArea.offset = {0, 0};
+    beginInfo.renderArea.extent = context.extent;
+    beginInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+    beginInfo.pClearValues = clearValues.data();
+
+    vkCmdBeginRenderPass(cmd, &beginInfo, pass.secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                                                         : VK_SUBPASS_CONTENTS_INLINE);
+}
+
+bool RenderGraph::isUsedAfter(ImageHandle image, uint32_t pass) const {
+    const Resource& resource = resources[image];
+    return resource.imported || resource.lastPass > pass;
+}
+
+bool RenderGraph::isWrittenBefore(ImageHandle image, uint32_t pass) const {
+    const Resource& resource = resources[image];
+    if (resource.imported && resource.initialLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+        return true;
+    }
+    for (uint32_t i = resource.firstPass; i < pass; i++) {
+        if (passes[i].culled) {
+            continue;
+        }
+        for (const auto& use : passes[i].uses) {
+            if (use.image == image && accessInfo(use.access).writes) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+vulkan::AttachmentOps RenderGraph::opsFor(const optional<Attachment>& attachment, uint32_t pass) const {
+    // Load what earlier passes drew, store what later passes or the caller use
+    vulkan::AttachmentOps ops;
+    if (!attachment) {
+        return ops;
+    }
+    if (attachment->clear) {
+        ops.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    } else if (isWrittenBefore(attachment->image, pass)) {
+        ops.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    }
+    ops.storeOp = isUsedAfter(attachment->image, pass) ? VK_ATTACHMENT_STORE_OP_STORE
+                                                       : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    return ops;
+}
+
+vulkan::RenderPass& RenderGraph::renderPassFor(const Pass& pass, uint32_t index) {
+    VkFormat colorFormat = pass.color ? image(pass.color->image).format() : VK_FORMAT_UNDEFINED;
+    VkFormat depthFormat = pass.depth ? image(pass.depth->image).format() : VK_FORMAT_UNDEFINED;
+    vulkan::AttachmentOps colorOps = opsFor(pass.color, index);
+    vulkan::AttachmentOps depthOps = opsFor(pass.depth, index);
+
+    for (auto& cached : renderPasses) {
+        if (cached.colorFormat == colorFormat && cached.depthFormat == depthFormat &&
+            cached.colorOps.loadOp == colorOps.loadOp && cached.colorOps.storeOp == colorOps.storeOp &&
+            cached.depthOps.loadOp == depthOps.loadOp && cached.depthOps.storeOp == depthOps.storeOp &&
+            cached.viewMask == pass.viewMask) {
+            return *cached.renderPass;
+        }
+    }
+
+    renderPasses.push_back({colorFormat, depthFormat, colorOps, depthOps, pass.viewMask,
+                            make_unique<vulkan::RenderPass>(*deviceRef, colorFormat, depthFormat, colorOps, depthOps,
+                                                            pass.viewMask)});
+    return *renderPasses.back().renderPass;
+}
+
+VkFramebuffer RenderGraph::framebufferFor(vulkan::RenderPass& renderPass, const Pass& pass, VkExtent2D extent) {
+    VkImageView color = pass.color ? image(pass.color->image).view() : VK_NULL_HANDLE;
+    VkImageView depth = pass.depth ? image(pass.depth->image).view() : VK_NULL_HANDLE;
+    uint64_t colorGeneration = pass.color ? image(pass.color->image).viewGeneration() : 0;
+    uint64_t depthGeneration = pass.depth ? image(pass.depth->image).viewGeneration() : 0;
+
+    for (auto& cached : framebuffers) {
+        if (cached.renderPass == renderPass.handle() &&
+            cached.color == colorGeneration && cached.depth == depthGeneration &&
+            cached.extent.width == extent.width && cached.extent.height == extent.height) {
+            cached.lastUsed = executeCount;
+            return cached.framebuffer->handle();
+        }
+    }
+
+    vector<VkImageView> attachments;
+    if (color != VK_NULL_HANDLE) {
+        attachments.push_back(color);
+    }
+    if (depth != VK_NULL_HANDLE) {
+        attachments.push_back(depth);
+    }
+    framebuffers.push_back({renderPass.handle(), colorGeneration, depthGeneration, extent, executeCount,
+                            make_unique<vulkan::Framebuffer>(*deviceRef, renderPass, attachments, extent)});
+    return framebuffers.back().framebuffer->handle();
+}
+
+} // namespace anim::renderer
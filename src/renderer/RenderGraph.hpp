@@ -0,0 +1,254 @@
+#pragma once
+
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Image.hpp"
+#include "../vulkan/RenderPass.hpp"
+#include "../vulkan/Framebuffer.hpp"
+#include "../vulkan/CommandEncoder.hpp"
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <optional>
+#include <functional>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// How a pass uses an image, decides its layout and the stages that wait for it
+enum class ImageAccess {
+    ColorAttachment,   // Written as a color attachment
+    DepthAttachment,   // Depth tested and written
+    SampledGraphics,   // Sampled by fragment shaders
+    SampledCompute,    // Sampled by compute shaders
+    StorageCompute,    // Read and written by compute shaders
+    TransferSrc,
+    TransferDst
+};
+
+// A transient image, single mip and single sample
+struct GraphImageDesc {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    VkImageUsageFlags usage = 0;
+    VkImageAspectFlags aspect = 0;
+    uint32_t layers = 1;  // Barriers and attachments cover every layer
+
+    bool operator==(const GraphImageDesc& other) const = default;
+};
+
+struct RenderGraphStats {
+    uint32_t passes = 0;
+    uint32_t culledPasses = 0;
+    uint32_t barriers = 0;       // Image barriers
+    uint32_t barrierBatches = 0; // Barrier commands they were recorded in
+};
+
+// Records a frame as a list of passes that declare the images they read and
+// write. Each frame the graph is declared again, then execute() drops passes
+// whose results nothing uses, records the passes left in order with the
+// barriers between them, and begins rendering around the graphics ones:
+// dynamic rendering where the device supports it, a render pass otherwise.
+//
+// Transient images live only within the frame. Those whose passes do not
+// overlap are placed in the same memory, which is kept for the next frames
+// as long as the graph declares the same images.
+class RenderGraph {
+public:
+    using ImageHandle = uint32_t;
+
+    struct PassContext {
+        vulkan::CommandEncoder& encoder;     // Forgotten state at the start of each pass
+        vulkan::RenderTarget target;         // Graphics passes only
+        VkFramebuffer framebuffer = VK_NULL_HANDLE;  // Render pass path only
+        VkExtent2D extent = {0, 0};
+    };
+    using Execute = function<void(PassContext& context)>;
+
+    // Declares what one pass touches, returned by addPass
+    class PassBuilder {
+    public:
+        PassBuilder& read(ImageHandle image, ImageAccess access);
+        PassBuilder& write(ImageHandle image, ImageAccess access);
+        // Makes this a graphics pass. Without a clear value the attachment
+        // keeps what earlier passes drew.
+        PassBuilder& colorAttachment(ImageHandle image, optional<VkClearColorValue> clear = nullopt);
+        PassBuilder& depthAttachment(ImageHandle image, optional<float> clear = nullopt);
+        // Draws are recorded in secondary command buffers the pass executes
+        PassBuilder& secondaryCommandBuffers(bool enabled = true);
+        // Multiview: every draw renders into each layer in the mask, the
+        // attachments need that many layers (Device::features().maxMultiviewViews)
+        PassBuilder& viewMask(uint32_t mask);
+        // Never culled, for passes with results the graph does not track
+        // (buffers, queries, images owned elsewhere)
+        PassBuilder& sideEffects();
+
+    private:
+        friend class RenderGraph;
+        PassBuilder(RenderGraph& graph, uint32_t pass) : graph(&graph), pass(pass) {}
+
+        RenderGraph* graph;
+        uint32_t pass;
+    };
+
+    explicit RenderGraph(vulkan::Device& device);
+    ~RenderGraph();
+
+    // Non-copyable
+    RenderGraph(const RenderGraph&) = delete;
+    RenderGraph& operator=(const RenderGraph&) = delete;
+
+    // Starts declaring the next frame, earlier handles become invalid
+    void reset();
+
+    // An image that outlives the frame, starting in initialLayout. Earlier use
+    // must be complete or synchronized by the caller. The frame leaves it ready
+    // for finalAccess.
+    ImageHandle importImage(const string& name, const vulkan::Image& image,
+                            VkImageLayout initialLayout, ImageAccess finalAccess);
+    // An image kept across frames, last used by the previous frame with
+    // previousAccess. Its first use this frame waits for that one.
+    ImageHandle importImage(const string& name, const vulkan::Image& image,
+                            ImageAccess previousAccess, ImageAccess finalAccess);
+    // An image that lives within the frame, it starts undefined
+    ImageHandle createImage(const string& name, const GraphImageDesc& desc);
+
+    PassBuilder addPass(const string& name, Execute execute);
+
+    // Whether a pass declared so far writes the image
+    bool isWritten(ImageHandle image) const;
+
+    // Culls, places transient images and records the frame
+    void execute(vulkan::CommandEncoder& encoder);
+
+    // Transient images exist once execute has started, use from a pass
+    const vulkan::Image& image(ImageHandle image) const;
+
+    // Of the last execute
+    const RenderGraphStats& stats() const { return lastStats; }
+
+private:
+    struct ImageUse {
+        ImageHandle image;
+        ImageAccess access;
+        bool discards = false;  // Cleared attachment, earlier contents are not needed
+    };
+
+    struct Attachment {
+        ImageHandle image;
+        optional<VkClearValue> clear;
+    };
+
+    struct Pass {
+        string name;
+        Execute execute;
+        vector<ImageUse> uses;
+        optional<Attachment> color;
+        optional<Attachment> depth;
+        bool secondary = false;
+        uint32_t viewMask = 0;
+        bool sideEffects = false;
+        bool culled = false;
+    };
+
+    // Where a resource stands between passes while the frame is recorded
+    struct ImageState {
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags2 writeStages = 0;    // Last write, 0 once none is pending
+        VkAccessFlags2 writeAccess = 0;
+        VkPipelineStageFlags2 visibleStages = 0;  // Already waited for the last write
+        VkPipelineStageFlags2 readStages = 0;     // Read since the last write
+    };
+
+    struct Resource {
+        string name;
+        const vulkan::Image* imported = nullptr;
+        VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        ImageAccess finalAccess = ImageAccess::TransferSrc;
+        ImageState initialState; // Imported only
+        GraphImageDesc desc;    // Transient only
+        int32_t transient = -1; // Index into placed
+        uint32_t firstPass = 0; // Lifetime over the passes that were kept
+        uint32_t lastPass = 0;
+        bool used = false;
+        bool started = false;   // Touched by a barrier this frame
+        ImageState state;
+    };
+
+    // Memory shared by transient images with disjoint lifetimes
+    struct MemoryBlock {
+        VkMemoryRequirements requirements{};
+        VmaAllocation allocation = VK_NULL_HANDLE;
+        // Last use in recording order, the next image placed here waits for it
+        VkPipelineStageFlags2 lastStages = 0;
+        VkAccessFlags2 lastAccess = 0;
+    };
+
+    struct PlacedImage {
+        GraphImageDesc desc;
+        uint32_t block;
+        unique_ptr<vulkan::Image> image;
+    };
+
+    struct CachedRenderPass {
+        VkFormat colorFormat;
+        VkFormat depthFormat;
+        vulkan::AttachmentOps colorOps;
+        vulkan::AttachmentOps depthOps;
+        uint32_t viewMask;
+        unique_ptr<vulkan::RenderPass> renderPass;
+    };
+
+    // Keyed on view generations, a recreated image may get a destroyed view's handle back
+    struct CachedFramebuffer {
+        VkRenderPass renderPass;
+        uint64_t color;  // Image::viewGeneration(), 0 without the attachment
+        uint64_t depth;
+        VkExtent2D extent;
+        uint64_t lastUsed;
+        unique_ptr<vulkan::Framebuffer> framebuffer;
+    };
+
+    void cull();
+    void computeLifetimes();
+    void placeTransients();
+    void releaseTransients();
+    const VkMemoryRequirements& requirementsFor(const GraphImageDesc& desc);
+    void recordBarriers(VkCommandBuffer cmd, const vector<ImageUse>& uses);
+    void recordFinalBarriers(VkCommandBuffer cmd);
+    void submitBarriers(VkCommandBuffer cmd, const vector<VkImageMemoryBarrier2>& barriers);
+    void executePass(Pass& pass, uint32_t index, vulkan::CommandEncoder& encoder);
+    void beginRendering(VkCommandBuffer cmd, const Pass& pass, uint32_t index, VkExtent2D extent);
+    void beginRenderPass(VkCommandBuffer cmd, const Pass& pass, const PassContext& context);
+    vulkan::AttachmentOps opsFor(const optional<Attachment>& attachment, uint32_t pass) const;
+    vulkan::RenderPass& renderPassFor(const Pass& pass, uint32_t index);
+    VkFramebuffer framebufferFor(vulkan::RenderPass& renderPass, const Pass& pass, VkExtent2D extent);
+    bool isUsedAfter(ImageHandle image, uint32_t pass) const;
+    bool isWrittenBefore(ImageHandle image, uint32_t pass) const;
+
+    vulkan::Device* deviceRef;
+    bool synchronization2;
+    bool dynamicRendering;
+
+    vector<Resource> resources;
+    vector<Pass> passes;
+
+    // Transient images in declaration order, reused while the declarations match
+    vector<PlacedImage> placed;
+    vector<MemoryBlock> blocks;
+    vector<pair<GraphImageDesc, VkMemoryRequirements>> requirementCache;
+
+    vector<CachedRenderPass> renderPasses;
+    vector<CachedFramebuffer> framebuffers;
+    uint64_t executeCount = 0;
+
+    RenderGraphStats frameStats;
+    RenderGraphStats lastStats;
+};
+
+} // namespace anim::renderer
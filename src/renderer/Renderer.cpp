@@ -1,42 +1,81 @@
 #include "Renderer.hpp"
+#include "vulkan/Buffer.hpp"
 
 #include <stdexcept>
+#include <cstring>
+#include <utility>
+#include <iostream>
+#include <string>
 
 using namespace std;
 
 namespace anim::renderer {
 
-Renderer::Renderer(vulkan::Device& device, vulkan::Swapchain& swapchain)
+// A hidden window may stop displaying frames, the loop goes on after this
+static constexpr uint64_t PRESENT_WAIT_TIMEOUT_NS = 100'000'000;
+
+Renderer::Renderer(vulkan::Device& device, vulkan::Swapchain& swapchain, uint32_t framesInFlight)
+    : Renderer(device, &swapchain, swapchain.extent(), swapchain.imageFormat(), framesInFlight) {
+}
+
+Renderer::Renderer(vulkan::Device& device, VkExtent2D extent, VkFormat colorFormat, uint32_t framesInFlight)
+    : Renderer(device, nullptr, extent, colorFormat, framesInFlight) {
+}
+
+Renderer::Renderer(vulkan::Device& device, vulkan::Swapchain* swapchain, VkExtent2D extent, VkFormat colorFormat,
+                   uint32_t framesInFlight)
     : device_(&device)
-    , swapchain_(&swapchain) {
+    , swapchain_(swapchain)
+    , extent_(extent)
+    , colorFormat_(colorFormat)
+    , framesInFlight_(framesInFlight)
+    , targetWidth_(extent.width)
+    , targetHeight_(extent.height) {
+    if (framesInFlight < 1 || framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+        throw runtime_error("Frames in flight must be between 1 and " + to_string(MAX_FRAMES_IN_FLIGHT));
+    }
 
-    // Initialize clear values
-    clearValues_[0].color = {{0.39f, 0.58f, 0.93f, 1.0f}};  // Cornflower blue
-    clearValues_[1].depthStencil = {1.0f, 0};  // Far depth
+    clearColor_ = {{0.39f, 0.58f, 0.93f, 1.0f}};  // Cornflower blue
 
-    createDepthResources();
-    renderPass_ = make_unique<vulkan::RenderPass>(device, swapchain.imageFormat(), DEPTH_FORMAT);
-    createFramebuffers();
+    // The scene renders offscreen and is blitted to the swapchain after acquire,
+    // headless frames stay in the offscreen targets.
+    // The graph's scene passes share these formats, so pipelines made for this
+    // target work with all of them. Without dynamic rendering they need a
+    // render pass, any compatible one will do.
+    renderTarget_.colorFormat = colorFormat;
+    renderTarget_.depthFormat = DEPTH_FORMAT;
+    if (!device.features().dynamicRendering) {
+        renderPass_ = make_unique<vulkan::RenderPass>(device, colorFormat, DEPTH_FORMAT,
+                                                      VK_IMAGE_LAYOUT_UNDEFINED,
+                                                      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        renderTarget_.renderPass = renderPass_->handle();
+    }
+    createColorTargets();
+    graph_ = make_unique<RenderGraph>(device);
 
     commandPool_ = make_unique<vulkan::CommandPool>(device, device.graphicsQueueFamily());
 
-    // Create command buffers per swapchain image (indexed by imageIndex_)
-    uint32_t imageCount = swapchain.imageCount();
-    for (uint32_t i = 0; i < imageCount; i++) {
+    // Command buffers and imageAvailable semaphores: per frame-in-flight (indexed by currentFrame_)
+    // A slot is reused only after the timeline shows its previous frame completed
+    for (uint32_t i = 0; i < framesInFlight_; i++) {
         commandBuffers_.push_back(make_unique<vulkan::CommandBuffer>(*commandPool_));
+        if (swapchain_) {
+            presentCommandBuffers_.push_back(make_unique<vulkan::CommandBuffer>(*commandPool_));
+            imageAvailableSemaphores_.push_back(make_unique<vulkan::Semaphore>(device));
+        }
     }
 
-    // imageAvailable semaphores and fences: per frame-in-flight (indexed by currentFrame_)
-    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        imageAvailableSemaphores_.push_back(make_unique<vulkan::Semaphore>(device));
-        inFlightFences_.push_back(make_unique<vulkan::Fence>(device, true));  // Start signaled
+    if (swapchain_) {
+        createPresentSemaphores();
     }
 
-    // renderFinished semaphores: per swapchain image (indexed by imageIndex_)
-    // Safe to reuse when that image is re-acquired
-    for (uint32_t i = 0; i < imageCount; i++) {
-        renderFinishedSemaphores_.push_back(make_unique<vulkan::Semaphore>(device));
-    }
+    frameTimeline_ = make_unique<vulkan::TimelineSemaphore>(device, 0);
+
+    // Resources released while recording frame N are destroyed once it completes
+    device.deletionQueue().setSubmissionValue(frameNumber_ + 1);
+
+    cout << "Frames in flight: " << framesInFlight_ << endl;
+    cout << "Rendering: " << (renderTarget_.dynamic() ? "dynamic" : "render passes") << endl;
 }
 
 Renderer::~Renderer() {
@@ -45,104 +84,313 @@ Renderer::~Renderer() {
     }
 }
 
-void Renderer::createDepthResources() {
-    VkExtent2D extent = swapchain_->extent();
-    depthImage_ = make_unique<vulkan::Image>(
-        *device_, extent.width, extent.height, DEPTH_FORMAT,
-        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-        VK_IMAGE_ASPECT_DEPTH_BIT
-    );
+void Renderer::createColorTargets() {
+    // One offscreen color target per frame slot, so a frame can render while
+    // the previous one is still being blitted to the swapchain
+    colorTargets_.clear();
+    for (uint32_t i = 0; i < framesInFlight_; i++) {
+        colorTargets_.push_back(make_unique<vulkan::Image>(
+            *device_, extent_.width, extent_.height, colorFormat_,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_SAMPLE_COUNT_1_BIT,
+            vulkan::MemoryClass::Transient
+        ));
+    }
+}
+
+void Renderer::createPresentSemaphores() {
+    // renderFinished semaphores: per swapchain image (indexed by imageIndex_)
+    // Safe to reuse when that image is re-acquired
+    renderFinishedSemaphores_.clear();
+    for (uint32_t i = 0; i < swapchain_->imageCount(); i++) {
+        renderFinishedSemaphores_.push_back(make_unique<vulkan::Semaphore>(*device_));
+    }
 }
 
-void Renderer::createFramebuffers() {
-    framebuffers_.clear();
-    for (auto view : swapchain_->imageViews()) {
-        vector<VkImageView> attachments = {view, depthImage_->view()};
-        framebuffers_.push_back(
-            make_unique<vulkan::Framebuffer>(*device_, *renderPass_, attachments, swapchain_->extent())
-        );
+void Renderer::resizeTargets() {
+    // No waitIdle: the old swapchain, color targets and semaphores are retired
+    // through the deletion queue while in-flight frames finish. The graph
+    // replaces depth once it is declared at the new size.
+    if (swapchain_) {
+        swapchain_->recreate(targetWidth_, targetHeight_);
+        extent_ = swapchain_->extent();
+        createPresentSemaphores();
+    } else {
+        extent_ = {targetWidth_, targetHeight_};
     }
+    createColorTargets();
+    resizePending_ = false;
 }
 
 bool Renderer::beginFrame() {
-    // Wait for this frame slot's previous work to complete
-    inFlightFences_[currentFrame_]->wait();
+    // Wait for the frame that last used this slot to complete
+    if (frameNumber_ >= framesInFlight_) {
+        waitForFrame(frameNumber_ - framesInFlight_);
+    }
 
-    // Acquire next swapchain image using currentFrame_'s semaphore
-    VkResult result = swapchain_->acquireNextImage(
-        imageAvailableSemaphores_[currentFrame_]->handle(), &imageIndex_);
+    // Destroy resources released by frames that have completed
+    device_->deletionQueue().collect(frameTimeline_->value());
 
-    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-        return false;
-    }
+    // Refresh memory budget so loaders can back off before the driver pages
+    device_->updateMemoryBudget(static_cast<uint32_t>(frameNumber_));
 
-    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-        throw runtime_error("Failed to acquire swapchain image");
+    // Apply the latest requested size once, however many resize events arrived
+    if (resizePending_) {
+        if (targetWidth_ == 0 || targetHeight_ == 0) {
+            return false;  // Minimized
+        }
+        resizeTargets();
     }
 
-    // Reset fence only after we know we'll submit work
-    inFlightFences_[currentFrame_]->reset();
     frameStarted_ = true;
+    scenePassAdded_ = false;
 
-    // Begin recording commands (command buffer indexed by imageIndex_)
-    auto& cmd = *commandBuffers_[imageIndex_];
+    // Record the scene into this slot's offscreen target, no swapchain image needed yet
+    auto& cmd = *commandBuffers_[currentFrame_];
     cmd.reset();
     cmd.begin();
-    cmd.beginRenderPass(
-        renderPass_->handle(),
-        framebuffers_[imageIndex_]->handle(),
-        swapchain_->extent(),
-        clearValues_.data(), static_cast<uint32_t>(clearValues_.size()));
+    encoder_.begin(cmd.handle());
+    frameEncoderStats_ = {};
+
+    // The slot's last blit has completed, so the color target starts over.
+    // Depth lives within the frame.
+    VkExtent2D extent = extent_;
+    graph_->reset();
+    colorTarget_ = graph_->importImage("color", *colorTargets_[currentFrame_],
+                                       VK_IMAGE_LAYOUT_UNDEFINED, ImageAccess::TransferSrc);
+    depthTarget_ = graph_->createImage("depth", {
+        extent.width, extent.height, DEPTH_FORMAT,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_IMAGE_ASPECT_DEPTH_BIT});
 
     return true;
 }
 
+RenderGraph::PassBuilder Renderer::addScenePass(const string& name, RenderGraph::Execute execute) {
+    auto pass = graph_->addPass(name, move(execute));
+    if (scenePassAdded_) {
+        pass.colorAttachment(colorTarget_).depthAttachment(depthTarget_);
+    } else {
+        pass.colorAttachment(colorTarget_, clearColor_).depthAttachment(depthTarget_, 1.0f);  // Far depth
+        scenePassAdded_ = true;
+    }
+    return pass;
+}
+
 void Renderer::endFrame() {
     if (!frameStarted_) {
         return;
     }
 
-    // Command buffer indexed by imageIndex_
-    auto& cmd = *commandBuffers_[imageIndex_];
-    cmd.endRenderPass();
+    // Nothing drawn still presents the clear color
+    if (!scenePassAdded_) {
+        addScenePass("clear", [](RenderGraph::PassContext&) {});
+    }
+
+    auto& cmd = *commandBuffers_[currentFrame_];
+    graph_->execute(encoder_);
     cmd.end();
 
-    // imageAvailable indexed by currentFrame_, renderFinished indexed by imageIndex_
-    VkSemaphore waitSemaphores[] = {imageAvailableSemaphores_[currentFrame_]->handle()};
-    VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    VkSemaphore signalSemaphores[] = {renderFinishedSemaphores_[imageIndex_]->handle()};
-    VkCommandBuffer cmdBuf = cmd.handle();
+    encoderStats_ = frameEncoderStats_;
+    encoderStats_ += encoder_.stats();
+
+    // Nothing to present, the frame stays in this slot's color target
+    if (!swapchain_) {
+        submitFrame(&cmd, nullptr, VK_NULL_HANDLE);
+        return;
+    }
+
+    // Submit the scene first so the GPU works on it while we wait for an image
+    VkCommandBuffer sceneCmd = cmd.handle();
+    VkSubmitInfo sceneSubmit{};
+    sceneSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    sceneSubmit.commandBufferCount = 1;
+    sceneSubmit.pCommandBuffers = &sceneCmd;
+
+    if (vkQueueSubmit(device_->graphicsQueue(), 1, &sceneSubmit, VK_NULL_HANDLE) != VK_SUCCESS) {
+        throw runtime_error("Failed to submit command buffer");
+    }
+
+    // Acquire next swapchain image using currentFrame_'s semaphore
+    VkResult result = swapchain_->acquireNextImage(
+        imageAvailableSemaphores_[currentFrame_]->handle(), &imageIndex_);
+
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+        // Nothing to present, still signal the timeline so the frame retires
+        resizePending_ = true;
+        submitFrame(nullptr, nullptr, VK_NULL_HANDLE);
+        return;
+    }
+
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw runtime_error("Failed to acquire swapchain image");
+    }
+
+    // Suboptimal still signals the semaphore, present this frame and recreate next
+    if (result == VK_SUBOPTIMAL_KHR) {
+        resizePending_ = true;
+    }
+
+    // Short copy from the offscreen target into the acquired image
+    VkImage swapchainImage = swapchain_->imageHandles()[imageIndex_];
+    VkExtent2D extent = extent_;
+    auto& blit = *presentCommandBuffers_[currentFrame_];
+    blit.reset();
+    blit.begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+    // The acquire semaphore is waited on at TRANSFER (see submitFrame), so the
+    // layout transition must start there too to come after the presentation
+    // engine has released the image. TOP_OF_PIPE would not chain to the wait.
+    VkImageMemoryBarrier acquireBarrier{};
+    acquireBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    acquireBarrier.srcAccessMask = 0;
+    acquireBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    acquireBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    acquireBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    acquireBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    acquireBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    acquireBarrier.image = swapchainImage;
+    acquireBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    vkCmdPipelineBarrier(blit.handle(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &acquireBarrier);
+    blit.blitImage(colorTargets_[currentFrame_]->handle(), extent, swapchainImage, extent, VK_FILTER_NEAREST);
+    blit.transitionImageLayout(swapchainImage, swapchain_->imageFormat(),
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    blit.end();
+
+    VkSemaphore renderFinished = renderFinishedSemaphores_[imageIndex_]->handle();
+    submitFrame(&blit, imageAvailableSemaphores_[currentFrame_].get(), renderFinished);
+
+    // Present the acquired image, waiting on imageIndex_'s renderFinished semaphore
+    result = swapchain_->present(device_->presentQueue(), imageIndex_, renderFinished);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+        resizePending_ = true;
+    } else if (result != VK_SUCCESS) {
+        throw runtime_error("Failed to present swapchain image");
+    }
+}
+
+void Renderer::submitFrame(vulkan::CommandBuffer* cmd, vulkan::Semaphore* waitSemaphore,
+                           VkSemaphore signalSemaphore) {
+    // The frame timeline is signaled alongside, binary semaphores ignore their value
+    VkSemaphore signalSemaphores[] = {frameTimeline_->handle(), signalSemaphore};
+    uint64_t signalValues[] = {frameNumber_ + 1, 0};
+    uint32_t signalCount = signalSemaphore != VK_NULL_HANDLE ? 2 : 1;
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = signalCount;
+    timelineInfo.pSignalSemaphoreValues = signalValues;
+
+    VkSemaphore waitHandle = waitSemaphore ? waitSemaphore->handle() : VK_NULL_HANDLE;
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkCommandBuffer cmdBuf = cmd ? cmd->handle() : VK_NULL_HANDLE;
 
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = waitSemaphores;
-    submitInfo.pWaitDstStageMask = waitStages;
-    submitInfo.commandBufferCount = 1;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.waitSemaphoreCount = waitSemaphore ? 1 : 0;
+    submitInfo.pWaitSemaphores = &waitHandle;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = cmd ? 1 : 0;
     submitInfo.pCommandBuffers = &cmdBuf;
-    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.signalSemaphoreCount = signalCount;
     submitInfo.pSignalSemaphores = signalSemaphores;
 
-    if (vkQueueSubmit(device_->graphicsQueue(), 1, &submitInfo, inFlightFences_[currentFrame_]->handle()) != VK_SUCCESS) {
+    if (vkQueueSubmit(device_->graphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
         throw runtime_error("Failed to submit command buffer");
     }
 
-    // Present the acquired image, waiting on imageIndex_'s renderFinished semaphore
-    swapchain_->present(device_->presentQueue(), imageIndex_, renderFinishedSemaphores_[imageIndex_]->handle());
-
     frameStarted_ = false;
-    currentFrame_ = (currentFrame_ + 1) % MAX_FRAMES_IN_FLIGHT;
+    currentFrame_ = (currentFrame_ + 1) % framesInFlight_;
+    frameNumber_++;
+    device_->deletionQueue().setSubmissionValue(frameNumber_ + 1);
+}
+
+void Renderer::limitQueuedFrames(uint32_t maxQueued) {
+    if (!swapchain_) {
+        return;
+    }
+    uint64_t lastPresent = swapchain_->lastPresentId();
+    if (lastPresent > maxQueued) {
+        swapchain_->waitForPresent(lastPresent - maxQueued, PRESENT_WAIT_TIMEOUT_NS);
+    }
+}
+
+vector<uint8_t> Renderer::readFrame() {
+    if (frameNumber_ == 0) {
+        throw runtime_error("No frame to read back");
+    }
+
+    bool bgra = colorFormat_ == VK_FORMAT_B8G8R8A8_SRGB || colorFormat_ == VK_FORMAT_B8G8R8A8_UNORM;
+    if (!bgra && colorFormat_ != VK_FORMAT_R8G8B8A8_SRGB && colorFormat_ != VK_FORMAT_R8G8B8A8_UNORM) {
+        throw runtime_error("Readback needs an 8-bit RGBA or BGRA color target");
+    }
+
+    // The last frame's target stays in TRANSFER_SRC until its slot records again
+    waitForFrame(frameNumber_ - 1);
+    uint32_t slot = (currentFrame_ + framesInFlight_ - 1) % framesInFlight_;
+    const vulkan::Image& target = *colorTargets_[slot];
+
+    VkDeviceSize size = static_cast<VkDeviceSize>(extent_.width) * extent_.height * 4;
+    vulkan::Buffer staging(*device_, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+
+    vulkan::CommandBuffer cmd(*commandPool_);
+    cmd.begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    cmd.copyImageToBuffer(target.handle(), staging.handle(), extent_.width, extent_.height);
+    cmd.end();
+
+    VkCommandBuffer cmdHandle = cmd.handle();
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmdHandle;
+    if (vkQueueSubmit(device_->graphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+        throw runtime_error("Failed to submit readback");
+    }
+    vkQueueWaitIdle(device_->graphicsQueue());
+
+    vector<uint8_t> pixels(size);
+    staging.invalidate();
+    memcpy(pixels.data(), staging.map(), size);
+    staging.unmap();
+
+    if (bgra) {
+        for (size_t i = 0; i < pixels.size(); i += 4) {
+            swap(pixels[i], pixels[i + 2]);
+        }
+    }
+    return pixels;
 }
 
 void Renderer::handleResize(uint32_t width, uint32_t height) {
-    device_->waitIdle();
-    swapchain_->recreate(width, height);
-    createDepthResources();
-    createFramebuffers();
+    targetWidth_ = width;
+    targetHeight_ = height;
+    resizePending_ = true;
+}
+
+vulkan::RenderTarget Renderer::multiviewTarget(uint32_t viewMask) {
+    vulkan::RenderTarget target = renderTarget_;
+    target.viewMask = viewMask;
+    if (target.dynamic()) {
+        return target;
+    }
+
+    // Render passes are compatible when formats and view masks match, the ops do not matter
+    for (const auto& [mask, renderPass] : multiviewPasses_) {
+        if (mask == viewMask) {
+            target.renderPass = renderPass->handle();
+            return target;
+        }
+    }
+    multiviewPasses_.emplace_back(viewMask, make_unique<vulkan::RenderPass>(
+        *device_, colorFormat_, DEPTH_FORMAT, vulkan::AttachmentOps{}, vulkan::AttachmentOps{}, viewMask));
+    target.renderPass = multiviewPasses_.back().second->handle();
+    return target;
 }
 
 void Renderer::setClearColor(float r, float g, float b, float a) {
-    clearValues_[0].color = {{r, g, b, a}};
+    clearColor_ = {{r, g, b, a}};
 }
 
 } // namespace anim::renderer
@@ -5,13 +5,14 @@
 #include "vulkan/Sync.hpp"
 #include "vulkan/CommandPool.hpp"
 #include "vulkan/CommandBuffer.hpp"
+#include "vulkan/CommandEncoder.hpp"
 #include "vulkan/RenderPass.hpp"
-#include "vulkan/Framebuffer.hpp"
 #include "vulkan/Image.hpp"
+#include "RenderGraph.hpp"
 
 #include <vector>
 #include <memory>
-#include <array>
+#include <string>
 
 using namespace std;
 
@@ -19,7 +20,12 @@ namespace anim::renderer {
 
 class Renderer {
 public:
-    Renderer(vulkan::Device& device, vulkan::Swapchain& swapchain);
+    // framesInFlight is how many frames the CPU may record ahead of the GPU (1-4),
+    // lower values cut input latency, higher values absorb CPU/GPU spikes
+    Renderer(vulkan::Device& device, vulkan::Swapchain& swapchain, uint32_t framesInFlight = 2);
+    // Headless: frames render into offscreen color targets of this size and
+    // format and are not presented, read them back with readFrame()
+    Renderer(vulkan::Device& device, VkExtent2D extent, VkFormat colorFormat, uint32_t framesInFlight = 2);
     ~Renderer();
 
     // Non-copyable
@@ -27,41 +33,115 @@ public:
     Renderer& operator=(const Renderer&) = delete;
 
     // Frame management
+    // beginFrame starts the command buffer and the frame's render graph, which
+    // holds this slot's color target and a transient depth image
     bool beginFrame();
+    // Adds a graph pass drawing into color and depth. The frame's first scene
+    // pass clears them, later ones continue what it drew.
+    RenderGraph::PassBuilder addScenePass(const string& name, RenderGraph::Execute execute);
+    // Records the graph, then submits and presents (headless: only submits).
+    // A frame without scene passes is cleared.
     void endFrame();
+    // Records the new window size, the swapchain is recreated at the start of
+    // the next frame so bursts of resize events cost one recreation
     void handleResize(uint32_t width, uint32_t height);
+    // Blocks until at most maxQueued presented frames wait to be displayed, so
+    // the next frame samples input closer to when it is shown. Needs present
+    // wait (Swapchain::presentWaitSupported), does nothing without it.
+    void limitQueuedFrames(uint32_t maxQueued);
+    // Presented frames not displayed yet, 0 without present wait
+    uint32_t queuedFrames() { return swapchain_ ? swapchain_->queuedPresents() : 0; }
+
+    // Waits for the last frame that ended and copies its color target to host
+    // memory, tightly packed 8-bit RGBA rows top to bottom
+    vector<uint8_t> readFrame();
+    bool isHeadless() const { return swapchain_ == nullptr; }
 
     // Accessors
-    vulkan::CommandBuffer& commandBuffer() { return *commandBuffers_[imageIndex_]; }
-    vulkan::RenderPass& renderPass() { return *renderPass_; }
+    // Commands recorded here directly run before the graph's passes
+    vulkan::CommandBuffer& commandBuffer() { return *commandBuffers_[currentFrame_]; }
+    // Draws into commandBuffer() go through the encoder, the graph hands it to
+    // each pass with its state forgotten
+    vulkan::CommandEncoder& encoder() { return encoder_; }
+    RenderGraph& graph() { return *graph_; }
+    // Handles in the current frame's graph, the color target is blitted to
+    // the swapchain after the graph ran
+    RenderGraph::ImageHandle colorTarget() const { return colorTarget_; }
+    RenderGraph::ImageHandle depthTarget() const { return depthTarget_; }
+    // Counts of encoders recording secondary buffers for this frame, see ParallelRecorder
+    void addEncoderStats(const vulkan::EncoderStats& stats) { frameEncoderStats_ += stats; }
+    // Calls issued and dropped by every encoder of the last frame that ended
+    const vulkan::EncoderStats& encoderStats() const { return encoderStats_; }
+    // Compatible with every scene pass, for creating pipelines
+    const vulkan::RenderTarget& renderTarget() const { return renderTarget_; }
+    // The scene formats drawn with multiview into the layers of viewMask, for
+    // pipelines of graph passes with that view mask
+    vulkan::RenderTarget multiviewTarget(uint32_t viewMask);
+    VkExtent2D extent() const { return extent_; }
+    VkFormat colorFormat() const { return colorFormat_; }
+    uint32_t frameSlot() const { return currentFrame_; }
     uint32_t currentImageIndex() const { return imageIndex_; }
+    uint64_t frameNumber() const { return frameNumber_; }
+    uint32_t framesInFlight() const { return framesInFlight_; }
+
+    // Frame N (as returned by frameNumber() while it was recorded) signals
+    // value N + 1 on the frame timeline when its GPU work completes
+    const vulkan::TimelineSemaphore& frameTimeline() const { return *frameTimeline_; }
+    bool isFrameComplete(uint64_t frame) const { return frameTimeline_->value() > frame; }
+    void waitForFrame(uint64_t frame) const { frameTimeline_->wait(frame + 1); }
 
     void setClearColor(float r, float g, float b, float a = 1.0f);
 
 private:
-    void createDepthResources();
-    void createFramebuffers();
+    Renderer(vulkan::Device& device, vulkan::Swapchain* swapchain, VkExtent2D extent, VkFormat colorFormat,
+             uint32_t framesInFlight);
+
+    void createColorTargets();
+    void createPresentSemaphores();
+    void resizeTargets();
+    void submitFrame(vulkan::CommandBuffer* cmd, vulkan::Semaphore* waitSemaphore, VkSemaphore signalSemaphore);
 
     vulkan::Device* device_;
-    vulkan::Swapchain* swapchain_;
+    vulkan::Swapchain* swapchain_;  // Null when headless
+    VkExtent2D extent_;
+    VkFormat colorFormat_;
 
-    unique_ptr<vulkan::RenderPass> renderPass_;
-    unique_ptr<vulkan::Image> depthImage_;
-    vector<unique_ptr<vulkan::Framebuffer>> framebuffers_;
+    unique_ptr<vulkan::RenderPass> renderPass_;  // Without dynamic rendering only
+    vulkan::RenderTarget renderTarget_;
+    vector<pair<uint32_t, unique_ptr<vulkan::RenderPass>>> multiviewPasses_;  // By view mask, likewise
     unique_ptr<vulkan::CommandPool> commandPool_;
-    vector<unique_ptr<vulkan::CommandBuffer>> commandBuffers_;
-
-    // Per-frame-in-flight sync objects (indexed by currentFrame_)
-    static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+    unique_ptr<RenderGraph> graph_;
+    RenderGraph::ImageHandle colorTarget_ = 0;
+    RenderGraph::ImageHandle depthTarget_ = 0;
+
+    // Per-frame-in-flight objects (indexed by currentFrame_)
+    static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 4;
+    uint32_t framesInFlight_;
+    vector<unique_ptr<vulkan::Image>> colorTargets_;  // Offscreen scene color
+    vector<unique_ptr<vulkan::CommandBuffer>> commandBuffers_;  // Scene, recorded before acquire
+    vector<unique_ptr<vulkan::CommandBuffer>> presentCommandBuffers_;  // Blit to the acquired image
     vector<unique_ptr<vulkan::Semaphore>> imageAvailableSemaphores_;
+
+    // Per-swapchain-image (indexed by imageIndex_), presentation needs binary semaphores
     vector<unique_ptr<vulkan::Semaphore>> renderFinishedSemaphores_;
-    vector<unique_ptr<vulkan::Fence>> inFlightFences_;
 
-    uint32_t currentFrame_ = 0;  // Cycles 0 to MAX_FRAMES_IN_FLIGHT-1, indexes sync objects
-    uint32_t imageIndex_ = 0;    // Set by acquireNextImage, indexes framebuffers
+    vulkan::CommandEncoder encoder_;
+    vulkan::EncoderStats frameEncoderStats_;  // Secondaries of the frame being recorded
+    vulkan::EncoderStats encoderStats_;
+
+    // Paces the CPU against the GPU, replaces per-frame fences
+    unique_ptr<vulkan::TimelineSemaphore> frameTimeline_;
+
+    uint32_t currentFrame_ = 0;  // Cycles 0 to framesInFlight_-1, indexes per-frame objects
+    uint32_t imageIndex_ = 0;    // Set by acquireNextImage in endFrame
+    uint64_t frameNumber_ = 0;   // Frames submitted so far
     bool frameStarted_ = false;
+    bool scenePassAdded_ = false;  // The next scene pass continues the first
+    bool resizePending_ = false;  // Window resized or swapchain out of date
+    uint32_t targetWidth_;        // Latest requested size, applied in beginFrame
+    uint32_t targetHeight_;
 
-    array<VkClearValue, 2> clearValues_;
+    VkClearColorValue clearColor_;
     static constexpr VkFormat DEPTH_FORMAT = VK_FORMAT_D32_SFLOAT;
 };
 
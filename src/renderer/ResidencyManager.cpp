@@ -0,0 +1,183 @@
+#include "ResidencyManager.hpp"
+
+#include <iostream>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace anim::renderer {
+
+static constexpr uint32_t NO_MODEL = numeric_limits<uint32_t>::max();
+
+ResidencyManager::ResidencyManager(vulkan::Device& device, Scene& scene,
+                                   const vulkan::TimelineSemaphore& frameTimeline,
+                                   const ResidencyConfig& config)
+    : deviceRef(&device)
+    , sceneRef(&scene)
+    , frameTimeline(&frameTimeline)
+    , config(config) {
+}
+
+VkDeviceSize ResidencyManager::gpuBudget() const {
+    if (config.gpuBudget > 0) {
+        return config.gpuBudget;
+    }
+
+    // Share of the largest device-local heap, so other resources keep headroom
+    VkDeviceSize heapBudget = 0;
+    for (const auto& heap : deviceRef->heapBudgets()) {
+        if (heap.deviceLocal) {
+            heapBudget = max(heapBudget, heap.budget);
+        }
+    }
+    return static_cast<VkDeviceSize>(static_cast<double>(heapBudget) * config.deviceBudgetFraction);
+}
+
+uint32_t ResidencyManager::load(const string& path) {
+    auto data = make_unique<ModelData>(ModelLoader::parse(path));
+
+    // Make room before uploading, the parsed size is a close estimate of the GPU size
+    VkDeviceSize estimate = data->byteSize();
+    while (residentTotal + estimate > gpuBudget()) {
+        if (!evictOne(NO_MODEL)) {
+            break;
+        }
+    }
+
+    Entry entry;
+    entry.sceneModel = sceneRef->addModel(*data, path);
+    entry.state = Residency::Resident;
+    entry.lastUsedFrame = currentFrame;
+    entry.gpuBytes = sceneRef->modelMemorySize(entry.sceneModel);
+    entry.dataBytes = data->byteSize();
+    entry.data = std::move(data);
+
+    residentTotal += entry.gpuBytes;
+    cachedTotal += entry.dataBytes;
+    entries.push_back(std::move(entry));
+
+    uint32_t id = static_cast<uint32_t>(entries.size() - 1);
+    trimCpuCache(id);
+    return id;
+}
+
+void ResidencyManager::request(uint32_t model) {
+    Entry& entry = entries[model];
+    sceneRef->setModelVisible(entry.sceneModel, true);
+    entry.lastUsedFrame = currentFrame;
+
+    if (entry.state == Residency::Resident) {
+        return;
+    }
+
+    while (residentTotal + entry.gpuBytes > gpuBudget()) {
+        if (!evictOne(model)) {
+            break;
+        }
+    }
+
+    if (entry.state == Residency::OnDisk) {
+        entry.data = make_unique<ModelData>(ModelLoader::parse(sceneRef->model(entry.sceneModel).path));
+        entry.dataBytes = entry.data->byteSize();
+        cachedTotal += entry.dataBytes;
+    }
+
+    sceneRef->restoreModel(entry.sceneModel, *entry.data);
+    entry.gpuBytes = sceneRef->modelMemorySize(entry.sceneModel);
+    entry.state = Residency::Resident;
+    residentTotal += entry.gpuBytes;
+
+    cout << "Restored model: " << sceneRef->model(entry.sceneModel).path << endl;
+
+    trimCpuCache(model);
+}
+
+void ResidencyManager::release(uint32_t model) {
+    sceneRef->setModelVisible(entries[model].sceneModel, false);
+}
+
+void ResidencyManager::update(uint64_t frameNumber) {
+    currentFrame = frameNumber;
+
+    for (auto& entry : entries) {
+        if (entry.state == Residency::Resident && sceneRef->model(entry.sceneModel).visible) {
+            entry.lastUsedFrame = frameNumber;
+        }
+    }
+
+    while (residentTotal > gpuBudget()) {
+        if (!evictOne(NO_MODEL)) {
+            break;
+        }
+    }
+
+    // Give memory back early when the driver reports the device is nearly full
+    if (deviceRef->memoryPressure() == vulkan::MemoryPressure::Critical) {
+        evictOne(NO_MODEL);
+    }
+}
+
+bool ResidencyManager::evictOne(uint32_t keep) {
+    // Least recently drawn hidden model whose last frame has finished on the GPU
+    uint64_t completedFrames = frameTimeline->value();
+    Entry* victim = nullptr;
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        Entry& entry = entries[i];
+        if (i == keep || entry.state != Residency::Resident) {
+            continue;
+        }
+        if (sceneRef->model(entry.sceneModel).visible) {
+            continue;
+        }
+        if (entry.lastUsedFrame >= completedFrames) {
+            continue;
+        }
+        if (!victim || entry.lastUsedFrame < victim->lastUsedFrame) {
+            victim = &entry;
+        }
+    }
+
+    if (!victim) {
+        return false;
+    }
+
+    sceneRef->evictModel(victim->sceneModel);
+    residentTotal -= victim->gpuBytes;
+    victim->state = victim->data ? Residency::CpuCached : Residency::OnDisk;
+
+    cout << "Evicted model: " << sceneRef->model(victim->sceneModel).path
+         << " (" << victim->gpuBytes / (1024 * 1024) << " MB)" << endl;
+    return true;
+}
+
+void ResidencyManager::trimCpuCache(uint32_t keep) {
+    while (cachedTotal > config.cpuCacheBudget) {
+        Entry* victim = nullptr;
+        for (uint32_t i = 0; i < entries.size(); i++) {
+            Entry& entry = entries[i];
+            if (i == keep || !entry.data) {
+                continue;
+            }
+            if (!victim || entry.lastUsedFrame < victim->lastUsedFrame) {
+                victim = &entry;
+            }
+        }
+
+        if (!victim) {
+            return;
+        }
+        dropData(*victim);
+    }
+}
+
+void ResidencyManager::dropData(Entry& entry) {
+    cachedTotal -= entry.dataBytes;
+    entry.data.reset();
+    entry.dataBytes = 0;
+    if (entry.state == Residency::CpuCached) {
+        entry.state = Residency::OnDisk;
+    }
+}
+
+} // namespace anim::renderer
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Scene.hpp"
+#include "ModelLoader.hpp"
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Sync.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+namespace anim::renderer {
+
+struct ResidencyConfig {
+    VkDeviceSize gpuBudget = 0;           // 0 = derive from the device-local heap budget
+    float deviceBudgetFraction = 0.5f;    // Share of the heap budget used when deriving
+    size_t cpuCacheBudget = 512 * 1024 * 1024;  // Parsed models kept in RAM
+};
+
+enum class Residency {
+    Resident,   // GPU resources exist
+    CpuCached,  // Evicted, parsed data still in RAM
+    OnDisk      // Evicted, must be parsed again from its file
+};
+
+// Keeps the models in a Scene under a GPU memory budget. Models that were not
+// drawn recently are evicted least-recently-used first, keeping their parsed
+// data in RAM while that fits, and are uploaded again when requested.
+class ResidencyManager {
+public:
+    // frameTimeline is the renderer's, frame N is complete once it reaches N + 1
+    ResidencyManager(vulkan::Device& device, Scene& scene, const vulkan::TimelineSemaphore& frameTimeline,
+                     const ResidencyConfig& config = {});
+
+    // Non-copyable
+    ResidencyManager(const ResidencyManager&) = delete;
+    ResidencyManager& operator=(const ResidencyManager&) = delete;
+
+    // Loads a model into the scene and returns its id, visible by default
+    uint32_t load(const string& path);
+
+    // Makes a model visible, uploading it again if it was evicted
+    void request(uint32_t model);
+
+    // Hides a model, leaving it resident until the budget needs the space
+    void release(uint32_t model);
+
+    // Call once per frame before recording, frameNumber is the frame about to be
+    // recorded. Marks visible models as used and evicts until under budget.
+    void update(uint64_t frameNumber);
+
+    Residency residency(uint32_t model) const { return entries[model].state; }
+    VkDeviceSize gpuBudget() const;
+    VkDeviceSize residentBytes() const { return residentTotal; }
+    size_t cachedBytes() const { return cachedTotal; }
+
+private:
+    struct Entry {
+        uint32_t sceneModel = 0;
+        Residency state = Residency::Resident;
+        uint64_t lastUsedFrame = 0;
+        VkDeviceSize gpuBytes = 0;
+        unique_ptr<ModelData> data;  // Null once dropped to disk
+        size_t dataBytes = 0;
+    };
+
+    bool evictOne(uint32_t keep);
+    void trimCpuCache(uint32_t keep);
+    void dropData(Entry& entry);
+
+    vulkan::Device* deviceRef;
+    Scene* sceneRef;
+    const vulkan::TimelineSemaphore* frameTimeline;
+    ResidencyConfig config;
+
+    vector<Entry> entries;
+    VkDeviceSize residentTotal = 0;
+    size_t cachedTotal = 0;
+    uint64_t currentFrame = 0;
+};
+
+} // namespace anim::renderer
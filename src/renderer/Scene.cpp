@@ -2,27 +2,66 @@
 
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <algorithm>
+#include <cstddef>
 #include <fstream>
 #include <stdexcept>
+#include <unordered_set>
 
 using namespace std;
 
 namespace anim::renderer {
 
-struct UniformBufferObject {
-    glm::mat4 model;
+// Below this many meshes the flat SIMD cull is cheaper than traversing a BVH
+static constexpr size_t BVH_MIN_MESHES = 4096;
+
+// Refits keep the tree valid but not good, rebuild at least this often while meshes move
+static constexpr uint32_t MAX_REFITS_BEFORE_REBUILD = 300;
+
+// Auto depth pre-pass thresholds, apart so a scene near one does not flip every frame
+static constexpr float PREPASS_ENABLE_OVERDRAW = 2.0f;
+static constexpr float PREPASS_DISABLE_OVERDRAW = 1.5f;
+
+static constexpr float NEAR_PLANE = 0.1f;
+static constexpr float FAR_PLANE = 1000.0f;
+
+// Draw sort key, most significant bit first:
+//   opaque:  0 | material (15)    | depth (16)    | mesh (32)
+//   blended: 1 | max - depth (16) | material (15) | mesh (32)
+// Depth is the distance to the camera over the far plane. The mesh index keeps
+// keys unique and is read back as the draw.
+static constexpr uint64_t SORT_BLENDED = 1ull << 63;
+static constexpr uint64_t SORT_MATERIAL_MAX = (1ull << 15) - 1;
+static constexpr uint64_t SORT_DEPTH_MAX = (1ull << 16) - 1;
+
+// Instance buffers start this large (in matrices) and double when a frame needs more
+static constexpr size_t MIN_INSTANCE_CAPACITY = 256;
+
+// Model of lights added with addLight, they are always lit
+static constexpr uint32_t NO_LIGHT_MODEL = ~0u;
+
+// Lights scenes without a directional light, as before lights were loaded
+static constexpr float DEFAULT_SUN_INTENSITY = 3.0f;
+
+struct ViewUniforms {
     glm::mat4 view;
     glm::mat4 proj;
     glm::vec3 camPos;
     float padding; // Align to 16 bytes
 };
 
+// The shaders declare the same array size
+struct UniformBufferObject {
+    array<ViewUniforms, MAX_CULL_VIEWS> views;
+};
+
 struct PushConstants {
-    glm::mat4 model;           // 64 bytes
     glm::vec4 baseColorFactor; // 16 bytes
     glm::vec4 mrFactors;       // x=metallic, y=roughness - 16 bytes
     glm::vec4 emissiveFactor;  // xyz=emissive - 16 bytes
-}; // Total: 112 bytes
+    uint32_t view;             // Index into the UBO views
+    uint32_t padding[3];
+}; // Total: 64 bytes
 
 static vector<uint32_t> readShaderFile(const string& path) {
     ifstream file(path, ios::ate | ios::binary);
@@ -39,20 +78,29 @@ static vector<uint32_t> readShaderFile(const string& path) {
     return buffer;
 }
 
-Scene::Scene(vulkan::Device& device, VkRenderPass renderPass)
+Scene::Scene(vulkan::Device& device, const vulkan::RenderTarget& target, uint32_t framesInFlight)
     : deviceRef(&device)
-    , renderPassRef(renderPass) {
+    , renderTarget(target)
+    , framesInFlight(framesInFlight) {
     commandPool = make_unique<vulkan::CommandPool>(device, device.graphicsQueueFamily());
     pipelineCache = make_unique<vulkan::PipelineCache>(device);
     loadShaders();
     createDefaultTexture();
     createDescriptors();
-    createPipeline(renderPass);
+    lightClusters = make_unique<LightClusters>(device, *pipelineCache, readShaderFile(SHADER_DIR "cluster.comp.spv"),
+                                                framesInFlight);
+    shadowCascades = make_unique<ShadowCascades>(device, ShadowSettings{}, framesInFlight);
+    environmentLighting = make_unique<EnvironmentLighting>(
+        device, *pipelineCache, *commandPool, readShaderFile(SHADER_DIR "env_cube.comp.spv"),
+        readShaderFile(SHADER_DIR "env_irradiance.comp.spv"), readShaderFile(SHADER_DIR "env_prefilter.comp.spv"),
+        readShaderFile(SHADER_DIR "env_brdf.comp.spv"));
+    createPipeline(target);
 }
 
 void Scene::loadShaders() {
     vertShaderCode = readShaderFile(SHADER_DIR "model.vert.spv");
     fragShaderCode = readShaderFile(SHADER_DIR "model.frag.spv");
+    shadowShaderCode = readShaderFile(SHADER_DIR "shadow.vert.spv");
 }
 
 void Scene::createDefaultTexture() {
@@ -62,13 +110,16 @@ void Scene::createDefaultTexture() {
 }
 
 void Scene::createDescriptors() {
-    // Uniform buffer
-    uniformBuffer = make_unique<vulkan::Buffer>(
-        *deviceRef,
-        sizeof(UniformBufferObject),
-        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VMA_MEMORY_USAGE_CPU_TO_GPU
-    );
+    // View uniform buffer per frame slot, written once the renderer has waited for the slot
+    viewSlots.resize(framesInFlight);
+    for (auto& slot : viewSlots) {
+        slot.uniforms = make_unique<vulkan::Buffer>(
+            *deviceRef,
+            sizeof(UniformBufferObject),
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+            VMA_MEMORY_USAGE_CPU_TO_GPU
+        );
+    }
 
     // Descriptor layout with uniform buffer and 5 PBR texture samplers
     vector<VkDescriptorSetLayoutBinding> bindings = {
@@ -117,25 +168,98 @@ void Scene::createDescriptors() {
     };
     descriptorLayout = make_unique<vulkan::DescriptorSetLayout>(*deviceRef, bindings);
 
-    // Descriptor pool - reserve space for multiple materials + 1 default
+    // Descriptor pool - reserve space for multiple materials + 1 default in
+    // every frame slot, twice over so refreshDescriptors() can allocate while
+    // the replaced sets retire
     constexpr uint32_t MAX_MATERIALS = 256;
+    uint32_t maxSets = 2 * (MAX_MATERIALS + 1) * framesInFlight;
     vector<VkDescriptorPoolSize> poolSizes = {
-        {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = MAX_MATERIALS + 1},
-        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 5 * (MAX_MATERIALS + 1)}
+        {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = maxSets},
+        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 5 * maxSets}
+    };
+    descriptorPool = make_unique<vulkan::DescriptorPool>(
+        *deviceRef, poolSizes, maxSets, VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT);
+
+    // Default descriptor sets (for meshes without materials)
+    for (uint32_t i = 0; i < framesInFlight; i++) {
+        viewSlots[i].defaultSet = make_unique<vulkan::DescriptorSet>(*descriptorPool, *descriptorLayout);
+        writeMaterialDescriptors(*viewSlots[i].defaultSet, nullptr, i);
+    }
+
+    // Set 1: per-frame model matrices, read by gl_InstanceIndex
+    instanceSetLayout = make_unique<vulkan::DescriptorSetLayout>(*deviceRef, vector<VkDescriptorSetLayoutBinding>{
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+            .pImmutableSamplers = nullptr
+        }
+    });
+    vector<VkDescriptorPoolSize> instancePoolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = framesInFlight}
+    };
+    instancePool = make_unique<vulkan::DescriptorPool>(*deviceRef, instancePoolSizes, framesInFlight);
+    instanceSlots.resize(framesInFlight);
+}
+
+void Scene::writeMaterialDescriptors(vulkan::DescriptorSet& ds, const LoadedMaterial* mat, uint32_t frameSlot) {
+    ds.updateBuffer(0, viewSlots[frameSlot].uniforms->handle(), 0, sizeof(UniformBufferObject));
+
+    // Helper to get texture or default
+    auto getTexture = [&](int index) -> Texture& {
+        if (mat && index >= 0 && index < static_cast<int>(textures.size()) && textures[index]) {
+            return *textures[index];
+        }
+        return *defaultTexture;
     };
-    descriptorPool = make_unique<vulkan::DescriptorPool>(*deviceRef, poolSizes, MAX_MATERIALS + 1);
 
-    // Default descriptor set (for meshes without materials)
-    defaultDescriptorSet = make_unique<vulkan::DescriptorSet>(*descriptorPool, *descriptorLayout);
-    defaultDescriptorSet->updateBuffer(0, uniformBuffer->handle(), 0, sizeof(UniformBufferObject));
-    defaultDescriptorSet->updateImage(1, defaultTexture->view(), defaultTexture->sampler());
-    defaultDescriptorSet->updateImage(2, defaultTexture->view(), defaultTexture->sampler());
-    defaultDescriptorSet->updateImage(3, defaultTexture->view(), defaultTexture->sampler());
-    defaultDescriptorSet->updateImage(4, defaultTexture->view(), defaultTexture->sampler());
-    defaultDescriptorSet->updateImage(5, defaultTexture->view(), defaultTexture->sampler());
+    Texture& baseColor = getTexture(mat ? mat->baseColorTexture : -1);
+    Texture& normal = getTexture(mat ? mat->normalTexture : -1);
+    Texture& metallicRoughness = getTexture(mat ? mat->metallicRoughnessTexture : -1);
+    Texture& occlusion = getTexture(mat ? mat->occlusionTexture : -1);
+    Texture& emissive = getTexture(mat ? mat->emissiveTexture : -1);
+
+    ds.updateImage(1, baseColor.view(), baseColor.sampler());
+    ds.updateImage(2, normal.view(), normal.sampler());
+    ds.updateImage(3, metallicRoughness.view(), metallicRoughness.sampler());
+    ds.updateImage(4, occlusion.view(), occlusion.sampler());
+    ds.updateImage(5, emissive.view(), emissive.sampler());
+}
+
+void Scene::refreshDescriptors() {
+    if (gpuCulling) {
+        gpuCulling->refreshDescriptors();
+    }
+
+    // Only textures move among the material bindings, the uniform buffers are host-written
+    for (uint32_t slot = 0; slot < framesInFlight; slot++) {
+        auto replace = [this, slot](unique_ptr<vulkan::DescriptorSet>& ds, const LoadedMaterial* mat) {
+            descriptorPool->free(ds->handle());
+            ds = make_unique<vulkan::DescriptorSet>(*descriptorPool, *descriptorLayout);
+            writeMaterialDescriptors(*ds, mat, slot);
+        };
+        ViewSlot& viewSlot = viewSlots[slot];
+        replace(viewSlot.defaultSet, nullptr);
+        for (size_t i = 0; i < viewSlot.materialSets.size() && i < materials.size(); i++) {
+            if (viewSlot.materialSets[i]) {
+                replace(viewSlot.materialSets[i], &materials[i]);
+            }
+        }
+    }
 }
 
-void Scene::createPipeline(VkRenderPass renderPass) {
+void Scene::createMaterialDescriptors(const SceneModel& model) {
+    for (uint32_t slot = 0; slot < framesInFlight; slot++) {
+        for (uint32_t i = model.firstMaterial; i < model.firstMaterial + model.materialCount; i++) {
+            auto ds = make_unique<vulkan::DescriptorSet>(*descriptorPool, *descriptorLayout);
+            writeMaterialDescriptors(*ds, &materials[i], slot);
+            viewSlots[slot].materialSets[i] = std::move(ds);
+        }
+    }
+}
+
+void Scene::createPipeline(const vulkan::RenderTarget& target) {
     auto bindingDesc = Vertex::getBindingDescription();
     auto attribDescs = Vertex::getAttributeDescriptions();
 
@@ -149,67 +273,319 @@ void Scene::createPipeline(VkRenderPass renderPass) {
     pipelineConfig.fragShaderCode = fragShaderCode;
     pipelineConfig.vertexBindings = {bindingDesc};
     pipelineConfig.vertexAttribs = attribDescs;
-    pipelineConfig.descriptorLayouts = {descriptorLayout->handle()};
+    pipelineConfig.descriptorLayouts = {descriptorLayout->handle(), instanceSetLayout->handle(),
+                                        lightClusters->setLayout(), shadowCascades->setLayout(),
+                                        environmentLighting->setLayout()};
     pipelineConfig.pushConstantRanges = {pushConstantRange};
-    pipelineConfig.renderPass = renderPass;
+    pipelineConfig.target = target;
     pipelineConfig.polygonMode = VK_POLYGON_MODE_FILL;
 
     currentPipeline = &pipelineCache->getPipeline(pipelineConfig);
+    updateBlendPipeline();
+    updateShadowPipeline();
 }
 
 void Scene::toggleWireframe() {
     wireframeMode = !wireframeMode;
     pipelineConfig.polygonMode = wireframeMode ? VK_POLYGON_MODE_LINE : VK_POLYGON_MODE_FILL;
     currentPipeline = &pipelineCache->getPipeline(pipelineConfig);
+    if (indirectPipeline) {
+        indirectPipelineConfig.polygonMode = pipelineConfig.polygonMode;
+        indirectPipeline = &pipelineCache->getPipeline(indirectPipelineConfig);
+    }
+    if (depthPipeline) {
+        updateDepthPipeline();
+    }
+    updateBlendPipeline();
+    if (multiviewPipeline) {
+        updateMultiviewPipelines();
+    }
+}
+
+void Scene::setDepthPrepassMode(DepthPrepassMode mode) {
+    prepassMode = mode;
+    if (mode != DepthPrepassMode::Auto) {
+        setDepthPrepassActive(mode == DepthPrepassMode::On);
+    }
+}
+
+void Scene::reportOverdraw(float overdraw) {
+    if (prepassMode != DepthPrepassMode::Auto) {
+        return;
+    }
+    if (!prepassActive && overdraw >= PREPASS_ENABLE_OVERDRAW) {
+        setDepthPrepassActive(true);
+    } else if (prepassActive && overdraw < PREPASS_DISABLE_OVERDRAW) {
+        setDepthPrepassActive(false);
+    }
+}
+
+void Scene::setDepthPrepassActive(bool active) {
+    if (active == prepassActive) {
+        return;
+    }
+    prepassActive = active;
+
+    // The color pass only shades the fragments the pre-pass left in the depth buffer
+    pipelineConfig.depthCompareOp = active ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS;
+    pipelineConfig.depthWrite = !active;
+    currentPipeline = &pipelineCache->getPipeline(pipelineConfig);
+
+    if (active && !depthPipeline) {
+        depthShaderCode = readShaderFile(SHADER_DIR "depth.vert.spv");
+        updateDepthPipeline();
+    }
+}
+
+void Scene::updateDepthPipeline() {
+    // Same layout as the main pipeline, the shader only reads the UBO and the model matrix
+    depthPipelineConfig = pipelineConfig;
+    depthPipelineConfig.vertShaderCode = depthShaderCode;
+    depthPipelineConfig.fragShaderCode.clear();
+    depthPipelineConfig.vertexAttribs = {pipelineConfig.vertexAttribs[0]};
+    depthPipelineConfig.depthCompareOp = VK_COMPARE_OP_LESS;
+    depthPipelineConfig.depthWrite = true;
+    depthPipeline = &pipelineCache->getPipeline(depthPipelineConfig);
+}
+
+void Scene::updateBlendPipeline() {
+    // Blended meshes do not hide each other, they are drawn back to front instead.
+    // The test stays LESS with the pre-pass on, the pre-pass skips them.
+    blendPipelineConfig = pipelineConfig;
+    blendPipelineConfig.depthCompareOp = VK_COMPARE_OP_LESS;
+    blendPipelineConfig.depthWrite = false;
+    blendPipelineConfig.blendEnable = true;
+    blendPipeline = &pipelineCache->getPipeline(blendPipelineConfig);
+}
+
+void Scene::updateShadowPipeline() {
+    // Same layout as the main pipeline, the cascade's matrix is pushed where
+    // the material factors go. Always filled, whatever the wireframe mode.
+    shadowPipelineConfig = pipelineConfig;
+    shadowPipelineConfig.vertShaderCode = shadowShaderCode;
+    shadowPipelineConfig.fragShaderCode.clear();
+    shadowPipelineConfig.vertexBindings = {Mesh::positionBinding()};
+    shadowPipelineConfig.vertexAttribs = {pipelineConfig.vertexAttribs[0]};
+    shadowPipelineConfig.target = shadowCascades->target();
+    shadowPipelineConfig.polygonMode = VK_POLYGON_MODE_FILL;
+    shadowPipelineConfig.depthCompareOp = VK_COMPARE_OP_LESS;
+    shadowPipelineConfig.depthWrite = true;
+    shadowPipelineConfig.blendEnable = false;
+    shadowPipeline = &pipelineCache->getPipeline(shadowPipelineConfig);
+}
+
+void Scene::setShadowSettings(const ShadowSettings& settings) {
+    shadowCascades->setSettings(settings);
+}
+
+bool Scene::setMultiview(uint32_t firstView, uint32_t count, const vulkan::RenderTarget& target) {
+    if (count == 0) {
+        multiviewCount = 0;
+        multiviewPipeline = nullptr;
+        multiviewBlendPipeline = nullptr;
+        return true;
+    }
+    if (count > min(deviceRef->features().maxMultiviewViews, MAX_CULL_VIEWS)) {
+        return false;
+    }
+
+    multiviewFirst = firstView;
+    multiviewCount = count;
+    multiviewTarget = target;
+    if (multiviewShaderCode.empty()) {
+        multiviewShaderCode = readShaderFile(SHADER_DIR "model_multiview.vert.spv");
+    }
+    updateMultiviewPipelines();
+    return true;
 }
 
-void Scene::loadModel(const string& path) {
-    auto loaded = ModelLoader::load(*deviceRef, *commandPool, path);
+void Scene::updateMultiviewPipelines() {
+    // The main pipelines without the pre-pass, each draw goes to every layer of the target
+    multiviewPipelineConfig = pipelineConfig;
+    multiviewPipelineConfig.vertShaderCode = multiviewShaderCode;
+    multiviewPipelineConfig.target = multiviewTarget;
+    multiviewPipelineConfig.depthCompareOp = VK_COMPARE_OP_LESS;
+    multiviewPipelineConfig.depthWrite = true;
+    multiviewPipeline = &pipelineCache->getPipeline(multiviewPipelineConfig);
+
+    multiviewBlendPipelineConfig = multiviewPipelineConfig;
+    multiviewBlendPipelineConfig.depthWrite = false;
+    multiviewBlendPipelineConfig.blendEnable = true;
+    multiviewBlendPipeline = &pipelineCache->getPipeline(multiviewBlendPipelineConfig);
+}
+
+bool Scene::setGpuDriven(bool enabled) {
+    if (!enabled) {
+        gpuCulling.reset();
+        indirectPipeline = nullptr;
+        return true;
+    }
+    if (gpuCulling) {
+        return true;
+    }
+    if (!GpuCulling::isSupported(*deviceRef)) {
+        return false;
+    }
+
+    gpuCulling = make_unique<GpuCulling>(*deviceRef, *commandPool, *pipelineCache,
+                                         readShaderFile(SHADER_DIR "cull.comp.spv"),
+                                         readShaderFile(SHADER_DIR "hiz.comp.spv"), framesInFlight);
+    gpuCulling->setOcclusionCulling(occlusionCulling);
+    gpuSceneDirty = true;
+
+    // Same as the main pipeline, with the model matrix read from the instance buffer
+    indirectPipelineConfig = pipelineConfig;
+    indirectPipelineConfig.vertShaderCode = readShaderFile(SHADER_DIR "indirect.vert.spv");
+    indirectPipelineConfig.descriptorLayouts = {descriptorLayout->handle(), gpuCulling->instanceLayout(),
+                                                lightClusters->setLayout(), shadowCascades->setLayout(),
+                                                environmentLighting->setLayout()};
+    indirectPipelineConfig.depthCompareOp = VK_COMPARE_OP_LESS;
+    indirectPipelineConfig.depthWrite = true;
+    indirectPipeline = &pipelineCache->getPipeline(indirectPipelineConfig);
+    return true;
+}
+
+uint32_t Scene::loadModel(const string& path) {
+    return addModel(ModelLoader::parse(path), path);
+}
+
+uint32_t Scene::addModel(const ModelData& data, const string& path) {
+    auto loaded = ModelLoader::upload(*deviceRef, *commandPool, data);
+
+    SceneModel model;
+    model.path = path;
+    model.firstMesh = static_cast<uint32_t>(loadedMeshes.size());
+    model.meshCount = static_cast<uint32_t>(loaded.meshes.size());
+    model.firstMaterial = static_cast<uint32_t>(materials.size());
+    model.materialCount = static_cast<uint32_t>(loaded.materials.size());
+    model.firstTexture = static_cast<uint32_t>(textures.size());
+    model.textureCount = static_cast<uint32_t>(loaded.textures.size());
+    model.firstLight = static_cast<uint32_t>(lights.size());
+    model.lightCount = static_cast<uint32_t>(data.lights.size());
+    model.resident = true;
+
+    for (const auto& light : data.lights) {
+        lights.push_back(light);
+        lightModels.push_back(static_cast<uint32_t>(models.size()));
+    }
 
     // Move textures
     for (auto& tex : loaded.textures) {
         textures.push_back(std::move(tex));
     }
 
-    // Move materials
-    for (auto& mat : loaded.materials) {
+    // Move materials, rebasing texture indices onto the shared texture array
+    auto rebase = [&](int index) { return index >= 0 ? index + static_cast<int>(model.firstTexture) : -1; };
+    for (auto mat : loaded.materials) {
+        mat.baseColorTexture = rebase(mat.baseColorTexture);
+        mat.normalTexture = rebase(mat.normalTexture);
+        mat.metallicRoughnessTexture = rebase(mat.metallicRoughnessTexture);
+        mat.occlusionTexture = rebase(mat.occlusionTexture);
+        mat.emissiveTexture = rebase(mat.emissiveTexture);
         materials.push_back(mat);
+        for (auto& slot : viewSlots) {
+            slot.materialSets.push_back(nullptr);
+        }
     }
 
-    // Move meshes
+    // Move meshes, rebasing material indices
     for (auto& mesh : loaded.meshes) {
+        if (mesh.materialIndex >= 0) {
+            mesh.materialIndex += static_cast<int>(model.firstMaterial);
+        }
         loadedMeshes.push_back(std::move(mesh));
+        meshModels.push_back(static_cast<uint32_t>(models.size()));
+        setWorldBounds(static_cast<uint32_t>(loadedMeshes.size() - 1));
     }
+    bvhStale = true;
+    gpuSceneDirty = true;
+    staticShadowsDirty = true;
 
-    // Create descriptor set for each material
-    for (const auto& mat : materials) {
-        auto ds = make_unique<vulkan::DescriptorSet>(*descriptorPool, *descriptorLayout);
-        ds->updateBuffer(0, uniformBuffer->handle(), 0, sizeof(UniformBufferObject));
+    // Create descriptor sets for this model's materials only
+    createMaterialDescriptors(model);
 
-        // Helper to get texture or default
-        auto getTexture = [&](int index) -> Texture& {
-            if (index >= 0 && index < static_cast<int>(textures.size()) && textures[index]) {
-                return *textures[index];
-            }
-            return *defaultTexture;
-        };
+    models.push_back(model);
+    return static_cast<uint32_t>(models.size() - 1);
+}
+
+void Scene::evictModel(uint32_t id) {
+    SceneModel& model = models[id];
+    if (!model.resident) {
+        return;
+    }
+
+    for (auto& slot : viewSlots) {
+        for (uint32_t i = model.firstMaterial; i < model.firstMaterial + model.materialCount; i++) {
+            descriptorPool->free(slot.materialSets[i]->handle());
+            slot.materialSets[i].reset();
+        }
+    }
+    for (uint32_t i = model.firstTexture; i < model.firstTexture + model.textureCount; i++) {
+        textures[i].reset();
+    }
+    for (uint32_t i = model.firstMesh; i < model.firstMesh + model.meshCount; i++) {
+        loadedMeshes[i].mesh.reset();
+    }
 
-        Texture& baseColor = getTexture(mat.baseColorTexture);
-        Texture& normal = getTexture(mat.normalTexture);
-        Texture& metallicRoughness = getTexture(mat.metallicRoughnessTexture);
-        Texture& occlusion = getTexture(mat.occlusionTexture);
-        Texture& emissive = getTexture(mat.emissiveTexture);
+    model.resident = false;
+    gpuSceneDirty = true;
+    staticShadowsDirty = true;
+}
+
+void Scene::restoreModel(uint32_t id, const ModelData& data) {
+    SceneModel& model = models[id];
+    if (model.resident) {
+        return;
+    }
+
+    auto loaded = ModelLoader::upload(*deviceRef, *commandPool, data);
+    if (loaded.meshes.size() != model.meshCount || loaded.textures.size() != model.textureCount) {
+        throw runtime_error("Failed to restore model, data does not match: " + model.path);
+    }
 
-        ds->updateImage(1, baseColor.view(), baseColor.sampler());
-        ds->updateImage(2, normal.view(), normal.sampler());
-        ds->updateImage(3, metallicRoughness.view(), metallicRoughness.sampler());
-        ds->updateImage(4, occlusion.view(), occlusion.sampler());
-        ds->updateImage(5, emissive.view(), emissive.sampler());
+    for (uint32_t i = 0; i < model.textureCount; i++) {
+        textures[model.firstTexture + i] = std::move(loaded.textures[i]);
+    }
+    for (uint32_t i = 0; i < model.meshCount; i++) {
+        loadedMeshes[model.firstMesh + i].mesh = std::move(loaded.meshes[i].mesh);
+    }
+    createMaterialDescriptors(model);
+
+    model.resident = true;
+    gpuSceneDirty = true;
+    staticShadowsDirty = true;
+}
 
-        materialDescriptorSets.push_back(std::move(ds));
+void Scene::setModelVisible(uint32_t id, bool visible) {
+    if (models[id].visible != visible) {
+        models[id].visible = visible;
+        gpuSceneDirty = true;
+        staticShadowsDirty = true;
     }
 }
 
+VkDeviceSize Scene::modelMemorySize(uint32_t id) const {
+    const SceneModel& model = models[id];
+    if (!model.resident) {
+        return 0;
+    }
+
+    // Meshes placed by several nodes share their buffers, count those once
+    VkDeviceSize bytes = 0;
+    unordered_set<const Mesh*> counted;
+    for (uint32_t i = model.firstMesh; i < model.firstMesh + model.meshCount; i++) {
+        if (counted.insert(loadedMeshes[i].mesh.get()).second) {
+            bytes += loadedMeshes[i].mesh->memorySize();
+        }
+    }
+    for (uint32_t i = model.firstTexture; i < model.firstTexture + model.textureCount; i++) {
+        if (textures[i]) {
+            bytes += textures[i]->memorySize();
+        }
+    }
+    return bytes;
+}
+
 void Scene::addTriangle() {
     vector<Vertex> vertices = {
         {{0.0f, -0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}, {0.5f, 0.0f}},
@@ -218,60 +594,609 @@ void Scene::addTriangle() {
     };
     vector<uint32_t> indices = {0, 1, 2};
 
+    SceneModel model;
+    model.firstMesh = static_cast<uint32_t>(loadedMeshes.size());
+    model.meshCount = 1;
+    model.firstMaterial = static_cast<uint32_t>(materials.size());
+    model.firstTexture = static_cast<uint32_t>(textures.size());
+    model.firstLight = static_cast<uint32_t>(lights.size());
+    model.resident = true;
+    models.push_back(model);
+
     LoadedMesh loadedMesh;
     loadedMesh.mesh = make_unique<Mesh>(*deviceRef, vertices, indices);
+    loadedMesh.bounds = MeshBounds::fromVertices(vertices);
     loadedMeshes.push_back(std::move(loadedMesh));
+    meshModels.push_back(static_cast<uint32_t>(models.size() - 1));
+    setWorldBounds(static_cast<uint32_t>(loadedMeshes.size() - 1));
+    bvhStale = true;
+    gpuSceneDirty = true;
+    staticShadowsDirty = true;
+}
+
+uint32_t Scene::addLight(const PunctualLight& light) {
+    lights.push_back(light);
+    lightModels.push_back(NO_LIGHT_MODEL);
+    return static_cast<uint32_t>(lights.size() - 1);
+}
+
+void Scene::setWorldBounds(uint32_t mesh) {
+    if (worldBounds.size() < loadedMeshes.size()) {
+        worldBounds.resize(loadedMeshes.size());
+        worldBoxes.resize(loadedMeshes.size());
+    }
+
+    const LoadedMesh& loadedMesh = loadedMeshes[mesh];
+    MeshBounds world = loadedMesh.bounds.transformed(loadedMesh.transform);
+    worldBounds.set(mesh, world);
+    worldBoxes[mesh] = world.box;
+    if (world.box.valid()) {
+        sceneBox.expand(world.box);
+    }
+}
+
+void Scene::setMeshTransform(uint32_t mesh, const glm::mat4& transform) {
+    loadedMeshes[mesh].transform = transform;
+    setWorldBounds(mesh);
+    bvhMoved = true;
+    if (gpuCulling) {
+        gpuCulling->setTransform(mesh, loadedMeshes[mesh]);
+    }
+
+    // Cached cascades drew it where it was, they must forget it
+    if (!isDynamic(mesh)) {
+        dynamicMeshes.resize(max(dynamicMeshes.size(), loadedMeshes.size()));
+        dynamicMeshes[mesh] = 1;
+        staticShadowsDirty = true;
+    }
+}
+
+void Scene::updateBvh() {
+    if (bvhMoved && !bvhStale) {
+        bvh.refit(worldBoxes);
+        refitsSinceBuild++;
+        bvhStale = bvh.needsRebuild() || refitsSinceBuild >= MAX_REFITS_BEFORE_REBUILD;
+    }
+    bvhMoved = false;
+
+    if (bvhStale) {
+        bvh.build(worldBoxes, threadPool);
+        bvhStale = false;
+        refitsSinceBuild = 0;
+    }
+}
+
+optional<BvhHit> Scene::raycast(const glm::vec3& origin, const glm::vec3& direction) {
+    updateBvh();
+    return bvh.raycast(origin, direction);
+}
+
+void Scene::meshesInBox(const BoundingBox& box, vector<uint32_t>& meshes) {
+    updateBvh();
+    bvh.queryBox(box, meshes);
 }
 
 void Scene::update(float time, float aspect, const CameraData& camera) {
+    updateViews(time, {SceneView{camera, aspect}});
+}
+
+void Scene::updateViews(float time, const vector<SceneView>& sceneViews) {
     (void)time;  // No longer auto-rotating
+    if (sceneViews.empty() || sceneViews.size() > MAX_CULL_VIEWS) {
+        throw runtime_error("Scene views must number 1 to " + to_string(MAX_CULL_VIEWS));
+    }
 
-    UniformBufferObject ubo{};
-    ubo.model = glm::mat4(1.0f);  // Identity - no rotation
-    ubo.view = camera.view;
-    ubo.proj = glm::perspective(glm::radians(camera.fov), aspect, 0.1f, 1000.0f);
-    ubo.proj[1][1] *= -1;  // Flip Y for Vulkan
-    ubo.camPos = camera.position;
+    // Uploaded by writeInstances, frames in flight still read their slot's cameras
+    views.resize(sceneViews.size());
+    for (size_t i = 0; i < sceneViews.size(); i++) {
+        const CameraData& camera = sceneViews[i].camera;
+        views[i].view = camera.view;
+        views[i].projection = glm::perspective(glm::radians(camera.fov), sceneViews[i].aspect, NEAR_PLANE, FAR_PLANE);
+        views[i].projection[1][1] *= -1;  // Flip Y for Vulkan
+        views[i].viewProjection = views[i].projection * views[i].view;
+        views[i].position = camera.position;
+        views[i].frustum = Frustum::fromViewProjection(views[i].viewProjection);
+    }
+}
+
+void Scene::render(vulkan::CommandEncoder& encoder, uint32_t frameSlot) {
+    prepareDraws();
+    writeInstances(frameSlot);
+    if (prepassActive) {
+        recordDepthDraws(encoder, 0, drawCount());
+    }
+    recordDraws(encoder, 0, drawCount());
+}
+
+void Scene::prepareDraws() {
+    drawGroups.clear();
+    instanceTransforms.clear();
+    stats = {};
+    for (auto& view : views) {
+        view.firstGroup = 0;
+        view.groupCount = 0;
+    }
+    gatherLights();
+
+    // GPU-driven mode draws view 0 from the GPU's culling, other views cull here
+    uint32_t firstView = 0;
+    if (gpuCulling) {
+        if (gpuSceneDirty) {
+            vector<uint32_t> meshes;
+            for (const auto& model : models) {
+                if (model.resident && model.visible) {
+                    for (uint32_t i = model.firstMesh; i < model.firstMesh + model.meshCount; i++) {
+                        meshes.push_back(i);
+                    }
+                }
+            }
+            gpuCulling->build(loadedMeshes, meshes);
+            gpuSceneDirty = false;
+        }
+
+        // Visible counts stay on the GPU
+        stats.tested = gpuCulling->instanceCount();
+        firstView = 1;
+    }
+
+    if (firstView < views.size()) {
+        cullViews(firstView);
+    }
+
+    // Each view sorts and groups only what it sees, a multiview group what any of its views sees
+    for (uint32_t v = firstView; v < views.size(); v++) {
+        uint32_t count = 1;
+        if (multiviewCount > 0 && v == multiviewFirst) {
+            count = min(multiviewCount, static_cast<uint32_t>(views.size()) - v);
+        } else if (multiviewCount > 0 && v > multiviewFirst && v < multiviewFirst + multiviewCount) {
+            continue;
+        }
+        auto mask = static_cast<uint8_t>(((1u << count) - 1) << (v - firstView));
+
+        drawList.clear();
+        for (size_t i = 0; i < visibleMeshes.size(); i++) {
+            if (visibleViews[i] & mask) {
+                drawList.push_back(visibleMeshes[i]);
+            }
+        }
 
-    uniformBuffer->upload(&ubo, sizeof(ubo));
+        views[v].firstGroup = static_cast<uint32_t>(drawGroups.size());
+        sortDraws(views[v].position);
+        buildDrawGroups();
+        views[v].groupCount = static_cast<uint32_t>(drawGroups.size()) - views[v].firstGroup;
+    }
+
+    if (!gpuCulling) {
+        stats.drawn = instanceTransforms.size();
+    }
+
+    prepareShadowDraws();
+}
+
+void Scene::gatherLights() {
+    // Lights of hidden or evicted models go dark with their meshes
+    frameLights.clear();
+    bool directional = false;
+    for (size_t i = 0; i < lights.size(); i++) {
+        if (lightModels[i] != NO_LIGHT_MODEL) {
+            const SceneModel& model = models[lightModels[i]];
+            if (!model.resident || !model.visible) {
+                continue;
+            }
+        }
+        frameLights.push_back(lights[i]);
+        directional = directional || lights[i].type == LightType::Directional;
+    }
+    if (!directional) {
+        PunctualLight sun;
+        sun.type = LightType::Directional;
+        sun.direction = -glm::normalize(glm::vec3(1.0f, 1.0f, 1.0f));
+        sun.intensity = DEFAULT_SUN_INTENSITY;
+        frameLights.push_back(sun);
+    }
 }
 
-void Scene::render(VkCommandBuffer cmd) {
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->handle());
+void Scene::cullViews(uint32_t firstView) {
+    cullFrusta.clear();
+    for (uint32_t v = firstView; v < views.size(); v++) {
+        cullFrusta.push_back(views[v].frustum);
+    }
+    uint64_t tested = cullMeshes();
+
+    // GPU-driven counts are for view 0
+    if (firstView == 0) {
+        stats.tested = tested;
+        stats.culled = tested - visibleMeshes.size();
+    }
+}
+
+uint64_t Scene::cullMeshes() {
+    // Every frustum of cullFrusta in one pass, a bit per frustum in visibleViews
+    auto allViews = static_cast<uint8_t>((1u << cullFrusta.size()) - 1);
+
+    visibleMeshes.clear();
+    visibleViews.clear();
+    uint64_t tested = 0;
+    for (const auto& model : models) {
+        if (model.resident && model.visible) {
+            tested += model.meshCount;
+        }
+    }
 
-    for (const auto& loadedMesh : loadedMeshes) {
-        // Select descriptor set based on material index
-        VkDescriptorSet ds;
-        int matIdx = loadedMesh.materialIndex;
-        if (matIdx >= 0 && matIdx < static_cast<int>(materialDescriptorSets.size())) {
-            ds = materialDescriptorSets[matIdx]->handle();
+    if (cullingEnabled && loadedMeshes.size() >= BVH_MIN_MESHES) {
+        // One traversal for the whole scene and every view, then drop meshes of hidden or evicted models
+        updateBvh();
+        bvh.cull(cullFrusta, visibleMeshes, visibleViews);
+        size_t kept = 0;
+        for (size_t i = 0; i < visibleMeshes.size(); i++) {
+            const SceneModel& model = models[meshModels[visibleMeshes[i]]];
+            if (model.resident && model.visible) {
+                visibleMeshes[kept] = visibleMeshes[i];
+                visibleViews[kept] = visibleViews[i];
+                kept++;
+            }
+        }
+        visibleMeshes.resize(kept);
+        visibleViews.resize(kept);
+    } else {
+        for (const auto& model : models) {
+            if (!model.resident || !model.visible) {
+                continue;
+            }
+
+            if (cullingEnabled) {
+                // A model's meshes are contiguous, so each model is one batched SIMD pass for all views
+                worldBounds.cull(cullFrusta, model.firstMesh, model.meshCount, visibleMeshes, visibleViews);
+            } else {
+                for (uint32_t meshIdx = model.firstMesh; meshIdx < model.firstMesh + model.meshCount; meshIdx++) {
+                    visibleMeshes.push_back(meshIdx);
+                    visibleViews.push_back(allViews);
+                }
+            }
+        }
+    }
+    return tested;
+}
+
+bool Scene::isBlended(uint32_t mesh) const {
+    int matIdx = loadedMeshes[mesh].materialIndex;
+    return matIdx >= 0 && matIdx < static_cast<int>(materials.size()) && materials[matIdx].blend;
+}
+
+void Scene::sortDraws(const glm::vec3& viewPosition) {
+    sortKeys.resize(drawList.size());
+    for (size_t i = 0; i < drawList.size(); i++) {
+        uint32_t meshIdx = drawList[i];
+
+        // Material 0 is the default set
+        uint64_t material = min(static_cast<uint64_t>(loadedMeshes[meshIdx].materialIndex + 1), SORT_MATERIAL_MAX);
+
+        // Meshes without bounds sort nearest
+        uint64_t depth = 0;
+        if (worldBoxes[meshIdx].valid()) {
+            float distance = glm::length(worldBoxes[meshIdx].center() - viewPosition);
+            depth = static_cast<uint64_t>(glm::clamp(distance / FAR_PLANE, 0.0f, 1.0f) * SORT_DEPTH_MAX);
+        }
+
+        if (isBlended(meshIdx)) {
+            sortKeys[i] = SORT_BLENDED | ((SORT_DEPTH_MAX - depth) << 47) | (material << 32) | meshIdx;
         } else {
-            ds = defaultDescriptorSet->handle();
+            sortKeys[i] = (material << 48) | (depth << 32) | meshIdx;
         }
+    }
 
-        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, currentPipeline->layout(), 0, 1, &ds, 0, nullptr);
+    radixSort(sortKeys, sortScratch);
+    for (size_t i = 0; i < drawList.size(); i++) {
+        drawList[i] = static_cast<uint32_t>(sortKeys[i]);
+    }
+}
 
-        // Build push constants with model transform and material factors
-        PushConstants pc{};
-        pc.model = loadedMesh.transform;
+void Scene::buildDrawGroups(bool mergeMaterials) {
+    // Opaque draws of a material are contiguous after sorting, so each material
+    // run is grouped by geometry, ordered by its nearest instance. Blended draws
+    // only merge with the draw before them, their order must not change.
+    // Depth-only draws merge by geometry alone, whatever the material.
+    // Groups and instances are appended after those of the views before.
+    auto firstGroup = static_cast<uint32_t>(drawGroups.size());
+    auto firstInstance = static_cast<uint32_t>(instanceTransforms.size());
+    vector<uint32_t> groupOfDraw(drawList.size());
+    int runMaterial = -2;
+    for (size_t i = 0; i < drawList.size(); i++) {
+        const LoadedMesh& loadedMesh = loadedMeshes[drawList[i]];
+        bool blended = isBlended(drawList[i]);
 
-        if (matIdx >= 0 && matIdx < static_cast<int>(materials.size())) {
-            const auto& mat = materials[matIdx];
-            pc.baseColorFactor = mat.baseColorFactor;
-            pc.mrFactors = glm::vec4(mat.metallicFactor, mat.roughnessFactor, 0.0f, 0.0f);
-            pc.emissiveFactor = glm::vec4(mat.emissiveFactor, 0.0f);
+        uint32_t group = static_cast<uint32_t>(drawGroups.size());
+        if (blended) {
+            if (drawGroups.size() > firstGroup) {
+                const LoadedMesh& last = loadedMeshes[drawGroups.back().mesh];
+                if (isBlended(drawGroups.back().mesh) && last.mesh == loadedMesh.mesh &&
+                    last.materialIndex == loadedMesh.materialIndex) {
+                    group = static_cast<uint32_t>(drawGroups.size() - 1);
+                }
+            }
         } else {
-            pc.baseColorFactor = glm::vec4(1.0f);
-            pc.mrFactors = glm::vec4(1.0f, 1.0f, 0.0f, 0.0f);
-            pc.emissiveFactor = glm::vec4(0.0f);
+            if (!mergeMaterials && loadedMesh.materialIndex != runMaterial) {
+                runMaterial = loadedMesh.materialIndex;
+                groupLookup.clear();
+            }
+            auto [it, inserted] = groupLookup.try_emplace(loadedMesh.mesh.get(), group);
+            group = it->second;
         }
 
-        vkCmdPushConstants(cmd, currentPipeline->layout(),
-                          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
-                          0, sizeof(PushConstants), &pc);
+        if (group == drawGroups.size()) {
+            drawGroups.push_back({drawList[i], 0, 0});
+        }
+        drawGroups[group].instanceCount++;
+        groupOfDraw[i] = group;
+    }
+    groupLookup.clear();
 
-        loadedMesh.mesh->draw(cmd);
+    for (size_t i = firstGroup; i < drawGroups.size(); i++) {
+        DrawGroup& group = drawGroups[i];
+        group.firstInstance = firstInstance;
+        firstInstance += group.instanceCount;
+        group.instanceCount = 0;
+    }
+
+    instanceTransforms.resize(instanceTransforms.size() + drawList.size());
+    for (size_t i = 0; i < drawList.size(); i++) {
+        DrawGroup& group = drawGroups[groupOfDraw[i]];
+        instanceTransforms[group.firstInstance + group.instanceCount++] = loadedMeshes[drawList[i]].transform;
+    }
+}
+
+void Scene::prepareShadowDraws() {
+    for (auto& draws : shadowDraws) {
+        draws = {};
+    }
+    if (staticShadowsDirty) {
+        shadowCascades->invalidateStatic();
+        staticShadowsDirty = false;
+    }
+
+    // The first directional light casts shadows, gatherLights ensures there is one
+    glm::vec3 lightDirection = frameLights.back().direction;
+    for (const auto& light : frameLights) {
+        if (light.type == LightType::Directional) {
+            lightDirection = light.direction;
+            break;
+        }
+    }
+    shadowCascades->update(views[0].view, views[0].projection, NEAR_PLANE, lightDirection, sceneBox);
+
+    // Cascades drawn this frame are culled together, like the views
+    cullFrusta.clear();
+    shadowFrusta.clear();
+    for (uint32_t c = 0; c < shadowCascades->cascadeCount(); c++) {
+        if (shadowCascades->cascade(c).render) {
+            cullFrusta.push_back(shadowCascades->cascade(c).frustum);
+            shadowFrusta.push_back(c);
+        }
     }
+    if (cullFrusta.empty()) {
+        return;
+    }
+    cullMeshes();
+
+    // Blended meshes cast no shadows, static cascades only take static meshes
+    for (uint32_t f = 0; f < shadowFrusta.size(); f++) {
+        uint32_t cascade = shadowFrusta[f];
+        bool staticOnly = shadowCascades->cascade(cascade).staticOnly;
+        drawList.clear();
+        for (size_t i = 0; i < visibleMeshes.size(); i++) {
+            uint32_t mesh = visibleMeshes[i];
+            if ((visibleViews[i] & (1u << f)) && !isBlended(mesh) && !(staticOnly && isDynamic(mesh))) {
+                drawList.push_back(mesh);
+            }
+        }
+
+        shadowDraws[cascade].firstGroup = static_cast<uint32_t>(drawGroups.size());
+        buildDrawGroups(true);
+        shadowDraws[cascade].groupCount = static_cast<uint32_t>(drawGroups.size()) - shadowDraws[cascade].firstGroup;
+    }
+}
+
+void Scene::writeInstances(uint32_t frameSlot) {
+    currentSlot = frameSlot;
+
+    UniformBufferObject ubo{};
+    for (size_t i = 0; i < views.size(); i++) {
+        ubo.views[i].view = views[i].view;
+        ubo.views[i].proj = views[i].projection;
+        ubo.views[i].camPos = views[i].position;
+    }
+    viewSlots[frameSlot].uniforms->upload(&ubo, sizeof(ViewUniforms) * views.size());
+
+    if (gpuCulling) {
+        gpuCulling->update(frameSlot);
+    }
+
+    InstanceSlot& slot = instanceSlots[frameSlot];
+
+    VkDeviceSize size = instanceTransforms.size() * sizeof(glm::mat4);
+    if (!slot.buffer || slot.buffer->size() < size) {
+        VkDeviceSize capacity = slot.buffer ? slot.buffer->size() : MIN_INSTANCE_CAPACITY * sizeof(glm::mat4);
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        slot.buffer = make_unique<vulkan::Buffer>(
+            *deviceRef, capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        if (!slot.set) {
+            slot.set = make_unique<vulkan::DescriptorSet>(*instancePool, *instanceSetLayout);
+        }
+        slot.set->updateBuffer(0, slot.buffer->handle(), 0, VK_WHOLE_SIZE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    }
+
+    if (size > 0) {
+        slot.buffer->upload(instanceTransforms.data(), size);
+    }
+
+    clusterViews.clear();
+    for (const auto& view : views) {
+        clusterViews.push_back({view.view, view.projection});
+    }
+    lightClusters->update(frameSlot, frameLights, clusterViews, NEAR_PLANE, FAR_PLANE);
+    shadowCascades->upload(frameSlot);
+    environmentLighting->update(frameSlot);
+}
+
+void Scene::recordDraws(vulkan::CommandEncoder& encoder, size_t first, size_t count, uint32_t view) const {
+    if (count == 0) {
+        return;
+    }
+    VkDescriptorSet instances = instanceSlots[currentSlot].set->handle();
+    VkDescriptorSet lightSet = lightClusters->set();
+    VkDescriptorSet shadowSet = shadowCascades->set();
+    VkDescriptorSet environmentSet = environmentLighting->set();
+    bool multiview = multiviewCount > 0 && view == multiviewFirst;
+    const vulkan::Pipeline* opaque = multiview ? multiviewPipeline : currentPipeline;
+    const vulkan::Pipeline* blended = multiview ? multiviewBlendPipeline : blendPipeline;
+
+    // Sorted draws repeat pipelines, materials and geometry, the encoder drops the repeated binds
+    size_t start = views[view].firstGroup + first;
+    for (size_t i = start; i < start + count; i++) {
+        const DrawGroup& group = drawGroups[i];
+        const auto& loadedMesh = loadedMeshes[group.mesh];
+
+        const vulkan::Pipeline* pipeline = isBlended(group.mesh) ? blended : opaque;
+        encoder.bindPipeline(pipeline->handle());
+        encoder.bindDescriptorSet(pipeline->layout(), 1, instances);
+        encoder.bindDescriptorSet(pipeline->layout(), 2, lightSet);
+        encoder.bindDescriptorSet(pipeline->layout(), 3, shadowSet);
+        encoder.bindDescriptorSet(pipeline->layout(), 4, environmentSet);
+        bindMaterial(encoder, pipeline->layout(), loadedMesh.materialIndex, view);
+        loadedMesh.mesh->draw(encoder, group.instanceCount, group.firstInstance);
+    }
+}
+
+void Scene::recordDepthDraws(vulkan::CommandEncoder& encoder, size_t first, size_t count, uint32_t view) const {
+    encoder.bindPipeline(depthPipeline->handle());
+
+    // Every material set holds the same UBO, no textures are read
+    VkDescriptorSet sets[] = {viewSlots[currentSlot].defaultSet->handle(), instanceSlots[currentSlot].set->handle()};
+    encoder.bindDescriptorSets(depthPipeline->layout(), 0, 2, sets);
+    encoder.pushConstants(depthPipeline->layout(), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                          offsetof(PushConstants, view), sizeof(uint32_t), &view);
+
+    size_t start = views[view].firstGroup + first;
+    for (size_t i = start; i < start + count; i++) {
+        // Blended meshes must not hide what is behind them
+        if (isBlended(drawGroups[i].mesh)) {
+            continue;
+        }
+        loadedMeshes[drawGroups[i].mesh].mesh->draw(encoder, drawGroups[i].instanceCount, drawGroups[i].firstInstance);
+    }
+}
+
+RenderGraph::ImageHandle Scene::addShadowPass(RenderGraph& graph) {
+    RenderGraph::ImageHandle atlas = shadowCascades->importAtlas(graph);
+    if (shadowCascades->hasDraws() || shadowCascades->clearsAtlas()) {
+        optional<float> clear = shadowCascades->clearsAtlas() ? optional<float>(1.0f) : nullopt;
+        graph.addPass("shadows", [this](RenderGraph::PassContext& pass) {
+            recordShadowDraws(pass.encoder);
+        }).depthAttachment(atlas, clear);
+    }
+    return atlas;
+}
+
+void Scene::recordShadowDraws(vulkan::CommandEncoder& encoder) const {
+    encoder.bindPipeline(shadowPipeline->handle());
+    encoder.bindDescriptorSet(shadowPipeline->layout(), 1, instanceSlots[currentSlot].set->handle());
+
+    for (uint32_t c = 0; c < shadowCascades->cascadeCount(); c++) {
+        const ShadowCascade& cascade = shadowCascades->cascade(c);
+        if (!cascade.render) {
+            continue;
+        }
+
+        // Only this cascade's tile starts over, the cached ones keep theirs
+        VkClearAttachment clear{};
+        clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        clear.clearValue.depthStencil = {1.0f, 0};
+        VkClearRect rect{cascade.tile, 0, 1};
+        vkCmdClearAttachments(encoder.handle(), 1, &clear, 1, &rect);
+
+        encoder.setViewport(static_cast<float>(cascade.tile.offset.x), static_cast<float>(cascade.tile.offset.y),
+                            static_cast<float>(cascade.tile.extent.width), static_cast<float>(cascade.tile.extent.height));
+        encoder.setScissor(cascade.tile.offset.x, cascade.tile.offset.y,
+                           cascade.tile.extent.width, cascade.tile.extent.height);
+        encoder.pushConstants(shadowPipeline->layout(), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                              0, sizeof(glm::mat4), &cascade.viewProjection);
+
+        const ShadowDraws& draws = shadowDraws[c];
+        for (uint32_t i = draws.firstGroup; i < draws.firstGroup + draws.groupCount; i++) {
+            const DrawGroup& group = drawGroups[i];
+            loadedMeshes[group.mesh].mesh->drawPositions(encoder, group.instanceCount, group.firstInstance);
+        }
+    }
+}
+
+void Scene::recordCulling(VkCommandBuffer cmd, const vulkan::Image& depth) {
+    if (gpuCulling) {
+        gpuCulling->recordCulling(cmd, views[0].viewProjection, depth);
+    }
+}
+
+void Scene::setOcclusionCulling(bool enabled) {
+    occlusionCulling = enabled;
+    if (gpuCulling) {
+        gpuCulling->setOcclusionCulling(enabled);
+    }
+}
+
+void Scene::recordLateCulling(VkCommandBuffer cmd, const vulkan::Image& depth) {
+    if (gpuCulling) {
+        gpuCulling->recordLateCulling(cmd, views[0].viewProjection, depth);
+    }
+}
+
+void Scene::recordIndirectDraws(vulkan::CommandEncoder& encoder) const {
+    if (!gpuCulling || gpuCulling->instanceCount() == 0) {
+        return;
+    }
+
+    encoder.bindPipeline(indirectPipeline->handle());
+    gpuCulling->bind(encoder, indirectPipeline->layout());
+    encoder.bindDescriptorSet(indirectPipeline->layout(), 2, lightClusters->set());
+    encoder.bindDescriptorSet(indirectPipeline->layout(), 3, shadowCascades->set());
+    encoder.bindDescriptorSet(indirectPipeline->layout(), 4, environmentLighting->set());
+
+    const auto& batches = gpuCulling->batches();
+    for (uint32_t batch = 0; batch < batches.size(); batch++) {
+        bindMaterial(encoder, indirectPipeline->layout(), batches[batch].material, 0);
+        gpuCulling->drawBatch(encoder, batch);
+    }
+}
+
+void Scene::bindMaterial(vulkan::CommandEncoder& encoder, VkPipelineLayout layout, int matIdx, uint32_t view) const {
+    // Select descriptor set based on material index
+    const ViewSlot& slot = viewSlots[currentSlot];
+    VkDescriptorSet ds;
+    if (matIdx >= 0 && matIdx < static_cast<int>(slot.materialSets.size())) {
+        ds = slot.materialSets[matIdx]->handle();
+    } else {
+        ds = slot.defaultSet->handle();
+    }
+
+    encoder.bindDescriptorSet(layout, 0, ds);
+
+    // Build push constants with material factors
+    PushConstants pc{};
+    pc.view = view;
+
+    if (matIdx >= 0 && matIdx < static_cast<int>(materials.size())) {
+        const auto& mat = materials[matIdx];
+        pc.baseColorFactor = mat.baseColorFactor;
+        pc.mrFactors = glm::vec4(mat.metallicFactor, mat.roughnessFactor, 0.0f, 0.0f);
+        pc.emissiveFactor = glm::vec4(mat.emissiveFactor, 0.0f);
+    } else {
+        pc.baseColorFactor = glm::vec4(1.0f);
+        pc.mrFactors = glm::vec4(1.0f, 1.0f, 0.0f, 0.0f);
+        pc.emissiveFactor = glm::vec4(0.0f);
+    }
+
+    encoder.pushConstants(layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                          0, sizeof(PushConstants), &pc);
 }
 
 } // namespace anim::renderer
@@ -3,18 +3,30 @@
 #include "Mesh.hpp"
 #include "Texture.hpp"
 #include "ModelLoader.hpp"
+#include "Culling.hpp"
+#include "Bvh.hpp"
+#include "GpuCulling.hpp"
+#include "RadixSort.hpp"
+#include "LightClusters.hpp"
+#include "ShadowCascades.hpp"
+#include "EnvironmentLighting.hpp"
+#include "RenderGraph.hpp"
 #include "../vulkan/Device.hpp"
 #include "../vulkan/Pipeline.hpp"
 #include "../vulkan/PipelineCache.hpp"
 #include "../vulkan/Buffer.hpp"
 #include "../vulkan/DescriptorSet.hpp"
 #include "../vulkan/CommandPool.hpp"
+#include "../vulkan/CommandEncoder.hpp"
+#include "../core/ThreadPool.hpp"
 
 #include <glm/glm.hpp>
 
 #include <vector>
 #include <memory>
 #include <string>
+#include <optional>
+#include <unordered_map>
 
 using namespace std;
 
@@ -26,9 +38,39 @@ struct CameraData {
     float fov = 45.0f;
 };
 
+// A camera the scene is drawn from, see Scene::updateViews
+struct SceneView {
+    CameraData camera;
+    float aspect = 1.0f;
+};
+
+// A model's slots in the Scene's flat mesh, material and texture arrays.
+// Slots stay reserved while the model is evicted so it can be restored in place.
+struct SceneModel {
+    string path;
+    uint32_t firstMesh = 0;
+    uint32_t meshCount = 0;
+    uint32_t firstMaterial = 0;
+    uint32_t materialCount = 0;
+    uint32_t firstTexture = 0;
+    uint32_t textureCount = 0;
+    uint32_t firstLight = 0;
+    uint32_t lightCount = 0;
+    bool resident = false;  // GPU resources exist
+    bool visible = true;    // Drawn by render()
+};
+
+enum class DepthPrepassMode {
+    Off,
+    On,
+    Auto  // On while the measured overdraw is high, see Scene::reportOverdraw
+};
+
 class Scene {
 public:
-    Scene(vulkan::Device& device, VkRenderPass renderPass);
+    // framesInFlight is the renderer's, see Renderer::framesInFlight(), each
+    // frame slot gets its own per-frame buffers and sets
+    Scene(vulkan::Device& device, const vulkan::RenderTarget& target, uint32_t framesInFlight);
     ~Scene() = default;
 
     Scene(const Scene&) = delete;
@@ -36,11 +78,145 @@ public:
     Scene(Scene&&) = default;
     Scene& operator=(Scene&&) = default;
 
-    void loadModel(const string& path);
+    // Returns the model id used by the residency functions below
+    uint32_t loadModel(const string& path);
+    uint32_t addModel(const ModelData& data, const string& path);
     void addTriangle();
 
+    // Residency: evicting frees a model's GPU resources but keeps its slots,
+    // restoring uploads the same data again. Freed resources go through the
+    // device deletion queue, so this is safe while frames are in flight.
+    void evictModel(uint32_t model);
+    void restoreModel(uint32_t model, const ModelData& data);
+    void setModelVisible(uint32_t model, bool visible);
+    VkDeviceSize modelMemorySize(uint32_t model) const;
+    const SceneModel& model(uint32_t model) const { return models[model]; }
+    size_t modelCount() const { return models.size(); }
+
+    // A single view, view 0
     void update(float time, float aspect, const CameraData& camera);
-    void render(VkCommandBuffer cmd);
+    // Several views drawn from one prepareDraws(), e.g. split screen or
+    // thumbnails, at most MAX_CULL_VIEWS. Shaders index their camera by the
+    // view the draws are recorded for.
+    void updateViews(float time, const vector<SceneView>& sceneViews);
+    uint32_t viewCount() const { return static_cast<uint32_t>(views.size()); }
+    void render(vulkan::CommandEncoder& encoder, uint32_t frameSlot);
+
+    // Draw list: render() is prepareDraws(), writeInstances() and recordDraws()
+    // over the whole list. recordDraws only reads the scene, so ranges of the
+    // list can be recorded on several threads at once.
+    // prepareDraws frustum-culls meshes against every view from the last update,
+    // in one pass over the scene, then sorts each view's meshes: opaque ones by
+    // material, then front to back, and blended ones after them back to front.
+    // Meshes sharing geometry and material are merged into one instanced draw.
+    // The shadow cascades to be drawn are culled after the views, in one more pass.
+    // recordDraws skips binds that repeat the previous draw's, see
+    // vulkan::CommandEncoder. Set the view's viewport before recording it.
+    void prepareDraws();
+    // Uploads the cameras of the last update, the model matrices of the
+    // prepared draws, the lights and the shadow cascades into frameSlot's
+    // buffers, and writes finished environment cache files. Call once the
+    // renderer has waited for frameSlot and before recording.
+    void writeInstances(uint32_t frameSlot);
+    size_t drawCount(uint32_t view = 0) const { return views[view].groupCount; }
+    void recordDraws(vulkan::CommandEncoder& encoder, size_t first, size_t count, uint32_t view = 0) const;
+
+    // Multiview: views [firstView, firstView + count) share one draw list, the
+    // meshes any of them sees, recorded as firstView in a graph pass whose view
+    // mask has count bits, and drawn into that many layers of same-size targets.
+    // The other views of the group have no draws of their own. target comes from
+    // Renderer::multiviewTarget. These draws skip the depth pre-pass, and in
+    // GPU-driven mode view 0 is drawn indirectly, so start the group after it.
+    // Returns false if the device supports fewer views, count 0 turns it off.
+    bool setMultiview(uint32_t firstView, uint32_t count, const vulkan::RenderTarget& target);
+    bool isMultiview() const { return multiviewCount > 0; }
+
+    // Punctual lights, those of resident visible models and the ones added here.
+    // Writing the instances uploads them and bins them into clusters for each view.
+    // Without any directional light the scene is lit by a default sun.
+    uint32_t addLight(const PunctualLight& light);
+    void setLight(uint32_t light, const PunctualLight& value) { lights[light] = value; }
+    const PunctualLight& light(uint32_t light) const { return lights[light]; }
+    size_t lightCount() const { return lights.size(); }
+    void setLightClustering(LightClustering mode) { lightClusters->setMode(mode); }
+    LightClustering lightClustering() const { return lightClusters->mode(); }
+    // Bins the lights on the GPU, record outside the render pass and before
+    // the draws. No-op with CPU clustering.
+    void recordLightClustering(VkCommandBuffer cmd) { lightClusters->recordClustering(cmd); }
+
+    // Cascaded shadow maps from the first directional light, fitted to view 0
+    // and culled with the same bounds as the cameras. Meshes are static until
+    // setMeshTransform first moves them; static cascades, see ShadowSettings,
+    // only draw static meshes, so moving ones cast no shadow that far out.
+    void setShadowSettings(const ShadowSettings& settings);
+    const ShadowSettings& shadowSettings() const { return shadowCascades->settings(); }
+    // Imports the shadow atlas into the frame's graph and adds the pass drawing
+    // the cascades that need it, call after prepareDraws() and writeInstances().
+    // Passes recording draws must read the returned image as SampledGraphics.
+    RenderGraph::ImageHandle addShadowPass(RenderGraph& graph);
+
+    // Image-based ambient light from an HDR environment map, see
+    // EnvironmentLighting. Setting one queues its bake, spread over frames by
+    // recordEnvironmentBake while the previous environment stays lit.
+    // Settings apply to environments set afterwards.
+    void setEnvironment(const string& path) { environmentLighting->setEnvironment(path); }
+    void clearEnvironment() { environmentLighting->clearEnvironment(); }
+    void setEnvironmentSettings(const EnvironmentSettings& settings) { environmentLighting->setSettings(settings); }
+    const EnvironmentSettings& environmentSettings() const { return environmentLighting->settings(); }
+    bool isBakingEnvironment() const { return environmentLighting->isBaking(); }
+    // Records this frame's share of the bake, outside the render pass and
+    // before the draws
+    void recordEnvironmentBake(VkCommandBuffer cmd) { environmentLighting->recordBake(cmd); }
+    // Writes cache files of bakes finished in frames not yet waited for, once the device is idle
+    void flushEnvironmentCache() { environmentLighting->flushCache(); }
+
+    // Writes fresh descriptor sets after textures or buffers were relocated,
+    // in-flight frames keep the old ones until they retire
+    void refreshDescriptors();
+
+    // Moves a mesh, the BVH is refit on the next prepareDraws()
+    void setMeshTransform(uint32_t mesh, const glm::mat4& transform);
+    size_t meshCount() const { return loadedMeshes.size(); }
+
+    // Spatial queries over world-space mesh boxes, used for picking and streaming.
+    // Results include meshes of hidden and evicted models.
+    optional<BvhHit> raycast(const glm::vec3& origin, const glm::vec3& direction);
+    void meshesInBox(const BoundingBox& box, vector<uint32_t>& meshes);
+
+    // Builds the BVH in parallel when set, the pool must outlive the scene
+    void setThreadPool(core::ThreadPool* pool) { threadPool = pool; }
+
+    // GPU-driven mode: a compute pass culls instances and writes indirect draws,
+    // issued one per material. Returns false if the device lacks support.
+    bool setGpuDriven(bool enabled);
+    bool isGpuDriven() const { return gpuCulling != nullptr; }
+    // Culling dispatch, record outside the render pass. No-op unless GPU-driven.
+    void recordCulling(VkCommandBuffer cmd, const vulkan::Image& depth);
+    // Draws what the last culling dispatch kept, inside the render pass
+    void recordIndirectDraws(vulkan::CommandEncoder& encoder) const;
+
+    // Two-phase occlusion culling in GPU-driven mode, kept across mode changes.
+    // When hasLatePass(), add a render graph pass after the indirect draws that
+    // reads their depth as ImageAccess::SampledCompute and records
+    // recordLateCulling, then draw again in a pass that loads color and depth.
+    void setOcclusionCulling(bool enabled);
+    bool isOcclusionCulling() const { return occlusionCulling; }
+    bool hasLatePass() const { return gpuCulling && occlusionCulling; }
+    void recordLateCulling(VkCommandBuffer cmd, const vulkan::Image& depth);
+
+    // Depth pre-pass for CPU-recorded draws: recordDepthDraws lays down depth
+    // with a position-only shader, then recordDraws shades with an EQUAL test
+    // so model.frag runs once per pixel. GPU-driven draws do not use it.
+    void setDepthPrepassMode(DepthPrepassMode mode);
+    DepthPrepassMode depthPrepassMode() const { return prepassMode; }
+    bool isDepthPrepassActive() const { return prepassActive; }
+    // Auto mode switches on hysteresis, overdraw as measured by OverdrawMonitor
+    void reportOverdraw(float overdraw);
+    void recordDepthDraws(vulkan::CommandEncoder& encoder, size_t first, size_t count, uint32_t view = 0) const;
+
+    void setCullingEnabled(bool enabled) { cullingEnabled = enabled; }
+    bool isCullingEnabled() const { return cullingEnabled; }
+    const CullStats& cullStats() const { return stats; }  // Of the last prepareDraws()
 
     void toggleWireframe();
     bool isWireframe() const { return wireframeMode; }
@@ -48,28 +224,162 @@ public:
 private:
     void loadShaders();
     void createDescriptors();
-    void createPipeline(VkRenderPass renderPass);
+    void createPipeline(const vulkan::RenderTarget& target);
     void createDefaultTexture();
+    void writeMaterialDescriptors(vulkan::DescriptorSet& ds, const LoadedMaterial* mat, uint32_t frameSlot);
+    void createMaterialDescriptors(const SceneModel& model);
+    void bindMaterial(vulkan::CommandEncoder& encoder, VkPipelineLayout layout, int matIdx, uint32_t view) const;
+    void setDepthPrepassActive(bool active);
+    void updateDepthPipeline();
+    void updateBlendPipeline();
+    void updateMultiviewPipelines();
+    void gatherLights();
+    void cullViews(uint32_t firstView);
+    uint64_t cullMeshes();
+    void sortDraws(const glm::vec3& viewPosition);
+    void buildDrawGroups(bool mergeMaterials = false);
+    void prepareShadowDraws();
+    void updateShadowPipeline();
+    void recordShadowDraws(vulkan::CommandEncoder& encoder) const;
+    bool isDynamic(uint32_t mesh) const { return mesh < dynamicMeshes.size() && dynamicMeshes[mesh]; }
+    bool isBlended(uint32_t mesh) const;
+    void setWorldBounds(uint32_t mesh);
+    void updateBvh();
 
     vulkan::Device* deviceRef;
-    VkRenderPass renderPassRef;
+    vulkan::RenderTarget renderTarget;
+    uint32_t framesInFlight;
 
     unique_ptr<vulkan::CommandPool> commandPool;
     unique_ptr<vulkan::PipelineCache> pipelineCache;
     vulkan::Pipeline* currentPipeline = nullptr;
-    unique_ptr<vulkan::Buffer> uniformBuffer;
     unique_ptr<vulkan::DescriptorSetLayout> descriptorLayout;
     unique_ptr<vulkan::DescriptorPool> descriptorPool;
-    vector<unique_ptr<vulkan::DescriptorSet>> materialDescriptorSets;
-    unique_ptr<vulkan::DescriptorSet> defaultDescriptorSet;
+
+    // One view uniform buffer per frame slot. Set 0 holds it with a material's
+    // textures, so each slot has its own default and material sets.
+    struct ViewSlot {
+        unique_ptr<vulkan::Buffer> uniforms;
+        unique_ptr<vulkan::DescriptorSet> defaultSet;
+        vector<unique_ptr<vulkan::DescriptorSet>> materialSets;  // Indexed like materials, null while evicted
+    };
+    vector<ViewSlot> viewSlots;
 
     vector<uint32_t> vertShaderCode;
     vector<uint32_t> fragShaderCode;
 
-    // Loaded model data
+    // Loaded model data, evicted models leave null meshes, textures and sets
+    vector<SceneModel> models;
     vector<LoadedMesh> loadedMeshes;
     vector<unique_ptr<Texture>> textures;
     vector<LoadedMaterial> materials;
+    vector<uint32_t> drawList;  // Mesh indices of visible resident models, one view at a time
+    vector<uint64_t> sortKeys;
+    vector<uint64_t> sortScratch;
+
+    // Instanced draws of every view, model matrices are in draw order per group
+    struct DrawGroup {
+        uint32_t mesh;           // First mesh, all share its geometry and material
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+    };
+    vector<DrawGroup> drawGroups;
+    vector<glm::mat4> instanceTransforms;
+    unordered_map<const Mesh*, uint32_t> groupLookup;
+
+    // One instance buffer per frame slot, set 1 of model.vert and depth.vert
+    struct InstanceSlot {
+        unique_ptr<vulkan::Buffer> buffer;
+        unique_ptr<vulkan::DescriptorSet> set;
+    };
+    unique_ptr<vulkan::DescriptorSetLayout> instanceSetLayout;
+    unique_ptr<vulkan::DescriptorPool> instancePool;
+    vector<InstanceSlot> instanceSlots;
+    uint32_t currentSlot = 0;  // Of the last writeInstances, the one recorded draws use
+
+    // Frustum culling, worldBounds, worldBoxes and meshModels are indexed like loadedMeshes
+    CullingBounds worldBounds;
+    vector<BoundingBox> worldBoxes;
+    vector<uint32_t> meshModels;
+    bool cullingEnabled = true;
+    CullStats stats;
+
+    // Cameras of the last update, each with its range of drawGroups
+    struct ViewState {
+        Frustum frustum{};
+        glm::mat4 view{1.0f};
+        glm::mat4 projection{1.0f};
+        glm::mat4 viewProjection{1.0f};
+        glm::vec3 position{0.0f};
+        uint32_t firstGroup = 0;
+        uint32_t groupCount = 0;
+    };
+    vector<ViewState> views = vector<ViewState>(1);
+    vector<Frustum> cullFrusta;
+    vector<uint32_t> visibleMeshes;  // Seen by any view, with a bit per view in visibleViews
+    vector<uint8_t> visibleViews;
+
+    // Large scenes cull hierarchically, rebuilt when meshes are added and refit when they move
+    Bvh bvh;
+    bool bvhStale = true;
+    bool bvhMoved = false;
+    uint32_t refitsSinceBuild = 0;
+    core::ThreadPool* threadPool = nullptr;
+
+    // GPU-driven mode, rebuilt when meshes are added, evicted or hidden, moves patch their instance
+    unique_ptr<GpuCulling> gpuCulling;
+    bool gpuSceneDirty = true;
+    vulkan::PipelineConfig indirectPipelineConfig;
+    vulkan::Pipeline* indirectPipeline = nullptr;
+    bool occlusionCulling = false;
+
+    // Depth pre-pass, the depth pipeline follows pipelineConfig's polygon mode
+    DepthPrepassMode prepassMode = DepthPrepassMode::Off;
+    bool prepassActive = false;
+    vector<uint32_t> depthShaderCode;
+    vulkan::PipelineConfig depthPipelineConfig;
+    vulkan::Pipeline* depthPipeline = nullptr;
+
+    // Blended materials, tested against but not writing depth
+    vulkan::PipelineConfig blendPipelineConfig;
+    vulkan::Pipeline* blendPipeline = nullptr;
+
+    // Multiview group, opaque and blended pipelines for its target
+    uint32_t multiviewFirst = 0;
+    uint32_t multiviewCount = 0;
+    vulkan::RenderTarget multiviewTarget;
+    vector<uint32_t> multiviewShaderCode;
+    vulkan::PipelineConfig multiviewPipelineConfig;
+    vulkan::Pipeline* multiviewPipeline = nullptr;
+    vulkan::PipelineConfig multiviewBlendPipelineConfig;
+    vulkan::Pipeline* multiviewBlendPipeline = nullptr;
+
+    // Lights indexed by addLight's ids, with their model or NO_LIGHT_MODEL,
+    // and the ones lighting the current frame
+    vector<PunctualLight> lights;
+    vector<uint32_t> lightModels;
+    vector<PunctualLight> frameLights;
+    unique_ptr<LightClusters> lightClusters;
+    vector<ClusterView> clusterViews;  // Of views, for binning
+
+    // Shadow cascades, each with its range of drawGroups. Meshes moved since
+    // they were added are dynamic, indexed like loadedMeshes. sceneBox holds
+    // every mesh there has been, it only grows.
+    struct ShadowDraws {
+        uint32_t firstGroup = 0;
+        uint32_t groupCount = 0;
+    };
+    unique_ptr<ShadowCascades> shadowCascades;
+    array<ShadowDraws, MAX_SHADOW_CASCADES> shadowDraws;
+    vector<uint32_t> shadowFrusta;  // Cascade of each frustum in cullFrusta
+    vector<uint8_t> dynamicMeshes;
+    BoundingBox sceneBox;
+    bool staticShadowsDirty = true;
+    vector<uint32_t> shadowShaderCode;
+
+    unique_ptr<EnvironmentLighting> environmentLighting;
+    vulkan::PipelineConfig shadowPipelineConfig;
+    vulkan::Pipeline* shadowPipeline = nullptr;
 
     // Default texture for materials without specific textures
     unique_ptr<Texture> defaultTexture;
@@ -0,0 +1,316 @@
+#include "ShadowCascades.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+namespace anim::renderer {
+
+static_assert(sizeof(GpuShadowData) == 368, "GpuShadowData must match the std140 Shadows block in model.frag");
+
+// Split distances blend a logarithmic scheme, even resolution per depth, with
+// a uniform one that keeps the near cascades from getting too thin
+static constexpr float SPLIT_LAMBDA = 0.75f;
+
+// Cached cascades are fitted this much larger on every side, relative to
+// their slice's box, so the camera can move a while before they are redrawn
+static constexpr float CACHED_MARGIN = 0.2f;
+
+// Texel sizes are rounded up to steps of 1/8 octave, so turning the camera a
+// little does not resize the texels of a tight cascade
+static constexpr float TEXEL_SIZE_STEPS = 8.0f;
+
+// The light counts as turned, redrawing every cascade, below this cosine
+static constexpr float LIGHT_TURN_COS = 0.99999f;
+
+// Lookups this close to a tile's edge use the next cascade, PCF reads one
+// texel around the lookup
+static constexpr float EDGE_TEXELS = 2.0f;
+
+// Subtracted from the receiver's depth, on top of the normal offset in model.frag
+static constexpr float DEPTH_BIAS = 0.0005f;
+
+ShadowSettings ShadowSettings::forQuality(ShadowQuality quality) {
+    ShadowSettings settings;
+    switch (quality) {
+        case ShadowQuality::Off:
+            settings.cascadeCount = 0;
+            break;
+        case ShadowQuality::Low:
+            settings.cascadeCount = 2;
+            settings.resolution = 1024;
+            settings.distance = 50.0f;
+            settings.updateInterval = 2;
+            break;
+        case ShadowQuality::Medium:
+            break;
+        case ShadowQuality::High:
+            settings.cascadeCount = 4;
+            settings.distance = 150.0f;
+            break;
+    }
+    return settings;
+}
+
+ShadowCascades::ShadowCascades(vulkan::Device& device, const ShadowSettings& settings, uint32_t framesInFlight)
+    : deviceRef(&device)
+    , slots(framesInFlight) {
+    // Set 3 of model.frag: cascades, then the atlas
+    shadowSetLayout = make_unique<vulkan::DescriptorSetLayout>(device, vector<VkDescriptorSetLayoutBinding>{
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr
+        },
+        {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr
+        }
+    });
+
+    vector<VkDescriptorPoolSize> poolSizes = {
+        {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = framesInFlight},
+        {.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = framesInFlight}
+    };
+    descriptorPool = make_unique<vulkan::DescriptorPool>(device, poolSizes, framesInFlight);
+
+    // Linear filtering blends four comparisons, a 2x2 PCF for free
+    vulkan::SamplerConfig samplerConfig;
+    samplerConfig.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerConfig.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerConfig.enableAnisotropy = false;
+    samplerConfig.maxLod = 0.0f;
+    samplerConfig.enableCompare = true;
+    samplerConfig.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    compareSampler = make_unique<vulkan::Sampler>(device, samplerConfig);
+
+    // Render passes are compatible when formats match, the ops do not matter
+    atlasTarget.depthFormat = SHADOW_FORMAT;
+    if (!device.features().dynamicRendering) {
+        renderPass = make_unique<vulkan::RenderPass>(device, VK_FORMAT_UNDEFINED, SHADOW_FORMAT,
+                                                     vulkan::AttachmentOps{}, vulkan::AttachmentOps{});
+        atlasTarget.renderPass = renderPass->handle();
+    }
+
+    setSettings(settings);
+}
+
+void ShadowCascades::setSettings(const ShadowSettings& settings) {
+    config = settings;
+    config.cascadeCount = min(config.cascadeCount, MAX_SHADOW_CASCADES);
+    config.resolution = max(config.resolution, 16u);
+    config.updateInterval = max(config.updateInterval, 1u);
+    // The first cascade always draws dynamic meshes
+    config.staticCascades = config.cascadeCount > 0 ? min(config.staticCascades, config.cascadeCount - 1) : 0;
+    createAtlas();
+}
+
+void ShadowCascades::createAtlas() {
+    // Two tiles to a row. Without cascades the atlas is one texel, so set 3 stays valid.
+    uint32_t columns = config.cascadeCount > 1 ? 2 : 1;
+    uint32_t rows = max((config.cascadeCount + columns - 1) / columns, 1u);
+
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(deviceRef->physicalDevice(), &properties);
+    config.resolution = min(config.resolution, properties.limits.maxImageDimension2D / max(columns, rows));
+    uint32_t tileSize = enabled() ? config.resolution : 1;
+
+    atlas = make_unique<vulkan::Image>(
+        *deviceRef, columns * tileSize, rows * tileSize, SHADOW_FORMAT,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+    atlasVersion++;
+    atlasWritten = false;
+
+    for (uint32_t i = 0; i < MAX_SHADOW_CASCADES; i++) {
+        cascades[i] = {};
+        cascades[i].tile = {{static_cast<int32_t>((i % columns) * tileSize), static_cast<int32_t>((i / columns) * tileSize)},
+                            {tileSize, tileSize}};
+        fits[i] = {};
+    }
+}
+
+void ShadowCascades::update(const glm::mat4& view, const glm::mat4& proj, float nearPlane,
+                            const glm::vec3& direction, const BoundingBox& sceneBounds) {
+    // Draws of the last update that never reached a graph, the frame was
+    // skipped, must not be taken as cached
+    for (uint32_t i = 0; i < MAX_SHADOW_CASCADES; i++) {
+        if (cascades[i].render && !atlasImported) {
+            fits[i].valid = false;
+        }
+        cascades[i].render = false;
+    }
+    atlasImported = false;
+    if (!enabled()) {
+        return;
+    }
+    frame++;
+
+    // The light view keeps a fixed up axis, so texels only move when the light turns
+    glm::vec3 lightDir = glm::normalize(direction);
+    if (glm::dot(lightDir, lightDirection) < LIGHT_TURN_COS) {
+        lightDirection = lightDir;
+        glm::vec3 up = abs(lightDir.y) > 0.99f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        lightView = glm::lookAt(glm::vec3(0.0f), lightDir, up);
+        for (auto& fit : fits) {
+            fit.valid = false;
+        }
+    }
+    uint32_t firstStatic = config.cascadeCount - config.staticCascades;
+    if (staticDirty) {
+        for (uint32_t i = firstStatic; i < config.cascadeCount; i++) {
+            fits[i].valid = false;
+        }
+        staticDirty = false;
+    }
+
+    // Light space looks down -Z, casters toward the light have larger z
+    float casterMaxZ = numeric_limits<float>::lowest();
+    if (sceneBounds.valid()) {
+        for (uint32_t corner = 0; corner < 8; corner++) {
+            glm::vec3 point((corner & 1) ? sceneBounds.max.x : sceneBounds.min.x,
+                            (corner & 2) ? sceneBounds.max.y : sceneBounds.min.y,
+                            (corner & 4) ? sceneBounds.max.z : sceneBounds.min.z);
+            casterMaxZ = max(casterMaxZ, (lightView * glm::vec4(point, 1.0f)).z);
+        }
+    }
+
+    glm::mat4 viewToLight = lightView * glm::inverse(view);
+    float p00 = proj[0][0];
+    float p11 = abs(proj[1][1]);
+    float farPlane = max(config.distance, nearPlane * 2.0f);
+    float sliceNear = nearPlane;
+    for (uint32_t i = 0; i < config.cascadeCount; i++) {
+        float t = static_cast<float>(i + 1) / static_cast<float>(config.cascadeCount);
+        float sliceFar = glm::mix(nearPlane + (farPlane - nearPlane) * t, nearPlane * pow(farPlane / nearPlane, t),
+                                  SPLIT_LAMBDA);
+
+        // The slice's corners in light space
+        glm::vec3 boxMin(numeric_limits<float>::max());
+        glm::vec3 boxMax(numeric_limits<float>::lowest());
+        for (float depth : {sliceNear, sliceFar}) {
+            for (uint32_t corner = 0; corner < 4; corner++) {
+                float x = (corner & 1) ? depth / p00 : -depth / p00;
+                float y = (corner & 2) ? depth / p11 : -depth / p11;
+                glm::vec3 point(viewToLight * glm::vec4(x, y, -depth, 1.0f));
+                boxMin = glm::min(boxMin, point);
+                boxMax = glm::max(boxMax, point);
+            }
+        }
+        boxMax.z = max(boxMax.z, casterMaxZ);
+        sliceNear = sliceFar;
+
+        ShadowCascade& cascade = cascades[i];
+        bool isStatic = i >= firstStatic;
+        cascade.staticOnly = isStatic;
+        bool cached = i > 0 && (isStatic || config.updateInterval > 1);
+        if (!cached) {
+            fitCascade(i, boxMin, boxMax, 0.0f);
+            cascade.render = true;
+            continue;
+        }
+
+        // Staggered, so cascades sharing an interval are not drawn in the same frame
+        const Fit& fit = fits[i];
+        bool covered = fit.valid && glm::all(glm::greaterThanEqual(boxMin, fit.min)) &&
+                       glm::all(glm::lessThanEqual(boxMax, fit.max));
+        bool due = !isStatic && (frame + i) % config.updateInterval == 0;
+        if (!covered || due) {
+            fitCascade(i, boxMin, boxMax, CACHED_MARGIN);
+            cascade.render = true;
+        }
+    }
+}
+
+void ShadowCascades::fitCascade(uint32_t index, const glm::vec3& boxMin, const glm::vec3& boxMax, float margin) {
+    glm::vec3 pad = (boxMax - boxMin) * margin;
+    glm::vec3 fitMin = boxMin - pad;
+    glm::vec3 fitMax = boxMax + pad;
+
+    // Snap to whole texels: the corner to the texel grid, the size to cover
+    // the box from there
+    float resolution = static_cast<float>(config.resolution);
+    float largestTexel = 0.0f;
+    for (int axis = 0; axis < 2; axis++) {
+        float texel = max((fitMax[axis] - fitMin[axis]) / (resolution - 1.0f), 1e-6f);
+        texel = exp2(ceil(log2(texel) * TEXEL_SIZE_STEPS) / TEXEL_SIZE_STEPS);
+        fitMin[axis] = floor(fitMin[axis] / texel) * texel;
+        fitMax[axis] = fitMin[axis] + texel * resolution;
+        largestTexel = max(largestTexel, texel);
+    }
+    texelSizes[index] = largestTexel;
+    fits[index] = {fitMin, fitMax, true};
+
+    ShadowCascade& cascade = cascades[index];
+    glm::mat4 projection = glm::ortho(fitMin.x, fitMax.x, fitMin.y, fitMax.y, -fitMax.z, -fitMin.z);
+    cascade.viewProjection = projection * lightView;
+    cascade.frustum = Frustum::fromViewProjection(cascade.viewProjection);
+}
+
+bool ShadowCascades::hasDraws() const {
+    for (uint32_t i = 0; i < config.cascadeCount; i++) {
+        if (cascades[i].render) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ShadowCascades::upload(uint32_t frameSlot) {
+    currentSlot = frameSlot;
+    Slot& slot = slots[frameSlot];
+
+    if (!slot.set) {
+        slot.buffer = make_unique<vulkan::Buffer>(
+            *deviceRef, sizeof(GpuShadowData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        slot.set = make_unique<vulkan::DescriptorSet>(*descriptorPool, *shadowSetLayout);
+        slot.set->updateBuffer(0, slot.buffer->handle(), 0, sizeof(GpuShadowData));
+        // Persistently mapped, which also keeps the defragmenter from moving it
+        // out from under the set written once here
+        slot.mapped = slot.buffer->map();
+    }
+    if (slot.atlasVersion != atlasVersion) {
+        slot.set->updateImage(1, atlas->view(), compareSampler->handle());
+        slot.atlasVersion = atlasVersion;
+    }
+
+    // Nothing to sample until the atlas has been drawn
+    uint32_t count = atlasWritten ? config.cascadeCount : 0;
+    auto atlasSize = glm::vec2(static_cast<float>(atlas->width()), static_cast<float>(atlas->height()));
+
+    GpuShadowData data{};
+    for (uint32_t i = 0; i < count; i++) {
+        const VkRect2D& tile = cascades[i].tile;
+        data.cascades[i] = cascades[i].viewProjection;
+        data.tiles[i] = glm::vec4(glm::vec2(static_cast<float>(tile.offset.x), static_cast<float>(tile.offset.y)) / atlasSize,
+                                  glm::vec2(static_cast<float>(tile.extent.width), static_cast<float>(tile.extent.height)) / atlasSize);
+        data.texelSizes[static_cast<int>(i)] = texelSizes[i];
+    }
+    data.params = glm::vec4(1.0f / atlasSize, EDGE_TEXELS * 2.0f / static_cast<float>(config.resolution), DEPTH_BIAS);
+    data.counts = glm::uvec4(count, 0, 0, 0);
+    memcpy(slot.mapped, &data, sizeof(data));
+}
+
+RenderGraph::ImageHandle ShadowCascades::importAtlas(RenderGraph& graph) {
+    clearThisFrame = !atlasWritten;
+    atlasWritten = true;
+    atlasImported = true;
+    if (clearThisFrame) {
+        return graph.importImage("shadow atlas", *atlas, VK_IMAGE_LAYOUT_UNDEFINED, ImageAccess::SampledGraphics);
+    }
+    // The previous frame sampled it, the first pass drawing into it waits for that
+    return graph.importImage("shadow atlas", *atlas, ImageAccess::SampledGraphics, ImageAccess::SampledGraphics);
+}
+
+} // namespace anim::renderer
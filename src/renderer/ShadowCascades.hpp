@@ -0,0 +1,162 @@
+#pragma once
+
+#include "Bounds.hpp"
+#include "Culling.hpp"
+#include "RenderGraph.hpp"
+#include "../vulkan/Device.hpp"
+#include "../vulkan/Buffer.hpp"
+#include "../vulkan/Image.hpp"
+#include "../vulkan/Sampler.hpp"
+#include "../vulkan/RenderPass.hpp"
+#include "../vulkan/DescriptorSet.hpp"
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+namespace anim::renderer {
+
+// Cascades share one atlas, sampled with depth comparison
+static constexpr uint32_t MAX_SHADOW_CASCADES = 4;
+static constexpr VkFormat SHADOW_FORMAT = VK_FORMAT_D32_SFLOAT;
+
+enum class ShadowQuality {
+    Off,
+    Low,
+    Medium,
+    High
+};
+
+struct ShadowSettings {
+    uint32_t cascadeCount = 3;    // 0 turns shadows off, at most MAX_SHADOW_CASCADES
+    uint32_t resolution = 2048;   // Of each cascade's square tile in the atlas
+    float distance = 80.0f;       // From the camera, the cascades split the range up to here
+    uint32_t updateInterval = 1;  // Frames between redraws of cascades past the first, staggered
+    uint32_t staticCascades = 1;  // The farthest ones, drawn from static meshes and cached
+
+    static ShadowSettings forQuality(ShadowQuality quality);
+};
+
+// Set 3 of model.frag, std140 layout
+struct GpuShadowData {
+    array<glm::mat4, MAX_SHADOW_CASCADES> cascades;  // World to each cascade's clip space
+    array<glm::vec4, MAX_SHADOW_CASCADES> tiles;     // xy = offset, zw = scale in the atlas
+    glm::vec4 texelSizes;                            // World size of a texel, per cascade
+    glm::vec4 params;                                // xy = 1 / atlas size, z = tile edge margin, w = depth bias
+    glm::uvec4 counts;                               // x = cascades
+};
+
+// A cascade as of the last update
+struct ShadowCascade {
+    glm::mat4 viewProjection{1.0f};  // Orthographic, looking along the light
+    Frustum frustum{};               // Of viewProjection, for culling its casters
+    VkRect2D tile{};                 // In the atlas
+    bool render = false;             // Drawn this frame
+    bool staticOnly = false;         // Cached, drawn from static meshes only
+};
+
+// Cascaded shadow maps for one directional light. The camera's range up to
+// the shadow distance is split into slices, and each cascade is an
+// orthographic box fitted tightly around its slice in light space, snapped to
+// whole texels so shadows hold still while the camera moves. The box reaches
+// back to the scene bounds toward the light, so casters outside the view
+// still shadow it.
+//
+// The first cascade is refitted and drawn every frame. The others can be
+// drawn every updateInterval frames, staggered, and the static ones only when
+// the light turns, static meshes change or the camera leaves their box. Those
+// are fitted with a margin so they stay valid for a while.
+class ShadowCascades {
+public:
+    // Keeps a uniform buffer for each of the renderer's framesInFlight slots
+    ShadowCascades(vulkan::Device& device, const ShadowSettings& settings, uint32_t framesInFlight);
+
+    // Non-copyable
+    ShadowCascades(const ShadowCascades&) = delete;
+    ShadowCascades& operator=(const ShadowCascades&) = delete;
+
+    // Recreates the atlas, every cascade is drawn again
+    void setSettings(const ShadowSettings& settings);
+    const ShadowSettings& settings() const { return config; }
+    bool enabled() const { return config.cascadeCount > 0; }
+
+    // Fits the cascades to the camera and decides which are drawn this frame.
+    // proj is the camera's Vulkan projection, lightDirection where the light
+    // points, and sceneBounds holds every caster.
+    void update(const glm::mat4& view, const glm::mat4& proj, float nearPlane,
+                const glm::vec3& lightDirection, const BoundingBox& sceneBounds);
+    // Static meshes were added, removed, hidden or moved
+    void invalidateStatic() { staticDirty = true; }
+
+    uint32_t cascadeCount() const { return config.cascadeCount; }
+    const ShadowCascade& cascade(uint32_t index) const { return cascades[index]; }
+    bool hasDraws() const;  // Some cascade is drawn this frame
+
+    // Uploads the cascades into frameSlot's uniform buffer, call once the
+    // renderer has waited for frameSlot
+    void upload(uint32_t frameSlot);
+
+    // Imports the atlas into the frame's graph, left ready for sampling. A new
+    // atlas starts undefined, then clearsAtlas() is true for the frame and the
+    // pass drawing the cascades must clear all of it.
+    RenderGraph::ImageHandle importAtlas(RenderGraph& graph);
+    bool clearsAtlas() const { return clearThisFrame; }
+
+    // Depth-only target of the atlas, for the shadow pipeline
+    const vulkan::RenderTarget& target() const { return atlasTarget; }
+
+    // Cascades of the last upload and the atlas, set 3 of the scene pipelines
+    VkDescriptorSetLayout setLayout() const { return shadowSetLayout->handle(); }
+    VkDescriptorSet set() const { return slots[currentSlot].set->handle(); }
+
+private:
+    // Light-space box a cascade was drawn with
+    struct Fit {
+        glm::vec3 min{0.0f};
+        glm::vec3 max{0.0f};
+        bool valid = false;
+    };
+
+    void createAtlas();
+    void fitCascade(uint32_t index, const glm::vec3& boxMin, const glm::vec3& boxMax, float margin);
+
+    vulkan::Device* deviceRef;
+    ShadowSettings config;
+
+    unique_ptr<vulkan::Image> atlas;
+    unique_ptr<vulkan::Sampler> compareSampler;
+    unique_ptr<vulkan::RenderPass> renderPass;  // Render pass path only
+    vulkan::RenderTarget atlasTarget;
+    uint32_t atlasVersion = 0;  // Counts recreations, slots rewrite their set when behind
+    bool atlasWritten = false;
+    bool atlasImported = false;  // Since the last update
+    bool clearThisFrame = false;
+
+    unique_ptr<vulkan::DescriptorSetLayout> shadowSetLayout;
+    unique_ptr<vulkan::DescriptorPool> descriptorPool;
+
+    // One uniform buffer per frame slot, rewritten once the slot's frame has finished
+    struct Slot {
+        unique_ptr<vulkan::Buffer> buffer;
+        void* mapped = nullptr;  // Held for the buffer's lifetime
+        unique_ptr<vulkan::DescriptorSet> set;
+        uint32_t atlasVersion = 0;
+    };
+    vector<Slot> slots;
+    uint32_t currentSlot = 0;
+
+    array<ShadowCascade, MAX_SHADOW_CASCADES> cascades;
+    array<Fit, MAX_SHADOW_CASCADES> fits;
+    array<float, MAX_SHADOW_CASCADES> texelSizes{};
+    glm::vec3 lightDirection{0.0f};
+    glm::mat4 lightView{1.0f};
+    bool staticDirty = true;
+    uint64_t frame = 0;
+};
+
+} // namespace anim::renderer
@@ -13,8 +13,8 @@ namespace anim::renderer {
 
 Texture::Texture(vulkan::Device& device, vulkan::CommandPool& cmdPool, const string& path)
     : image(device, 1, 1, VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-            VK_IMAGE_ASPECT_COLOR_BIT)
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_SAMPLE_COUNT_1_BIT, vulkan::MemoryClass::Texture)
     , texSampler(device) {
     int width, height, channels;
     stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
@@ -25,8 +25,9 @@ Texture::Texture(vulkan::Device& device, vulkan::CommandPool& cmdPool, const str
 
     // Recreate image with actual dimensions
     image = vulkan::Image(device, width, height, VK_FORMAT_R8G8B8A8_SRGB,
-                          VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                          VK_IMAGE_ASPECT_COLOR_BIT);
+                          VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                          VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_SAMPLE_COUNT_1_BIT,
+                          vulkan::MemoryClass::Texture);
 
     upload(device, cmdPool, width, height, pixels);
 
@@ -36,8 +37,8 @@ Texture::Texture(vulkan::Device& device, vulkan::CommandPool& cmdPool, const str
 Texture::Texture(vulkan::Device& device, vulkan::CommandPool& cmdPool,
                  uint32_t width, uint32_t height, const void* pixels)
     : image(device, width, height, VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-            VK_IMAGE_ASPECT_COLOR_BIT)
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_SAMPLE_COUNT_1_BIT, vulkan::MemoryClass::Texture)
     , texSampler(device) {
     upload(device, cmdPool, width, height, pixels);
 }
@@ -49,7 +50,8 @@ void Texture::upload(vulkan::Device& device, vulkan::CommandPool& cmdPool,
     // Create staging buffer
     vulkan::Buffer stagingBuffer(device, imageSize,
                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                  VMA_MEMORY_USAGE_CPU_ONLY);
+                                  VMA_MEMORY_USAGE_CPU_ONLY,
+                                  vulkan::MemoryClass::Staging);
     stagingBuffer.upload(pixels, imageSize);
 
     // Record and submit transfer commands
@@ -77,6 +79,9 @@ void Texture::upload(vulkan::Device& device, vulkan::CommandPool& cmdPool,
 
     vkQueueSubmit(device.graphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE);
     vkQueueWaitIdle(device.graphicsQueue());
+
+    // Scene writes fresh material sets when the defragmenter moves it
+    image.setRelocatable(true);
 }
 
 } // namespace anim::renderer
@@ -36,6 +36,7 @@ public:
     VkSampler sampler() const { return texSampler.handle(); }
     uint32_t width() const { return image.width(); }
     uint32_t height() const { return image.height(); }
+    VkDeviceSize memorySize() const { return image.allocationSize(); }
 
 private:
     void upload(vulkan::Device& device, vulkan::CommandPool& cmdPool,
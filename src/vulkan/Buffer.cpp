@@ -8,32 +8,37 @@ using namespace std;
 namespace anim::vulkan {
 
 Buffer::Buffer(Device& device, VkDeviceSize size,
-               VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage)
+               VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage,
+               MemoryClass memoryClass)
     : deviceRef(&device)
-    , bufferSize(size) {
+    , bufferSize(size)
+    // Transfer usage lets the defragmenter copy the contents to a new location
+    , bufferUsage(usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT) {
 
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
-    bufferInfo.usage = usage;
+    bufferInfo.usage = bufferUsage;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
     VmaAllocationCreateInfo allocInfo{};
     allocInfo.usage = memoryUsage;
+    allocInfo.pool = deviceRef->memoryPoolFor(memoryClass, bufferInfo, memoryUsage);
 
-    if (vmaCreateBuffer(deviceRef->allocator(), &bufferInfo, &allocInfo,
-                        &buffer, &allocation, nullptr) != VK_SUCCESS) {
+    VkResult result = vmaCreateBuffer(deviceRef->allocator(), &bufferInfo, &allocInfo,
+                                      &buffer, &allocation, nullptr);
+    if (result != VK_SUCCESS && allocInfo.pool != VK_NULL_HANDLE) {
+        throw runtime_error("Failed to create buffer: memory pool of its class is full");
+    }
+    if (result != VK_SUCCESS) {
         throw runtime_error("Failed to create buffer");
     }
+
+    registerOwner();
 }
 
 Buffer::~Buffer() {
-    if (buffer != VK_NULL_HANDLE && deviceRef) {
-        if (mappedData) {
-            vmaUnmapMemory(deviceRef->allocator(), allocation);
-        }
-        vmaDestroyBuffer(deviceRef->allocator(), buffer, allocation);
-    }
+    destroy();
 }
 
 Buffer::Buffer(Buffer&& other) noexcept
@@ -41,38 +46,70 @@ Buffer::Buffer(Buffer&& other) noexcept
     , buffer(other.buffer)
     , allocation(other.allocation)
     , bufferSize(other.bufferSize)
-    , mappedData(other.mappedData) {
+    , bufferUsage(other.bufferUsage)
+    , mappedData(other.mappedData)
+    , relocationAllowed(other.relocationAllowed) {
     other.deviceRef = nullptr;
     other.buffer = VK_NULL_HANDLE;
     other.allocation = VK_NULL_HANDLE;
     other.bufferSize = 0;
     other.mappedData = nullptr;
+    registerOwner();
 }
 
 Buffer& Buffer::operator=(Buffer&& other) noexcept {
     if (this != &other) {
-        if (buffer != VK_NULL_HANDLE && deviceRef) {
-            if (mappedData) {
-                vmaUnmapMemory(deviceRef->allocator(), allocation);
-            }
-            vmaDestroyBuffer(deviceRef->allocator(), buffer, allocation);
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         buffer = other.buffer;
         allocation = other.allocation;
         bufferSize = other.bufferSize;
+        bufferUsage = other.bufferUsage;
         mappedData = other.mappedData;
+        relocationAllowed = other.relocationAllowed;
 
         other.deviceRef = nullptr;
         other.buffer = VK_NULL_HANDLE;
         other.allocation = VK_NULL_HANDLE;
         other.bufferSize = 0;
         other.mappedData = nullptr;
+        registerOwner();
     }
     return *this;
 }
 
+void Buffer::destroy() {
+    if (buffer == VK_NULL_HANDLE || !deviceRef) {
+        return;
+    }
+
+    VmaAllocator allocator = deviceRef->allocator();
+    if (mappedData) {
+        vmaUnmapMemory(allocator, allocation);
+        mappedData = nullptr;
+    }
+
+    // In-flight frames may still read the buffer, free it once they retire.
+    // Clearing the owner keeps the defragmenter away from it meanwhile.
+    vmaSetAllocationUserData(allocator, allocation, nullptr);
+    VkBuffer oldBuffer = buffer;
+    VmaAllocation oldAllocation = allocation;
+    deviceRef->deletionQueue().push([allocator, oldBuffer, oldAllocation]() {
+        vmaDestroyBuffer(allocator, oldBuffer, oldAllocation);
+    });
+
+    buffer = VK_NULL_HANDLE;
+    allocation = VK_NULL_HANDLE;
+}
+
+void Buffer::registerOwner() {
+    owner.object = this;
+    if (deviceRef && allocation != VK_NULL_HANDLE) {
+        vmaSetAllocationUserData(deviceRef->allocator(), allocation, &owner);
+    }
+}
+
 void Buffer::upload(const void* data, size_t size) {
     void* mapped = map();
     memcpy(mapped, data, size);
@@ -95,4 +132,41 @@ void Buffer::unmap() {
     }
 }
 
+void Buffer::invalidate() {
+    vmaInvalidateAllocation(deviceRef->allocator(), allocation, 0, VK_WHOLE_SIZE);
+}
+
+VkDeviceSize Buffer::allocationSize() const {
+    VmaAllocationInfo info{};
+    vmaGetAllocationInfo(deviceRef->allocator(), allocation, &info);
+    return info.size;
+}
+
+VkBuffer Buffer::createRelocated(VmaAllocation dstAllocation) const {
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = bufferSize;
+    bufferInfo.usage = bufferUsage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer newBuffer;
+    if (vkCreateBuffer(deviceRef->handle(), &bufferInfo, nullptr, &newBuffer) != VK_SUCCESS) {
+        throw runtime_error("Failed to create relocated buffer");
+    }
+    if (vmaBindBufferMemory(deviceRef->allocator(), dstAllocation, newBuffer) != VK_SUCCESS) {
+        vkDestroyBuffer(deviceRef->handle(), newBuffer, nullptr);
+        throw runtime_error("Failed to bind relocated buffer");
+    }
+    return newBuffer;
+}
+
+void Buffer::finishRelocation(VkBuffer newBuffer) {
+    // The allocation handle stays valid, VMA moves it to the new memory when
+    // the pass ends. In-flight frames may still read the old buffer.
+    VkDevice device = deviceRef->handle();
+    VkBuffer oldBuffer = buffer;
+    deviceRef->deletionQueue().push([device, oldBuffer]() { vkDestroyBuffer(device, oldBuffer, nullptr); });
+    buffer = newBuffer;
+}
+
 } // namespace anim::vulkan
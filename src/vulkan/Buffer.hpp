@@ -12,7 +12,8 @@ namespace anim::vulkan {
 class Buffer {
 public:
     Buffer(Device& device, VkDeviceSize size,
-           VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+           VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage,
+           MemoryClass memoryClass = MemoryClass::General);
     ~Buffer();
 
     // Non-copyable
@@ -25,17 +26,36 @@ public:
 
     VkBuffer handle() const { return buffer; }
     VkDeviceSize size() const { return bufferSize; }
+    VkDeviceSize allocationSize() const;  // Bytes actually reserved by VMA
 
     void upload(const void* data, size_t size);
     void* map();
     void unmap();
+    // Makes GPU writes visible to mapped reads on non-coherent memory
+    void invalidate();
+
+    // Defragmentation only moves buffers their owner opted in. The owner must
+    // rewrite descriptors from the relocation callback and not write the
+    // buffer from the host after creation.
+    void setRelocatable(bool relocatable) { relocationAllowed = relocatable; }
+    bool isRelocatable() const { return relocationAllowed && mappedData == nullptr; }
+    // Creates a buffer bound to the moved allocation, swapped in once the copy
+    // is recorded. The old handle is retired through the deletion queue.
+    VkBuffer createRelocated(VmaAllocation dstAllocation) const;
+    void finishRelocation(VkBuffer newBuffer);
 
 private:
+    void destroy();  // Defers handle destruction through the device deletion queue
+    void registerOwner();
+
     Device* deviceRef = nullptr;
     VkBuffer buffer = VK_NULL_HANDLE;
     VmaAllocation allocation = VK_NULL_HANDLE;
     VkDeviceSize bufferSize = 0;
+    VkBufferUsageFlags bufferUsage = 0;
     void* mappedData = nullptr;
+    bool relocationAllowed = false;
+    AllocationOwner owner{AllocationOwner::Kind::Buffer};
 };
 
 } // namespace anim::vulkan
@@ -1,6 +1,8 @@
 #include "CommandBuffer.hpp"
 
 #include <stdexcept>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -49,6 +51,33 @@ void CommandBuffer::begin(VkCommandBufferUsageFlags flags) {
     }
 }
 
+void CommandBuffer::beginSecondary(const RenderTarget& target, VkFramebuffer framebuffer,
+                                   VkCommandBufferUsageFlags flags) {
+    VkCommandBufferInheritanceRenderingInfo renderingInheritance{};
+    renderingInheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+    renderingInheritance.colorAttachmentCount = target.colorFormat != VK_FORMAT_UNDEFINED ? 1 : 0;
+    renderingInheritance.pColorAttachmentFormats = &target.colorFormat;
+    renderingInheritance.depthAttachmentFormat = target.depthFormat;
+    renderingInheritance.viewMask = target.viewMask;
+    renderingInheritance.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkCommandBufferInheritanceInfo inheritance{};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.pNext = target.dynamic() ? &renderingInheritance : nullptr;
+    inheritance.renderPass = target.renderPass;
+    inheritance.subpass = 0;
+    inheritance.framebuffer = framebuffer;
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = flags | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritance;
+
+    if (vkBeginCommandBuffer(buffer, &beginInfo) != VK_SUCCESS) {
+        throw runtime_error("Failed to begin secondary command buffer");
+    }
+}
+
 void CommandBuffer::end() {
     if (vkEndCommandBuffer(buffer) != VK_SUCCESS) {
         throw runtime_error("Failed to end command buffer");
@@ -78,6 +107,10 @@ void CommandBuffer::endRenderPass() {
     vkCmdEndRenderPass(buffer);
 }
 
+void CommandBuffer::executeCommands(const VkCommandBuffer* buffers, uint32_t count) {
+    vkCmdExecuteCommands(buffer, count, buffers);
+}
+
 void CommandBuffer::setViewport(float x, float y, float width, float height,
                                  float minDepth, float maxDepth) {
     VkViewport viewport{};
@@ -128,6 +161,16 @@ void CommandBuffer::drawIndexed(uint32_t indexCount, uint32_t instanceCount,
     vkCmdDrawIndexed(buffer, indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
 }
 
+void CommandBuffer::copyBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize size,
+                                VkDeviceSize srcOffset, VkDeviceSize dstOffset) {
+    VkBufferCopy region{};
+    region.srcOffset = srcOffset;
+    region.dstOffset = dstOffset;
+    region.size = size;
+
+    vkCmdCopyBuffer(buffer, src, dst, 1, &region);
+}
+
 void CommandBuffer::copyBufferToImage(VkBuffer srcBuffer, VkImage image,
                                        uint32_t width, uint32_t height) {
     VkBufferImageCopy region{};
@@ -145,6 +188,55 @@ void CommandBuffer::copyBufferToImage(VkBuffer srcBuffer, VkImage image,
                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
 }
 
+void CommandBuffer::copyImageToBuffer(VkImage image, VkBuffer dstBuffer,
+                                       uint32_t width, uint32_t height, VkDeviceSize offset) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {width, height, 1};
+
+    vkCmdCopyImageToBuffer(buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dstBuffer, 1, &region);
+}
+
+void CommandBuffer::copyImage(VkImage src, VkImage dst, uint32_t width, uint32_t height,
+                               uint32_t mipLevels, VkImageAspectFlags aspect) {
+    vector<VkImageCopy> regions(mipLevels);
+    for (uint32_t mip = 0; mip < mipLevels; mip++) {
+        auto& region = regions[mip];
+        region.srcSubresource.aspectMask = aspect;
+        region.srcSubresource.mipLevel = mip;
+        region.srcSubresource.baseArrayLayer = 0;
+        region.srcSubresource.layerCount = 1;
+        region.dstSubresource = region.srcSubresource;
+        region.extent = {max(width >> mip, 1u), max(height >> mip, 1u), 1};
+    }
+
+    vkCmdCopyImage(buffer, src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                   static_cast<uint32_t>(regions.size()), regions.data());
+}
+
+void CommandBuffer::blitImage(VkImage src, VkExtent2D srcExtent, VkImage dst, VkExtent2D dstExtent,
+                               VkFilter filter) {
+    VkImageBlit region{};
+    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.mipLevel = 0;
+    region.srcSubresource.baseArrayLayer = 0;
+    region.srcSubresource.layerCount = 1;
+    region.srcOffsets[1] = {static_cast<int32_t>(srcExtent.width), static_cast<int32_t>(srcExtent.height), 1};
+    region.dstSubresource = region.srcSubresource;
+    region.dstOffsets[1] = {static_cast<int32_t>(dstExtent.width), static_cast<int32_t>(dstExtent.height), 1};
+
+    vkCmdBlitImage(buffer, src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, filter);
+}
+
 void CommandBuffer::transitionImageLayout(VkImage image, VkFormat format,
                                            VkImageLayout oldLayout, VkImageLayout newLayout,
                                            uint32_t mipLevels) {
@@ -176,6 +268,18 @@ void CommandBuffer::transitionImageLayout(VkImage image, VkFormat format,
         barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
         srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
         dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    } else if (oldLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL &&
+               newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        srcStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
+               newLayout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
     } else {
         throw runtime_error("Unsupported layout transition");
     }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CommandPool.hpp"
+#include "RenderPass.hpp"
 
 #include <vulkan/vulkan.h>
 
@@ -24,6 +25,10 @@ public:
     VkCommandBuffer handle() const { return buffer; }
 
     void begin(VkCommandBufferUsageFlags flags = 0);
+    // Secondary buffer recorded inside subpass 0 of the target's render pass, or
+    // inside dynamic rendering with the target's formats, executed from a primary
+    void beginSecondary(const RenderTarget& target, VkFramebuffer framebuffer,
+                        VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
     void end();
     void reset(VkCommandBufferResetFlags flags = 0);
 
@@ -32,6 +37,7 @@ public:
                          uint32_t clearValueCount,
                          VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
     void endRenderPass();
+    void executeCommands(const VkCommandBuffer* buffers, uint32_t count);
 
     void setViewport(float x, float y, float width, float height,
                      float minDepth = 0.0f, float maxDepth = 1.0f);
@@ -48,8 +54,18 @@ public:
     void drawIndexed(uint32_t indexCount, uint32_t instanceCount = 1,
                      uint32_t firstIndex = 0, int32_t vertexOffset = 0, uint32_t firstInstance = 0);
 
+    void copyBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize size,
+                    VkDeviceSize srcOffset = 0, VkDeviceSize dstOffset = 0);
     void copyBufferToImage(VkBuffer buffer, VkImage image,
                            uint32_t width, uint32_t height);
+    // Tightly packed rows, the image must be in TRANSFER_SRC_OPTIMAL
+    void copyImageToBuffer(VkImage image, VkBuffer buffer,
+                           uint32_t width, uint32_t height, VkDeviceSize offset = 0);
+    void copyImage(VkImage src, VkImage dst, uint32_t width, uint32_t height,
+                   uint32_t mipLevels = 1, VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT);
+    // Whole-image color blit, scales and converts formats when extents or formats differ
+    void blitImage(VkImage src, VkExtent2D srcExtent, VkImage dst, VkExtent2D dstExtent,
+                   VkFilter filter = VK_FILTER_LINEAR);
     void transitionImageLayout(VkImage image, VkFormat format,
                                VkImageLayout oldLayout, VkImageLayout newLayout,
                                uint32_t mipLevels = 1);
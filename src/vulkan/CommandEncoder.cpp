@@ -0,0 +1,216 @@
+#include "CommandEncoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+EncoderCounts& EncoderCounts::operator+=(const EncoderCounts& other) {
+    pipelines += other.pipelines;
+    descriptorSets += other.descriptorSets;
+    buffers += other.buffers;
+    pushConstants += other.pushConstants;
+    dynamicState += other.dynamicState;
+    return *this;
+}
+
+EncoderStats& EncoderStats::operator+=(const EncoderStats& other) {
+    issued += other.issued;
+    skipped += other.skipped;
+    mergedPushConstants += other.mergedPushConstants;
+    draws += other.draws;
+    return *this;
+}
+
+void CommandEncoder::begin(VkCommandBuffer cmd) {
+    buffer = cmd;
+    counters = {};
+    invalidate();
+}
+
+void CommandEncoder::invalidate() {
+    pipeline = VK_NULL_HANDLE;
+    setLayout = VK_NULL_HANDLE;
+    sets.fill(VK_NULL_HANDLE);
+    vertexBuffers.fill(VK_NULL_HANDLE);
+    indexBuffer = VK_NULL_HANDLE;
+    pushLayout = VK_NULL_HANDLE;
+    pushValid.reset();
+    pendingBegin = pendingEnd = 0;
+    hasViewport = false;
+    hasScissor = false;
+}
+
+void CommandEncoder::bindPipeline(VkPipeline newPipeline) {
+    if (newPipeline == pipeline) {
+        counters.skipped.pipelines++;
+        return;
+    }
+    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, newPipeline);
+    pipeline = newPipeline;
+    counters.issued.pipelines++;
+}
+
+void CommandEncoder::bindDescriptorSets(VkPipelineLayout layout, uint32_t firstSet, uint32_t count,
+                                        const VkDescriptorSet* newSets) {
+    // Another layout may disturb any set, only trust what this call binds
+    if (layout != setLayout) {
+        setLayout = layout;
+        sets.fill(VK_NULL_HANDLE);
+    }
+
+    bool changed = false;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = firstSet + i;
+        if (slot >= MAX_DESCRIPTOR_SETS || sets[slot] != newSets[i]) {
+            changed = true;
+        }
+    }
+    if (!changed) {
+        counters.skipped.descriptorSets++;
+        return;
+    }
+
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, firstSet, count, newSets, 0, nullptr);
+    for (uint32_t i = 0; i < count && firstSet + i < MAX_DESCRIPTOR_SETS; i++) {
+        sets[firstSet + i] = newSets[i];
+    }
+    counters.issued.descriptorSets++;
+}
+
+void CommandEncoder::bindVertexBuffer(uint32_t binding, VkBuffer vertexBuffer, VkDeviceSize offset) {
+    bool tracked = binding < MAX_VERTEX_BINDINGS;
+    if (tracked && vertexBuffers[binding] == vertexBuffer && vertexOffsets[binding] == offset) {
+        counters.skipped.buffers++;
+        return;
+    }
+    vkCmdBindVertexBuffers(buffer, binding, 1, &vertexBuffer, &offset);
+    if (tracked) {
+        vertexBuffers[binding] = vertexBuffer;
+        vertexOffsets[binding] = offset;
+    }
+    counters.issued.buffers++;
+}
+
+void CommandEncoder::bindIndexBuffer(VkBuffer newBuffer, VkDeviceSize offset, VkIndexType type) {
+    if (newBuffer == indexBuffer && offset == indexOffset && type == indexType) {
+        counters.skipped.buffers++;
+        return;
+    }
+    vkCmdBindIndexBuffer(buffer, newBuffer, offset, type);
+    indexBuffer = newBuffer;
+    indexOffset = offset;
+    indexType = type;
+    counters.issued.buffers++;
+}
+
+void CommandEncoder::pushConstants(VkPipelineLayout layout, VkShaderStageFlags stages,
+                                   uint32_t offset, uint32_t size, const void* data) {
+    if (offset + size > MAX_PUSH_CONSTANT_BYTES) {
+        // Beyond what is tracked, record as is and forget the tracked values
+        flushPushConstants();
+        vkCmdPushConstants(buffer, layout, stages, offset, size, data);
+        pushLayout = VK_NULL_HANDLE;
+        pushValid.reset();
+        counters.issued.pushConstants++;
+        return;
+    }
+
+    if (layout != pushLayout || stages != pushStages) {
+        flushPushConstants();
+        pushLayout = layout;
+        pushStages = stages;
+        pushValid.reset();
+    }
+
+    bool known = true;
+    for (uint32_t i = offset; i < offset + size && known; i++) {
+        known = pushValid[i];
+    }
+    if (known && memcmp(pushData.data() + offset, data, size) == 0) {
+        counters.skipped.pushConstants++;
+        return;
+    }
+
+    // Touching or overlapping the pending range: widen it instead of recording another call
+    if (pendingEnd > pendingBegin) {
+        if (offset <= pendingEnd && offset + size >= pendingBegin) {
+            counters.mergedPushConstants++;
+        } else {
+            flushPushConstants();
+        }
+    }
+
+    memcpy(pushData.data() + offset, data, size);
+    for (uint32_t i = offset; i < offset + size; i++) {
+        pushValid.set(i);
+    }
+    if (pendingEnd > pendingBegin) {
+        pendingBegin = min(pendingBegin, offset);
+        pendingEnd = max(pendingEnd, offset + size);
+    } else {
+        pendingBegin = offset;
+        pendingEnd = offset + size;
+    }
+}
+
+void CommandEncoder::flushPushConstants() {
+    if (pendingEnd <= pendingBegin) {
+        return;
+    }
+    vkCmdPushConstants(buffer, pushLayout, pushStages, pendingBegin, pendingEnd - pendingBegin,
+                       pushData.data() + pendingBegin);
+    pendingBegin = pendingEnd = 0;
+    counters.issued.pushConstants++;
+}
+
+void CommandEncoder::setViewport(float x, float y, float width, float height, float minDepth, float maxDepth) {
+    VkViewport newViewport{x, y, width, height, minDepth, maxDepth};
+    if (hasViewport && memcmp(&newViewport, &viewport, sizeof(viewport)) == 0) {
+        counters.skipped.dynamicState++;
+        return;
+    }
+    vkCmdSetViewport(buffer, 0, 1, &newViewport);
+    viewport = newViewport;
+    hasViewport = true;
+    counters.issued.dynamicState++;
+}
+
+void CommandEncoder::setScissor(int32_t x, int32_t y, uint32_t width, uint32_t height) {
+    VkRect2D newScissor{{x, y}, {width, height}};
+    if (hasScissor && memcmp(&newScissor, &scissor, sizeof(scissor)) == 0) {
+        counters.skipped.dynamicState++;
+        return;
+    }
+    vkCmdSetScissor(buffer, 0, 1, &newScissor);
+    scissor = newScissor;
+    hasScissor = true;
+    counters.issued.dynamicState++;
+}
+
+void CommandEncoder::beforeDraw() {
+    flushPushConstants();
+    counters.draws++;
+}
+
+void CommandEncoder::drawIndexed(uint32_t indexCount, uint32_t instanceCount,
+                                 uint32_t firstIndex, int32_t vertexOffset, uint32_t firstInstance) {
+    beforeDraw();
+    vkCmdDrawIndexed(buffer, indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
+}
+
+void CommandEncoder::drawIndexedIndirect(VkBuffer commands, VkDeviceSize offset, uint32_t drawCount, uint32_t stride) {
+    beforeDraw();
+    vkCmdDrawIndexedIndirect(buffer, commands, offset, drawCount, stride);
+}
+
+void CommandEncoder::drawIndexedIndirectCount(VkBuffer commands, VkDeviceSize offset,
+                                              VkBuffer countBuffer, VkDeviceSize countOffset,
+                                              uint32_t maxDrawCount, uint32_t stride) {
+    beforeDraw();
+    vkCmdDrawIndexedIndirectCount(buffer, commands, offset, countBuffer, countOffset, maxDrawCount, stride);
+}
+
+} // namespace anim::vulkan
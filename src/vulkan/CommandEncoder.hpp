@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+// Graphics state calls by kind
+struct EncoderCounts {
+    uint32_t pipelines = 0;
+    uint32_t descriptorSets = 0;
+    uint32_t buffers = 0;        // Vertex and index
+    uint32_t pushConstants = 0;
+    uint32_t dynamicState = 0;   // Viewport and scissor
+
+    uint32_t total() const { return pipelines + descriptorSets + buffers + pushConstants + dynamicState; }
+    EncoderCounts& operator+=(const EncoderCounts& other);
+};
+
+struct EncoderStats {
+    EncoderCounts issued;
+    EncoderCounts skipped;          // Calls that would not have changed any state
+    uint32_t mergedPushConstants = 0;  // Updates folded into an adjacent one
+    uint32_t draws = 0;
+
+    EncoderStats& operator+=(const EncoderStats& other);
+};
+
+// Records graphics draws into a command buffer it does not own, remembering
+// what is bound so calls that change nothing are dropped. Push constant
+// updates are held until the next draw, adjacent ranges go out as one call.
+// Anything recorded on the buffer directly may change the remembered state,
+// call invalidate() afterwards.
+class CommandEncoder {
+public:
+    CommandEncoder() = default;
+    explicit CommandEncoder(VkCommandBuffer cmd) { begin(cmd); }
+
+    // Non-copyable
+    CommandEncoder(const CommandEncoder&) = delete;
+    CommandEncoder& operator=(const CommandEncoder&) = delete;
+
+    // Movable
+    CommandEncoder(CommandEncoder&&) noexcept = default;
+    CommandEncoder& operator=(CommandEncoder&&) noexcept = default;
+
+    // Starts over on a freshly begun buffer, clears state and stats
+    void begin(VkCommandBuffer cmd);
+    // Forgets bound state, e.g. after a render pass begins or secondaries execute
+    void invalidate();
+
+    VkCommandBuffer handle() const { return buffer; }
+    const EncoderStats& stats() const { return counters; }
+
+    void bindPipeline(VkPipeline pipeline);
+    void bindDescriptorSets(VkPipelineLayout layout, uint32_t firstSet, uint32_t count, const VkDescriptorSet* sets);
+    void bindDescriptorSet(VkPipelineLayout layout, uint32_t set, VkDescriptorSet descriptorSet) {
+        bindDescriptorSets(layout, set, 1, &descriptorSet);
+    }
+    void bindVertexBuffer(uint32_t binding, VkBuffer vertexBuffer, VkDeviceSize offset = 0);
+    void bindIndexBuffer(VkBuffer indexBuffer, VkDeviceSize offset = 0, VkIndexType indexType = VK_INDEX_TYPE_UINT32);
+    void pushConstants(VkPipelineLayout layout, VkShaderStageFlags stages,
+                       uint32_t offset, uint32_t size, const void* data);
+
+    void setViewport(float x, float y, float width, float height,
+                     float minDepth = 0.0f, float maxDepth = 1.0f);
+    void setScissor(int32_t x, int32_t y, uint32_t width, uint32_t height);
+
+    void drawIndexed(uint32_t indexCount, uint32_t instanceCount = 1,
+                     uint32_t firstIndex = 0, int32_t vertexOffset = 0, uint32_t firstInstance = 0);
+    void drawIndexedIndirect(VkBuffer commands, VkDeviceSize offset, uint32_t drawCount, uint32_t stride);
+    void drawIndexedIndirectCount(VkBuffer commands, VkDeviceSize offset,
+                                  VkBuffer countBuffer, VkDeviceSize countOffset,
+                                  uint32_t maxDrawCount, uint32_t stride);
+
+private:
+    // Vulkan guarantees 128 bytes of push constants, the renderer uses no more
+    static constexpr uint32_t MAX_PUSH_CONSTANT_BYTES = 128;
+    static constexpr uint32_t MAX_DESCRIPTOR_SETS = 5;  // The scene pipelines' sets
+    static constexpr uint32_t MAX_VERTEX_BINDINGS = 4;
+
+    void flushPushConstants();
+    void beforeDraw();
+
+    VkCommandBuffer buffer = VK_NULL_HANDLE;
+    EncoderStats counters;
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+
+    // Sets are remembered for one layout, binding with another forgets the rest
+    VkPipelineLayout setLayout = VK_NULL_HANDLE;
+    array<VkDescriptorSet, MAX_DESCRIPTOR_SETS> sets{};
+
+    array<VkBuffer, MAX_VERTEX_BINDINGS> vertexBuffers{};
+    array<VkDeviceSize, MAX_VERTEX_BINDINGS> vertexOffsets{};
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+    VkDeviceSize indexOffset = 0;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+
+    // Push constant values as of the next draw, known where valid is set.
+    // [pendingBegin, pendingEnd) has not been recorded yet.
+    VkPipelineLayout pushLayout = VK_NULL_HANDLE;
+    VkShaderStageFlags pushStages = 0;
+    array<uint8_t, MAX_PUSH_CONSTANT_BYTES> pushData{};
+    bitset<MAX_PUSH_CONSTANT_BYTES> pushValid;
+    uint32_t pendingBegin = 0;
+    uint32_t pendingEnd = 0;
+
+    VkViewport viewport{};
+    VkRect2D scissor{};
+    bool hasViewport = false;
+    bool hasScissor = false;
+};
+
+} // namespace anim::vulkan
@@ -0,0 +1,103 @@
+#include "ComputePipeline.hpp"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+ComputePipeline::ComputePipeline(Device& device, const vector<uint32_t>& shaderCode,
+                                 const vector<VkDescriptorSetLayout>& descriptorLayouts,
+                                 const vector<VkPushConstantRange>& pushConstantRanges)
+    : deviceRef(&device) {
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = shaderCode.size() * sizeof(uint32_t);
+    moduleInfo.pCode = shaderCode.data();
+
+    VkShaderModule shaderModule;
+    if (vkCreateShaderModule(deviceRef->handle(), &moduleInfo, nullptr, &shaderModule) != VK_SUCCESS) {
+        throw runtime_error("Failed to create shader module");
+    }
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(descriptorLayouts.size());
+    pipelineLayoutInfo.pSetLayouts = descriptorLayouts.empty() ? nullptr : descriptorLayouts.data();
+    pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size());
+    pipelineLayoutInfo.pPushConstantRanges = pushConstantRanges.empty() ? nullptr : pushConstantRanges.data();
+
+    if (vkCreatePipelineLayout(deviceRef->handle(), &pipelineLayoutInfo,
+                               nullptr, &pipelineLayout) != VK_SUCCESS) {
+        vkDestroyShaderModule(deviceRef->handle(), shaderModule, nullptr);
+        throw runtime_error("Failed to create compute pipeline layout");
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipelineLayout;
+
+    if (vkCreateComputePipelines(deviceRef->handle(), VK_NULL_HANDLE, 1,
+                                 &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+        vkDestroyPipelineLayout(deviceRef->handle(), pipelineLayout, nullptr);
+        vkDestroyShaderModule(deviceRef->handle(), shaderModule, nullptr);
+        throw runtime_error("Failed to create compute pipeline");
+    }
+
+    vkDestroyShaderModule(deviceRef->handle(), shaderModule, nullptr);
+}
+
+ComputePipeline::~ComputePipeline() {
+    destroy();
+}
+
+void ComputePipeline::destroy() {
+    if (!deviceRef || (pipeline == VK_NULL_HANDLE && pipelineLayout == VK_NULL_HANDLE)) {
+        return;
+    }
+
+    VkDevice device = deviceRef->handle();
+    VkPipeline oldPipeline = pipeline;
+    VkPipelineLayout oldLayout = pipelineLayout;
+    deviceRef->deletionQueue().push([device, oldPipeline, oldLayout]() {
+        if (oldPipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, oldPipeline, nullptr);
+        }
+        if (oldLayout != VK_NULL_HANDLE) {
+            vkDestroyPipelineLayout(device, oldLayout, nullptr);
+        }
+    });
+
+    pipeline = VK_NULL_HANDLE;
+    pipelineLayout = VK_NULL_HANDLE;
+}
+
+ComputePipeline::ComputePipeline(ComputePipeline&& other) noexcept
+    : deviceRef(other.deviceRef)
+    , pipeline(other.pipeline)
+    , pipelineLayout(other.pipelineLayout) {
+    other.deviceRef = nullptr;
+    other.pipeline = VK_NULL_HANDLE;
+    other.pipelineLayout = VK_NULL_HANDLE;
+}
+
+ComputePipeline& ComputePipeline::operator=(ComputePipeline&& other) noexcept {
+    if (this != &other) {
+        destroy();
+
+        deviceRef = other.deviceRef;
+        pipeline = other.pipeline;
+        pipelineLayout = other.pipelineLayout;
+
+        other.deviceRef = nullptr;
+        other.pipeline = VK_NULL_HANDLE;
+        other.pipelineLayout = VK_NULL_HANDLE;
+    }
+    return *this;
+}
+
+} // namespace anim::vulkan
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Device.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+class ComputePipeline {
+public:
+    ComputePipeline(Device& device, const vector<uint32_t>& shaderCode,
+                    const vector<VkDescriptorSetLayout>& descriptorLayouts = {},
+                    const vector<VkPushConstantRange>& pushConstantRanges = {});
+    ~ComputePipeline();
+
+    // Non-copyable
+    ComputePipeline(const ComputePipeline&) = delete;
+    ComputePipeline& operator=(const ComputePipeline&) = delete;
+
+    // Movable
+    ComputePipeline(ComputePipeline&& other) noexcept;
+    ComputePipeline& operator=(ComputePipeline&& other) noexcept;
+
+    VkPipeline handle() const { return pipeline; }
+    VkPipelineLayout layout() const { return pipelineLayout; }
+
+private:
+    void destroy();
+
+    Device* deviceRef = nullptr;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+};
+
+} // namespace anim::vulkan
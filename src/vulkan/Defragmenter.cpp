@@ -0,0 +1,262 @@
+#include "Defragmenter.hpp"
+#include "Buffer.hpp"
+#include "Image.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+static float fragmentationOf(const VmaDetailedStatistics& stats) {
+    VkDeviceSize freeBytes = stats.statistics.blockBytes - stats.statistics.allocationBytes;
+    if (freeBytes == 0 || stats.unusedRangeCount == 0) {
+        return 0.0f;
+    }
+    return 1.0f - static_cast<float>(stats.unusedRangeSizeMax) / static_cast<float>(freeBytes);
+}
+
+Defragmenter::Defragmenter(Device& device, const DefragmentationConfig& config)
+    : deviceRef(&device)
+    , config(config) {
+    commandPool = make_unique<CommandPool>(device, device.graphicsQueueFamily());
+    copyCommands = make_unique<CommandBuffer>(*commandPool);
+    copyFence = make_unique<Fence>(device, true);
+
+    targets.push_back(VK_NULL_HANDLE);
+    for (auto memoryClass : {MemoryClass::Texture, MemoryClass::Geometry, MemoryClass::Staging}) {
+        if (VmaPool pool = device.memoryPool(memoryClass)) {
+            targets.push_back(pool);
+        }
+    }
+}
+
+Defragmenter::~Defragmenter() {
+    if (passPending) {
+        // The retiring pass refers to this object, end it before going away
+        deviceRef->waitIdle();
+        deviceRef->deletionQueue().flush();
+    }
+    if (context != VK_NULL_HANDLE) {
+        vmaEndDefragmentation(deviceRef->allocator(), context, nullptr);
+    }
+}
+
+VmaDetailedStatistics Defragmenter::poolStatistics(VmaPool pool) const {
+    VmaDetailedStatistics stats{};
+    if (pool != VK_NULL_HANDLE) {
+        vmaCalculatePoolStatistics(deviceRef->allocator(), pool, &stats);
+    } else {
+        // Totals include custom pools, subtract them to get the default pools
+        VmaTotalStatistics total{};
+        vmaCalculateStatistics(deviceRef->allocator(), &total);
+        stats = total.total;
+        for (size_t i = 1; i < targets.size(); i++) {
+            VmaDetailedStatistics poolStats{};
+            vmaCalculatePoolStatistics(deviceRef->allocator(), targets[i], &poolStats);
+            stats.statistics.blockBytes -= poolStats.statistics.blockBytes;
+            stats.statistics.allocationBytes -= poolStats.statistics.allocationBytes;
+        }
+    }
+    return stats;
+}
+
+FragmentationStats Defragmenter::stats() const {
+    VmaTotalStatistics total{};
+    vmaCalculateStatistics(deviceRef->allocator(), &total);
+
+    FragmentationStats result;
+    result.blockBytes = total.total.statistics.blockBytes;
+    result.allocationBytes = total.total.statistics.allocationBytes;
+    result.largestFreeRange = total.total.unusedRangeCount > 0 ? total.total.unusedRangeSizeMax : 0;
+    result.freeRangeCount = total.total.unusedRangeCount;
+    result.fragmentation = fragmentationOf(total.total);
+    result.allocationsMoved = allocationsMoved;
+    result.bytesMoved = bytesMoved;
+    result.blocksFreed = blocksFreed;
+    return result;
+}
+
+void Defragmenter::step() {
+    // The last pass's copies are still running, or frames still use its old memory
+    if (passPending || !copyFence->signaled()) {
+        return;
+    }
+
+    if (context != VK_NULL_HANDLE && !passesRemaining) {
+        endDefragmentation();
+        return;
+    }
+    if (context == VK_NULL_HANDLE && !beginDefragmentation()) {
+        return;
+    }
+
+    if (!runPass()) {
+        endDefragmentation();
+    }
+}
+
+bool Defragmenter::beginDefragmentation() {
+    // Pick the next pool whose free space is fragmented enough to be worth moving
+    for (size_t i = 0; i < targets.size(); i++) {
+        size_t index = (currentTarget + i) % targets.size();
+        VmaDetailedStatistics stats = poolStatistics(targets[index]);
+        VkDeviceSize freeBytes = stats.statistics.blockBytes - stats.statistics.allocationBytes;
+
+        if (freeBytes < config.minFreeBytes || fragmentationOf(stats) < config.fragmentationThreshold) {
+            continue;
+        }
+
+        VmaDefragmentationInfo info{};
+        info.flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT;
+        info.pool = targets[index];
+        info.maxBytesPerPass = config.maxBytesPerFrame;
+        info.maxAllocationsPerPass = config.maxMovesPerFrame;
+
+        if (vmaBeginDefragmentation(deviceRef->allocator(), &info, &context) != VK_SUCCESS) {
+            context = VK_NULL_HANDLE;
+            return false;
+        }
+
+        currentTarget = index;
+        passesRemaining = true;
+        return true;
+    }
+    return false;
+}
+
+void Defragmenter::endDefragmentation() {
+    VmaDefragmentationStats defragStats{};
+    vmaEndDefragmentation(deviceRef->allocator(), context, &defragStats);
+    context = VK_NULL_HANDLE;
+    currentTarget = (currentTarget + 1) % targets.size();
+
+    blocksFreed += defragStats.deviceMemoryBlocksFreed;
+    if (defragStats.allocationsMoved > 0) {
+        cout << "Defragmentation moved " << defragStats.allocationsMoved << " allocation(s), freed "
+             << defragStats.deviceMemoryBlocksFreed << " block(s)" << endl;
+    }
+}
+
+// Returns false when the current defragmentation has nothing left to move
+bool Defragmenter::runPass() {
+    pass = {};
+    if (vmaBeginDefragmentationPass(deviceRef->allocator(), context, &pass) == VK_SUCCESS) {
+        return false;
+    }
+
+    struct PendingBuffer { Buffer* owner; VkBuffer newBuffer; };
+    struct PendingImage { Image* owner; VkImage newImage; };
+    vector<PendingBuffer> buffers;
+    vector<PendingImage> images;
+    VkDeviceSize passBytes = 0;
+
+    CommandBuffer& cmd = *copyCommands;
+    cmd.reset();
+    cmd.begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+    // Sources may have been written by frames submitted earlier
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmd.handle(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    for (uint32_t i = 0; i < pass.moveCount; i++) {
+        auto& move = pass.pMoves[i];
+
+        VmaAllocationInfo allocInfo{};
+        vmaGetAllocationInfo(deviceRef->allocator(), move.srcAllocation, &allocInfo);
+        auto* owner = static_cast<AllocationOwner*>(allocInfo.pUserData);
+
+        if (owner && owner->kind == AllocationOwner::Kind::Buffer) {
+            auto* buffer = static_cast<Buffer*>(owner->object);
+            if (!buffer->isRelocatable()) {
+                move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+                continue;
+            }
+            VkBuffer newBuffer = buffer->createRelocated(move.dstTmpAllocation);
+            cmd.copyBuffer(buffer->handle(), newBuffer, buffer->size());
+            buffers.push_back({buffer, newBuffer});
+        } else if (owner && owner->kind == AllocationOwner::Kind::Image) {
+            auto* image = static_cast<Image*>(owner->object);
+            if (!image->isRelocatable()) {
+                move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+                continue;
+            }
+            VkImage newImage = image->createRelocated(move.dstTmpAllocation);
+            cmd.transitionImageLayout(image->handle(), image->format(),
+                                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image->mipLevels());
+            cmd.transitionImageLayout(newImage, image->format(),
+                                      VK_IMAGE_LAYOUT_UNDEFINED,
+                                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, image->mipLevels());
+            cmd.copyImage(image->handle(), newImage, image->width(), image->height(),
+                          image->mipLevels(), image->aspect());
+            cmd.transitionImageLayout(newImage, image->format(),
+                                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, image->mipLevels());
+            images.push_back({image, newImage});
+        } else {
+            // Not owned by a wrapper we know how to rebind
+            move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+            continue;
+        }
+        passBytes += allocInfo.size;
+    }
+
+    // Frames recorded from now on use the new handles
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd.handle(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+    cmd.end();
+
+    if (buffers.empty() && images.empty()) {
+        // Nothing was copied, the pass can end right away
+        return vmaEndDefragmentationPass(deviceRef->allocator(), context, &pass) == VK_INCOMPLETE;
+    }
+
+    VkCommandBuffer cmdHandle = cmd.handle();
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmdHandle;
+
+    copyFence->reset();
+    if (vkQueueSubmit(deviceRef->graphicsQueue(), 1, &submitInfo, copyFence->handle()) != VK_SUCCESS) {
+        throw runtime_error("Failed to submit defragmentation copies");
+    }
+
+    // Old handles are retired through the deletion queue
+    for (auto& pending : buffers) {
+        pending.owner->finishRelocation(pending.newBuffer);
+    }
+    for (auto& pending : images) {
+        pending.owner->finishRelocation(pending.newImage);
+    }
+
+    allocationsMoved += buffers.size() + images.size();
+    bytesMoved += passBytes;
+
+    if (onRelocated) {
+        onRelocated();
+    }
+
+    // Ending the pass releases the old memory. It waits for the frame being
+    // recorded, which completes after the copies and every earlier frame. An
+    // owner destroyed meanwhile frees its allocation after this entry runs.
+    passPending = true;
+    deviceRef->deletionQueue().push([this]() { retirePass(); });
+    return true;
+}
+
+void Defragmenter::retirePass() {
+    passesRemaining = vmaEndDefragmentationPass(deviceRef->allocator(), context, &pass) == VK_INCOMPLETE;
+    passPending = false;
+}
+
+} // namespace anim::vulkan
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Device.hpp"
+#include "CommandPool.hpp"
+#include "CommandBuffer.hpp"
+#include "Sync.hpp"
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+struct DefragmentationConfig {
+    uint32_t maxMovesPerFrame = 64;
+    VkDeviceSize maxBytesPerFrame = 32 * 1024 * 1024;
+    float fragmentationThreshold = 0.5f;     // Start when free space is this fragmented
+    VkDeviceSize minFreeBytes = 16 * 1024 * 1024;  // Ignore pools with little free space
+};
+
+struct FragmentationStats {
+    VkDeviceSize blockBytes = 0;        // Device memory held by VMA
+    VkDeviceSize allocationBytes = 0;   // Bytes in live allocations
+    VkDeviceSize largestFreeRange = 0;
+    uint32_t freeRangeCount = 0;
+    float fragmentation = 0.0f;         // 1 - largestFreeRange / free bytes
+
+    // Totals since creation
+    uint64_t allocationsMoved = 0;
+    uint64_t bytesMoved = 0;
+    uint64_t blocksFreed = 0;
+};
+
+// Incremental defragmentation built on VMA's pass API. Each step() moves a
+// bounded number of allocations, recreates the owning Buffer/Image handles
+// and notifies listeners so descriptor sets can be rewritten. Only resources
+// their owner marked relocatable are moved. Copies are fenced, not waited on:
+// the old handles and memory retire through the device deletion queue once
+// the frames that used them complete.
+class Defragmenter {
+public:
+    Defragmenter(Device& device, const DefragmentationConfig& config = {});
+    ~Defragmenter();
+
+    // Non-copyable
+    Defragmenter(const Defragmenter&) = delete;
+    Defragmenter& operator=(const Defragmenter&) = delete;
+
+    // Call once per frame before recording
+    void step();
+
+    bool active() const { return context != VK_NULL_HANDLE; }
+    FragmentationStats stats() const;
+
+    void setMaxMovesPerFrame(uint32_t moves) { config.maxMovesPerFrame = moves; }
+    void setMaxBytesPerFrame(VkDeviceSize bytes) { config.maxBytesPerFrame = bytes; }
+    uint32_t maxMovesPerFrame() const { return config.maxMovesPerFrame; }
+    VkDeviceSize maxBytesPerFrame() const { return config.maxBytesPerFrame; }
+
+    // Called after a pass has moved resources, before the next frame records.
+    // Listeners must write fresh descriptor sets, in-flight frames still use
+    // the old ones.
+    void setRelocationCallback(function<void()> callback) { onRelocated = std::move(callback); }
+
+private:
+    bool beginDefragmentation();
+    void endDefragmentation();
+    bool runPass();
+    void retirePass();
+    VmaDetailedStatistics poolStatistics(VmaPool pool) const;
+
+    Device* deviceRef;
+    DefragmentationConfig config;
+    unique_ptr<CommandPool> commandPool;
+    unique_ptr<CommandBuffer> copyCommands;
+    unique_ptr<Fence> copyFence;  // Signaled once the last pass's copies completed
+    function<void()> onRelocated;
+
+    // Pools defragmented in turn, VK_NULL_HANDLE is the default pool set
+    vector<VmaPool> targets;
+    size_t currentTarget = 0;
+    VmaDefragmentationContext context = VK_NULL_HANDLE;
+    VmaDefragmentationPassMoveInfo pass{};
+    bool passPending = false;       // Moved, old memory still in use by in-flight frames
+    bool passesRemaining = true;    // Last ended pass left moves for another one
+
+    uint64_t allocationsMoved = 0;
+    uint64_t bytesMoved = 0;
+    uint64_t blocksFreed = 0;
+};
+
+} // namespace anim::vulkan
@@ -0,0 +1,68 @@
+#include "DeletionQueue.hpp"
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+void DeletionQueue::push(function<void()> destroy) {
+    bool retired = false;
+    uint64_t completed = 0;
+    {
+        lock_guard<mutex> guard(lock);
+        entries.push_back({submissionValue, std::move(destroy)});
+        retired = submissionValue <= completedValue;
+        completed = completedValue;
+    }
+
+    // Nothing in flight can reference it, run it along with anything older
+    if (retired) {
+        collect(completed);
+    }
+}
+
+void DeletionQueue::setSubmissionValue(uint64_t value) {
+    lock_guard<mutex> guard(lock);
+    submissionValue = value;
+}
+
+void DeletionQueue::collect(uint64_t completed) {
+    // Destroy outside the lock, destructors may push more entries
+    vector<function<void()>> ready;
+    {
+        lock_guard<mutex> guard(lock);
+        completedValue = max(completedValue, completed);
+        while (!entries.empty() && entries.front().value <= completedValue) {
+            ready.push_back(std::move(entries.front().destroy));
+            entries.pop_front();
+        }
+    }
+
+    for (auto& destroy : ready) {
+        destroy();
+    }
+}
+
+void DeletionQueue::flush() {
+    vector<function<void()>> ready;
+    {
+        lock_guard<mutex> guard(lock);
+        for (auto& entry : entries) {
+            ready.push_back(std::move(entry.destroy));
+        }
+        entries.clear();
+    }
+
+    for (auto& destroy : ready) {
+        destroy();
+    }
+}
+
+size_t DeletionQueue::size() const {
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+}
+
+} // namespace anim::vulkan
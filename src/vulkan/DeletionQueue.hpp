@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+using namespace std;
+
+namespace anim::vulkan {
+
+// Defers destruction of GPU objects until the work that may still use them
+// has completed. Entries are tagged with the submission value the renderer is
+// currently recording and run once the completed value reaches it.
+class DeletionQueue {
+public:
+    DeletionQueue() = default;
+
+    // Non-copyable
+    DeletionQueue(const DeletionQueue&) = delete;
+    DeletionQueue& operator=(const DeletionQueue&) = delete;
+
+    // Runs destroy once all work up to the current submission value is done,
+    // immediately if nothing is in flight
+    void push(function<void()> destroy);
+
+    // Value that work recorded from now on will signal when it completes
+    void setSubmissionValue(uint64_t value);
+
+    // Runs every entry whose value is <= completedValue
+    void collect(uint64_t completedValue);
+
+    // Runs everything, the caller guarantees the GPU is idle
+    void flush();
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        uint64_t value;
+        function<void()> destroy;
+    };
+
+    mutable mutex lock;
+    deque<Entry> entries;  // Ordered by value since submission values only grow
+    uint64_t submissionValue = 0;
+    uint64_t completedValue = 0;
+};
+
+} // namespace anim::vulkan
@@ -56,13 +56,14 @@ DescriptorSetLayout& DescriptorSetLayout::operator=(DescriptorSetLayout&& other)
 // =============================================================================
 
 DescriptorPool::DescriptorPool(Device& device, const vector<VkDescriptorPoolSize>& poolSizes,
-                               uint32_t maxSets)
+                               uint32_t maxSets, VkDescriptorPoolCreateFlags flags)
     : deviceRef(&device) {
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
     poolInfo.maxSets = maxSets;
+    poolInfo.flags = flags;
 
     if (vkCreateDescriptorPool(deviceRef->handle(), &poolInfo, nullptr, &pool) != VK_SUCCESS) {
         throw runtime_error("Failed to create descriptor pool");
@@ -70,9 +71,19 @@ DescriptorPool::DescriptorPool(Device& device, const vector<VkDescriptorPoolSize
 }
 
 DescriptorPool::~DescriptorPool() {
-    if (deviceRef && pool != VK_NULL_HANDLE) {
-        vkDestroyDescriptorPool(deviceRef->handle(), pool, nullptr);
+    destroy();
+}
+
+void DescriptorPool::destroy() {
+    if (!deviceRef || pool == VK_NULL_HANDLE) {
+        return;
     }
+
+    // Destroying the pool frees its sets, which in-flight frames may still use
+    VkDevice device = deviceRef->handle();
+    VkDescriptorPool old = pool;
+    deviceRef->deletionQueue().push([device, old]() { vkDestroyDescriptorPool(device, old, nullptr); });
+    pool = VK_NULL_HANDLE;
 }
 
 DescriptorPool::DescriptorPool(DescriptorPool&& other) noexcept
@@ -84,9 +95,7 @@ DescriptorPool::DescriptorPool(DescriptorPool&& other) noexcept
 
 DescriptorPool& DescriptorPool::operator=(DescriptorPool&& other) noexcept {
     if (this != &other) {
-        if (deviceRef && pool != VK_NULL_HANDLE) {
-            vkDestroyDescriptorPool(deviceRef->handle(), pool, nullptr);
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         pool = other.pool;
@@ -125,6 +134,15 @@ vector<VkDescriptorSet> DescriptorPool::allocate(const vector<VkDescriptorSetLay
     return sets;
 }
 
+void DescriptorPool::free(VkDescriptorSet set) {
+    // Deferred so in-flight frames can keep using the set
+    VkDevice device = deviceRef->handle();
+    VkDescriptorPool owner = pool;
+    deviceRef->deletionQueue().push([device, owner, set]() {
+        vkFreeDescriptorSets(device, owner, 1, &set);
+    });
+}
+
 void DescriptorPool::reset() {
     vkResetDescriptorPool(deviceRef->handle(), pool, 0);
 }
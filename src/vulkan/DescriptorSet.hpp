@@ -34,7 +34,8 @@ private:
 // Allocates descriptor sets
 class DescriptorPool {
 public:
-    DescriptorPool(Device& device, const vector<VkDescriptorPoolSize>& poolSizes, uint32_t maxSets);
+    DescriptorPool(Device& device, const vector<VkDescriptorPoolSize>& poolSizes, uint32_t maxSets,
+                   VkDescriptorPoolCreateFlags flags = 0);
     ~DescriptorPool();
 
     // Non-copyable
@@ -50,9 +51,12 @@ public:
 
     VkDescriptorSet allocate(VkDescriptorSetLayout layout);
     vector<VkDescriptorSet> allocate(const vector<VkDescriptorSetLayout>& layouts);
+    void free(VkDescriptorSet set);  // Requires VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT
     void reset();
 
 private:
+    void destroy();
+
     Device* deviceRef = nullptr;
     VkDescriptorPool pool = VK_NULL_HANDLE;
 };
@@ -4,11 +4,15 @@
 #include <iostream>
 #include <stdexcept>
 #include <set>
+#include <algorithm>
 
 using namespace std;
 
 namespace anim::vulkan {
 
+// Scene pipelines bind up to five sets, see CommandEncoder::MAX_DESCRIPTOR_SETS
+static constexpr uint32_t MIN_BOUND_DESCRIPTOR_SETS = 5;
+
 const vector<const char*> deviceExtensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 #ifdef __APPLE__
@@ -16,20 +20,34 @@ const vector<const char*> deviceExtensions = {
 #endif
 };
 
-Device::Device(VkInstance instance, VkSurfaceKHR surface) {
+// Extensions a device needs, headless devices do without the swapchain
+static vector<const char*> requiredExtensions(VkSurfaceKHR surface) {
+    vector<const char*> extensions;
+    for (const char* name : deviceExtensions) {
+        if (surface != VK_NULL_HANDLE || string(name) != VK_KHR_SWAPCHAIN_EXTENSION_NAME) {
+            extensions.push_back(name);
+        }
+    }
+    return extensions;
+}
+
+// Enabled when the physical device supports them
+const vector<const char*> optionalDeviceExtensions = {
+    VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+};
+
+Device::Device(VkInstance instance, VkSurfaceKHR surface, const MemoryConfig& memoryConfig)
+    : memoryConfig(memoryConfig)
+    , deletion(make_unique<DeletionQueue>()) {
     pickPhysicalDevice(instance, surface);
     createLogicalDevice(surface);
     createAllocator(instance);
+    createMemoryPools();
     cout << "Vulkan device created" << endl;
 }
 
 Device::~Device() {
-    if (vmaAllocator != VK_NULL_HANDLE) {
-        vmaDestroyAllocator(vmaAllocator);
-    }
-    if (device != VK_NULL_HANDLE) {
-        vkDestroyDevice(device, nullptr);
-    }
+    destroy();
 }
 
 Device::Device(Device&& other) noexcept
@@ -38,22 +56,24 @@ Device::Device(Device&& other) noexcept
     , graphicsQ(other.graphicsQ)
     , presentQ(other.presentQ)
     , vmaAllocator(other.vmaAllocator)
-    , queueFamilies(other.queueFamilies) {
+    , queueFamilies(other.queueFamilies)
+    , enabledExtensions(move(other.enabledExtensions))
+    , optionalFeatures(other.optionalFeatures)
+    , memoryConfig(other.memoryConfig)
+    , pools(other.pools)
+    , pressure(other.pressure)
+    , deletion(move(other.deletion)) {
     other.physical = VK_NULL_HANDLE;
     other.device = VK_NULL_HANDLE;
     other.graphicsQ = VK_NULL_HANDLE;
     other.presentQ = VK_NULL_HANDLE;
     other.vmaAllocator = VK_NULL_HANDLE;
+    other.pools.fill(VK_NULL_HANDLE);
 }
 
 Device& Device::operator=(Device&& other) noexcept {
     if (this != &other) {
-        if (vmaAllocator != VK_NULL_HANDLE) {
-            vmaDestroyAllocator(vmaAllocator);
-        }
-        if (device != VK_NULL_HANDLE) {
-            vkDestroyDevice(device, nullptr);
-        }
+        destroy();
 
         physical = other.physical;
         device = other.device;
@@ -61,18 +81,47 @@ Device& Device::operator=(Device&& other) noexcept {
         presentQ = other.presentQ;
         vmaAllocator = other.vmaAllocator;
         queueFamilies = other.queueFamilies;
+        enabledExtensions = move(other.enabledExtensions);
+        optionalFeatures = other.optionalFeatures;
+        memoryConfig = other.memoryConfig;
+        pools = other.pools;
+        pressure = other.pressure;
+        deletion = move(other.deletion);
 
         other.physical = VK_NULL_HANDLE;
         other.device = VK_NULL_HANDLE;
         other.graphicsQ = VK_NULL_HANDLE;
         other.presentQ = VK_NULL_HANDLE;
         other.vmaAllocator = VK_NULL_HANDLE;
+        other.pools.fill(VK_NULL_HANDLE);
     }
     return *this;
 }
 
+void Device::destroy() {
+    if (device != VK_NULL_HANDLE && deletion) {
+        vkDeviceWaitIdle(device);
+        deletion->flush();
+    }
+    for (auto& pool : pools) {
+        if (pool != VK_NULL_HANDLE) {
+            vmaDestroyPool(vmaAllocator, pool);
+            pool = VK_NULL_HANDLE;
+        }
+    }
+    if (vmaAllocator != VK_NULL_HANDLE) {
+        vmaDestroyAllocator(vmaAllocator);
+        vmaAllocator = VK_NULL_HANDLE;
+    }
+    if (device != VK_NULL_HANDLE) {
+        vkDestroyDevice(device, nullptr);
+        device = VK_NULL_HANDLE;
+    }
+}
+
 void Device::waitIdle() const {
     vkDeviceWaitIdle(device);
+    deletion->flush();
 }
 
 void Device::pickPhysicalDevice(VkInstance instance, VkSurfaceKHR surface) {
@@ -122,17 +171,108 @@ void Device::createLogicalDevice(VkSurfaceKHR surface) {
         queueCreateInfos.push_back(queueCreateInfo);
     }
 
-    VkPhysicalDeviceFeatures deviceFeatures{};
-    deviceFeatures.fillModeNonSolid = VK_TRUE;
-    deviceFeatures.samplerAnisotropy = VK_TRUE;
+    // Vulkan 1.3 features may only be queried and enabled on 1.3 devices
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical, &props);
+    bool vulkan13 = props.apiVersion >= VK_API_VERSION_1_3;
+
+    // Present wait needs both extensions, their features are queried only then
+    bool presentWaitAvailable = surface != VK_NULL_HANDLE &&
+                                isExtensionAvailable(physical, VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+                                isExtensionAvailable(physical, VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+
+    // Optional features the device supports
+    VkPhysicalDeviceVulkan13Features supported13{};
+    supported13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    VkPhysicalDeviceVulkan12Features supported12{};
+    supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    supported12.pNext = vulkan13 ? &supported13 : nullptr;
+    VkPhysicalDeviceVulkan11Features supported11{};
+    supported11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    supported11.pNext = &supported12;
+    VkPhysicalDevicePresentWaitFeaturesKHR supportedPresentWait{};
+    supportedPresentWait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    supportedPresentWait.pNext = &supported11;
+    VkPhysicalDevicePresentIdFeaturesKHR supportedPresentId{};
+    supportedPresentId.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    supportedPresentId.pNext = &supportedPresentWait;
+    VkPhysicalDeviceFeatures2 supported{};
+    supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported.pNext = presentWaitAvailable ? static_cast<void*>(&supportedPresentId) : &supported11;
+    vkGetPhysicalDeviceFeatures2(physical, &supported);
+
+    optionalFeatures.multiDrawIndirect = supported.features.multiDrawIndirect;
+    optionalFeatures.drawIndirectFirstInstance = supported.features.drawIndirectFirstInstance;
+    optionalFeatures.drawIndirectCount = supported12.drawIndirectCount;
+    optionalFeatures.occlusionQueryPrecise = supported.features.occlusionQueryPrecise;
+    optionalFeatures.synchronization2 = vulkan13 && supported13.synchronization2;
+    optionalFeatures.dynamicRendering = vulkan13 && supported13.dynamicRendering;
+    optionalFeatures.presentWait = presentWaitAvailable && supportedPresentId.presentId &&
+                                   supportedPresentWait.presentWait;
+    if (supported11.multiview) {
+        VkPhysicalDeviceVulkan11Properties properties11{};
+        properties11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
+        VkPhysicalDeviceProperties2 properties{};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties.pNext = &properties11;
+        vkGetPhysicalDeviceProperties2(physical, &properties);
+        optionalFeatures.maxMultiviewViews = properties11.maxMultiviewViewCount;
+    }
+
+    // Vulkan 1.1, 1.2 and 1.3 features, chained through VkPhysicalDeviceFeatures2
+    VkPhysicalDeviceVulkan13Features features13{};
+    features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    features13.synchronization2 = optionalFeatures.synchronization2;
+    features13.dynamicRendering = optionalFeatures.dynamicRendering;
+
+    VkPhysicalDeviceVulkan12Features features12{};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    features12.pNext = vulkan13 ? &features13 : nullptr;
+    features12.timelineSemaphore = VK_TRUE;
+    features12.drawIndirectCount = optionalFeatures.drawIndirectCount;
+
+    VkPhysicalDeviceVulkan11Features features11{};
+    features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    features11.pNext = &features12;
+    features11.multiview = optionalFeatures.maxMultiviewViews > 0;
+
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+    presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    presentWaitFeatures.pNext = &features11;
+    presentWaitFeatures.presentWait = VK_TRUE;
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+    presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    presentIdFeatures.pNext = &presentWaitFeatures;
+    presentIdFeatures.presentId = VK_TRUE;
+
+    VkPhysicalDeviceFeatures2 deviceFeatures{};
+    deviceFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    deviceFeatures.pNext = optionalFeatures.presentWait ? static_cast<void*>(&presentIdFeatures) : &features11;
+    deviceFeatures.features.fillModeNonSolid = VK_TRUE;
+    deviceFeatures.features.samplerAnisotropy = VK_TRUE;
+    deviceFeatures.features.multiDrawIndirect = optionalFeatures.multiDrawIndirect;
+    deviceFeatures.features.drawIndirectFirstInstance = optionalFeatures.drawIndirectFirstInstance;
+    deviceFeatures.features.occlusionQueryPrecise = optionalFeatures.occlusionQueryPrecise;
+
+    vector<const char*> extensions = requiredExtensions(surface);
+    for (const char* name : optionalDeviceExtensions) {
+        if (isExtensionAvailable(physical, name)) {
+            extensions.push_back(name);
+        }
+    }
+    if (optionalFeatures.presentWait) {
+        extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
+    enabledExtensions = set<string>(extensions.begin(), extensions.end());
 
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
-    createInfo.pEnabledFeatures = &deviceFeatures;
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    createInfo.pNext = &deviceFeatures;
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     if (vkCreateDevice(physical, &createInfo, nullptr, &device) != VK_SUCCESS) {
         throw runtime_error("Failed to create logical device");
@@ -156,8 +296,13 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice dev, VkSurfaceKHR
             indices.graphics = i;
         }
 
+        // Headless: nothing is presented, the graphics queue stands in
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &presentSupport);
+        if (surface != VK_NULL_HANDLE) {
+            vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &presentSupport);
+        } else {
+            presentSupport = (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        }
         if (presentSupport) {
             indices.present = i;
         }
@@ -173,10 +318,10 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice dev, VkSurfaceKHR
 bool Device::isDeviceSuitable(VkPhysicalDevice dev, VkSurfaceKHR surface) {
     QueueFamilyIndices indices = findQueueFamilies(dev, surface);
 
-    bool extensionsSupported = checkDeviceExtensionSupport(dev);
+    bool extensionsSupported = checkDeviceExtensionSupport(dev, surface);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = surface == VK_NULL_HANDLE;
+    if (extensionsSupported && !swapChainAdequate) {
         uint32_t formatCount;
         vkGetPhysicalDeviceSurfaceFormatsKHR(dev, surface, &formatCount, nullptr);
 
@@ -186,23 +331,53 @@ bool Device::isDeviceSuitable(VkPhysicalDevice dev, VkSurfaceKHR surface) {
         swapChainAdequate = formatCount > 0 && presentModeCount > 0;
     }
 
-    return indices.isComplete() && extensionsSupported && swapChainAdequate;
+    // Frame pacing uses timeline semaphores
+    VkPhysicalDeviceVulkan12Features features12{};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(dev, &features);
+
+    // Vulkan only guarantees four bound sets, environment lighting is the
+    // scene pipelines' fifth. Desktop devices all bind at least eight.
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(dev, &props);
+
+    return indices.isComplete() && extensionsSupported && swapChainAdequate &&
+           features12.timelineSemaphore && props.limits.maxBoundDescriptorSets >= MIN_BOUND_DESCRIPTOR_SETS;
 }
 
-bool Device::checkDeviceExtensionSupport(VkPhysicalDevice dev) {
+bool Device::checkDeviceExtensionSupport(VkPhysicalDevice dev, VkSurfaceKHR surface) {
     uint32_t extensionCount;
     vkEnumerateDeviceExtensionProperties(dev, nullptr, &extensionCount, nullptr);
 
     vector<VkExtensionProperties> availableExtensions(extensionCount);
     vkEnumerateDeviceExtensionProperties(dev, nullptr, &extensionCount, availableExtensions.data());
 
-    set<string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+    vector<const char*> required = requiredExtensions(surface);
+    set<string> missing(required.begin(), required.end());
 
     for (const auto& extension : availableExtensions) {
-        requiredExtensions.erase(extension.extensionName);
+        missing.erase(extension.extensionName);
     }
 
-    return requiredExtensions.empty();
+    return missing.empty();
+}
+
+bool Device::isExtensionAvailable(VkPhysicalDevice dev, const char* name) {
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(dev, nullptr, &extensionCount, nullptr);
+
+    vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(dev, nullptr, &extensionCount, availableExtensions.data());
+
+    for (const auto& extension : availableExtensions) {
+        if (string(extension.extensionName) == name) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void Device::createAllocator(VkInstance instance) {
@@ -212,9 +387,196 @@ void Device::createAllocator(VkInstance instance) {
     allocatorInfo.instance = instance;
     allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_4;
 
+    // Without the extension VMA still estimates budgets from heap sizes
+    if (memoryBudgetSupported()) {
+        allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+    }
+
     if (vmaCreateAllocator(&allocatorInfo, &vmaAllocator) != VK_SUCCESS) {
         throw runtime_error("Failed to create VMA allocator");
     }
 }
 
+// Finds the memory type a pool for the given class should allocate from,
+// using a representative resource of that class
+static VkResult findMemoryTypeForClass(VmaAllocator allocator, MemoryClass memoryClass,
+                                       uint32_t* memoryTypeIndex) {
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.extent = {1024, 1024, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = 65536;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo allocInfo{};
+
+    switch (memoryClass) {
+        case MemoryClass::Texture:
+            imageInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
+            imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                              VK_IMAGE_USAGE_SAMPLED_BIT;
+            allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+            return vmaFindMemoryTypeIndexForImageInfo(allocator, &imageInfo, &allocInfo, memoryTypeIndex);
+        case MemoryClass::Transient:
+            imageInfo.format = VK_FORMAT_D32_SFLOAT;
+            imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+            allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+            return vmaFindMemoryTypeIndexForImageInfo(allocator, &imageInfo, &allocInfo, memoryTypeIndex);
+        case MemoryClass::Geometry:
+            bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                               VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+            allocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+            return vmaFindMemoryTypeIndexForBufferInfo(allocator, &bufferInfo, &allocInfo, memoryTypeIndex);
+        case MemoryClass::Staging:
+            bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+            allocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+            return vmaFindMemoryTypeIndexForBufferInfo(allocator, &bufferInfo, &allocInfo, memoryTypeIndex);
+        case MemoryClass::General:
+            break;
+    }
+    return VK_ERROR_FEATURE_NOT_PRESENT;
+}
+
+void Device::createMemoryPools() {
+    for (size_t i = 0; i < MEMORY_CLASS_COUNT; i++) {
+        auto memoryClass = static_cast<MemoryClass>(i);
+        const auto& config = memoryConfig.pools[i];
+        if (memoryClass == MemoryClass::General || !config.enabled) {
+            continue;
+        }
+
+        uint32_t memoryTypeIndex = 0;
+        if (findMemoryTypeForClass(vmaAllocator, memoryClass, &memoryTypeIndex) != VK_SUCCESS) {
+            // Resources of this class fall back to the default pools
+            continue;
+        }
+
+        VmaPoolCreateInfo poolInfo{};
+        poolInfo.memoryTypeIndex = memoryTypeIndex;
+        poolInfo.blockSize = config.blockSize;
+        poolInfo.maxBlockCount = config.maxBlockCount;
+
+        if (vmaCreatePool(vmaAllocator, &poolInfo, &pools[i]) != VK_SUCCESS) {
+            throw runtime_error("Failed to create VMA pool");
+        }
+        poolMemoryTypes[i] = memoryTypeIndex;
+    }
+}
+
+VmaPool Device::memoryPoolFor(MemoryClass memoryClass, const VkBufferCreateInfo& bufferInfo,
+                              VmaMemoryUsage usage) const {
+    size_t index = static_cast<size_t>(memoryClass);
+    if (pools[index] == VK_NULL_HANDLE) {
+        return VK_NULL_HANDLE;
+    }
+
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = usage;
+    allocInfo.memoryTypeBits = 1u << poolMemoryTypes[index];
+    uint32_t memoryTypeIndex = 0;
+    if (vmaFindMemoryTypeIndexForBufferInfo(vmaAllocator, &bufferInfo, &allocInfo, &memoryTypeIndex) != VK_SUCCESS) {
+        return VK_NULL_HANDLE;
+    }
+    return pools[index];
+}
+
+VmaPool Device::memoryPoolFor(MemoryClass memoryClass, const VkImageCreateInfo& imageInfo,
+                              VmaMemoryUsage usage) const {
+    size_t index = static_cast<size_t>(memoryClass);
+    if (pools[index] == VK_NULL_HANDLE) {
+        return VK_NULL_HANDLE;
+    }
+
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = usage;
+    allocInfo.memoryTypeBits = 1u << poolMemoryTypes[index];
+    uint32_t memoryTypeIndex = 0;
+    if (vmaFindMemoryTypeIndexForImageInfo(vmaAllocator, &imageInfo, &allocInfo, &memoryTypeIndex) != VK_SUCCESS) {
+        return VK_NULL_HANDLE;
+    }
+    return pools[index];
+}
+
+VmaPool Device::memoryPoolFor(MemoryClass memoryClass, const VkMemoryRequirements& requirements,
+                              VmaMemoryUsage usage) const {
+    size_t index = static_cast<size_t>(memoryClass);
+    if (pools[index] == VK_NULL_HANDLE) {
+        return VK_NULL_HANDLE;
+    }
+
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = usage;
+    uint32_t memoryTypeIndex = 0;
+    uint32_t typeBits = requirements.memoryTypeBits & (1u << poolMemoryTypes[index]);
+    if (vmaFindMemoryTypeIndex(vmaAllocator, typeBits, &allocInfo, &memoryTypeIndex) != VK_SUCCESS) {
+        return VK_NULL_HANDLE;
+    }
+    return pools[index];
+}
+
+vector<HeapBudget> Device::heapBudgets() const {
+    const VkPhysicalDeviceMemoryProperties* memProps = nullptr;
+    vmaGetMemoryProperties(vmaAllocator, &memProps);
+
+    vector<VmaBudget> budgets(memProps->memoryHeapCount);
+    vmaGetHeapBudgets(vmaAllocator, budgets.data());
+
+    vector<HeapBudget> result(memProps->memoryHeapCount);
+    for (uint32_t i = 0; i < memProps->memoryHeapCount; i++) {
+        result[i].usage = budgets[i].usage;
+        result[i].budget = budgets[i].budget;
+        result[i].deviceLocal = (memProps->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    }
+    return result;
+}
+
+void Device::updateMemoryBudget(uint32_t frameIndex) {
+    // Lets VMA refresh its cached budget from the driver once per frame
+    vmaSetCurrentFrameIndex(vmaAllocator, frameIndex);
+
+    float maxRatio = 0.0f;
+    for (const auto& heap : heapBudgets()) {
+        if (heap.deviceLocal && heap.budget > 0) {
+            maxRatio = max(maxRatio, static_cast<float>(heap.usage) / static_cast<float>(heap.budget));
+        }
+    }
+
+    MemoryPressure newPressure = MemoryPressure::Normal;
+    if (maxRatio >= memoryConfig.criticalPressureRatio) {
+        newPressure = MemoryPressure::Critical;
+    } else if (maxRatio >= memoryConfig.highPressureRatio) {
+        newPressure = MemoryPressure::High;
+    }
+
+    if (newPressure != pressure) {
+        static const char* names[] = {"normal", "high", "critical"};
+        cout << "GPU memory pressure: " << names[static_cast<int>(newPressure)]
+             << " (" << static_cast<int>(maxRatio * 100.0f) << "% of budget)" << endl;
+        pressure = newPressure;
+    }
+}
+
+bool Device::canAllocate(VkDeviceSize size) const {
+    // Fits if any device-local heap stays under the critical ratio
+    for (const auto& heap : heapBudgets()) {
+        if (!heap.deviceLocal) {
+            continue;
+        }
+        auto limit = static_cast<VkDeviceSize>(static_cast<double>(heap.budget) * memoryConfig.criticalPressureRatio);
+        if (heap.usage + size <= limit) {
+            return true;
+        }
+    }
+    return false;
+}
+
 } // namespace anim::vulkan
@@ -3,8 +3,14 @@
 #include <vulkan/vulkan.h>
 #include <vk_mem_alloc.h>
 
+#include "DeletionQueue.hpp"
+
 #include <vector>
 #include <optional>
+#include <array>
+#include <set>
+#include <string>
+#include <memory>
 
 using namespace std;
 
@@ -17,9 +23,71 @@ struct QueueFamilyIndices {
     bool isComplete() const { return graphics.has_value() && present.has_value(); }
 };
 
+// Resource classes with their own VMA pool, so usage can be tracked and
+// capped per kind of allocation
+enum class MemoryClass {
+    General,    // VMA default pools
+    Texture,    // Sampled images
+    Geometry,   // Vertex and index buffers
+    Transient,  // Render targets recreated with the swapchain
+    Staging     // Host-visible upload buffers
+};
+
+constexpr size_t MEMORY_CLASS_COUNT = 5;
+
+struct MemoryPoolConfig {
+    bool enabled = true;
+    VkDeviceSize blockSize = 0;  // 0 = VMA default
+    size_t maxBlockCount = 0;    // 0 = unlimited
+};
+
+struct MemoryConfig {
+    // Indexed by MemoryClass, the General entry is ignored
+    array<MemoryPoolConfig, MEMORY_CLASS_COUNT> pools;
+
+    // Fraction of a device-local heap budget at which loaders should back off
+    float highPressureRatio = 0.80f;
+    float criticalPressureRatio = 0.95f;
+};
+
+struct HeapBudget {
+    VkDeviceSize usage = 0;   // Bytes used by this process
+    VkDeviceSize budget = 0;  // Bytes this process can use before the driver pages
+    bool deviceLocal = false;
+};
+
+// Stored as VMA allocation user data so the defragmenter can find the
+// Buffer or Image that owns a moved allocation
+struct AllocationOwner {
+    enum class Kind { Buffer, Image };
+
+    Kind kind;
+    void* object = nullptr;
+};
+
+// Optional features, enabled when the physical device supports them
+struct DeviceFeatures {
+    bool multiDrawIndirect = false;
+    bool drawIndirectFirstInstance = false;
+    bool drawIndirectCount = false;  // vkCmdDrawIndexedIndirectCount
+    bool occlusionQueryPrecise = false;  // Occlusion queries return exact sample counts
+    bool synchronization2 = false;  // vkCmdPipelineBarrier2, Vulkan 1.3 devices
+    bool dynamicRendering = false;  // vkCmdBeginRendering, Vulkan 1.3 devices
+    bool presentWait = false;  // VK_KHR_present_id and VK_KHR_present_wait
+    uint32_t maxMultiviewViews = 0;  // Views of one multiview pass (Vulkan 1.1), 0 without multiview
+};
+
+enum class MemoryPressure {
+    Normal,
+    High,      // Streaming should stop growing
+    Critical   // New allocations will likely page or fail
+};
+
 class Device {
 public:
-    Device(VkInstance instance, VkSurfaceKHR surface);
+    // A null surface creates a headless device: no present support or
+    // swapchain extension is required, present and graphics queues are the same
+    Device(VkInstance instance, VkSurfaceKHR surface, const MemoryConfig& memoryConfig = {});
     ~Device();
 
     // Non-copyable
@@ -37,16 +105,42 @@ public:
     uint32_t graphicsQueueFamily() const { return queueFamilies.graphics.value(); }
     uint32_t presentQueueFamily() const { return queueFamilies.present.value(); }
     VmaAllocator allocator() const { return vmaAllocator; }
+    bool hasExtension(const string& name) const { return enabledExtensions.count(name) > 0; }
+    const DeviceFeatures& features() const { return optionalFeatures; }
+
+    // Memory pools and budget
+    VmaPool memoryPool(MemoryClass memoryClass) const { return pools[static_cast<size_t>(memoryClass)]; }
+    // The class's pool when its memory type suits the resource, VK_NULL_HANDLE
+    // for the default pools. A resource that fits the pool's memory type is
+    // never moved out of it, so a full pool fails instead of passing its cap.
+    VmaPool memoryPoolFor(MemoryClass memoryClass, const VkBufferCreateInfo& bufferInfo,
+                          VmaMemoryUsage usage) const;
+    VmaPool memoryPoolFor(MemoryClass memoryClass, const VkImageCreateInfo& imageInfo,
+                          VmaMemoryUsage usage) const;
+    VmaPool memoryPoolFor(MemoryClass memoryClass, const VkMemoryRequirements& requirements,
+                          VmaMemoryUsage usage) const;
+    bool memoryBudgetSupported() const { return hasExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME); }
+    vector<HeapBudget> heapBudgets() const;
+    void updateMemoryBudget(uint32_t frameIndex);
+    MemoryPressure memoryPressure() const { return pressure; }
+    bool canAllocate(VkDeviceSize size) const;
+
+    // Destruction of handles the GPU may still use, see DeletionQueue
+    DeletionQueue& deletionQueue() const { return *deletion; }
 
+    // Waits for the GPU and runs all deferred destruction
     void waitIdle() const;
 
 private:
     void pickPhysicalDevice(VkInstance instance, VkSurfaceKHR surface);
     void createLogicalDevice(VkSurfaceKHR surface);
     void createAllocator(VkInstance instance);
+    void createMemoryPools();
+    void destroy();
     QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface);
     bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface);
-    bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+    bool checkDeviceExtensionSupport(VkPhysicalDevice device, VkSurfaceKHR surface);
+    bool isExtensionAvailable(VkPhysicalDevice device, const char* name);
 
     VkPhysicalDevice physical = VK_NULL_HANDLE;
     VkDevice device = VK_NULL_HANDLE;
@@ -54,6 +148,15 @@ private:
     VkQueue presentQ = VK_NULL_HANDLE;
     VmaAllocator vmaAllocator = VK_NULL_HANDLE;
     QueueFamilyIndices queueFamilies;
+    set<string> enabledExtensions;
+    DeviceFeatures optionalFeatures;
+
+    MemoryConfig memoryConfig;
+    array<VmaPool, MEMORY_CLASS_COUNT> pools{};
+    array<uint32_t, MEMORY_CLASS_COUNT> poolMemoryTypes{};
+    MemoryPressure pressure = MemoryPressure::Normal;
+
+    unique_ptr<DeletionQueue> deletion;
 };
 
 } // namespace anim::vulkan
@@ -25,9 +25,19 @@ Framebuffer::Framebuffer(Device& device, RenderPass& renderPass,
 }
 
 Framebuffer::~Framebuffer() {
-    if (deviceRef && framebuffer != VK_NULL_HANDLE) {
-        vkDestroyFramebuffer(deviceRef->handle(), framebuffer, nullptr);
+    destroy();
+}
+
+void Framebuffer::destroy() {
+    if (!deviceRef || framebuffer == VK_NULL_HANDLE) {
+        return;
     }
+
+    // Deferred until frames recorded against it retire
+    VkDevice device = deviceRef->handle();
+    VkFramebuffer old = framebuffer;
+    deviceRef->deletionQueue().push([device, old]() { vkDestroyFramebuffer(device, old, nullptr); });
+    framebuffer = VK_NULL_HANDLE;
 }
 
 Framebuffer::Framebuffer(Framebuffer&& other) noexcept
@@ -40,9 +50,7 @@ Framebuffer::Framebuffer(Framebuffer&& other) noexcept
 
 Framebuffer& Framebuffer::operator=(Framebuffer&& other) noexcept {
     if (this != &other) {
-        if (deviceRef && framebuffer != VK_NULL_HANDLE) {
-            vkDestroyFramebuffer(deviceRef->handle(), framebuffer, nullptr);
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         framebuffer = other.framebuffer;
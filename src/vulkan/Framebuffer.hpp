@@ -28,6 +28,8 @@ public:
     VkExtent2D extent() const { return fbExtent; }
 
 private:
+    void destroy();
+
     Device* deviceRef = nullptr;
     VkFramebuffer framebuffer = VK_NULL_HANDLE;
     VkExtent2D fbExtent;
@@ -1,41 +1,65 @@
 #include "Image.hpp"
 
 #include <stdexcept>
+#include <atomic>
 
 using namespace std;
 
 namespace anim::vulkan {
 
+static atomic<uint64_t> nextViewGeneration{1};
+
 Image::Image(Device& device, uint32_t width, uint32_t height, VkFormat format,
              VkImageUsageFlags usage, VkImageAspectFlags aspectFlags,
-             uint32_t mipLevels, VkSampleCountFlagBits samples)
+             uint32_t mipLevels, VkSampleCountFlagBits samples,
+             MemoryClass memoryClass, bool cube)
     : deviceRef(&device)
     , imageFormat(format)
     , extent{width, height}
-    , mipLevelCount(mipLevels) {
-    createImage(usage, mipLevels, samples);
-    createImageView(aspectFlags);
+    , mipLevelCount(mipLevels)
+    , layerCount(cube ? 6 : 1)
+    , cubeCompatible(cube)
+    , imageUsage(usage)
+    , aspectMask(aspectFlags)
+    , sampleCount(samples) {
+    createImage(memoryClass);
+    createImageView();
+    registerOwner();
+}
+
+Image::Image(Device& device, uint32_t width, uint32_t height, VkFormat format,
+             VkImageUsageFlags usage, VkImageAspectFlags aspectFlags,
+             VmaAllocation memory, VkDeviceSize offset, uint32_t layers)
+    : deviceRef(&device)
+    , imageFormat(format)
+    , extent{width, height}
+    , layerCount(layers)
+    , imageUsage(usage)
+    , aspectMask(aspectFlags) {
+    // No allocation of its own, so the defragmenter never sees it
+    createPlacedImage(memory, offset);
+    createImageView();
 }
 
 Image::~Image() {
-    if (deviceRef) {
-        if (imageView != VK_NULL_HANDLE) {
-            vkDestroyImageView(deviceRef->handle(), imageView, nullptr);
-        }
-        if (image != VK_NULL_HANDLE) {
-            vmaDestroyImage(deviceRef->allocator(), image, allocation);
-        }
-    }
+    destroy();
 }
 
 Image::Image(Image&& other) noexcept
     : deviceRef(other.deviceRef)
     , image(other.image)
     , imageView(other.imageView)
+    , generation(other.generation)
     , allocation(other.allocation)
     , imageFormat(other.imageFormat)
     , extent(other.extent)
-    , mipLevelCount(other.mipLevelCount) {
+    , mipLevelCount(other.mipLevelCount)
+    , layerCount(other.layerCount)
+    , cubeCompatible(other.cubeCompatible)
+    , imageUsage(other.imageUsage)
+    , aspectMask(other.aspectMask)
+    , sampleCount(other.sampleCount)
+    , relocationAllowed(other.relocationAllowed) {
     other.deviceRef = nullptr;
     other.image = VK_NULL_HANDLE;
     other.imageView = VK_NULL_HANDLE;
@@ -43,26 +67,29 @@ Image::Image(Image&& other) noexcept
     other.imageFormat = VK_FORMAT_UNDEFINED;
     other.extent = {0, 0};
     other.mipLevelCount = 1;
+    other.layerCount = 1;
+    other.cubeCompatible = false;
+    registerOwner();
 }
 
 Image& Image::operator=(Image&& other) noexcept {
     if (this != &other) {
-        if (deviceRef) {
-            if (imageView != VK_NULL_HANDLE) {
-                vkDestroyImageView(deviceRef->handle(), imageView, nullptr);
-            }
-            if (image != VK_NULL_HANDLE) {
-                vmaDestroyImage(deviceRef->allocator(), image, allocation);
-            }
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         image = other.image;
         imageView = other.imageView;
+        generation = other.generation;
         allocation = other.allocation;
         imageFormat = other.imageFormat;
         extent = other.extent;
         mipLevelCount = other.mipLevelCount;
+        layerCount = other.layerCount;
+        cubeCompatible = other.cubeCompatible;
+        imageUsage = other.imageUsage;
+        aspectMask = other.aspectMask;
+        sampleCount = other.sampleCount;
+        relocationAllowed = other.relocationAllowed;
 
         other.deviceRef = nullptr;
         other.image = VK_NULL_HANDLE;
@@ -71,50 +98,180 @@ Image& Image::operator=(Image&& other) noexcept {
         other.imageFormat = VK_FORMAT_UNDEFINED;
         other.extent = {0, 0};
         other.mipLevelCount = 1;
+        other.layerCount = 1;
+        other.cubeCompatible = false;
+        registerOwner();
     }
     return *this;
 }
 
-void Image::createImage(VkImageUsageFlags usage, uint32_t mipLevels, VkSampleCountFlagBits samples) {
+VkImageCreateInfo Image::imageCreateInfo(VkFormat format, VkExtent2D extent, uint32_t mipLevels,
+                                         VkImageUsageFlags usage, VkSampleCountFlagBits samples,
+                                         uint32_t layers, bool cube) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.flags = cube ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.format = imageFormat;
+    imageInfo.format = format;
     imageInfo.extent.width = extent.width;
     imageInfo.extent.height = extent.height;
     imageInfo.extent.depth = 1;
     imageInfo.mipLevels = mipLevels;
-    imageInfo.arrayLayers = 1;
+    imageInfo.arrayLayers = layers;
     imageInfo.samples = samples;
     imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
     imageInfo.usage = usage;
     imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    return imageInfo;
+}
+
+VkImageCreateInfo Image::imageCreateInfo() const {
+    return imageCreateInfo(imageFormat, extent, mipLevelCount, imageUsage, sampleCount, layerCount, cubeCompatible);
+}
+
+VkMemoryRequirements Image::memoryRequirements(Device& device, uint32_t width, uint32_t height,
+                                               VkFormat format, VkImageUsageFlags usage, uint32_t layers) {
+    // Requirements depend on the driver, ask with a throwaway image
+    VkImageCreateInfo imageInfo = imageCreateInfo(format, {width, height}, 1, usage, VK_SAMPLE_COUNT_1_BIT, layers);
+    VkImage probe;
+    if (vkCreateImage(device.handle(), &imageInfo, nullptr, &probe) != VK_SUCCESS) {
+        throw runtime_error("Failed to create image");
+    }
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device.handle(), probe, &requirements);
+    vkDestroyImage(device.handle(), probe, nullptr);
+    return requirements;
+}
+
+void Image::createImage(MemoryClass memoryClass) {
+    VkImageCreateInfo imageInfo = imageCreateInfo();
 
     VmaAllocationCreateInfo allocInfo{};
     allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    allocInfo.pool = deviceRef->memoryPoolFor(memoryClass, imageInfo, allocInfo.usage);
 
-    if (vmaCreateImage(deviceRef->allocator(), &imageInfo, &allocInfo,
-                       &image, &allocation, nullptr) != VK_SUCCESS) {
+    VkResult result = vmaCreateImage(deviceRef->allocator(), &imageInfo, &allocInfo,
+                                     &image, &allocation, nullptr);
+    if (result != VK_SUCCESS && allocInfo.pool != VK_NULL_HANDLE) {
+        throw runtime_error("Failed to create image: memory pool of its class is full");
+    }
+    if (result != VK_SUCCESS) {
         throw runtime_error("Failed to create image");
     }
 }
 
-void Image::createImageView(VkImageAspectFlags aspectFlags) {
+void Image::createPlacedImage(VmaAllocation memory, VkDeviceSize offset) {
+    VkImageCreateInfo imageInfo = imageCreateInfo();
+    if (vkCreateImage(deviceRef->handle(), &imageInfo, nullptr, &image) != VK_SUCCESS) {
+        throw runtime_error("Failed to create image");
+    }
+    if (vmaBindImageMemory2(deviceRef->allocator(), memory, offset, image, nullptr) != VK_SUCCESS) {
+        vkDestroyImage(deviceRef->handle(), image, nullptr);
+        image = VK_NULL_HANDLE;
+        throw runtime_error("Failed to bind image memory");
+    }
+}
+
+void Image::createImageView() {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.viewType = cubeCompatible ? VK_IMAGE_VIEW_TYPE_CUBE
+                      : layerCount > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
     viewInfo.format = imageFormat;
-    viewInfo.subresourceRange.aspectMask = aspectFlags;
+    viewInfo.subresourceRange.aspectMask = aspectMask;
     viewInfo.subresourceRange.baseMipLevel = 0;
     viewInfo.subresourceRange.levelCount = mipLevelCount;
     viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
+    viewInfo.subresourceRange.layerCount = layerCount;
 
     if (vkCreateImageView(deviceRef->handle(), &viewInfo, nullptr, &imageView) != VK_SUCCESS) {
         throw runtime_error("Failed to create image view");
     }
+    generation = nextViewGeneration.fetch_add(1, memory_order_relaxed);
+}
+
+void Image::destroy() {
+    if (!deviceRef || (image == VK_NULL_HANDLE && imageView == VK_NULL_HANDLE)) {
+        return;
+    }
+
+    // In-flight frames may still sample the image, free it once they retire
+    VkDevice device = deviceRef->handle();
+    VmaAllocator allocator = deviceRef->allocator();
+    if (allocation != VK_NULL_HANDLE) {
+        vmaSetAllocationUserData(allocator, allocation, nullptr);
+    }
+    VkImage oldImage = image;
+    VkImageView oldView = imageView;
+    VmaAllocation oldAllocation = allocation;
+    deviceRef->deletionQueue().push([device, allocator, oldImage, oldView, oldAllocation]() {
+        if (oldView != VK_NULL_HANDLE) {
+            vkDestroyImageView(device, oldView, nullptr);
+        }
+        if (oldImage != VK_NULL_HANDLE) {
+            vmaDestroyImage(allocator, oldImage, oldAllocation);
+        }
+    });
+
+    image = VK_NULL_HANDLE;
+    imageView = VK_NULL_HANDLE;
+    allocation = VK_NULL_HANDLE;
+}
+
+void Image::registerOwner() {
+    owner.object = this;
+    if (deviceRef && allocation != VK_NULL_HANDLE) {
+        vmaSetAllocationUserData(deviceRef->allocator(), allocation, &owner);
+    }
+}
+
+VkDeviceSize Image::allocationSize() const {
+    if (allocation == VK_NULL_HANDLE) {
+        return 0;
+    }
+    VmaAllocationInfo info{};
+    vmaGetAllocationInfo(deviceRef->allocator(), allocation, &info);
+    return info.size;
+}
+
+bool Image::isRelocatable() const {
+    constexpr VkImageUsageFlags required =
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    constexpr VkImageUsageFlags attachments =
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+        VK_IMAGE_USAGE_STORAGE_BIT;
+    return relocationAllowed && allocation != VK_NULL_HANDLE && layerCount == 1 &&
+           (imageUsage & required) == required && (imageUsage & attachments) == 0;
+}
+
+VkImage Image::createRelocated(VmaAllocation dstAllocation) const {
+    VkImageCreateInfo imageInfo = imageCreateInfo();
+
+    VkImage newImage;
+    if (vkCreateImage(deviceRef->handle(), &imageInfo, nullptr, &newImage) != VK_SUCCESS) {
+        throw runtime_error("Failed to create relocated image");
+    }
+    if (vmaBindImageMemory(deviceRef->allocator(), dstAllocation, newImage) != VK_SUCCESS) {
+        vkDestroyImage(deviceRef->handle(), newImage, nullptr);
+        throw runtime_error("Failed to bind relocated image");
+    }
+    return newImage;
+}
+
+void Image::finishRelocation(VkImage newImage) {
+    // The allocation handle stays valid, VMA moves it to the new memory when
+    // the pass ends. In-flight frames may still sample the old image.
+    VkDevice device = deviceRef->handle();
+    VkImage oldImage = image;
+    VkImageView oldView = imageView;
+    deviceRef->deletionQueue().push([device, oldImage, oldView]() {
+        vkDestroyImageView(device, oldView, nullptr);
+        vkDestroyImage(device, oldImage, nullptr);
+    });
+    image = newImage;
+    createImageView();
 }
 
 } // namespace anim::vulkan
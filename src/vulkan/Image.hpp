@@ -11,9 +11,18 @@ namespace anim::vulkan {
 
 class Image {
 public:
+    // A cube image has six layers, faces in +X, -X, +Y, -Y, +Z, -Z order, and a cube view
     Image(Device& device, uint32_t width, uint32_t height, VkFormat format,
           VkImageUsageFlags usage, VkImageAspectFlags aspectFlags,
-          uint32_t mipLevels = 1, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+          uint32_t mipLevels = 1, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT,
+          MemoryClass memoryClass = MemoryClass::General, bool cube = false);
+    // Placed at offset in memory the caller owns and may share with other
+    // images, see RenderGraph. Contents are undefined whenever another image
+    // sharing the memory was used since. With several layers the view is a
+    // 2D array covering all of them.
+    Image(Device& device, uint32_t width, uint32_t height, VkFormat format,
+          VkImageUsageFlags usage, VkImageAspectFlags aspectFlags,
+          VmaAllocation memory, VkDeviceSize offset = 0, uint32_t layers = 1);
     ~Image();
 
     // Non-copyable
@@ -26,22 +35,57 @@ public:
 
     VkImage handle() const { return image; }
     VkImageView view() const { return imageView; }
+    // Unique per view created, unlike the handle which the driver may reuse
+    // once a view is destroyed. Caches keyed on views should compare this.
+    uint64_t viewGeneration() const { return generation; }
     VkFormat format() const { return imageFormat; }
     uint32_t width() const { return extent.width; }
     uint32_t height() const { return extent.height; }
     uint32_t mipLevels() const { return mipLevelCount; }
+    uint32_t layers() const { return layerCount; }
+    bool isCube() const { return cubeCompatible; }  // Six layers, viewed as a cube
+    VkImageAspectFlags aspect() const { return aspectMask; }
+    VkDeviceSize allocationSize() const;  // Bytes actually reserved by VMA, 0 when placed
+
+    // What a single-mip image with these properties needs to be placed
+    static VkMemoryRequirements memoryRequirements(Device& device, uint32_t width, uint32_t height,
+                                                   VkFormat format, VkImageUsageFlags usage,
+                                                   uint32_t layers = 1);
+
+    // Defragmentation: only single-layer sampled images kept in
+    // SHADER_READ_ONLY_OPTIMAL whose owner opted in can be moved. The owner
+    // must rewrite descriptors from the relocation callback.
+    void setRelocatable(bool relocatable) { relocationAllowed = relocatable; }
+    bool isRelocatable() const;
+    VkImage createRelocated(VmaAllocation dstAllocation) const;
+    void finishRelocation(VkImage newImage);
 
 private:
-    void createImage(VkImageUsageFlags usage, uint32_t mipLevels, VkSampleCountFlagBits samples);
-    void createImageView(VkImageAspectFlags aspectFlags);
+    void destroy();
+    static VkImageCreateInfo imageCreateInfo(VkFormat format, VkExtent2D extent, uint32_t mipLevels,
+                                             VkImageUsageFlags usage, VkSampleCountFlagBits samples,
+                                             uint32_t layers, bool cube = false);
+    VkImageCreateInfo imageCreateInfo() const;
+    void createImage(MemoryClass memoryClass);
+    void createPlacedImage(VmaAllocation memory, VkDeviceSize offset);
+    void createImageView();
+    void registerOwner();
 
     Device* deviceRef = nullptr;
     VkImage image = VK_NULL_HANDLE;
     VkImageView imageView = VK_NULL_HANDLE;
+    uint64_t generation = 0;
     VmaAllocation allocation = VK_NULL_HANDLE;
     VkFormat imageFormat = VK_FORMAT_UNDEFINED;
     VkExtent2D extent = {0, 0};
     uint32_t mipLevelCount = 1;
+    uint32_t layerCount = 1;
+    bool cubeCompatible = false;
+    VkImageUsageFlags imageUsage = 0;
+    VkImageAspectFlags aspectMask = 0;
+    VkSampleCountFlagBits sampleCount = VK_SAMPLE_COUNT_1_BIT;
+    bool relocationAllowed = false;
+    AllocationOwner owner{AllocationOwner::Kind::Image};
 };
 
 } // namespace anim::vulkan
@@ -6,18 +6,22 @@ using namespace std;
 
 namespace anim::vulkan {
 
-Pipeline::Pipeline(Device& device, VkRenderPass renderPass,
+Pipeline::Pipeline(Device& device, const RenderTarget& target,
                    const vector<uint32_t>& vertShaderCode,
                    const vector<uint32_t>& fragShaderCode,
                    const vector<VkVertexInputBindingDescription>& vertexBindings,
                    const vector<VkVertexInputAttributeDescription>& vertexAttribs,
                    const vector<VkDescriptorSetLayout>& descriptorLayouts,
                    const vector<VkPushConstantRange>& pushConstantRanges,
-                   VkPolygonMode polygonMode)
+                   VkPolygonMode polygonMode,
+                   VkCompareOp depthCompareOp,
+                   bool depthWrite,
+                   bool blendEnable)
     : deviceRef(&device) {
 
+    bool hasFragment = !fragShaderCode.empty();
     VkShaderModule vertModule = createShaderModule(vertShaderCode);
-    VkShaderModule fragModule = createShaderModule(fragShaderCode);
+    VkShaderModule fragModule = hasFragment ? createShaderModule(fragShaderCode) : VK_NULL_HANDLE;
 
     VkPipelineShaderStageCreateInfo vertStageInfo{};
     vertStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -84,22 +88,30 @@ Pipeline::Pipeline(Device& device, VkRenderPass renderPass,
     VkPipelineDepthStencilStateCreateInfo depthStencil{};
     depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
     depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = VK_TRUE;
-    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depthStencil.depthWriteEnable = depthWrite ? VK_TRUE : VK_FALSE;
+    depthStencil.depthCompareOp = depthCompareOp;
     depthStencil.depthBoundsTestEnable = VK_FALSE;
     depthStencil.stencilTestEnable = VK_FALSE;
 
     // Color blending
     VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask =
-        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-        VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
+    // Without a fragment shader the color outputs are undefined, leave them untouched
+    colorBlendAttachment.colorWriteMask = hasFragment
+        ? VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+          VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT
+        : 0;
+    colorBlendAttachment.blendEnable = blendEnable ? VK_TRUE : VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
 
     VkPipelineColorBlendStateCreateInfo colorBlending{};
     colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
     colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.attachmentCount = 1;
+    colorBlending.attachmentCount = target.colorFormat != VK_FORMAT_UNDEFINED ? 1 : 0;
     colorBlending.pAttachments = &colorBlendAttachment;
 
     // Pipeline layout
@@ -112,7 +124,9 @@ Pipeline::Pipeline(Device& device, VkRenderPass renderPass,
 
     if (vkCreatePipelineLayout(deviceRef->handle(), &pipelineLayoutInfo,
                                nullptr, &pipelineLayout) != VK_SUCCESS) {
-        vkDestroyShaderModule(deviceRef->handle(), fragModule, nullptr);
+        if (fragModule != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(deviceRef->handle(), fragModule, nullptr);
+        }
         vkDestroyShaderModule(deviceRef->handle(), vertModule, nullptr);
         throw runtime_error("Failed to create pipeline layout");
     }
@@ -120,7 +134,7 @@ Pipeline::Pipeline(Device& device, VkRenderPass renderPass,
     // Create pipeline
     VkGraphicsPipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
+    pipelineInfo.stageCount = hasFragment ? 2 : 1;
     pipelineInfo.pStages = shaderStages;
     pipelineInfo.pVertexInputState = &vertexInputInfo;
     pipelineInfo.pInputAssemblyState = &inputAssembly;
@@ -131,32 +145,62 @@ Pipeline::Pipeline(Device& device, VkRenderPass renderPass,
     pipelineInfo.pColorBlendState = &colorBlending;
     pipelineInfo.pDynamicState = &dynamicState;
     pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.renderPass = renderPass;
+    pipelineInfo.renderPass = target.renderPass;
     pipelineInfo.subpass = 0;
+
+    // Dynamic rendering: the attachment formats stand in for the render pass
+    VkPipelineRenderingCreateInfo renderingInfo{};
+    renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+    renderingInfo.colorAttachmentCount = target.colorFormat != VK_FORMAT_UNDEFINED ? 1 : 0;
+    renderingInfo.pColorAttachmentFormats = &target.colorFormat;
+    renderingInfo.depthAttachmentFormat = target.depthFormat;
+    renderingInfo.viewMask = target.viewMask;
+    if (target.dynamic()) {
+        pipelineInfo.pNext = &renderingInfo;
+    }
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
     if (vkCreateGraphicsPipelines(deviceRef->handle(), VK_NULL_HANDLE, 1,
                                    &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
         vkDestroyPipelineLayout(deviceRef->handle(), pipelineLayout, nullptr);
-        vkDestroyShaderModule(deviceRef->handle(), fragModule, nullptr);
+        if (fragModule != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(deviceRef->handle(), fragModule, nullptr);
+        }
         vkDestroyShaderModule(deviceRef->handle(), vertModule, nullptr);
         throw runtime_error("Failed to create graphics pipeline");
     }
 
     // Shader modules can be destroyed after pipeline creation
-    vkDestroyShaderModule(deviceRef->handle(), fragModule, nullptr);
+    if (fragModule != VK_NULL_HANDLE) {
+        vkDestroyShaderModule(deviceRef->handle(), fragModule, nullptr);
+    }
     vkDestroyShaderModule(deviceRef->handle(), vertModule, nullptr);
 }
 
 Pipeline::~Pipeline() {
-    if (deviceRef) {
-        if (pipeline != VK_NULL_HANDLE) {
-            vkDestroyPipeline(deviceRef->handle(), pipeline, nullptr);
+    destroy();
+}
+
+void Pipeline::destroy() {
+    if (!deviceRef || (pipeline == VK_NULL_HANDLE && pipelineLayout == VK_NULL_HANDLE)) {
+        return;
+    }
+
+    // Swapped-out pipelines may still be bound in in-flight command buffers
+    VkDevice device = deviceRef->handle();
+    VkPipeline oldPipeline = pipeline;
+    VkPipelineLayout oldLayout = pipelineLayout;
+    deviceRef->deletionQueue().push([device, oldPipeline, oldLayout]() {
+        if (oldPipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, oldPipeline, nullptr);
         }
-        if (pipelineLayout != VK_NULL_HANDLE) {
-            vkDestroyPipelineLayout(deviceRef->handle(), pipelineLayout, nullptr);
+        if (oldLayout != VK_NULL_HANDLE) {
+            vkDestroyPipelineLayout(device, oldLayout, nullptr);
         }
-    }
+    });
+
+    pipeline = VK_NULL_HANDLE;
+    pipelineLayout = VK_NULL_HANDLE;
 }
 
 Pipeline::Pipeline(Pipeline&& other) noexcept
@@ -170,14 +214,7 @@ Pipeline::Pipeline(Pipeline&& other) noexcept
 
 Pipeline& Pipeline::operator=(Pipeline&& other) noexcept {
     if (this != &other) {
-        if (deviceRef) {
-            if (pipeline != VK_NULL_HANDLE) {
-                vkDestroyPipeline(deviceRef->handle(), pipeline, nullptr);
-            }
-            if (pipelineLayout != VK_NULL_HANDLE) {
-                vkDestroyPipelineLayout(deviceRef->handle(), pipelineLayout, nullptr);
-            }
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         pipeline = other.pipeline;
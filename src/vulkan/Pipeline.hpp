@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Device.hpp"
+#include "RenderPass.hpp"
 
 #include <vulkan/vulkan.h>
 
@@ -12,14 +13,21 @@ namespace anim::vulkan {
 
 class Pipeline {
 public:
-    Pipeline(Device& device, VkRenderPass renderPass,
+    // Empty fragShaderCode creates a depth-only pipeline that writes no color.
+    // blendEnable blends by source alpha over what is already drawn.
+    // A target without a render pass creates the pipeline for dynamic rendering,
+    // its formats must match the render pass's attachments otherwise.
+    Pipeline(Device& device, const RenderTarget& target,
              const vector<uint32_t>& vertShaderCode,
              const vector<uint32_t>& fragShaderCode,
              const vector<VkVertexInputBindingDescription>& vertexBindings,
              const vector<VkVertexInputAttributeDescription>& vertexAttribs,
              const vector<VkDescriptorSetLayout>& descriptorLayouts = {},
              const vector<VkPushConstantRange>& pushConstantRanges = {},
-             VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL);
+             VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL,
+             VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS,
+             bool depthWrite = true,
+             bool blendEnable = false);
     ~Pipeline();
 
     // Non-copyable
@@ -34,6 +42,7 @@ public:
     VkPipelineLayout layout() const { return pipelineLayout; }
 
 private:
+    void destroy();
     VkShaderModule createShaderModule(const vector<uint32_t>& code);
 
     Device* deviceRef = nullptr;
@@ -1,6 +1,7 @@
 #include "PipelineCache.hpp"
 
 #include <functional>
+#include <algorithm>
 
 using namespace std;
 
@@ -21,6 +22,13 @@ static size_t hashShaderCode(const vector<uint32_t>& code) {
     return seed;
 }
 
+static bool pushConstantRangesEqual(const vector<VkPushConstantRange>& a, const vector<VkPushConstantRange>& b) {
+    return equal(a.begin(), a.end(), b.begin(), b.end(),
+                 [](const VkPushConstantRange& x, const VkPushConstantRange& y) {
+                     return x.stageFlags == y.stageFlags && x.offset == y.offset && x.size == y.size;
+                 });
+}
+
 bool PipelineConfig::operator==(const PipelineConfig& other) const {
     return vertShaderCode == other.vertShaderCode &&
            fragShaderCode == other.fragShaderCode &&
@@ -28,8 +36,11 @@ bool PipelineConfig::operator==(const PipelineConfig& other) const {
            vertexAttribs.size() == other.vertexAttribs.size() &&
            descriptorLayouts == other.descriptorLayouts &&
            pushConstantRanges.size() == other.pushConstantRanges.size() &&
-           renderPass == other.renderPass &&
-           polygonMode == other.polygonMode;
+           target == other.target &&
+           polygonMode == other.polygonMode &&
+           depthCompareOp == other.depthCompareOp &&
+           depthWrite == other.depthWrite &&
+           blendEnable == other.blendEnable;
 }
 
 size_t PipelineConfigHash::operator()(const PipelineConfig& config) const {
@@ -40,8 +51,34 @@ size_t PipelineConfigHash::operator()(const PipelineConfig& config) const {
     hashCombine(seed, config.vertexAttribs.size());
     hashCombine(seed, config.descriptorLayouts.size());
     hashCombine(seed, config.pushConstantRanges.size());
-    hashCombine(seed, reinterpret_cast<size_t>(config.renderPass));
+    hashCombine(seed, reinterpret_cast<size_t>(config.target.renderPass));
+    hashCombine(seed, static_cast<size_t>(config.target.colorFormat));
+    hashCombine(seed, static_cast<size_t>(config.target.depthFormat));
+    hashCombine(seed, static_cast<size_t>(config.target.viewMask));
     hashCombine(seed, static_cast<size_t>(config.polygonMode));
+    hashCombine(seed, static_cast<size_t>(config.depthCompareOp));
+    hashCombine(seed, config.depthWrite);
+    hashCombine(seed, config.blendEnable);
+    return seed;
+}
+
+bool ComputePipelineConfig::operator==(const ComputePipelineConfig& other) const {
+    return shaderCode == other.shaderCode &&
+           descriptorLayouts == other.descriptorLayouts &&
+           pushConstantRangesEqual(pushConstantRanges, other.pushConstantRanges);
+}
+
+size_t ComputePipelineConfigHash::operator()(const ComputePipelineConfig& config) const {
+    size_t seed = 0;
+    hashCombine(seed, hashShaderCode(config.shaderCode));
+    for (VkDescriptorSetLayout layout : config.descriptorLayouts) {
+        hashCombine(seed, reinterpret_cast<size_t>(layout));
+    }
+    for (const auto& range : config.pushConstantRanges) {
+        hashCombine(seed, range.stageFlags);
+        hashCombine(seed, range.offset);
+        hashCombine(seed, range.size);
+    }
     return seed;
 }
 
@@ -62,14 +99,17 @@ Pipeline& PipelineCache::getPipeline(const PipelineConfig& config) {
     // Create new pipeline
     auto pipeline = make_unique<Pipeline>(
         *device_,
-        config.renderPass,
+        config.target,
         config.vertShaderCode,
         config.fragShaderCode,
         config.vertexBindings,
         config.vertexAttribs,
         config.descriptorLayouts,
         config.pushConstantRanges,
-        config.polygonMode
+        config.polygonMode,
+        config.depthCompareOp,
+        config.depthWrite,
+        config.blendEnable
     );
 
     auto& ref = *pipeline;
@@ -77,8 +117,27 @@ Pipeline& PipelineCache::getPipeline(const PipelineConfig& config) {
     return ref;
 }
 
+ComputePipeline& PipelineCache::getComputePipeline(const ComputePipelineConfig& config) {
+    auto it = computePipelines_.find(config);
+    if (it != computePipelines_.end()) {
+        return *it->second;
+    }
+
+    auto pipeline = make_unique<ComputePipeline>(
+        *device_,
+        config.shaderCode,
+        config.descriptorLayouts,
+        config.pushConstantRanges
+    );
+
+    auto& ref = *pipeline;
+    computePipelines_.emplace(config, std::move(pipeline));
+    return ref;
+}
+
 void PipelineCache::clear() {
     pipelines_.clear();
+    computePipelines_.clear();
 }
 
 } // namespace anim::vulkan
@@ -2,6 +2,7 @@
 
 #include "Device.hpp"
 #include "Pipeline.hpp"
+#include "ComputePipeline.hpp"
 
 #include <vulkan/vulkan.h>
 
@@ -15,13 +16,16 @@ namespace anim::vulkan {
 
 struct PipelineConfig {
     vector<uint32_t> vertShaderCode;
-    vector<uint32_t> fragShaderCode;
+    vector<uint32_t> fragShaderCode;  // Empty for depth-only pipelines
     vector<VkVertexInputBindingDescription> vertexBindings;
     vector<VkVertexInputAttributeDescription> vertexAttribs;
     vector<VkDescriptorSetLayout> descriptorLayouts;
     vector<VkPushConstantRange> pushConstantRanges;
-    VkRenderPass renderPass;
+    RenderTarget target;
     VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+    VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
+    bool depthWrite = true;
+    bool blendEnable = false;
 
     bool operator==(const PipelineConfig& other) const;
 };
@@ -30,6 +34,18 @@ struct PipelineConfigHash {
     size_t operator()(const PipelineConfig& config) const;
 };
 
+struct ComputePipelineConfig {
+    vector<uint32_t> shaderCode;
+    vector<VkDescriptorSetLayout> descriptorLayouts;
+    vector<VkPushConstantRange> pushConstantRanges;
+
+    bool operator==(const ComputePipelineConfig& other) const;
+};
+
+struct ComputePipelineConfigHash {
+    size_t operator()(const ComputePipelineConfig& config) const;
+};
+
 class PipelineCache {
 public:
     PipelineCache(Device& device);
@@ -41,6 +57,7 @@ public:
 
     // Get or create pipeline
     Pipeline& getPipeline(const PipelineConfig& config);
+    ComputePipeline& getComputePipeline(const ComputePipelineConfig& config);
 
     // Clear cache
     void clear();
@@ -48,6 +65,7 @@ public:
 private:
     Device* device_;
     unordered_map<PipelineConfig, unique_ptr<Pipeline>, PipelineConfigHash> pipelines_;
+    unordered_map<ComputePipelineConfig, unique_ptr<ComputePipeline>, ComputePipelineConfigHash> computePipelines_;
 };
 
 } // namespace anim::vulkan
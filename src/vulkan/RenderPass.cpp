@@ -2,21 +2,23 @@
 
 #include <stdexcept>
 #include <array>
+#include <vector>
 
 using namespace std;
 
 namespace anim::vulkan {
 
 RenderPass::RenderPass(Device& device, VkFormat colorFormat, VkFormat depthFormat,
-                       VkImageLayout initialLayout, VkImageLayout finalLayout)
+                       VkImageLayout initialLayout, VkImageLayout finalLayout, VkAttachmentLoadOp loadOp)
     : deviceRef(&device)
     , hasDepthAttachment(depthFormat != VK_FORMAT_UNDEFINED) {
+    bool continues = loadOp == VK_ATTACHMENT_LOAD_OP_LOAD;
 
     // Color attachment description
     VkAttachmentDescription colorAttachment{};
     colorAttachment.format = colorFormat;
     colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    colorAttachment.loadOp = loadOp;
     colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
@@ -27,11 +29,13 @@ RenderPass::RenderPass(Device& device, VkFormat colorFormat, VkFormat depthForma
     VkAttachmentDescription depthAttachment{};
     depthAttachment.format = depthFormat;
     depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.loadOp = loadOp;
+    // Kept for occlusion culling, which builds its depth pyramid from it
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depthAttachment.initialLayout = continues ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                                              : VK_IMAGE_LAYOUT_UNDEFINED;
     depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     // Subpass uses color attachment
@@ -62,6 +66,27 @@ RenderPass::RenderPass(Device& device, VkFormat colorFormat, VkFormat depthForma
                               VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    if (continues) {
+        // Loaded attachments must see the earlier pass's writes
+        dependency.srcStageMask |= VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependency.dstStageMask |= VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependency.dstAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+    }
+
+    // Offscreen targets are copied out after the pass, make the writes visible to transfers
+    VkSubpassDependency outDependency{};
+    outDependency.srcSubpass = 0;
+    outDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    outDependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    outDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    outDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    outDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    array<VkSubpassDependency, 2> dependencies = {dependency, outDependency};
+    bool copiedOut = finalLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
     // Create render pass
     array<VkAttachmentDescription, 2> attachments = {colorAttachment, depthAttachment};
@@ -72,8 +97,75 @@ RenderPass::RenderPass(Device& device, VkFormat colorFormat, VkFormat depthForma
     createInfo.pAttachments = attachments.data();
     createInfo.subpassCount = 1;
     createInfo.pSubpasses = &subpass;
-    createInfo.dependencyCount = 1;
-    createInfo.pDependencies = &dependency;
+    createInfo.dependencyCount = copiedOut ? 2 : 1;
+    createInfo.pDependencies = dependencies.data();
+
+    if (vkCreateRenderPass(deviceRef->handle(), &createInfo, nullptr, &renderPass) != VK_SUCCESS) {
+        throw runtime_error("Failed to create render pass");
+    }
+}
+
+RenderPass::RenderPass(Device& device, VkFormat colorFormat, VkFormat depthFormat,
+                       AttachmentOps colorOps, AttachmentOps depthOps, uint32_t viewMask)
+    : deviceRef(&device)
+    , hasDepthAttachment(depthFormat != VK_FORMAT_UNDEFINED) {
+    bool hasColor = colorFormat != VK_FORMAT_UNDEFINED;
+    vector<VkAttachmentDescription> attachments;
+
+    VkAttachmentReference colorAttachmentRef{};
+    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    if (hasColor) {
+        VkAttachmentDescription colorAttachment{};
+        colorAttachment.format = colorFormat;
+        colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        colorAttachment.loadOp = colorOps.loadOp;
+        colorAttachment.storeOp = colorOps.storeOp;
+        colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorAttachmentRef.attachment = static_cast<uint32_t>(attachments.size());
+        attachments.push_back(colorAttachment);
+    }
+
+    VkAttachmentReference depthAttachmentRef{};
+    depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    if (hasDepthAttachment) {
+        VkAttachmentDescription depthAttachment{};
+        depthAttachment.format = depthFormat;
+        depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        depthAttachment.loadOp = depthOps.loadOp;
+        depthAttachment.storeOp = depthOps.storeOp;
+        depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        depthAttachmentRef.attachment = static_cast<uint32_t>(attachments.size());
+        attachments.push_back(depthAttachment);
+    }
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = hasColor ? 1 : 0;
+    subpass.pColorAttachments = hasColor ? &colorAttachmentRef : nullptr;
+    if (hasDepthAttachment) {
+        subpass.pDepthStencilAttachment = &depthAttachmentRef;
+    }
+
+    VkRenderPassCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    createInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+    createInfo.pAttachments = attachments.data();
+    createInfo.subpassCount = 1;
+    createInfo.pSubpasses = &subpass;
+
+    VkRenderPassMultiviewCreateInfo multiview{};
+    multiview.sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO;
+    multiview.subpassCount = 1;
+    multiview.pViewMasks = &viewMask;
+    if (viewMask != 0) {
+        createInfo.pNext = &multiview;
+    }
 
     if (vkCreateRenderPass(deviceRef->handle(), &createInfo, nullptr, &renderPass) != VK_SUCCESS) {
         throw runtime_error("Failed to create render pass");
@@ -8,12 +8,39 @@ using namespace std;
 
 namespace anim::vulkan {
 
+// Load and store of one attachment of a pass synchronized from outside
+struct AttachmentOps {
+    VkAttachmentLoadOp loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    VkAttachmentStoreOp storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+};
+
+// What a pipeline or secondary command buffer renders into: a render pass,
+// or with dynamic rendering (no render pass) just the attachment formats
+struct RenderTarget {
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    VkFormat colorFormat = VK_FORMAT_UNDEFINED;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+    uint32_t viewMask = 0;  // Multiview: layers every draw is broadcast to, 0 = off
+
+    bool dynamic() const { return renderPass == VK_NULL_HANDLE; }
+    bool operator==(const RenderTarget& other) const = default;
+};
+
 class RenderPass {
 public:
-    // Creates a render pass with color and optional depth attachment
+    // Creates a render pass with color and optional depth attachment.
+    // With VK_ATTACHMENT_LOAD_OP_LOAD the pass continues what an earlier pass
+    // drew, the depth attachment must then be in DEPTH_STENCIL_ATTACHMENT_OPTIMAL.
     RenderPass(Device& device, VkFormat colorFormat, VkFormat depthFormat = VK_FORMAT_UNDEFINED,
                VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-               VkImageLayout finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+               VkImageLayout finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+               VkAttachmentLoadOp loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR);
+    // Attachments stay in their attachment layout and the pass has no external
+    // dependencies, the caller records the barriers around it (RenderGraph).
+    // Either format may be VK_FORMAT_UNDEFINED to leave that attachment out.
+    // A view mask renders every draw into each of those attachment layers.
+    RenderPass(Device& device, VkFormat colorFormat, VkFormat depthFormat,
+               AttachmentOps colorOps, AttachmentOps depthOps, uint32_t viewMask = 0);
     ~RenderPass();
 
     // Non-copyable
@@ -22,8 +22,8 @@ Sampler::Sampler(Device& device, const SamplerConfig& config)
     samplerInfo.maxAnisotropy = min(config.maxAnisotropy, properties.limits.maxSamplerAnisotropy);
     samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
     samplerInfo.unnormalizedCoordinates = VK_FALSE;
-    samplerInfo.compareEnable = VK_FALSE;
-    samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+    samplerInfo.compareEnable = config.enableCompare ? VK_TRUE : VK_FALSE;
+    samplerInfo.compareOp = config.enableCompare ? config.compareOp : VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = config.mipmapMode;
     samplerInfo.mipLodBias = 0.0f;
     samplerInfo.minLod = config.minLod;
@@ -35,9 +35,19 @@ Sampler::Sampler(Device& device, const SamplerConfig& config)
 }
 
 Sampler::~Sampler() {
-    if (deviceRef && sampler != VK_NULL_HANDLE) {
-        vkDestroySampler(deviceRef->handle(), sampler, nullptr);
+    destroy();
+}
+
+void Sampler::destroy() {
+    if (!deviceRef || sampler == VK_NULL_HANDLE) {
+        return;
     }
+
+    // Descriptor sets used by in-flight frames may still reference it
+    VkDevice device = deviceRef->handle();
+    VkSampler old = sampler;
+    deviceRef->deletionQueue().push([device, old]() { vkDestroySampler(device, old, nullptr); });
+    sampler = VK_NULL_HANDLE;
 }
 
 Sampler::Sampler(Sampler&& other) noexcept
@@ -49,9 +59,7 @@ Sampler::Sampler(Sampler&& other) noexcept
 
 Sampler& Sampler::operator=(Sampler&& other) noexcept {
     if (this != &other) {
-        if (deviceRef && sampler != VK_NULL_HANDLE) {
-            vkDestroySampler(deviceRef->handle(), sampler, nullptr);
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         sampler = other.sampler;
@@ -19,6 +19,8 @@ struct SamplerConfig {
     bool enableAnisotropy = true;
     float minLod = 0.0f;
     float maxLod = VK_LOD_CLAMP_NONE;
+    bool enableCompare = false;  // Depth comparison, for shadow samplers
+    VkCompareOp compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
 };
 
 class Sampler {
@@ -37,6 +39,8 @@ public:
     VkSampler handle() const { return sampler; }
 
 private:
+    void destroy();
+
     Device* deviceRef = nullptr;
     VkSampler sampler = VK_NULL_HANDLE;
 };
@@ -8,21 +8,37 @@ using namespace std;
 
 namespace anim::vulkan {
 
-Swapchain::Swapchain(Device& device, VkSurfaceKHR surface, uint32_t width, uint32_t height)
-    : deviceRef(&device), surfaceRef(surface) {
+Swapchain::Swapchain(Device& device, VkSurfaceKHR surface, uint32_t width, uint32_t height,
+                     const SwapchainConfig& config)
+    : deviceRef(&device), surfaceRef(surface), config(config) {
+    if (device.features().presentWait) {
+        waitForPresentKHR = reinterpret_cast<PFN_vkWaitForPresentKHR>(
+            vkGetDeviceProcAddr(device.handle(), "vkWaitForPresentKHR"));
+    }
     createSwapchain(surface, width, height);
     createImageViews();
-    cout << "Swapchain created (" << swapExtent.width << "x" << swapExtent.height << ")" << endl;
+    cout << "Swapchain created (" << swapExtent.width << "x" << swapExtent.height << ", "
+         << presentModeName(mode) << ", " << images.size() << " images"
+         << (waitForPresentKHR ? ", present wait" : "") << ")" << endl;
 }
 
-Swapchain::~Swapchain() {
-    if (deviceRef) {
+// Presents from in-flight frames may still reference the swapchain and views,
+// destroy them once those frames retire
+static void retireSwapchain(Device& device, VkSwapchainKHR swapchain, vector<VkImageView> views) {
+    VkDevice handle = device.handle();
+    device.deletionQueue().push([handle, swapchain, views]() {
         for (auto view : views) {
-            vkDestroyImageView(deviceRef->handle(), view, nullptr);
+            vkDestroyImageView(handle, view, nullptr);
         }
         if (swapchain != VK_NULL_HANDLE) {
-            vkDestroySwapchainKHR(deviceRef->handle(), swapchain, nullptr);
+            vkDestroySwapchainKHR(handle, swapchain, nullptr);
         }
+    });
+}
+
+Swapchain::~Swapchain() {
+    if (deviceRef) {
+        retireSwapchain(*deviceRef, swapchain, move(views));
     }
 }
 
@@ -33,7 +49,13 @@ Swapchain::Swapchain(Swapchain&& other) noexcept
     , images(move(other.images))
     , views(move(other.views))
     , format(other.format)
-    , swapExtent(other.swapExtent) {
+    , swapExtent(other.swapExtent)
+    , config(other.config)
+    , mode(other.mode)
+    , waitForPresentKHR(other.waitForPresentKHR)
+    , presentCount(other.presentCount)
+    , firstPresentId(other.firstPresentId)
+    , displayedId(other.displayedId) {
     other.deviceRef = nullptr;
     other.swapchain = VK_NULL_HANDLE;
 }
@@ -41,12 +63,7 @@ Swapchain::Swapchain(Swapchain&& other) noexcept
 Swapchain& Swapchain::operator=(Swapchain&& other) noexcept {
     if (this != &other) {
         if (deviceRef) {
-            for (auto view : views) {
-                vkDestroyImageView(deviceRef->handle(), view, nullptr);
-            }
-            if (swapchain != VK_NULL_HANDLE) {
-                vkDestroySwapchainKHR(deviceRef->handle(), swapchain, nullptr);
-            }
+            retireSwapchain(*deviceRef, swapchain, move(views));
         }
 
         deviceRef = other.deviceRef;
@@ -56,6 +73,12 @@ Swapchain& Swapchain::operator=(Swapchain&& other) noexcept {
         views = move(other.views);
         format = other.format;
         swapExtent = other.swapExtent;
+        config = other.config;
+        mode = other.mode;
+        waitForPresentKHR = other.waitForPresentKHR;
+        presentCount = other.presentCount;
+        firstPresentId = other.firstPresentId;
+        displayedId = other.displayedId;
 
         other.deviceRef = nullptr;
         other.swapchain = VK_NULL_HANDLE;
@@ -64,11 +87,9 @@ Swapchain& Swapchain::operator=(Swapchain&& other) noexcept {
 }
 
 void Swapchain::recreate(uint32_t width, uint32_t height) {
-    deviceRef->waitIdle();
-
-    for (auto view : views) {
-        vkDestroyImageView(deviceRef->handle(), view, nullptr);
-    }
+    // No wait: the old swapchain is passed as oldSwapchain so the driver can
+    // hand over its resources, then retired once in-flight frames complete
+    vector<VkImageView> oldViews = move(views);
     views.clear();
 
     VkSwapchainKHR oldSwapchain = swapchain;
@@ -76,8 +97,11 @@ void Swapchain::recreate(uint32_t width, uint32_t height) {
 
     createSwapchain(surfaceRef, width, height, oldSwapchain);
     createImageViews();
+    // Ids are waited for per swapchain, earlier ones never complete on this one
+    firstPresentId = presentCount + 1;
+    displayedId = presentCount;
 
-    vkDestroySwapchainKHR(deviceRef->handle(), oldSwapchain, nullptr);
+    retireSwapchain(*deviceRef, oldSwapchain, move(oldViews));
 
     cout << "Swapchain recreated (" << swapExtent.width << "x" << swapExtent.height << ")" << endl;
 }
@@ -102,9 +126,42 @@ VkResult Swapchain::present(VkQueue queue, uint32_t imageIndex, VkSemaphore wait
     presentInfo.pSwapchains = &swapchain;
     presentInfo.pImageIndices = &imageIndex;
 
+    VkPresentIdKHR presentId{};
+    presentId.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    presentId.swapchainCount = 1;
+    uint64_t id = presentCount + 1;
+    presentId.pPresentIds = &id;
+    if (waitForPresentKHR) {
+        presentInfo.pNext = &presentId;
+        presentCount = id;
+    }
+
     return vkQueuePresentKHR(queue, &presentInfo);
 }
 
+bool Swapchain::waitForPresent(uint64_t presentId, uint64_t timeoutNs) {
+    if (!waitForPresentKHR || presentId <= displayedId || presentId < firstPresentId) {
+        return true;
+    }
+    VkResult result = waitForPresentKHR(deviceRef->handle(), swapchain, presentId, timeoutNs);
+    if (result == VK_TIMEOUT) {
+        return false;
+    }
+    // Out of date or lost surface: the present will never be shown, stop waiting for it
+    displayedId = presentId;
+    return true;
+}
+
+uint32_t Swapchain::queuedPresents() {
+    // Newest first, the first one displayed covers all before it
+    for (uint64_t id = presentCount; id > displayedId; id--) {
+        if (waitForPresent(id, 0)) {
+            break;
+        }
+    }
+    return static_cast<uint32_t>(presentCount - displayedId);
+}
+
 void Swapchain::createSwapchain(VkSurfaceKHR surface, uint32_t width, uint32_t height, VkSwapchainKHR oldSwapchain) {
     VkPhysicalDevice physicalDevice = deviceRef->physicalDevice();
 
@@ -122,14 +179,11 @@ void Swapchain::createSwapchain(VkSurfaceKHR surface, uint32_t width, uint32_t h
     vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &presentModeCount, presentModes.data());
 
     VkSurfaceFormatKHR surfaceFormat = chooseSurfaceFormat(formats);
-    VkPresentModeKHR presentMode = choosePresentMode(presentModes);
+    mode = choosePresentMode(presentModes);
     swapExtent = chooseExtent(capabilities, width, height);
     format = surfaceFormat.format;
 
-    uint32_t imageCount = capabilities.minImageCount + 1;
-    if (capabilities.maxImageCount > 0 && imageCount > capabilities.maxImageCount) {
-        imageCount = capabilities.maxImageCount;
-    }
+    uint32_t imageCount = chooseImageCount(capabilities);
 
     VkSwapchainCreateInfoKHR createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -139,7 +193,11 @@ void Swapchain::createSwapchain(VkSurfaceKHR surface, uint32_t width, uint32_t h
     createInfo.imageColorSpace = surfaceFormat.colorSpace;
     createInfo.imageExtent = swapExtent;
     createInfo.imageArrayLayers = 1;
-    createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    // Frames are rendered offscreen and blitted into the swapchain image
+    if (!(capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+        throw runtime_error("Swapchain images do not support transfer destination usage");
+    }
+    createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 
     uint32_t queueFamilyIndices[] = {
         deviceRef->graphicsQueueFamily(),
@@ -156,7 +214,7 @@ void Swapchain::createSwapchain(VkSurfaceKHR surface, uint32_t width, uint32_t h
 
     createInfo.preTransform = capabilities.currentTransform;
     createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    createInfo.presentMode = presentMode;
+    createInfo.presentMode = mode;
     createInfo.clipped = VK_TRUE;
     createInfo.oldSwapchain = oldSwapchain;
 
@@ -205,14 +263,24 @@ VkSurfaceFormatKHR Swapchain::chooseSurfaceFormat(const vector<VkSurfaceFormatKH
 }
 
 VkPresentModeKHR Swapchain::choosePresentMode(const vector<VkPresentModeKHR>& modes) {
-    for (const auto& mode : modes) {
-        if (mode == VK_PRESENT_MODE_MAILBOX_KHR) {
-            return mode;  // Triple buffering, low latency
-        }
+    if (find(modes.begin(), modes.end(), config.presentMode) != modes.end()) {
+        return config.presentMode;
+    }
+    if (config.presentMode != VK_PRESENT_MODE_MAILBOX_KHR) {
+        cout << "Present mode " << presentModeName(config.presentMode) << " not supported, using FIFO" << endl;
     }
     return VK_PRESENT_MODE_FIFO_KHR;  // VSync, always available
 }
 
+uint32_t Swapchain::chooseImageCount(const VkSurfaceCapabilitiesKHR& capabilities) {
+    uint32_t imageCount = config.imageCount > 0 ? config.imageCount : capabilities.minImageCount + 1;
+    imageCount = max(imageCount, capabilities.minImageCount);
+    if (capabilities.maxImageCount > 0 && imageCount > capabilities.maxImageCount) {
+        imageCount = capabilities.maxImageCount;
+    }
+    return imageCount;
+}
+
 VkExtent2D Swapchain::chooseExtent(const VkSurfaceCapabilitiesKHR& capabilities, uint32_t width, uint32_t height) {
     if (capabilities.currentExtent.width != UINT32_MAX) {
         return capabilities.currentExtent;
@@ -224,4 +292,14 @@ VkExtent2D Swapchain::chooseExtent(const VkSurfaceCapabilitiesKHR& capabilities,
     return extent;
 }
 
+const char* presentModeName(VkPresentModeKHR mode) {
+    switch (mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+        case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+        default: return "UNKNOWN";
+    }
+}
+
 } // namespace anim::vulkan
@@ -10,9 +10,16 @@ using namespace std;
 
 namespace anim::vulkan {
 
+struct SwapchainConfig {
+    // Falls back to FIFO, which every surface supports
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    uint32_t imageCount = 0;  // 0 = one more than the surface minimum
+};
+
 class Swapchain {
 public:
-    Swapchain(Device& device, VkSurfaceKHR surface, uint32_t width, uint32_t height);
+    Swapchain(Device& device, VkSurfaceKHR surface, uint32_t width, uint32_t height,
+              const SwapchainConfig& config = {});
     ~Swapchain();
 
     // Non-copyable
@@ -27,19 +34,34 @@ public:
     VkFormat imageFormat() const { return format; }
     VkExtent2D extent() const { return swapExtent; }
     const vector<VkImageView>& imageViews() const { return views; }
+    const vector<VkImage>& imageHandles() const { return images; }
     uint32_t imageCount() const { return static_cast<uint32_t>(views.size()); }
+    VkPresentModeKHR presentMode() const { return mode; }
 
+    // Safe while frames are in flight, the old swapchain is retired through the
+    // device deletion queue
     void recreate(uint32_t width, uint32_t height);
 
     VkResult acquireNextImage(VkSemaphore signalSemaphore, uint32_t* imageIndex);
     VkResult present(VkQueue queue, uint32_t imageIndex, VkSemaphore waitSemaphore);
 
+    // With present wait (DeviceFeatures::presentWait) every present gets an
+    // increasing id, 0 before the first
+    bool presentWaitSupported() const { return waitForPresentKHR != nullptr; }
+    uint64_t lastPresentId() const { return presentCount; }
+    // Blocks until the present with this id is displayed, false on timeout.
+    // Presents to an earlier swapchain count as displayed.
+    bool waitForPresent(uint64_t presentId, uint64_t timeoutNs);
+    // Presented but not yet displayed, 0 without present wait
+    uint32_t queuedPresents();
+
 private:
     void createSwapchain(VkSurfaceKHR surface, uint32_t width, uint32_t height, VkSwapchainKHR oldSwapchain = VK_NULL_HANDLE);
     void createImageViews();
 
     VkSurfaceFormatKHR chooseSurfaceFormat(const vector<VkSurfaceFormatKHR>& formats);
     VkPresentModeKHR choosePresentMode(const vector<VkPresentModeKHR>& modes);
+    uint32_t chooseImageCount(const VkSurfaceCapabilitiesKHR& capabilities);
     VkExtent2D chooseExtent(const VkSurfaceCapabilitiesKHR& capabilities, uint32_t width, uint32_t height);
 
     Device* deviceRef = nullptr;
@@ -49,6 +71,15 @@ private:
     vector<VkImageView> views;
     VkFormat format;
     VkExtent2D swapExtent;
+    SwapchainConfig config;
+    VkPresentModeKHR mode = VK_PRESENT_MODE_FIFO_KHR;
+
+    PFN_vkWaitForPresentKHR waitForPresentKHR = nullptr;
+    uint64_t presentCount = 0;
+    uint64_t firstPresentId = 1;   // First present to the current swapchain
+    uint64_t displayedId = 0;      // Newest present known to be displayed
 };
 
+const char* presentModeName(VkPresentModeKHR mode);
+
 } // namespace anim::vulkan
@@ -20,9 +20,19 @@ Semaphore::Semaphore(Device& device) : deviceRef(&device) {
 }
 
 Semaphore::~Semaphore() {
-    if (deviceRef && semaphore != VK_NULL_HANDLE) {
-        vkDestroySemaphore(deviceRef->handle(), semaphore, nullptr);
+    destroy();
+}
+
+void Semaphore::destroy() {
+    if (!deviceRef || semaphore == VK_NULL_HANDLE) {
+        return;
     }
+
+    // A pending present may still wait on it
+    VkDevice device = deviceRef->handle();
+    VkSemaphore old = semaphore;
+    deviceRef->deletionQueue().push([device, old]() { vkDestroySemaphore(device, old, nullptr); });
+    semaphore = VK_NULL_HANDLE;
 }
 
 Semaphore::Semaphore(Semaphore&& other) noexcept
@@ -34,9 +44,7 @@ Semaphore::Semaphore(Semaphore&& other) noexcept
 
 Semaphore& Semaphore::operator=(Semaphore&& other) noexcept {
     if (this != &other) {
-        if (deviceRef && semaphore != VK_NULL_HANDLE) {
-            vkDestroySemaphore(deviceRef->handle(), semaphore, nullptr);
-        }
+        destroy();
 
         deviceRef = other.deviceRef;
         semaphore = other.semaphore;
@@ -95,8 +103,90 @@ void Fence::wait(uint64_t timeout) {
     vkWaitForFences(deviceRef->handle(), 1, &fence, VK_TRUE, timeout);
 }
 
+bool Fence::signaled() const {
+    return vkGetFenceStatus(deviceRef->handle(), fence) == VK_SUCCESS;
+}
+
 void Fence::reset() {
     vkResetFences(deviceRef->handle(), 1, &fence);
 }
 
+// =============================================================================
+// TimelineSemaphore
+// =============================================================================
+
+TimelineSemaphore::TimelineSemaphore(Device& device, uint64_t initialValue) : deviceRef(&device) {
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = initialValue;
+
+    VkSemaphoreCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    createInfo.pNext = &typeInfo;
+
+    if (vkCreateSemaphore(deviceRef->handle(), &createInfo, nullptr, &semaphore) != VK_SUCCESS) {
+        throw runtime_error("Failed to create timeline semaphore");
+    }
+}
+
+TimelineSemaphore::~TimelineSemaphore() {
+    if (deviceRef && semaphore != VK_NULL_HANDLE) {
+        vkDestroySemaphore(deviceRef->handle(), semaphore, nullptr);
+    }
+}
+
+TimelineSemaphore::TimelineSemaphore(TimelineSemaphore&& other) noexcept
+    : deviceRef(other.deviceRef)
+    , semaphore(other.semaphore) {
+    other.deviceRef = nullptr;
+    other.semaphore = VK_NULL_HANDLE;
+}
+
+TimelineSemaphore& TimelineSemaphore::operator=(TimelineSemaphore&& other) noexcept {
+    if (this != &other) {
+        if (deviceRef && semaphore != VK_NULL_HANDLE) {
+            vkDestroySemaphore(deviceRef->handle(), semaphore, nullptr);
+        }
+
+        deviceRef = other.deviceRef;
+        semaphore = other.semaphore;
+
+        other.deviceRef = nullptr;
+        other.semaphore = VK_NULL_HANDLE;
+    }
+    return *this;
+}
+
+uint64_t TimelineSemaphore::value() const {
+    uint64_t current = 0;
+    vkGetSemaphoreCounterValue(deviceRef->handle(), semaphore, &current);
+    return current;
+}
+
+bool TimelineSemaphore::wait(uint64_t value, uint64_t timeout) const {
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &semaphore;
+    waitInfo.pValues = &value;
+
+    VkResult result = vkWaitSemaphores(deviceRef->handle(), &waitInfo, timeout);
+    if (result != VK_SUCCESS && result != VK_TIMEOUT) {
+        throw runtime_error("Failed to wait for timeline semaphore");
+    }
+    return result == VK_SUCCESS;
+}
+
+void TimelineSemaphore::signal(uint64_t value) {
+    VkSemaphoreSignalInfo signalInfo{};
+    signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO;
+    signalInfo.semaphore = semaphore;
+    signalInfo.value = value;
+
+    if (vkSignalSemaphore(deviceRef->handle(), &signalInfo) != VK_SUCCESS) {
+        throw runtime_error("Failed to signal timeline semaphore");
+    }
+}
+
 } // namespace anim::vulkan
@@ -24,6 +24,8 @@ public:
     VkSemaphore handle() const { return semaphore; }
 
 private:
+    void destroy();
+
     Device* deviceRef = nullptr;
     VkSemaphore semaphore = VK_NULL_HANDLE;
 };
@@ -44,6 +46,7 @@ public:
     VkFence handle() const { return fence; }
 
     void wait(uint64_t timeout = UINT64_MAX);
+    bool signaled() const;  // Polls without blocking
     void reset();
 
 private:
@@ -51,4 +54,30 @@ private:
     VkFence fence = VK_NULL_HANDLE;
 };
 
+// Semaphore with a monotonically increasing 64-bit counter. The GPU signals
+// values on submit, the host can query or wait on them without a fence.
+class TimelineSemaphore {
+public:
+    TimelineSemaphore(Device& device, uint64_t initialValue = 0);
+    ~TimelineSemaphore();
+
+    // Non-copyable
+    TimelineSemaphore(const TimelineSemaphore&) = delete;
+    TimelineSemaphore& operator=(const TimelineSemaphore&) = delete;
+
+    // Movable
+    TimelineSemaphore(TimelineSemaphore&& other) noexcept;
+    TimelineSemaphore& operator=(TimelineSemaphore&& other) noexcept;
+
+    VkSemaphore handle() const { return semaphore; }
+
+    uint64_t value() const;  // Last value signaled
+    bool wait(uint64_t value, uint64_t timeout = UINT64_MAX) const;  // False on timeout
+    void signal(uint64_t value);  // Host-side signal
+
+private:
+    Device* deviceRef = nullptr;
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+};
+
 } // namespace anim::vulkan